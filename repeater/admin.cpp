@@ -0,0 +1,214 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <errno.h>
+#endif
+
+#include "thread.h"
+#include "sockets.h"
+#include "rfb.h"     /* CARD8 */
+#include "vncauth.h" /* CHALLENGESIZE */
+#include "repeater.h"
+#include "slots.h"
+#include "workers.h"
+#include "admission.h"
+#include "handshake.h"
+#include "resolver.h"
+#include "admin.h"
+
+#ifndef WIN32
+#define _stricmp strcasecmp
+#else
+#define snprintf _snprintf
+#endif
+
+/**
+ * Size of the reply buffer. Enough for a few thousand sessions.
+ */
+#define ADMIN_REPLY_LIMIT	(256 * 1024)
+
+
+/*****************************************************************************
+ *
+ * Read a single command line from the admin connection.
+ *
+ *****************************************************************************/
+static int
+admin_read_command(SOCKET s, char * line, unsigned int size)
+{
+	unsigned int len;
+	int bytes;
+
+	len = 0;
+	while( len < size - 1 ) {
+		if( socket_poll( s, 0, 5000 ) <= 0 )
+			return -1;
+
+		bytes = socket_read( s, line + len, size - 1 - len );
+		if( bytes <= 0 )
+			return -1;
+		len += bytes;
+
+		line[len] = '\0';
+		if( strchr( line, '\n' ) != NULL )
+			break;
+	}
+
+	line[len] = '\0';
+	line[strcspn( line, "\r\n" )] = '\0';
+	return len;
+}
+
+
+
+/*****************************************************************************
+ *
+ * Execute a command and write the reply into buf.
+ *
+ *****************************************************************************/
+static int
+admin_execute(char * command, char * buf, unsigned int size)
+{
+	worker_stats stats;
+	admission_stats load;
+	handshake_stats handshake;
+	resolver_stats resolver;
+	char * name;
+	char * arg;
+	int n;
+
+	name = strtok( command, " \t" );
+	arg = strtok( NULL, " \t" );
+
+	if( ( name != NULL ) && ( _stricmp( name, "top" ) == 0 ) ) {
+		n = ADMIN_DEFAULT_TOP;
+		if( arg != NULL ) {
+			n = atoi( arg );
+			if( n <= 0 )
+				n = ADMIN_DEFAULT_TOP;
+		}
+		return ListTopSlots( buf, size, (unsigned int)n );
+	}
+
+	if( ( name != NULL ) && ( _stricmp( name, "workers" ) == 0 ) ) {
+		WorkersGetStats( &stats );
+		n = snprintf( buf, size, "BUSY %u (peak %u)\nIDLE %u\nLIMIT %u\nQUEUED %u (peak %u, max %u)\nSTARTED %lu\nJOBS %lu\nREJECTED %lu\nSTACK %u KiB\n",
+			stats.busy, stats.busy_peak, stats.idle, stats.limit, stats.queued, stats.queued_peak, WORKER_QUEUE_LIMIT,
+			stats.started, stats.jobs, stats.rejected, WORKER_STACK_SIZE / 1024 );
+		return ( ( n < 0 ) || ( (unsigned int)n >= size ) ) ? (int)size - 1 : n;
+	}
+
+	if( ( name != NULL ) && ( _stricmp( name, "load" ) == 0 ) ) {
+		AdmissionGetStats( &load );
+		n = snprintf( buf, size, "FDS %u (limit %u)\nSESSIONS %u\nWAITING %u (limit %u slots)\nBUFFERED %llu (limit %llu)\nPRESSURE %u%%\nACCEPTING %s\nPAUSES %lu\nSHED %lu\nACCEPT ERRORS %lu\n",
+			load.fds, load.fd_limit, load.sessions, load.waiting, load.slot_limit, load.buffered, load.buffer_limit, load.pressure,
+			load.paused ? "no" : ( load.full ? "peers only" : "yes" ), load.pauses, load.shed, load.accept_errors );
+		return ( ( n < 0 ) || ( (unsigned int)n >= size ) ) ? (int)size - 1 : n;
+	}
+
+	if( ( name != NULL ) && ( _stricmp( name, "handshakes" ) == 0 ) ) {
+		HandshakeGetStats( &handshake );
+		ResolverGetStats( &resolver );
+		n = snprintf( buf, size, "THREADS %u\nBUSY %u\nQUEUED %u (peak %u, max %u)\nDONE %lu\nSTOLEN %lu\nREJECTED %lu\nRESOLVER %u (max %u)\nRESOLVER HITS %lu\nRESOLVER MISSES %lu\nRESOLVER FAILURES %lu\n",
+			handshake.threads, handshake.busy, handshake.queued, handshake.queued_peak, handshake.threads * HANDSHAKE_QUEUE_LIMIT,
+			handshake.done, handshake.stolen, handshake.rejected, resolver.entries, RESOLVER_ENTRIES, resolver.hits, resolver.misses, resolver.failures );
+		return ( ( n < 0 ) || ( (unsigned int)n >= size ) ) ? (int)size - 1 : n;
+	}
+
+	strncpy( buf, "Commands:\n  top [n]   List the n sessions using the most bandwidth.\n  workers   Show the relay worker threads and their queue.\n  handshakes  Show the handshake threads and their queues, and the Mode I name cache.\n  load      Show the descriptors and memory in use, and whether connections are accepted.\n", size - 1 );
+	buf[size - 1] = '\0';
+	return (int)strlen( buf );
+}
+
+
+
+/*****************************************************************************
+ *
+ * Admin listener thread. Only accepts connections from the loopback
+ * interface and serves one command per connection.
+ *
+ *****************************************************************************/
+THREAD_CALL
+admin_listen(LPVOID lpParam)
+{
+	listener_thread_params *thread_params;
+	SOCKET connection;
+	struct sockaddr client;
+	socklen_t socklen;
+	char command[ADMIN_COMMAND_LIMIT];
+	char * reply;
+	int len;
+
+	thread_params = (listener_thread_params *)lpParam;
+	if( thread_params->sock == INVALID_SOCKET )
+		thread_params->sock = CreateLoopbackListenerSocket( thread_params->port );
+	if ( thread_params->sock == INVALID_SOCKET ) {
+		error("Failed to start the admin listener on port %d.\n", thread_params->port);
+		return 0;
+	}
+
+	reply = (char *)malloc( ADMIN_REPLY_LIMIT );
+	if( reply == NULL ) {
+		error("Not enough memory for the admin listener.\n");
+		return 0;
+	}
+
+	debug("Listening for admin connections on port %d.\n", thread_params->port);
+
+	while( notstopped )
+	{
+		/* Woken up to stop, the socket stays open */
+		if( socket_wait( thread_params->sock, thread_params->wake ) <= 0 )
+			break;
+
+		socklen = sizeof(client);
+		connection = socket_accept(thread_params->sock, &client, &socklen);
+		if( connection == INVALID_SOCKET ) {
+			if( notstopped )
+				debug("admin_listen(): accept() failed, errno=%d\n", errno);
+			/* Out of descriptors, wait for some to be shed instead of spinning */
+			AdmissionAcceptFailed( errno );
+			if( AdmissionPaused() && ( socket_wait_timeout( thread_params->wake, ADMISSION_POLL ) != 0 ) )
+				break;
+			continue;
+		}
+
+		if( admin_read_command( connection, command, sizeof(command) ) >= 0 ) {
+			len = admin_execute( command, reply, ADMIN_REPLY_LIMIT );
+			if( len > 0 )
+				socket_write_exact( connection, reply, len );
+		}
+
+		socket_close( connection );
+	}
+
+	free( reply );
+#ifdef _DEBUG
+	debug("Admin listening thread has exited.\n");
+#endif
+	return 0;
+}
@@ -0,0 +1,259 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <errno.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#endif
+
+#include "mutex.h"
+#include "sockets.h"
+#include "rfb.h"
+#include "vncauth.h"
+#include "repeater.h"
+#include "slots.h"
+#include "config.h"
+#include "admission.h"
+
+static volatile int admission_paused = 0;
+static unsigned long long admission_last = 0;
+static int admission_running = 0;
+#ifndef WIN32
+static DIR * admission_fd_dir = NULL;
+#endif
+
+/* The figures of the last check, under mutex_admission */
+static admission_stats admission;
+static mutex_t mutex_admission;
+
+
+/*****************************************************************************
+ *
+ * Helpers
+ *
+ *****************************************************************************/
+
+/* Descriptors open in the process, 0 if it can't be told. The directory
+ * stays open: at the limit, opendir() would fail just when it matters. */
+static unsigned int
+admission_count_fds( void )
+{
+#ifdef WIN32
+	return 0;
+#else
+	struct dirent * entry;
+	unsigned int count;
+
+	if( admission_fd_dir == NULL )
+		return 0;
+	rewinddir( admission_fd_dir );
+
+	/* ".", ".." and the directory itself are not counted */
+	count = 0;
+	while( ( entry = readdir( admission_fd_dir ) ) != NULL ) {
+		if( entry->d_name[0] != '.' )
+			count++;
+	}
+	return ( count > 0 ) ? count - 1 : 0;
+#endif
+}
+
+static unsigned int
+admission_fd_limit( void )
+{
+#ifdef WIN32
+	return 0;
+#else
+	struct rlimit limit;
+
+	if( ( getrlimit( RLIMIT_NOFILE, &limit ) != 0 ) || ( limit.rlim_cur == RLIM_INFINITY ) )
+		return 0;
+	return (unsigned int)limit.rlim_cur;
+#endif
+}
+
+/* Percent of limit in use, 0 without a limit */
+static unsigned int
+admission_percent(unsigned long long used, unsigned long long limit)
+{
+	if( limit == 0 )
+		return 0;
+	return (unsigned int)( ( used * 100 ) / limit );
+}
+
+/* How many of used must go to get under percent of limit */
+static unsigned int
+admission_excess(unsigned long long used, unsigned long long limit, unsigned int percent)
+{
+	unsigned long long level;
+
+	if( limit == 0 )
+		return 0;
+	level = limit * percent / 100;
+	return ( used >= level ) ? (unsigned int)( used - level + 1 ) : 0;
+}
+
+
+/*****************************************************************************
+ *
+ * Admission control
+ *
+ *****************************************************************************/
+
+int
+AdmissionInit( void )
+{
+	if( mutex_init( &mutex_admission ) != 0 ) {
+		error("Failed to create the admission mutex.\n");
+		return -1;
+	}
+	memset( &admission, 0, sizeof(admission) );
+#ifndef WIN32
+	admission_fd_dir = opendir( "/proc/self/fd" );
+	if( admission_fd_dir == NULL )
+		debug("Can't count the open descriptors, overload is measured on MaxBufferedBytes only.\n");
+#endif
+	admission_running = 1;
+	return 0;
+}
+
+void
+AdmissionFree( void )
+{
+	if( admission_running ) {
+		admission_running = 0;
+#ifndef WIN32
+		if( admission_fd_dir != NULL )
+			closedir( admission_fd_dir );
+		admission_fd_dir = NULL;
+#endif
+		mutex_destroy( &mutex_admission );
+	}
+}
+
+void
+AdmissionCheck(unsigned long long now)
+{
+	const repeater_config * config;
+	admission_stats current;
+	unsigned int shed;
+	unsigned int excess;
+
+	if( !admission_running || ( now - admission_last < ADMISSION_INTERVAL ) )
+		return;
+	admission_last = now;
+
+	config = ConfigGet();
+	memset( &current, 0, sizeof(current) );
+	current.fds = admission_count_fds();
+	current.fd_limit = admission_fd_limit();
+	CountSlots( &current.sessions, &current.waiting, &current.buffered );
+	current.slot_limit = config->max_sessions;
+	current.buffer_limit = config->max_buffered;
+
+	/* The waiting servers and viewers hold a descriptor each, the ones waiting
+	 * the longest go until accepting may start again */
+	shed = 0;
+	excess = admission_excess( current.fds, current.fd_limit, config->overload_low );
+	if( ( admission_percent( current.fds, current.fd_limit ) >= config->overload_high ) && ( current.waiting > 0 ) ) {
+		shed = ShedWaitingSlots( excess );
+		if( shed > 0 ) {
+			error("Out of descriptors: closed the %u servers and viewers waiting the longest.\n", shed);
+			current.waiting -= shed;
+			current.fds = ( current.fds > shed ) ? current.fds - shed : 0;
+		}
+	}
+
+	current.pressure = admission_percent( current.fds, current.fd_limit );
+	if( admission_percent( current.buffered, current.buffer_limit ) > current.pressure )
+		current.pressure = admission_percent( current.buffered, current.buffer_limit );
+
+	mutex_lock( &mutex_admission );
+	current.pauses = admission.pauses;
+	current.shed = admission.shed + shed;
+	current.accept_errors = admission.accept_errors;
+
+	/* Hysteresis: stop at the high watermark, go on again under the low one */
+	if( !admission_paused && ( current.pressure >= config->overload_high ) ) {
+		error("Overloaded (%u%% of a limit), not accepting connections for now.\n", current.pressure);
+		admission_paused = 1;
+		current.pauses++;
+	} else if( admission_paused && ( current.pressure < config->overload_low ) ) {
+		debug("Load back to %u%%, accepting connections again.\n", current.pressure);
+		admission_paused = 0;
+	}
+	current.paused = admission_paused;
+
+	/* Only a server or viewer whose peer is waiting gets a slot now */
+	current.full = ( current.slot_limit > 0 ) && ( current.sessions + current.waiting >= current.slot_limit );
+	admission = current;
+	mutex_unlock( &mutex_admission );
+}
+
+int
+AdmissionPaused( void )
+{
+	return admission_paused;
+}
+
+void
+AdmissionAcceptFailed(int err)
+{
+#ifndef WIN32
+	if( ( err != EMFILE ) && ( err != ENFILE ) && ( err != ENOBUFS ) && ( err != ENOMEM ) )
+		return;
+#else
+	if( err != WSAEMFILE && err != WSAENOBUFS )
+		return;
+#endif
+	if( !admission_running )
+		return;
+
+	/* The next check decides when to go on, it is not to come at once */
+	mutex_lock( &mutex_admission );
+	if( !admission_paused ) {
+		error("accept() ran out of resources (error %d), not accepting connections for now.\n", err);
+		admission_paused = 1;
+		admission.pauses++;
+	}
+	admission.accept_errors++;
+	mutex_unlock( &mutex_admission );
+}
+
+void
+AdmissionGetStats(admission_stats * stats)
+{
+	if( !admission_running ) {
+		memset( stats, 0, sizeof(admission_stats) );
+		return;
+	}
+	mutex_lock( &mutex_admission );
+	*stats = admission;
+	stats->paused = admission_paused;
+	mutex_unlock( &mutex_admission );
+}
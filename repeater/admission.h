@@ -0,0 +1,75 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+/**
+ * Admission control. Every ADMISSION_INTERVAL the main thread measures
+ * the open descriptors against RLIMIT_NOFILE and the bytes the relays
+ * hold against MaxBufferedBytes. At OverloadHigh percent of either, the
+ * listeners stop accepting and the connections wait in the backlog, until
+ * both are back under OverloadLow. Above OverloadHigh of the descriptors,
+ * the servers and viewers waiting the longest for their peer are closed
+ * to get back under it. Running sessions are never touched.
+ *
+ * MaxSessions does not stop the listeners: while every slot is taken,
+ * both ports go on accepting and a server or viewer whose peer is
+ * already waiting still pairs. Only one that would need a new slot is
+ * refused, after its handshake. The full statistic just reports it.
+ */
+#define ADMISSION_INTERVAL	500000	/* Microseconds */
+#define ADMISSION_POLL		100	/* Milliseconds a paused listener sleeps */
+
+typedef struct _admission_stats {
+	unsigned int fds;
+	unsigned int fd_limit;          /* 0 when unknown */
+	unsigned int sessions;
+	unsigned int waiting;
+	unsigned int slot_limit;        /* 0 for no limit */
+	unsigned long long buffered;
+	unsigned long long buffer_limit; /* 0 for no limit */
+	unsigned int pressure;          /* Percent of the closest limit */
+	int paused;
+	int full;                       /* Every slot taken, only peers of a waiting slot get in */
+	unsigned long pauses;           /* Times accepting stopped */
+	unsigned long shed;             /* Waiting slots closed */
+	unsigned long accept_errors;    /* accept() out of descriptors or memory */
+} admission_stats;
+
+int AdmissionInit( void );
+void AdmissionFree( void );
+
+/* Called by the main loop, measures at most every ADMISSION_INTERVAL */
+void AdmissionCheck(unsigned long long now);
+
+/* The listeners leave the backlog alone while this is set */
+int AdmissionPaused( void );
+
+/* accept() failed with errno err: stop accepting at once if it ran out of something */
+void AdmissionAcceptFailed(int err);
+
+void AdmissionGetStats(admission_stats * stats);
+
+#endif
@@ -0,0 +1,398 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+/*
+ * bench - Microbenchmarks for the repeater internals.
+ *
+ * Measures the slot registry (AddSlot, FindSlotByChallenge, FreeSlot) at
+ * several table sizes, vncEncryptBytes() and ParseDisplay() throughput and
+ * the relay loop over socketpairs. Results are written to
+ * stdout as JSON so runs can be diffed across versions. Linux only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "thread.h"
+#include "sockets.h"
+#include "rfb.h"
+#include "vncauth.h"
+#include "repeater.h"
+#include "slots.h"
+#include "relay.h"
+#include "workers.h"
+#include "version.h"
+
+#define BENCH_SAMPLE_OPS	1000
+#define BENCH_CRYPT_OPS		200000
+#define BENCH_RELAY_CHUNK	(64 * 1024)
+
+// Structures
+
+typedef struct _relay_peer {
+	SOCKET sock;
+	unsigned long long bytes;
+} relay_peer;
+
+// Global variables
+int notstopped;
+int first_result;
+SOCKET unused_socket;
+
+
+/*****************************************************************************
+ *
+ * Output methods (the code under test logs through these; keep them quiet)
+ *
+ *****************************************************************************/
+
+void debug(const char *fmt, ...)
+{
+}
+
+void error( const char *fmt, ... )
+{
+}
+
+void fatal(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "FATAL: ");
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+void report_bytes(char *prefix, char *buf, int len)
+{
+}
+
+
+/*****************************************************************************
+ *
+ * Helpers / Misc.
+ *
+ *****************************************************************************/
+
+double
+now_seconds( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void
+result(const char * name, unsigned long slots, unsigned long ops, double seconds, unsigned long long bytes)
+{
+	printf("%s\n    {\"name\": \"%s\"", first_result ? "" : ",", name);
+	if( slots > 0 )
+		printf(", \"slots\": %lu", slots);
+	printf(", \"ops\": %lu, \"seconds\": %.6f, \"ns_per_op\": %.1f, \"ops_per_sec\": %.1f",
+		ops, seconds, ( ops > 0 ) ? seconds * 1e9 / ops : 0.0, ( seconds > 0 ) ? ops / seconds : 0.0);
+	if( bytes > 0 )
+		printf(", \"bytes\": %llu, \"mib_per_sec\": %.1f", bytes, ( seconds > 0 ) ? bytes / seconds / ( 1024.0 * 1024.0 ) : 0.0);
+	printf("}");
+	first_result = 0;
+	fflush( stdout );
+}
+
+/* A slot waiting for a viewer, with a unique challenge */
+repeaterslot *
+bench_slot(unsigned long code)
+{
+	repeaterslot * slot;
+	char display[MAX_HOST_NAME_LEN + 1];
+	char phost[MAX_HOST_NAME_LEN + 1];
+	int id;
+
+	slot = (repeaterslot *)malloc( sizeof(repeaterslot) );
+	memset( slot, 0, sizeof(repeaterslot) );
+	sprintf( display, "ID:%lu", code );
+	ParseDisplay( display, phost, MAX_HOST_NAME_LEN, &id, slot->challenge );
+	slot->server = unused_socket;
+	slot->viewer = INVALID_SOCKET;
+	slot->code = code;
+	slot->timestamp = (unsigned long)time(NULL);
+	return slot;
+}
+
+/* AddSlot() keeps its own copy unless the slot was inserted as is */
+repeaterslot *
+bench_add(repeaterslot * slot)
+{
+	repeaterslot * current;
+
+	current = AddSlot( slot );
+	if( current != slot )
+		free( slot );
+	return current;
+}
+
+
+/*****************************************************************************
+ *
+ * Slot registry
+ *
+ *****************************************************************************/
+
+void
+bench_slots(unsigned long size)
+{
+	repeaterslot ** samples;
+	repeaterslot * slot;
+	unsigned long ops;
+	unsigned long i;
+	double start;
+
+	InitializeSlots( 0 );
+	samples = (repeaterslot **)malloc( BENCH_SAMPLE_OPS * sizeof(repeaterslot *) );
+
+	/* Fill the table up to the requested size */
+	for( i = 0; i < size; i++ )
+		bench_add( bench_slot( 1 + i ) );
+
+	ops = ( size < BENCH_SAMPLE_OPS ) ? size : BENCH_SAMPLE_OPS;
+
+	/* AddSlot() on a table of this size */
+	for( i = 0; i < ops; i++ )
+		samples[i] = bench_slot( 10000000 + i );
+	start = now_seconds();
+	for( i = 0; i < ops; i++ )
+		samples[i] = bench_add( samples[i] );
+	result( "slots.add", size, ops, now_seconds() - start, 0 );
+
+	/* FindSlotByChallenge() hits, spread over the table */
+	slot = bench_slot( 0 );
+	start = now_seconds();
+	for( i = 0; i < ops; i++ ) {
+		samples[i] = FindSlotByChallenge( samples[i]->challenge );
+	}
+	result( "slots.find", size, ops, now_seconds() - start, 0 );
+
+	/* FindSlotByChallenge() misses walk the whole table */
+	start = now_seconds();
+	for( i = 0; i < ops; i++ )
+		FindSlotByChallenge( slot->challenge );
+	result( "slots.find_miss", size, ops, now_seconds() - start, 0 );
+	free( slot );
+
+	/* FreeSlot() of the slots added above */
+	start = now_seconds();
+	for( i = 0; i < ops; i++ )
+		FreeSlot( samples[i] );
+	result( "slots.free", size, ops, now_seconds() - start, 0 );
+
+	FreeSlots();
+	free( samples );
+}
+
+
+/*****************************************************************************
+ *
+ * Authentication helpers
+ *
+ *****************************************************************************/
+
+void
+bench_crypt( void )
+{
+	unsigned char challenge[CHALLENGESIZE];
+	char display[MAX_HOST_NAME_LEN + 1];
+	char phost[MAX_HOST_NAME_LEN + 1];
+	int id;
+	unsigned long i;
+	double start;
+
+	memset( challenge, 0, CHALLENGESIZE );
+	start = now_seconds();
+	for( i = 0; i < BENCH_CRYPT_OPS; i++ )
+		vncEncryptBytes( challenge, "12345678" );
+	result( "vncEncryptBytes", 0, BENCH_CRYPT_OPS, now_seconds() - start, 0 );
+
+	memset( display, 0, sizeof(display) );
+	strcpy( display, "ID:12345678" );
+	start = now_seconds();
+	for( i = 0; i < BENCH_CRYPT_OPS; i++ )
+		ParseDisplay( display, phost, MAX_HOST_NAME_LEN, &id, challenge );
+	result( "ParseDisplay", 0, BENCH_CRYPT_OPS, now_seconds() - start, 0 );
+}
+
+
+/*****************************************************************************
+ *
+ * Relay loop
+ *
+ *****************************************************************************/
+
+THREAD_CALL
+relay_writer(LPVOID lpParam)
+{
+	relay_peer * peer = (relay_peer *)lpParam;
+	char buf[BENCH_RELAY_CHUNK];
+	unsigned long long left;
+	int n;
+
+	memset( buf, 'x', sizeof(buf) );
+	left = peer->bytes;
+	while( left > 0 ) {
+		n = send( peer->sock, buf, ( left < sizeof(buf) ) ? (size_t)left : sizeof(buf), MSG_NOSIGNAL );
+		if( n <= 0 )
+			break;
+		left -= n;
+	}
+	return 0;
+}
+
+/* Push bytes through the relay in one direction and time it */
+void
+bench_relay(const char * name, int server_to_viewer, unsigned long long bytes)
+{
+	int server_pair[2];
+	int viewer_pair[2];
+	repeaterslot * slot;
+	relay_peer writer;
+	thread_t writer_thread;
+	unsigned char challenge[CHALLENGESIZE];
+	char buf[BENCH_RELAY_CHUNK];
+	unsigned long long received;
+	SOCKET reader;
+	double start;
+	int n;
+
+	InitializeSlots( 0 );
+	if( ( socketpair( AF_UNIX, SOCK_STREAM, 0, server_pair ) != 0 ) || ( socketpair( AF_UNIX, SOCK_STREAM, 0, viewer_pair ) != 0 ) ) {
+		fatal("socketpair() failed, errno=%d\n", errno);
+		return;
+	}
+
+	/* The repeater owns [0], the fake peers own [1] */
+	fcntl( server_pair[0], F_SETFL, O_NONBLOCK );
+	fcntl( viewer_pair[0], F_SETFL, O_NONBLOCK );
+
+	slot = bench_slot( 1 );
+	slot->server = server_pair[0];
+	slot->viewer = viewer_pair[0];
+	slot = bench_add( slot );
+	memcpy( challenge, slot->challenge, CHALLENGESIZE );
+
+	if( RelayStart( slot ) != 0 ) {
+		fatal("Unable to start the relay.\n");
+		return;
+	}
+
+	/* ClientInit forwarded to the server */
+	recv( server_pair[1], buf, 1, MSG_WAITALL );
+
+	writer.sock = server_to_viewer ? server_pair[1] : viewer_pair[1];
+	writer.bytes = bytes;
+	reader = server_to_viewer ? viewer_pair[1] : server_pair[1];
+
+	start = now_seconds();
+	thread_create( &writer_thread, NULL, relay_writer, (LPVOID)&writer );
+
+	received = 0;
+	while( received < bytes ) {
+		n = recv( reader, buf, sizeof(buf), 0 );
+		if( n <= 0 )
+			break;
+		received += n;
+	}
+	result( name, 0, 1, now_seconds() - start, received );
+
+	thread_join( writer_thread, 30 );
+
+	/* Closing the peers ends the repeater thread, which frees the slot */
+	close( server_pair[1] );
+	close( viewer_pair[1] );
+	while( FindSlotByChallenge( challenge ) != NULL )
+		usleep( 1000 );
+	FreeSlots();
+}
+
+
+/*****************************************************************************
+ *
+ * Main entry point
+ *
+ *****************************************************************************/
+
+int main(int argc, char **argv)
+{
+	static const unsigned long sizes[] = { 10, 100, 1000, 10000, 100000 };
+	unsigned long max_slots;
+	unsigned long long relay_bytes;
+	struct rlimit limit;
+	unsigned int i;
+
+	max_slots = 100000;
+	relay_bytes = 256ULL * 1024 * 1024;
+	for( i = 1; i < (unsigned int)argc; i++ ) {
+		if( ( strcmp( argv[i], "-slots" ) == 0 ) && ( i + 1 < (unsigned int)argc ) ) {
+			max_slots = strtoul( argv[++i], NULL, 10 );
+		} else if( ( strcmp( argv[i], "-relay" ) == 0 ) && ( i + 1 < (unsigned int)argc ) ) {
+			relay_bytes = strtoull( argv[++i], NULL, 10 );
+		} else {
+			fprintf(stderr, "\nUsage: %s [-slots max] [-relay bytes]\n\n", argv[0]);
+			fprintf(stderr, "  -slots max    Largest slot table to measure (default 100000).\n");
+			fprintf(stderr, "  -relay bytes  Bytes pushed through the relay per direction (default 268435456).\n\n");
+			return 1;
+		}
+	}
+
+	/* Slot sockets that are never really opened: above the descriptor limit */
+	getrlimit( RLIMIT_NOFILE, &limit );
+	unused_socket = ( limit.rlim_cur < 0x7fffffff ) ? (SOCKET)limit.rlim_cur + 1 : 0x7ffffff0;
+
+	notstopped = 1;
+	mutex_init( &mutex_slots );
+	WorkersInit( 0 );
+	first_result = 1;
+
+	printf("{\n  \"version\": \"%s\",\n  \"results\": [", VNCREPEATER_VERSION);
+
+	for( i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++ ) {
+		if( sizes[i] <= max_slots )
+			bench_slots( sizes[i] );
+	}
+
+	bench_crypt();
+
+	if( relay_bytes > 0 ) {
+		bench_relay( "relay.server_to_viewer", 1, relay_bytes );
+		bench_relay( "relay.viewer_to_server", 0, relay_bytes );
+	}
+
+	printf("\n  ]\n}\n");
+
+	WorkersFree();
+	mutex_destroy( &mutex_slots );
+	return 0;
+}
@@ -22,12 +22,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
 #ifdef WIN32
 #include <winsock.h>
 #else
 #include <sys/types.h>
+#include <pthread.h>
 #endif
 
+#include "mutex.h"
 #include "config.h"
 
 #ifndef WIN32
@@ -71,122 +75,445 @@ trim(char * s) {
 	return start;
 }
 
-int 
-LoadConfigurationKey(const char * key, char * value, unsigned int size)
+/* Value types of the configuration keys */
+#define CONFIG_PORT		0
+#define CONFIG_NUMBER		1
+#define CONFIG_BOOLEAN		2
+#define CONFIG_STRING		3
+#define CONFIG_RANGE		4	/* "first-last" or one ID */
+#define CONFIG_RATE_RANGE	5	/* "first-last rate" */
+#define CONFIG_NETWORK		6	/* "address[/bits] [first-last]" */
+
+typedef struct _config_key {
+	const char * name;
+	int type;
+	size_t offset;                  /* Of the value in repeater_config */
+	size_t count_offset;            /* Ranges: of their count */
+} config_key;
+
+#define CONFIG_FIELD(field)	offsetof(repeater_config, field)
+
+static const config_key config_keys[] = {
+	{ "ServerPort",		CONFIG_PORT,		CONFIG_FIELD(server_port),	0 },
+	{ "ViewerPort",		CONFIG_PORT,		CONFIG_FIELD(viewer_port),	0 },
+	{ "AdminPort",		CONFIG_PORT,		CONFIG_FIELD(admin_port),	0 },
+	{ "ModeIPort",		CONFIG_PORT,		CONFIG_FIELD(modei_port),	0 },
+	{ "ModeIConnects",	CONFIG_NUMBER,		CONFIG_FIELD(modei_connects),	0 },
+	{ "ModeIAllow",		CONFIG_NETWORK,		CONFIG_FIELD(modei_allow),	CONFIG_FIELD(modei_allow_count) },
+	{ "MaxSessions",	CONFIG_NUMBER,		CONFIG_FIELD(max_sessions),	0 },
+	{ "DeferAccept",	CONFIG_NUMBER,		CONFIG_FIELD(defer_accept),	0 },
+	{ "FastOpen",		CONFIG_NUMBER,		CONFIG_FIELD(fast_open),	0 },
+	{ "AcceptRate",		CONFIG_NUMBER,		CONFIG_FIELD(accept_rate),	0 },
+	{ "AcceptBurst",	CONFIG_NUMBER,		CONFIG_FIELD(accept_burst),	0 },
+	{ "MaxBufferedBytes",	CONFIG_NUMBER,		CONFIG_FIELD(max_buffered),	0 },
+	{ "OverloadHigh",	CONFIG_NUMBER,		CONFIG_FIELD(overload_high),	0 },
+	{ "OverloadLow",	CONFIG_NUMBER,		CONFIG_FIELD(overload_low),	0 },
+	{ "HandshakeThreads",	CONFIG_NUMBER,		CONFIG_FIELD(handshake_threads),	0 },
+	{ "ServerTLS",		CONFIG_BOOLEAN,		CONFIG_FIELD(server_tls),	0 },
+	{ "ViewerTLS",		CONFIG_BOOLEAN,		CONFIG_FIELD(viewer_tls),	0 },
+	{ "TLSCertificate",	CONFIG_STRING,		CONFIG_FIELD(tls_certificate),	0 },
+	{ "TLSKey",		CONFIG_STRING,		CONFIG_FIELD(tls_key),		0 },
+	{ "InputPriority",	CONFIG_BOOLEAN,		CONFIG_FIELD(input_priority),	0 },
+	{ "Broadcast",		CONFIG_BOOLEAN,		CONFIG_FIELD(broadcast),	0 },
+	{ "ShadowFramebuffer",	CONFIG_BOOLEAN,		CONFIG_FIELD(shadow),		0 },
+	{ "CoalesceUpdates",	CONFIG_BOOLEAN,		CONFIG_FIELD(coalesce),		0 },
+	{ "TuneSockets",	CONFIG_BOOLEAN,		CONFIG_FIELD(tune_sockets),	0 },
+	{ "ZeroCopyThreshold",	CONFIG_NUMBER,		CONFIG_FIELD(zerocopy_threshold),	0 },
+	{ "SessionRate",	CONFIG_NUMBER,		CONFIG_FIELD(session_rate),	0 },
+	{ "GlobalRate",		CONFIG_NUMBER,		CONFIG_FIELD(global_rate),	0 },
+	{ "RateLimit",		CONFIG_RATE_RANGE,	CONFIG_FIELD(rate_limits),	CONFIG_FIELD(rate_limit_count) },
+	{ "RecordDirectory",	CONFIG_STRING,		CONFIG_FIELD(record_directory),	0 },
+	{ "Record",		CONFIG_RANGE,		CONFIG_FIELD(records),		CONFIG_FIELD(record_count) },
+	{ "UpgradeSocket",	CONFIG_STRING,		CONFIG_FIELD(upgrade_path),	0 },
+	{ "DrainTimeout",	CONFIG_NUMBER,		CONFIG_FIELD(drain_timeout),	0 },
+	{ "LogLevel",		CONFIG_NUMBER,		CONFIG_FIELD(log_level),	0 },
+	{ NULL,			0,			0,				0 }
+};
+
+/* What ConfigGet() returns until a configuration is published */
+static repeater_config config_defaults;
+static int config_defaults_set = 0;
+
+static repeater_config * volatile config_current = NULL;
+static repeater_config * config_retired = NULL;
+static int config_published = 0;
+static mutex_t mutex_config;
+
+
+static void
+config_set_defaults(repeater_config * config)
+{
+	memset( config, 0, sizeof(repeater_config) );
+	config->server_port = 5500;
+	config->viewer_port = 5900;
+	config->admin_port = 0;
+	config->modei_port = 0;
+	config->modei_connects = 4;
+	config->max_sessions = 20;
+	config->drain_timeout = 300;
+	config->log_level = 1;
+	config->tune_sockets = 1;
+	config->accept_burst = 10;
+	config->overload_high = 90;
+	config->overload_low = 75;
+}
+
+static int
+config_parse_number(const char * value, unsigned long * number)
 {
+	char * end;
+
+	if( ( value[0] < '0' ) || ( value[0] > '9' ) )
+		return -1;
+	*number = strtoul( value, &end, 10 );
+	return ( *end == '\0' ) ? 0 : -1;
+}
+
+/* "a.b.c.d[/bits]", then an optional port or "first-last" port range */
+static const char *
+config_parse_network(const char * value, config_network * network)
+{
+	unsigned int octet[4];
+	unsigned int bits;
+	unsigned long first;
+	unsigned long last;
+	char extra;
+	int length;
+	int n;
+
+	length = 0;
+	if( ( sscanf( value, "%u.%u.%u.%u%n", &octet[0], &octet[1], &octet[2], &octet[3], &length ) != 4 )
+		|| ( octet[0] > 255 ) || ( octet[1] > 255 ) || ( octet[2] > 255 ) || ( octet[3] > 255 ) )
+		return "expected \"address[/bits] [first-last]\"";
+	value += length;
+
+	bits = 32;
+	if( *value == '/' ) {
+		length = 0;
+		if( ( sscanf( value, "/%u%n", &bits, &length ) != 1 ) || ( bits > 32 ) )
+			return "expected a network size of 0 to 32 bits";
+		value += length;
+	}
+	if( ( *value != '\0' ) && ( *value != ' ' ) && ( *value != '\t' ) )
+		return "expected \"address[/bits] [first-last]\"";
+
+	first = 1;
+	last = 65535;
+	while( ( *value == ' ' ) || ( *value == '\t' ) )
+		value++;
+	if( *value != '\0' ) {
+		n = sscanf( value, "%lu-%lu %c", &first, &last, &extra );
+		if( n == 1 )
+			last = first;
+		if( ( n < 1 ) || ( n > 2 ) || ( first == 0 ) || ( first > last ) || ( last > 65535 ) )
+			return "expected a port or \"first-last\" ports";
+	}
+
+	network->mask = ( bits == 0 ) ? 0 : ( 0xFFFFFFFFUL << ( 32 - bits ) ) & 0xFFFFFFFFUL;
+	network->address = ( ( (unsigned long)octet[0] << 24 ) | ( octet[1] << 16 ) | ( octet[2] << 8 ) | octet[3] ) & network->mask;
+	network->port_first = (unsigned int)first;
+	network->port_last = (unsigned int)last;
+	return NULL;
+}
+
+/* Parse value as the key says, into the configuration. Returns an error message or NULL. */
+static const char *
+config_parse_value(repeater_config * config, const config_key * key, const char * value)
+{
+	char * field;
+	unsigned int * count;
+	config_range range;
+	config_network network;
+	const char * message;
+	unsigned long number;
+	char extra;
+	int n;
+
+	field = (char *)config + key->offset;
+
+	switch( key->type ) {
+	case CONFIG_PORT:
+		if( ( config_parse_number( value, &number ) != 0 ) || ( number > 65535 ) )
+			return "expected a port number";
+		*(u_short *)field = (u_short)number;
+		break;
+	case CONFIG_NUMBER:
+		if( ( config_parse_number( value, &number ) != 0 ) || ( number > 0xFFFFFFFFUL ) )
+			return "expected a positive number";
+		*(unsigned int *)field = (unsigned int)number;
+		break;
+	case CONFIG_BOOLEAN:
+		if( ( _stricmp( "TRUE", value ) == 0 ) || ( _stricmp( "1", value ) == 0 ) )
+			*(int *)field = 1;
+		else if( ( _stricmp( "FALSE", value ) == 0 ) || ( _stricmp( "0", value ) == 0 ) )
+			*(int *)field = 0;
+		else
+			return "expected true or false";
+		break;
+	case CONFIG_STRING:
+		strcpy( field, value );
+		break;
+	case CONFIG_RANGE:
+	case CONFIG_RATE_RANGE:
+		memset( &range, 0, sizeof(range) );
+		if( key->type == CONFIG_RATE_RANGE ) {
+			n = sscanf( value, "%lu-%lu %lu %c", &range.first, &range.last, &range.rate, &extra );
+			if( ( n != 3 ) || ( range.first > range.last ) )
+				return "expected \"first-last rate\"";
+		} else {
+			n = sscanf( value, "%lu-%lu %c", &range.first, &range.last, &extra );
+			if( n == 1 )
+				range.last = range.first;
+			if( ( n < 1 ) || ( n > 2 ) || ( range.first > range.last ) )
+				return "expected \"first-last\" or an ID";
+		}
+
+		count = (unsigned int *)( (char *)config + key->count_offset );
+		if( *count == CONFIG_MAX_RANGES )
+			return "too many ranges";
+		/* The first matching range wins, keep the configuration order */
+		((config_range *)field)[(*count)++] = range;
+		break;
+	case CONFIG_NETWORK:
+		if( ( message = config_parse_network( value, &network ) ) != NULL )
+			return message;
+		count = (unsigned int *)( (char *)config + key->count_offset );
+		if( *count == CONFIG_MAX_RANGES )
+			return "too many networks";
+		((config_network *)field)[(*count)++] = network;
+		break;
+	}
+
+	return NULL;
+}
+
+/* Checks across keys, once the whole file is in */
+static const char *
+config_check(repeater_config * config)
+{
+	if( config->server_port == 0 )
+		return "ServerPort can not be 0";
+	if( config->viewer_port == 0 )
+		return "ViewerPort can not be 0";
+	if( ( config->server_port == config->viewer_port ) || ( config->admin_port == config->server_port ) || ( config->admin_port == config->viewer_port ) )
+		return "the server, viewer and admin ports must differ";
+	if( ( config->modei_port != 0 ) && ( ( config->modei_port == config->server_port ) || ( config->modei_port == config->viewer_port ) || ( config->modei_port == config->admin_port ) ) )
+		return "ModeIPort must differ from the other ports";
+
+	if( ( config->overload_low == 0 ) || ( config->overload_low >= config->overload_high ) || ( config->overload_high > 100 ) )
+		return "OverloadLow and OverloadHigh must be percents, OverloadLow under OverloadHigh";
+
+	if( ( config->server_tls || config->viewer_tls ) && ( config->tls_certificate[0] == '\0' ) )
+		return "ServerTLS and ViewerTLS need a TLSCertificate";
+	if( config->tls_key[0] == '\0' )
+		strcpy( config->tls_key, config->tls_certificate );
+
+	/* The shadow framebuffer is there for viewers joining a running server */
+	if( config->shadow )
+		config->broadcast = 1;
+
+	return NULL;
+}
+
+repeater_config *
+ConfigLoad( void )
+{
+	repeater_config * config;
+	const config_key * key;
+	const char * message;
 	FILE * fp;
 	char line[ CONFIG_LINE_LIMIT ];
-	char * config_key;
+	char * config_key_name;
 	char * config_value;
+	unsigned int seen[ sizeof(config_keys) / sizeof(config_keys[0]) ];
+	unsigned int line_number;
 
-	/* Zero memory */
-	memset( value, 0, size);
+	config = (repeater_config *)malloc( sizeof(repeater_config) );
+	if( config == NULL ) {
+		fprintf( stderr, "Not enough memory.\n");
+		return NULL;
+	}
+	config_set_defaults( config );
+	memset( seen, 0, sizeof(seen) );
 
 	/* Open the file */
 	if( ( fp = fopen( CONFIG_FILE_PATH , "r") ) == NULL )
 	{
 		/* The configuration file is optional */
-		return 0;
+		return config;
 	}
 
-	while( !feof( fp ) )
+	message = NULL;
+	line_number = 0;
+	while( ( message == NULL ) && ( fgets( line, CONFIG_LINE_LIMIT, fp ) != NULL ) )
 	{
-		/* Read a line */
-		if( fgets( line, CONFIG_LINE_LIMIT, fp ) == NULL ) {
-			break;
-		}
+		line_number++;
 
-		/* Ignore comments and empty lines */
-		if( ( line[0] == '#' ) || ( line[0] == '\n' ) )
+		/* Tokenize string to get the key name, ignore comments and empty lines */
+		config_key_name = strtok( line, " \r\n\t");
+		if( ( config_key_name == NULL ) || ( config_key_name[0] == '#' ) )
 			continue;
 
-		/* Tokenize string to get the key name */
-		config_key = strtok( line, " \n\t");
-
-		/* If it is NOT the correct key, continue to the next line */
-		if( config_key == NULL )
-			continue;
-		else if( _stricmp( config_key, key ) != 0 ) 
+		for( key = config_keys; key->name != NULL; key++ ) {
+			if( _stricmp( config_key_name, key->name ) == 0 )
+				break;
+		}
+		if( key->name == NULL ) {
+			fprintf( stderr, "%s:%u: unknown key \"%s\", ignored.\n", CONFIG_FILE_PATH, line_number, config_key_name );
 			continue;
+		}
 
-		/* They key is OK! Grab the value... */
 		config_value = strtok(NULL, "\0");
-		fclose( fp );
-
-		if( config_value == NULL ) {
-			return 0;
-		} else {
+		if( config_value != NULL )
 			config_value = trim( config_value );
-			if( config_value == NULL )
-				return 0;
+		if( ( config_value == NULL ) || ( config_value[0] == '\0' ) ) {
+			message = "missing value";
+			break;
 		}
 
-		/* Convert the values */
-		if( strlen( config_value ) > size ) {
-			memcpy( value, config_value, size - 1);
-			return 1;
-		} else {
-			memcpy( value, config_value, strlen( config_value ) );
-			return 1;
+		/* The first line naming a key wins, except for the ranges */
+		if( ( key->count_offset == 0 ) && ( seen[key - config_keys]++ > 0 ) ) {
+			fprintf( stderr, "%s:%u: %s given again, ignored.\n", CONFIG_FILE_PATH, line_number, key->name );
+			continue;
 		}
-	}
 
+		message = config_parse_value( config, key, config_value );
+	}
 	fclose( fp );
-	return 0;
+
+	if( message != NULL ) {
+		fprintf( stderr, "%s:%u: %s.\n", CONFIG_FILE_PATH, line_number, message );
+	} else if( ( message = config_check( config ) ) != NULL ) {
+		fprintf( stderr, "%s: %s.\n", CONFIG_FILE_PATH, message );
+	}
+
+	if( message != NULL ) {
+		free( config );
+		return NULL;
+	}
+	return config;
 }
 
-int GetConfigurationPort(const char * key, u_short * value)
+/* Free the retired snapshots nobody can be reading anymore. Called under mutex_config. */
+static void
+config_reap(unsigned long now)
 {
-	char * result;
-	int retVal;
+	repeater_config ** last;
+	repeater_config * config;
 
-	retVal = 0;
-	result = (char *)malloc( CONFIG_LINE_LIMIT );
-	if( result == NULL ) {
-		fprintf( stderr, "Not enough memory.\n");
-		return 0;
+	last = &config_retired;
+	while( ( config = *last ) != NULL ) {
+		if( ( config->refs == 0 ) && ( now - config->retired >= CONFIG_GRACE_PERIOD ) ) {
+			*last = config->next;
+			free( config );
+		} else {
+			last = &config->next;
+		}
 	}
+}
 
-	if ( LoadConfigurationKey( key, result, CONFIG_LINE_LIMIT ) == 1 ) {
-		if( result[0] != '-' ) {
-			int port = atoi( result );
-			if( ( port > 0 ) && ( port < 65535 ) ) {
-				memcpy( value, (u_short *)&port, sizeof(u_short) );
-				retVal = 1;
-			}
+void
+ConfigPublish(repeater_config * config)
+{
+	repeater_config * old;
+	unsigned long now;
+
+	/* The first one comes before any other thread */
+	if( !config_published ) {
+		if( mutex_init( &mutex_config ) != 0 ) {
+			fprintf( stderr, "Failed to create the configuration mutex.\n");
+			return;
 		}
+		config_published = 1;
 	}
 
-	free( result );
-	return retVal;
+	config->refs = 0;
+	config->next = NULL;
+	now = (unsigned long)time( NULL );
+
+	mutex_lock( &mutex_config );
+	old = config_current;
+
+	/* Readers take the pointer without locking: the snapshot goes out whole */
+#ifdef WIN32
+	MemoryBarrier();
+#else
+	__sync_synchronize();
+#endif
+	config_current = config;
+
+	if( old != NULL ) {
+		old->retired = now;
+		old->next = config_retired;
+		config_retired = old;
+	}
+	config_reap( now );
+	mutex_unlock( &mutex_config );
 }
 
-int 
-GetConfigurationBoolean(const char * key, int * value)
+const repeater_config *
+ConfigGet( void )
 {
-	char * result;
+	repeater_config * config;
 
-	int retVal;
+	config = config_current;
+	if( config != NULL )
+		return config;
 
-	retVal = 0;
-	result = (char *)malloc( CONFIG_LINE_LIMIT );
-	if( result == NULL ) {
-		fprintf( stderr, "Not enough memory.\n");
-		return 0;
+	if( !config_defaults_set ) {
+		config_set_defaults( &config_defaults );
+		config_defaults_set = 1;
 	}
+	return &config_defaults;
+}
+
+const repeater_config *
+ConfigAcquire( void )
+{
+	repeater_config * config;
+
+	if( !config_published )
+		return ConfigGet();
 
-	if ( LoadConfigurationKey( key, result, CONFIG_LINE_LIMIT ) == 1 ) {
-		if( ( _stricmp( "TRUE", result ) == 0 ) || ( _stricmp( "1", result) == 0 ) ) {
-			int mem_value = 1;
-			memcpy( value, &mem_value, sizeof( int ));
-			retVal = 1;
-		} else if( ( _stricmp( "FALSE", result ) == 0 ) || ( _stricmp( "0", result) == 0 ) ) {
-			int mem_value = 0;
-			memcpy( value, &mem_value, sizeof( int ));
-			retVal = 1;
-		}	
+	mutex_lock( &mutex_config );
+	config = config_current;
+	if( config != NULL )
+		config->refs++;
+	mutex_unlock( &mutex_config );
+
+	return ( config != NULL ) ? config : ConfigGet();
+}
+
+void
+ConfigRelease(const repeater_config * config)
+{
+	if( !config_published || ( config == &config_defaults ) )
+		return;
+
+	mutex_lock( &mutex_config );
+	((repeater_config *)config)->refs--;
+	mutex_unlock( &mutex_config );
+}
+
+void
+ConfigFree( void )
+{
+	repeater_config * config;
+
+	if( !config_published )
+		return;
+
+	/* Every other thread is gone */
+	config = config_current;
+	config_current = NULL;
+	if( config != NULL )
+		free( config );
+	while( config_retired != NULL ) {
+		config = config_retired;
+		config_retired = config->next;
+		free( config );
 	}
 
-	free( result );
-	return retVal;
-}
\ No newline at end of file
+	mutex_destroy( &mutex_config );
+	config_published = 0;
+}
@@ -19,10 +19,118 @@
 //
 /////////////////////////////////////////////////////////////////////////////
 
+
+
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
 /**
  * Limit to how long any given config line may be.
  */
 #define CONFIG_LINE_LIMIT	2048
 
-int GetConfigurationBoolean(const char * key, int * value);
-int GetConfigurationPort(const char * key, u_short * value);
\ No newline at end of file
+/**
+ * Keys allowed more than once (RateLimit, Record, ModeIAllow) keep up to this many lines.
+ */
+#define CONFIG_MAX_RANGES	64
+
+typedef struct _config_range {
+	unsigned long first;
+	unsigned long last;
+	unsigned long rate;             /* RateLimit only: bytes per second */
+} config_range;
+
+/**
+ * ModeIAllow: a network and a port range the Mode I viewers may connect to.
+ */
+typedef struct _config_network {
+	unsigned long address;          /* Host order, masked */
+	unsigned long mask;
+	unsigned int port_first;
+	unsigned int port_last;
+} config_network;
+
+/**
+ * Everything vncrepeater.conf says, parsed and checked once. A published
+ * snapshot never changes, so any thread may read it without locking.
+ */
+typedef struct _repeater_config {
+	u_short server_port;
+	u_short viewer_port;
+	u_short admin_port;             /* 0 disables it */
+	u_short modei_port;             /* UltraVNC repeater viewers, 0 disables it */
+	unsigned int max_sessions;      /* 0 for no limit */
+	unsigned int defer_accept;      /* Seconds the server port waits for data before accept(), 0 for off */
+	unsigned int fast_open;         /* TCP Fast Open queue of both ports, 0 for off */
+	unsigned int accept_rate;       /* Connections per second and source address on each port, 0 for no limit */
+	unsigned int accept_burst;
+	unsigned int max_buffered;      /* Bytes the relays may hold before accepting stops, 0 for no limit */
+	unsigned int overload_high;     /* Percent of a limit that stops accepting */
+	unsigned int overload_low;      /* Percent of every limit to get under to accept again */
+	unsigned int handshake_threads; /* Threads running the handshakes, 0 for 4 per core and at least 16 */
+	int server_tls;                 /* TLS on the server port, offloaded to the kernel */
+	int viewer_tls;                 /* Same on the viewer port */
+	char tls_certificate[CONFIG_LINE_LIMIT];  /* PEM chain, the key too if tls_key is not given */
+	char tls_key[CONFIG_LINE_LIMIT];
+
+	/* Mode I, where the viewer names the server */
+	unsigned int modei_connects;    /* Connects under way at once, 0 for no limit */
+	unsigned int modei_allow_count; /* None: no server may be named */
+	config_network modei_allow[CONFIG_MAX_RANGES];
+
+	/* Relay */
+	int input_priority;             /* Push complete viewer messages at once, batch the server updates */
+	int broadcast;                  /* Let more than one viewer join a server */
+	int shadow;                     /* Keep a copy of the framebuffer for late viewers */
+	int coalesce;                   /* Merge the updates a slow viewer can not keep up with */
+	int tune_sockets;               /* Size the socket buffers from TCP_INFO */
+	unsigned int zerocopy_threshold; /* Server to viewer sends this big use MSG_ZEROCOPY, 0 for off */
+
+	/* Shaper, bytes per second and direction, 0 for no limit */
+	unsigned int session_rate;
+	unsigned int global_rate;
+	unsigned int rate_limit_count;
+	config_range rate_limits[CONFIG_MAX_RANGES];
+
+	/* Recorder */
+	char record_directory[CONFIG_LINE_LIMIT];
+	unsigned int record_count;
+	config_range records[CONFIG_MAX_RANGES];
+
+	/* Process */
+	char upgrade_path[CONFIG_LINE_LIMIT];
+	unsigned int drain_timeout;     /* Seconds */
+	unsigned int log_level;         /* 0 errors only, 1 also the events */
+
+	/* Bookkeeping, under mutex_config */
+	unsigned int refs;              /* Sessions running with this snapshot */
+	unsigned long retired;          /* When a newer one was published */
+	struct _repeater_config * next; /* Retired snapshots */
+} repeater_config;
+
+/**
+ * Parse the configuration file, a missing one leaves the defaults. Returns
+ * NULL, after saying why, when a line is invalid.
+ */
+repeater_config * ConfigLoad( void );
+
+/**
+ * Make config the one ConfigGet() returns, it must not change afterwards.
+ * Before that, ConfigGet() returns the defaults. The snapshot it replaces
+ * is freed once no session holds it and CONFIG_GRACE_PERIOD has passed,
+ * long enough for any ConfigGet() caller to be done with it.
+ */
+#define CONFIG_GRACE_PERIOD	60
+
+void ConfigPublish(repeater_config * config);
+const repeater_config * ConfigGet( void );
+
+/**
+ * For readers that keep the snapshot, like a session for its whole life.
+ */
+const repeater_config * ConfigAcquire( void );
+void ConfigRelease(const repeater_config * config);
+
+void ConfigFree( void );
+
+#endif
@@ -33,7 +33,13 @@ static void unscrun(unsigned long *, unsigned char *);
 static void desfunc(unsigned long *, unsigned long *);
 static void cookey(unsigned long *);
 
-static unsigned long KnL[32] = { 0L };
+/* The key register, one per thread: the handshakes run side by side */
+#ifdef WIN32
+#define KEY_REGISTER	__declspec(thread)
+#else
+#define KEY_REGISTER	__thread
+#endif
+static KEY_REGISTER unsigned long KnL[32] = { 0L };
 //static unsigned long KnR[32] = { 0L };
 //static unsigned long Kn3[32] = { 0L };
 //static unsigned char Df_Key[24] = {
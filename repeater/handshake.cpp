@@ -0,0 +1,400 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include "thread.h"
+#include "mutex.h"
+#include "sockets.h"
+#include "repeater.h"
+#include "pool.h"
+#include "handshake.h"
+
+/* Milliseconds an idle thread sleeps between two looks at the queues */
+#define HANDSHAKE_IDLE_POLL	1000
+
+
+typedef struct _handshake_item {
+	handshake_job job;
+	SOCKET connection;
+} handshake_item;
+
+/* A thread and its queue. Stolen items come from the tail, the owner takes the head. */
+typedef struct _handshake_queue {
+	mutex_t mutex;
+	handshake_item items[HANDSHAKE_QUEUE_LIMIT];
+	unsigned int head;
+	volatile unsigned int count;
+	unsigned int index;
+} handshake_queue;
+
+static handshake_queue * handshake_queues = NULL;
+static unsigned int handshake_count = 0;
+static volatile int handshake_stopping = 0;
+static int handshake_running = 0;
+
+/* Everything below is under mutex_handshake */
+static handshake_stats handshakes;
+static unsigned int handshake_next = 0;
+static mutex_t mutex_handshake;
+
+/* A byte per connection wakes the idle threads up, threads counts them all */
+static idle_pool handshake_pool;
+
+
+/*****************************************************************************
+ *
+ * Queues
+ *
+ *****************************************************************************/
+
+static int
+handshake_push(handshake_queue * queue, handshake_job job, SOCKET connection)
+{
+	unsigned int slot;
+
+	mutex_lock( &queue->mutex );
+	if( queue->count == HANDSHAKE_QUEUE_LIMIT ) {
+		mutex_unlock( &queue->mutex );
+		return -1;
+	}
+	slot = ( queue->head + queue->count ) % HANDSHAKE_QUEUE_LIMIT;
+	queue->items[slot].job = job;
+	queue->items[slot].connection = connection;
+	queue->count++;
+	mutex_unlock( &queue->mutex );
+	return 0;
+}
+
+/* The owner takes the oldest connection */
+static int
+handshake_pop(handshake_queue * queue, handshake_item * item)
+{
+	mutex_lock( &queue->mutex );
+	if( queue->count == 0 ) {
+		mutex_unlock( &queue->mutex );
+		return -1;
+	}
+	*item = queue->items[queue->head];
+	queue->head = ( queue->head + 1 ) % HANDSHAKE_QUEUE_LIMIT;
+	queue->count--;
+	mutex_unlock( &queue->mutex );
+	return 0;
+}
+
+/* A thief takes the newest one, away from the owner */
+static int
+handshake_steal(handshake_queue * queue, handshake_item * item)
+{
+	mutex_lock( &queue->mutex );
+	if( queue->count == 0 ) {
+		mutex_unlock( &queue->mutex );
+		return -1;
+	}
+	queue->count--;
+	*item = queue->items[( queue->head + queue->count ) % HANDSHAKE_QUEUE_LIMIT];
+	mutex_unlock( &queue->mutex );
+	return 0;
+}
+
+/* Own queue first, then the longest of the others. Returns 1 when stolen, -1 for nothing. */
+static int
+handshake_take(handshake_queue * own, handshake_item * item)
+{
+	handshake_queue * victim;
+	unsigned int longest;
+	unsigned int i;
+
+	if( handshake_pop( own, item ) == 0 )
+		return 0;
+
+	/* The counts are read unlocked, the steal checks again */
+	while( 1 ) {
+		victim = NULL;
+		longest = 0;
+		for( i = 1; i < handshake_count; i++ ) {
+			if( handshake_queues[( own->index + i ) % handshake_count].count > longest ) {
+				victim = &handshake_queues[( own->index + i ) % handshake_count];
+				longest = victim->count;
+			}
+		}
+		if( victim == NULL )
+			return -1;
+		if( handshake_steal( victim, item ) == 0 )
+			return 1;
+	}
+}
+
+
+/*****************************************************************************
+ *
+ * Threads
+ *
+ *****************************************************************************/
+
+static THREAD_CALL
+handshake_main(LPVOID lpParam)
+{
+	handshake_queue * own;
+	handshake_item item;
+	int stolen;
+
+	own = (handshake_queue *)lpParam;
+	while( !handshake_stopping ) {
+		/* Busy before taking, HandshakeWait() is not to miss it in between */
+		mutex_lock( &mutex_handshake );
+		handshakes.busy++;
+		mutex_unlock( &mutex_handshake );
+
+		stolen = handshake_take( own, &item );
+		if( stolen < 0 ) {
+			mutex_lock( &mutex_handshake );
+			handshakes.busy--;
+			mutex_unlock( &mutex_handshake );
+
+			pool_idle( &handshake_pool, HANDSHAKE_IDLE_POLL );
+			continue;
+		}
+
+		if( stolen ) {
+			mutex_lock( &mutex_handshake );
+			handshakes.stolen++;
+			mutex_unlock( &mutex_handshake );
+		}
+
+		item.job( item.connection );
+
+		mutex_lock( &mutex_handshake );
+		handshakes.busy--;
+		handshakes.done++;
+		mutex_unlock( &mutex_handshake );
+	}
+
+	mutex_lock( &mutex_handshake );
+	handshake_pool.threads--;
+	mutex_unlock( &mutex_handshake );
+	return 0;
+}
+
+static unsigned int
+handshake_cores( void )
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo( &info );
+	return (unsigned int)info.dwNumberOfProcessors;
+#else
+	long cores;
+
+	cores = sysconf( _SC_NPROCESSORS_ONLN );
+	return ( cores > 0 ) ? (unsigned int)cores : 1;
+#endif
+}
+
+
+/*****************************************************************************
+ *
+ * Pool
+ *
+ *****************************************************************************/
+
+int
+HandshakeInit(unsigned int threads)
+{
+	unsigned int i;
+
+	if( threads == 0 ) {
+		threads = handshake_cores() * HANDSHAKE_THREADS_PER_CORE;
+		if( threads < HANDSHAKE_MIN_THREADS )
+			threads = HANDSHAKE_MIN_THREADS;
+	}
+	if( threads > HANDSHAKE_THREAD_LIMIT )
+		threads = HANDSHAKE_THREAD_LIMIT;
+
+	handshake_queues = (handshake_queue *)calloc( threads, sizeof(handshake_queue) );
+	if( handshake_queues == NULL ) {
+		error("Not enough memory for the handshake queues.\n");
+		return -1;
+	}
+	if( pool_init( &handshake_pool, &mutex_handshake ) != 0 ) {
+		error("Failed to create the wake up sockets for the handshakes.\n");
+		free( handshake_queues );
+		handshake_queues = NULL;
+		return -1;
+	}
+	if( mutex_init( &mutex_handshake ) != 0 ) {
+		error("Failed to create the handshake mutex.\n");
+		pool_free( &handshake_pool );
+		free( handshake_queues );
+		handshake_queues = NULL;
+		return -1;
+	}
+
+	memset( &handshakes, 0, sizeof(handshakes) );
+	handshake_stopping = 0;
+	handshake_count = 0;
+	for( i = 0; i < threads; i++ ) {
+		handshake_queues[i].index = i;
+		if( mutex_init( &handshake_queues[i].mutex ) != 0 )
+			break;
+		/* Counted first, the thread looks at the others right away */
+		handshake_count++;
+		mutex_lock( &mutex_handshake );
+		handshake_pool.threads++;
+		mutex_unlock( &mutex_handshake );
+		if( thread_create_detached( handshake_main, (LPVOID)&handshake_queues[i], 0 ) != 0 ) {
+			mutex_lock( &mutex_handshake );
+			handshake_pool.threads--;
+			mutex_unlock( &mutex_handshake );
+			handshake_count--;
+			mutex_destroy( &handshake_queues[i].mutex );
+			break;
+		}
+	}
+	handshake_running = 1;
+
+	if( handshake_count == 0 ) {
+		error("Unable to start a handshake thread.\n");
+		HandshakeFree();
+		return -1;
+	}
+	if( handshake_count < threads )
+		error("Only %u of %u handshake threads started.\n", handshake_count, threads);
+	handshakes.threads = handshake_count;
+	debug("%u handshake threads.\n", handshake_count);
+	return 0;
+}
+
+void
+HandshakeFree( void )
+{
+	handshake_item item;
+	unsigned int i;
+
+	if( !handshake_running )
+		return;
+
+	handshake_stopping = 1;
+	handshake_running = 0;
+	/* They still use the queues as well */
+	if( pool_stop( &handshake_pool, HANDSHAKE_STOP_TIMEOUT, "handshake" ) > 0 )
+		return;
+
+	/* Accepted but never handled */
+	for( i = 0; i < handshake_count; i++ ) {
+		while( handshake_pop( &handshake_queues[i], &item ) == 0 )
+			socket_close( item.connection );
+		mutex_destroy( &handshake_queues[i].mutex );
+	}
+	mutex_destroy( &mutex_handshake );
+	pool_free( &handshake_pool );
+	free( handshake_queues );
+	handshake_queues = NULL;
+	handshake_count = 0;
+}
+
+int
+HandshakeSubmit(handshake_job job, SOCKET connection)
+{
+	unsigned int first;
+	unsigned int queued;
+	unsigned int i;
+
+	if( !handshake_running )
+		return -1;
+
+	mutex_lock( &mutex_handshake );
+	first = handshake_next;
+	handshake_next = ( handshake_next + 1 ) % handshake_count;
+	mutex_unlock( &mutex_handshake );
+
+	/* Dealt in turn, a full queue passes it on */
+	for( i = 0; i < handshake_count; i++ ) {
+		if( handshake_push( &handshake_queues[( first + i ) % handshake_count], job, connection ) == 0 )
+			break;
+	}
+
+	queued = 0;
+	mutex_lock( &mutex_handshake );
+	if( i == handshake_count ) {
+		handshakes.rejected++;
+		mutex_unlock( &mutex_handshake );
+		error("Every handshake queue is full.\n");
+		return -1;
+	}
+	for( i = 0; i < handshake_count; i++ )
+		queued += handshake_queues[i].count;
+	if( queued > handshakes.queued_peak )
+		handshakes.queued_peak = queued;
+	mutex_unlock( &mutex_handshake );
+
+	pool_wake( &handshake_pool, 1 );
+	return 0;
+}
+
+void
+HandshakeWait(unsigned int seconds)
+{
+	handshake_stats stats;
+	unsigned int i;
+
+	for( i = 0; i < seconds * 20; i++ ) {
+		HandshakeGetStats( &stats );
+		if( ( stats.queued == 0 ) && ( stats.busy == 0 ) )
+			return;
+		usleep( 50000 );
+	}
+	error("Handshakes still under way after %u seconds, they will get no slot.\n", seconds);
+}
+
+void
+HandshakeGetStats(handshake_stats * stats)
+{
+	unsigned int queued;
+	unsigned int i;
+
+	if( !handshake_running ) {
+		memset( stats, 0, sizeof(handshake_stats) );
+		return;
+	}
+
+	/* Queues first: what left them by now was counted busy before */
+	queued = 0;
+	for( i = 0; i < handshake_count; i++ )
+		queued += handshake_queues[i].count;
+
+	mutex_lock( &mutex_handshake );
+	*stats = handshakes;
+	mutex_unlock( &mutex_handshake );
+	stats->queued = queued;
+}
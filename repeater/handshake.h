@@ -0,0 +1,71 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+
+#ifndef _HANDSHAKE_H
+#define _HANDSHAKE_H
+
+/**
+ * The handshakes of the accepted connections run on a pool of threads,
+ * so a slow peer or a reconnect storm does not hold up the listeners.
+ * Each thread has its own queue: the listeners deal the connections out
+ * in turn, a thread works through its queue oldest first and, once it is
+ * empty, steals the newest connection of the longest queue left.
+ *
+ * HandshakeThreads sets the number of threads, by default
+ * HANDSHAKE_THREADS_PER_CORE per core and at least HANDSHAKE_MIN_THREADS:
+ * a handshake mostly waits on its peer, a few silent ones are not to hold
+ * up the others.
+ */
+#define HANDSHAKE_THREADS_PER_CORE	4
+#define HANDSHAKE_MIN_THREADS	16
+#define HANDSHAKE_THREAD_LIMIT	64
+#define HANDSHAKE_QUEUE_LIMIT	256	/* Connections per thread, past that they are refused */
+#define HANDSHAKE_STOP_TIMEOUT	15	/* Seconds to finish the handshakes under way */
+
+typedef void (*handshake_job)(SOCKET connection);
+
+typedef struct _handshake_stats {
+	unsigned int threads;
+	unsigned int busy;
+	unsigned int queued;
+	unsigned int queued_peak;
+	unsigned long done;             /* Handshakes run so far */
+	unsigned long stolen;           /* Taken from the queue of another thread */
+	unsigned long rejected;         /* Refused with every queue full */
+} handshake_stats;
+
+/* threads: 0 for the default */
+int HandshakeInit(unsigned int threads);
+void HandshakeFree( void );
+
+/* Run job(connection) on the pool. Returns -1 when every queue is full. */
+int HandshakeSubmit(handshake_job job, SOCKET connection);
+
+/* Wait up to seconds for the queued and running handshakes to end */
+void HandshakeWait(unsigned int seconds);
+
+void HandshakeGetStats(handshake_stats * stats);
+
+#endif
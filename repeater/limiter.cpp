@@ -0,0 +1,134 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "limiter.h"
+
+
+/*****************************************************************************
+ *
+ * Helpers
+ *
+ *****************************************************************************/
+
+static unsigned int
+limiter_hash(unsigned int addr)
+{
+	return ( addr * 2654435761U ) >> ( 32 - LIMITER_BITS );
+}
+
+/* Tokens the entry holds at now, at most full */
+static unsigned int
+limiter_tokens(limiter_entry * e, unsigned int now, unsigned int rate, unsigned int full)
+{
+	unsigned long long tokens;
+
+	/* A connection a second is a thousandth of a token per millisecond */
+	tokens = e->tokens + (unsigned long long)( now - e->last ) * rate;
+	return ( tokens > full ) ? full : (unsigned int)tokens;
+}
+
+
+/*****************************************************************************
+ *
+ * Accept limiter
+ *
+ *****************************************************************************/
+
+void
+LimiterInit(accept_limiter * l)
+{
+	memset( l, 0, sizeof(accept_limiter) );
+}
+
+int
+LimiterAllow(accept_limiter * l, unsigned int addr, unsigned int rate, unsigned int burst, unsigned long long now, unsigned int * refused)
+{
+	limiter_entry * entry;
+	limiter_entry * spare;
+	limiter_entry * e;
+	unsigned int spare_age;
+	unsigned int age;
+	unsigned int full;
+	unsigned int ms;
+	unsigned int h;
+	int i;
+
+	*refused = 0;
+	if( rate == 0 )
+		return 1;
+
+	if( burst == 0 )
+		burst = 1;
+	full = ( burst >= 4000000 ) ? 4000000000U : burst * 1000;
+	ms = (unsigned int)( now / 1000 );
+
+	entry = NULL;
+	spare = NULL;
+	spare_age = 0;
+	h = limiter_hash( addr );
+	for( i = 0; i < LIMITER_PROBE; i++ ) {
+		e = &l->entries[( h + i ) & ( LIMITER_SLOTS - 1 )];
+		if( e->addr == addr ) {
+			entry = e;
+			break;
+		}
+
+		/* Unused first, then aged out (its bucket is full again), then idle the longest */
+		if( e->addr == 0 )
+			age = 0xFFFFFFFF;
+		else if( limiter_tokens( e, ms, rate, full ) == full )
+			age = 0xFFFFFFFE;
+		else
+			age = ms - e->last;
+		if( ( spare == NULL ) || ( age > spare_age ) ) {
+			spare = e;
+			spare_age = age;
+		}
+	}
+
+	if( entry == NULL ) {
+		entry = spare;
+		entry->addr = addr;
+		entry->tokens = full;
+		entry->last = ms;
+		entry->refused = 0;
+	}
+
+	entry->tokens = limiter_tokens( entry, ms, rate, full );
+	entry->last = ms;
+	if( entry->tokens < 1000 ) {
+		entry->refused++;
+		l->refused++;
+		*refused = entry->refused;
+		return 0;
+	}
+
+	entry->tokens -= 1000;
+	*refused = entry->refused;
+	entry->refused = 0;
+	return 1;
+}
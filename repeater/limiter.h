@@ -0,0 +1,65 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+#ifndef _LIMITER_H
+#define _LIMITER_H
+
+/**
+ * Accept limiter: a token bucket per source address, refilled at
+ * AcceptRate connections per second up to AcceptBurst. The listeners ask
+ * it right after accept(), before any handshake, and reset the
+ * connections it refuses.
+ *
+ * The buckets live in a fixed table, LIMITER_PROBE slots are looked at
+ * from the address hash. An entry whose bucket has filled up again tells
+ * nothing anymore and is reused as is; when none of the slots is free,
+ * the one idle the longest goes.
+ */
+#define LIMITER_BITS		12
+#define LIMITER_SLOTS		( 1 << LIMITER_BITS )
+#define LIMITER_PROBE		8
+
+typedef struct _limiter_entry {
+	unsigned int addr;              /* IPv4, network order, 0 for unused */
+	unsigned int last;              /* Last refill, in milliseconds */
+	unsigned int tokens;            /* In thousandths of a connection */
+	unsigned int refused;           /* Since the last one let through */
+} limiter_entry;
+
+typedef struct _accept_limiter {
+	limiter_entry entries[LIMITER_SLOTS];
+	unsigned long refused;          /* So far */
+} accept_limiter;
+
+void LimiterInit(accept_limiter * l);
+
+/**
+ * 1 if a connection from addr may go on, 0 if it is over the rate. rate 0
+ * lets everything through. refused gets the connections from addr
+ * refused in a row, this one included, or before this one when it goes
+ * on. now is ShaperNow().
+ */
+int LimiterAllow(accept_limiter * l, unsigned int addr, unsigned int rate, unsigned int burst, unsigned long long now, unsigned int * refused);
+
+#endif
@@ -0,0 +1,1074 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+/*
+ * loadgen - Load generator for the repeater.
+ *
+ * Opens N fake UltraVNC servers against the server port and N matching
+ * viewers against the viewer port, pumps synthetic framebuffer updates from
+ * every server to its viewer and reports the pairing rate, the handshake
+ * latency percentiles and the relay throughput. Viewers can also send
+ * pointer events while the updates flow, to measure the input latency
+ * under load. Interactive sessions only carry pointer events, their
+ * latency next to bulk sessions shows how fair the relay is. With -tls,
+ * the connections to TLS ports are handed to the kernel (kTLS) after the
+ * handshake, like the repeater does, so TLS and plaintext runs compare the
+ * same relay path. Linux only (epoll).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "rfb.h"
+#include "vncauth.h"
+
+#define TRUE	1
+#define FALSE	0
+
+#define MAX_HOST_NAME_LEN	250
+
+#define LOADGEN_MAX_EVENTS	256
+#define LOADGEN_READ_SIZE	(64 * 1024)
+
+/* Server handshake: ID + version out, version in, auth out, ClientInit in */
+#define SERVER_CONNECTING	0
+#define SERVER_TLS			1
+#define SERVER_READ_VERSION	2
+#define SERVER_WAIT_INIT	3
+#define SERVER_PUMPING		4
+#define SERVER_DONE			5
+
+/* Viewer handshake: the repeater acts as a VNC server with VNC authentication */
+#define VIEWER_IDLE			0
+#define VIEWER_CONNECTING	1
+#define VIEWER_TLS			2
+#define VIEWER_READ_VERSION	3
+#define VIEWER_READ_AUTH	4
+#define VIEWER_READ_RESULT	5
+#define VIEWER_RELAYING		6
+#define VIEWER_DONE			7
+
+#define ROLE_SERVER	0
+#define ROLE_VIEWER	1
+
+/* -tls: the ports speaking TLS */
+#define TLS_SERVER	1
+#define TLS_VIEWER	2
+
+/* Pointer events in flight per session, to match them on the server side */
+#define INPUT_WINDOW		256
+#define MAX_INPUT_SAMPLES	(1024 * 1024)
+
+// Structures
+
+typedef struct _loadgen_session loadgen_session;
+
+typedef struct _loadgen_conn {
+	int fd;
+	int role;
+	int state;
+	char in[MAX_HOST_NAME_LEN + 64];   /* Handshake input */
+	unsigned int in_len;
+	char out[MAX_HOST_NAME_LEN + 64];  /* Handshake output */
+	unsigned int out_len;
+	unsigned int out_pos;
+	unsigned int events;               /* What epoll waits for */
+#ifdef HAVE_OPENSSL
+	SSL * ssl;                         /* During the TLS handshake only */
+#endif
+	loadgen_session * session;
+} loadgen_conn;
+
+struct _loadgen_session {
+	unsigned int id;
+	loadgen_conn server;
+	loadgen_conn viewer;
+	double start;            /* Viewer connect() issued */
+	double paired;           /* Server received ClientInit */
+	double finished;
+	unsigned long long sent;     /* Bytes queued by the fake server */
+	unsigned long long received; /* Bytes received by the fake viewer */
+	unsigned long long expected;
+	unsigned int msg_pos;        /* Position inside the current update */
+	int failed;
+	int interactive;             /* Pointer events only, lives until the bulk sessions are done */
+	double next_input;           /* When the viewer sends its next event */
+	unsigned int input_seq;
+	double input_sent[INPUT_WINDOW];
+};
+
+typedef struct _loadgen_options {
+	const char * host;
+	u_short server_port;
+	u_short viewer_port;
+	unsigned int sessions;
+	unsigned int concurrency;
+	unsigned int base_id;
+	unsigned long long bytes;
+	unsigned int rect;
+	unsigned int timeout;
+	unsigned int input_rate;
+	unsigned int interactive;
+	unsigned int tls;                  /* TLS_SERVER, TLS_VIEWER */
+} loadgen_options;
+
+// Global variables
+loadgen_options options;
+loadgen_session * sessions;
+int epfd;
+struct sockaddr_in server_addr;
+struct sockaddr_in viewer_addr;
+
+#ifdef HAVE_OPENSSL
+SSL_CTX * tls_ctx;
+#endif
+
+char * update_msg;           /* A synthetic FramebufferUpdate message */
+unsigned int update_len;
+
+unsigned int connecting;     /* Sessions with a handshake in flight */
+unsigned int next_session;
+unsigned int paired_count;
+unsigned int finished_count;
+unsigned int failed_count;
+
+unsigned int bulk_left;      /* Bulk sessions not finished yet */
+
+double * input_latencies;    /* Viewer to server pointer event latency */
+unsigned int input_count;
+double * interactive_latencies;
+unsigned int interactive_count;
+
+
+/*****************************************************************************
+ *
+ * Helpers / Misc.
+ *
+ *****************************************************************************/
+
+double
+now_seconds( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void
+usage(char * appname)
+{
+	fprintf(stderr, "\nUsage: %s [options]\n\n", appname);
+	fprintf(stderr, "  -host addr        Repeater address (default 127.0.0.1).\n");
+	fprintf(stderr, "  -server port      Repeater port for VNC servers (default 5500).\n");
+	fprintf(stderr, "  -viewer port      Repeater port for VNC viewers (default 5900).\n");
+	fprintf(stderr, "  -sessions n       Number of server/viewer pairs (default 100).\n");
+	fprintf(stderr, "  -concurrency n    Handshakes in flight at once (default 32).\n");
+	fprintf(stderr, "  -id n             First repeater ID (default 1000).\n");
+	fprintf(stderr, "  -bytes n          Framebuffer bytes to pump per session (default 4194304).\n");
+	fprintf(stderr, "  -rect n           Side of the synthetic raw rectangles (default 64).\n");
+	fprintf(stderr, "  -timeout s        Give up after s seconds (default 120).\n");
+	fprintf(stderr, "  -input n          Pointer events per second sent by each viewer (default 0).\n");
+	fprintf(stderr, "  -interactive n    Sessions among the others that only send pointer events (default 0).\n");
+	fprintf(stderr, "  -tls port         TLS towards the \"server\" port, the \"viewer\" port or \"both\", with kTLS (default none).\n\n");
+	exit(1);
+}
+
+void
+build_update( unsigned int side )
+{
+	rfbFramebufferUpdateMsg * fu;
+	rfbFramebufferUpdateRectHeader * rect;
+	unsigned int i;
+
+	update_len = sz_rfbFramebufferUpdateMsg + sz_rfbFramebufferUpdateRectHeader + side * side * 4;
+	update_msg = (char *)malloc( update_len );
+	if( update_msg == NULL ) {
+		fprintf(stderr, "Not enough memory.\n");
+		exit(1);
+	}
+
+	fu = (rfbFramebufferUpdateMsg *)update_msg;
+	fu->type = rfbFramebufferUpdate;
+	fu->pad = 0;
+	fu->nRects = Swap16IfLE(1);
+
+	rect = (rfbFramebufferUpdateRectHeader *)(update_msg + sz_rfbFramebufferUpdateMsg);
+	rect->r.x = 0;
+	rect->r.y = 0;
+	rect->r.w = Swap16IfLE(side);
+	rect->r.h = Swap16IfLE(side);
+	rect->encoding = Swap32IfLE(rfbEncodingRaw);
+
+	for( i = sz_rfbFramebufferUpdateMsg + sz_rfbFramebufferUpdateRectHeader; i < update_len; i++ )
+		update_msg[i] = (char)i;
+}
+
+int
+open_connection( loadgen_conn * conn, struct sockaddr_in * addr )
+{
+	const int one = 1;
+	struct epoll_event ev;
+
+	conn->fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if( conn->fd < 0 ) {
+		fprintf(stderr, "socket() failed, errno=%d\n", errno);
+		return -1;
+	}
+
+	setsockopt( conn->fd, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof( one ));
+	fcntl( conn->fd, F_SETFL, O_NONBLOCK );
+
+	if( ( connect( conn->fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in) ) < 0 ) && ( errno != EINPROGRESS ) ) {
+		fprintf(stderr, "connect() failed, errno=%d\n", errno);
+		close( conn->fd );
+		conn->fd = -1;
+		return -1;
+	}
+
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = conn;
+	epoll_ctl( epfd, EPOLL_CTL_ADD, conn->fd, &ev );
+	conn->events = ev.events;
+	return 0;
+}
+
+void
+set_events( loadgen_conn * conn, unsigned int events )
+{
+	struct epoll_event ev;
+
+	if( conn->events == events )
+		return;
+	ev.events = events;
+	ev.data.ptr = conn;
+	epoll_ctl( epfd, EPOLL_CTL_MOD, conn->fd, &ev );
+	conn->events = events;
+}
+
+/* Level-triggered: EPOLLOUT only while there is output left, or epoll spins */
+void
+output_events( loadgen_conn * conn )
+{
+	set_events( conn, ( conn->out_len > 0 ) ? ( EPOLLIN | EPOLLOUT ) : EPOLLIN );
+}
+
+void
+close_connection( loadgen_conn * conn )
+{
+#ifdef HAVE_OPENSSL
+	if( conn->ssl != NULL ) {
+		SSL_free( conn->ssl );
+		conn->ssl = NULL;
+	}
+#endif
+	if( conn->fd >= 0 ) {
+		epoll_ctl( epfd, EPOLL_CTL_DEL, conn->fd, NULL );
+		close( conn->fd );
+		conn->fd = -1;
+	}
+}
+
+void
+finish_session( loadgen_session * session, int failed )
+{
+	if( session->finished != 0 )
+		return;
+
+	if( session->paired == 0 ) {
+		/* Still counted as a handshake in flight */
+		connecting--;
+	}
+
+	session->finished = now_seconds();
+	session->failed = failed;
+	session->server.state = SERVER_DONE;
+	session->viewer.state = VIEWER_DONE;
+	close_connection( &session->server );
+	close_connection( &session->viewer );
+
+	if( failed )
+		failed_count++;
+	else
+		finished_count++;
+	if( !session->interactive )
+		bulk_left--;
+}
+
+/* Queue handshake output and try to flush it */
+int
+queue_output( loadgen_conn * conn, const char * buf, unsigned int len )
+{
+	memcpy( conn->out + conn->out_len, buf, len );
+	conn->out_len += len;
+	return 0;
+}
+
+int
+flush_output( loadgen_conn * conn )
+{
+	int n;
+
+	while( conn->out_pos < conn->out_len ) {
+		n = send( conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos, MSG_NOSIGNAL );
+		if( n < 0 ) {
+			if( errno == EAGAIN )
+				return 0;
+			return -1;
+		}
+		conn->out_pos += n;
+	}
+
+	conn->out_len = 0;
+	conn->out_pos = 0;
+	return 0;
+}
+
+/* Read until the handshake input buffer holds len bytes. 1 when complete. */
+int
+fill_input( loadgen_conn * conn, unsigned int len )
+{
+	int n;
+
+	while( conn->in_len < len ) {
+		n = recv( conn->fd, conn->in + conn->in_len, len - conn->in_len, 0 );
+		if( n == 0 )
+			return -1;
+		if( n < 0 )
+			return ( errno == EAGAIN ) ? 0 : -1;
+		conn->in_len += n;
+	}
+
+	return 1;
+}
+
+int
+connect_done( loadgen_conn * conn )
+{
+	int err;
+	socklen_t len;
+
+	len = sizeof(err);
+	if( ( getsockopt( conn->fd, SOL_SOCKET, SO_ERROR, &err, &len ) < 0 ) || ( err != 0 ) )
+		return -1;
+	return 0;
+}
+
+/*
+ * Client side of the TLS handshake, a step at a time. Once it is over the
+ * kernel must hold both directions, the socket is used as a plain one.
+ * 1 when done, 0 while in progress.
+ */
+int
+tls_handshake( loadgen_conn * conn, unsigned int events )
+{
+#ifdef HAVE_OPENSSL
+	int n;
+
+	if( conn->ssl == NULL ) {
+		conn->ssl = SSL_new( tls_ctx );
+		if( ( conn->ssl == NULL ) || ( SSL_set_fd( conn->ssl, conn->fd ) != 1 ) )
+			return -1;
+	}
+
+	n = SSL_connect( conn->ssl );
+	if( n != 1 ) {
+		switch( SSL_get_error( conn->ssl, n ) ) {
+		case SSL_ERROR_WANT_READ:
+			set_events( conn, EPOLLIN );
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			set_events( conn, EPOLLOUT );
+			return 0;
+		}
+		ERR_print_errors_fp( stderr );
+		return -1;
+	}
+
+	if( !BIO_get_ktls_send( SSL_get_wbio( conn->ssl ) ) || !BIO_get_ktls_recv( SSL_get_rbio( conn->ssl ) ) ) {
+		fprintf(stderr, "The kernel did not take the TLS connection over (%s).\n", SSL_get_cipher_name( conn->ssl ));
+		return -1;
+	}
+
+	SSL_set_shutdown( conn->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN );
+	SSL_free( conn->ssl );
+	conn->ssl = NULL;
+	set_events( conn, events );
+	return 1;
+#else
+	return -1;
+#endif
+}
+
+
+/*****************************************************************************
+ *
+ * Fake VNC server
+ *
+ *****************************************************************************/
+
+void
+start_session( loadgen_session * session )
+{
+	char host_id[MAX_HOST_NAME_LEN];
+	rfbProtocolVersionMsg protocol_version;
+
+	connecting++;
+	session->server.state = SERVER_CONNECTING;
+	if( open_connection( &session->server, &server_addr ) != 0 ) {
+		finish_session( session, TRUE );
+		return;
+	}
+
+	/* Host ID followed by our protocol version */
+	memset( host_id, 0, sizeof(host_id) );
+	snprintf( host_id, sizeof(host_id), "ID:%u", session->id );
+	queue_output( &session->server, host_id, MAX_HOST_NAME_LEN );
+	sprintf( protocol_version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion );
+	queue_output( &session->server, protocol_version, sz_rfbProtocolVersionMsg );
+}
+
+void
+start_viewer( loadgen_session * session )
+{
+	session->start = now_seconds();
+	session->viewer.state = VIEWER_CONNECTING;
+	if( open_connection( &session->viewer, &viewer_addr ) != 0 )
+		finish_session( session, TRUE );
+}
+
+int
+pump_server( loadgen_session * session )
+{
+	loadgen_conn * conn = &session->server;
+	unsigned int len;
+	int n;
+
+	/* ServerInit goes first */
+	if( conn->out_len > 0 ) {
+		output_events( conn );
+		return 0;
+	}
+
+	while( session->sent < session->expected ) {
+		len = update_len - session->msg_pos;
+		if( len > session->expected - session->sent )
+			len = (unsigned int)( session->expected - session->sent );
+
+		n = send( conn->fd, update_msg + session->msg_pos, len, MSG_NOSIGNAL );
+		if( n < 0 ) {
+			if( errno == EAGAIN ) {
+				set_events( conn, EPOLLIN | EPOLLOUT );
+				return 0;
+			}
+			return -1;
+		}
+
+		session->sent += n;
+		session->msg_pos += n;
+		if( session->msg_pos == update_len )
+			session->msg_pos = 0;
+	}
+
+	/* Nothing left to write */
+	set_events( conn, EPOLLIN );
+	return 0;
+}
+
+/* Match the pointer events sent by the viewer and record their latency */
+void
+receive_input( loadgen_session * session, const char * buf, int len )
+{
+	loadgen_conn * conn = &session->server;
+	rfbPointerEventMsg pe;
+	unsigned int seq;
+	double now;
+	int take;
+
+	now = now_seconds();
+	while( len > 0 ) {
+		take = sz_rfbPointerEventMsg - conn->in_len;
+		if( take > len )
+			take = len;
+		memcpy( conn->in + conn->in_len, buf, take );
+		conn->in_len += take;
+		buf += take;
+		len -= take;
+
+		if( conn->in_len < sz_rfbPointerEventMsg )
+			break;
+		conn->in_len = 0;
+
+		/* The sequence number travels in the coordinates */
+		memcpy( &pe, conn->in, sz_rfbPointerEventMsg );
+		if( pe.type != rfbPointerEvent )
+			continue;
+		seq = ( (unsigned int)Swap16IfLE(pe.x) << 16 ) | Swap16IfLE(pe.y);
+		if( session->input_seq - seq > INPUT_WINDOW )
+			continue;
+		if( session->interactive ) {
+			if( interactive_count < MAX_INPUT_SAMPLES )
+				interactive_latencies[interactive_count++] = ( now - session->input_sent[seq % INPUT_WINDOW] ) * 1000.0;
+		} else if( input_count < MAX_INPUT_SAMPLES ) {
+			input_latencies[input_count++] = ( now - session->input_sent[seq % INPUT_WINDOW] ) * 1000.0;
+		}
+	}
+}
+
+int
+handle_server( loadgen_session * session, unsigned int events )
+{
+	loadgen_conn * conn = &session->server;
+	rfbServerInitMsg server_init;
+	CARD32 auth_type;
+	char discard[LOADGEN_READ_SIZE];
+	int n;
+
+	if( conn->state == SERVER_CONNECTING ) {
+		if( !( events & EPOLLOUT ) )
+			return 0;
+		if( connect_done( conn ) != 0 )
+			return -1;
+		conn->state = ( options.tls & TLS_SERVER ) ? SERVER_TLS : SERVER_READ_VERSION;
+	}
+
+	if( conn->state == SERVER_TLS ) {
+		n = tls_handshake( conn, EPOLLIN | EPOLLOUT );
+		if( n <= 0 )
+			return n;
+		conn->state = SERVER_READ_VERSION;
+	}
+
+	if( flush_output( conn ) != 0 )
+		return -1;
+	if( conn->state != SERVER_PUMPING )
+		output_events( conn );
+
+	switch( conn->state ) {
+	case SERVER_READ_VERSION:
+		n = fill_input( conn, sz_rfbProtocolVersionMsg );
+		if( n <= 0 )
+			return n;
+		conn->in_len = 0;
+
+		/* No authentication between the repeater and the server */
+		auth_type = Swap32IfLE(rfbNoAuth);
+		queue_output( conn, (char *)&auth_type, sizeof(auth_type) );
+		if( flush_output( conn ) != 0 )
+			return -1;
+		output_events( conn );
+		conn->state = SERVER_WAIT_INIT;
+
+		/* The viewer can go now */
+		start_viewer( session );
+		return 0;
+
+	case SERVER_WAIT_INIT:
+		n = fill_input( conn, 1 );
+		if( n <= 0 )
+			return n;
+		conn->in_len = 0;
+
+		session->paired = now_seconds();
+		paired_count++;
+		connecting--;
+
+		/* ServerInit, then the synthetic updates */
+		memset( &server_init, 0, sizeof(server_init) );
+		server_init.framebufferWidth = Swap16IfLE(1024);
+		server_init.framebufferHeight = Swap16IfLE(768);
+		server_init.format.bitsPerPixel = 32;
+		server_init.format.depth = 24;
+		server_init.format.trueColour = 1;
+		server_init.format.redMax = Swap16IfLE(255);
+		server_init.format.greenMax = Swap16IfLE(255);
+		server_init.format.blueMax = Swap16IfLE(255);
+		server_init.format.redShift = 16;
+		server_init.format.greenShift = 8;
+		server_init.nameLength = Swap32IfLE(7);
+		queue_output( conn, (char *)&server_init, sz_rfbServerInitMsg );
+		queue_output( conn, "loadgen", 7 );
+		if( flush_output( conn ) != 0 )
+			return -1;
+
+		conn->state = SERVER_PUMPING;
+		return pump_server( session );
+
+	case SERVER_PUMPING:
+		if( events & EPOLLIN ) {
+			n = recv( conn->fd, discard, sizeof(discard), 0 );
+			if( ( n == 0 ) || ( ( n < 0 ) && ( errno != EAGAIN ) ) )
+				return -1;
+			if( n > 0 )
+				receive_input( session, discard, n );
+		}
+		if( events & EPOLLOUT )
+			return pump_server( session );
+		return 0;
+	}
+
+	return 0;
+}
+
+
+/*****************************************************************************
+ *
+ * Fake VNC viewer
+ *
+ *****************************************************************************/
+
+int
+handle_viewer( loadgen_session * session, unsigned int events )
+{
+	loadgen_conn * conn = &session->viewer;
+	rfbProtocolVersionMsg protocol_version;
+	char password[16];
+	unsigned char challenge[CHALLENGESIZE];
+	char buf[LOADGEN_READ_SIZE];
+	CARD32 value;
+	CARD8 client_init;
+	int n;
+
+	if( conn->state == VIEWER_CONNECTING ) {
+		if( !( events & EPOLLOUT ) )
+			return 0;
+		if( connect_done( conn ) != 0 )
+			return -1;
+		conn->state = ( options.tls & TLS_VIEWER ) ? VIEWER_TLS : VIEWER_READ_VERSION;
+		set_events( conn, EPOLLIN );
+	}
+
+	if( conn->state == VIEWER_TLS ) {
+		n = tls_handshake( conn, EPOLLIN );
+		if( n <= 0 )
+			return n;
+		conn->state = VIEWER_READ_VERSION;
+	}
+
+	if( flush_output( conn ) != 0 )
+		return -1;
+
+	switch( conn->state ) {
+	case VIEWER_READ_VERSION:
+		n = fill_input( conn, sz_rfbProtocolVersionMsg );
+		if( n <= 0 )
+			return n;
+		conn->in_len = 0;
+
+		sprintf( protocol_version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion );
+		queue_output( conn, protocol_version, sz_rfbProtocolVersionMsg );
+		conn->state = VIEWER_READ_AUTH;
+		return flush_output( conn );
+
+	case VIEWER_READ_AUTH:
+		/* Authentication scheme and challenge */
+		n = fill_input( conn, sizeof(CARD32) + CHALLENGESIZE );
+		if( n <= 0 )
+			return n;
+		conn->in_len = 0;
+
+		memcpy( &value, conn->in, sizeof(CARD32) );
+		if( Swap32IfLE(value) != rfbVncAuth )
+			return -1;
+
+		/* The password is the repeater ID */
+		memcpy( challenge, conn->in + sizeof(CARD32), CHALLENGESIZE );
+		snprintf( password, sizeof(password), "%u", session->id );
+		vncEncryptBytes( challenge, password );
+		queue_output( conn, (char *)challenge, CHALLENGESIZE );
+		conn->state = VIEWER_READ_RESULT;
+		return flush_output( conn );
+
+	case VIEWER_READ_RESULT:
+		n = fill_input( conn, sizeof(CARD32) );
+		if( n <= 0 )
+			return n;
+		conn->in_len = 0;
+
+		memcpy( &value, conn->in, sizeof(CARD32) );
+		if( Swap32IfLE(value) != rfbVncAuthOK )
+			return -1;
+
+		/* Shared session */
+		client_init = 1;
+		queue_output( conn, (char *)&client_init, sizeof(client_init) );
+		conn->state = VIEWER_RELAYING;
+		return flush_output( conn );
+
+	case VIEWER_RELAYING:
+		while( ( n = recv( conn->fd, buf, sizeof(buf), 0 ) ) > 0 ) {
+			session->received += n;
+		}
+		if( ( n == 0 ) || ( errno != EAGAIN ) )
+			return -1;
+
+		if( !session->interactive && ( session->received >= session->expected + sz_rfbServerInitMsg + 7 ) )
+			finish_session( session, FALSE );
+		return 0;
+	}
+
+	return 0;
+}
+
+
+void
+send_input( loadgen_session * session, double now )
+{
+	rfbPointerEventMsg pe;
+
+	pe.type = rfbPointerEvent;
+	pe.buttonMask = 0;
+	pe.x = Swap16IfLE( ( session->input_seq >> 16 ) & 0xffff );
+	pe.y = Swap16IfLE( session->input_seq & 0xffff );
+
+	session->input_sent[session->input_seq % INPUT_WINDOW] = now;
+	if( send( session->viewer.fd, (char *)&pe, sz_rfbPointerEventMsg, MSG_NOSIGNAL ) == sz_rfbPointerEventMsg )
+		session->input_seq++;
+	session->next_input = now + 1.0 / options.input_rate;
+}
+
+
+/*****************************************************************************
+ *
+ * Report
+ *
+ *****************************************************************************/
+
+int
+compare_double(const void * a, const void * b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return ( x < y ) ? -1 : ( ( x > y ) ? 1 : 0 );
+}
+
+double
+percentile( double * values, unsigned int count, double p )
+{
+	unsigned int index;
+
+	if( count == 0 )
+		return 0;
+	index = (unsigned int)( p * ( count - 1 ) + 0.5 );
+	return values[index];
+}
+
+void
+report( double started, double first_paired, double last_paired, double ended )
+{
+	double * latencies;
+	unsigned int count;
+	unsigned int i;
+	unsigned long long received;
+
+	latencies = (double *)malloc( options.sessions * sizeof(double) );
+	count = 0;
+	received = 0;
+	for( i = 0; i < options.sessions; i++ ) {
+		if( sessions[i].paired != 0 )
+			latencies[count++] = ( sessions[i].paired - sessions[i].start ) * 1000.0;
+		received += sessions[i].received;
+	}
+	qsort( latencies, count, sizeof(double), compare_double );
+
+	printf("sessions:          %u (%u completed, %u failed)\n", options.sessions, finished_count, failed_count);
+	printf("paired:            %u\n", paired_count);
+	printf("pairing rate:      %.1f sessions/s\n",
+		( last_paired > started ) ? paired_count / ( last_paired - started ) : 0.0);
+	printf("handshake latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		percentile( latencies, count, 0.50 ),
+		percentile( latencies, count, 0.90 ),
+		percentile( latencies, count, 0.99 ),
+		percentile( latencies, count, 1.00 ));
+	if( ( options.input_rate > 0 ) && ( options.interactive < options.sessions ) ) {
+		qsort( input_latencies, input_count, sizeof(double), compare_double );
+		printf("input latency:     p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms (%u events)\n",
+			percentile( input_latencies, input_count, 0.50 ),
+			percentile( input_latencies, input_count, 0.90 ),
+			percentile( input_latencies, input_count, 0.99 ),
+			percentile( input_latencies, input_count, 1.00 ),
+			input_count);
+	}
+	if( options.interactive > 0 ) {
+		qsort( interactive_latencies, interactive_count, sizeof(double), compare_double );
+		printf("interactive input: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms (%u events)\n",
+			percentile( interactive_latencies, interactive_count, 0.50 ),
+			percentile( interactive_latencies, interactive_count, 0.90 ),
+			percentile( interactive_latencies, interactive_count, 0.99 ),
+			percentile( interactive_latencies, interactive_count, 1.00 ),
+			interactive_count);
+	}
+	printf("relayed:           %llu bytes in %.3f s\n", received,
+		( first_paired != 0 ) ? ended - first_paired : 0.0);
+	printf("relay throughput:  %.1f MiB/s\n",
+		( ( first_paired != 0 ) && ( ended > first_paired ) ) ? received / ( ended - first_paired ) / ( 1024.0 * 1024.0 ) : 0.0);
+
+	free( latencies );
+}
+
+
+/*****************************************************************************
+ *
+ * Main entry point
+ *
+ *****************************************************************************/
+
+int main(int argc, char **argv)
+{
+	struct epoll_event events[LOADGEN_MAX_EVENTS];
+	loadgen_conn * conn;
+	double started, first_paired, last_paired, deadline, now;
+	unsigned int i;
+	int n, rc;
+
+	options.host = "127.0.0.1";
+	options.server_port = 5500;
+	options.viewer_port = 5900;
+	options.sessions = 100;
+	options.concurrency = 32;
+	options.base_id = 1000;
+	options.bytes = 4 * 1024 * 1024;
+	options.rect = 64;
+	options.timeout = 120;
+	options.input_rate = 0;
+	options.interactive = 0;
+
+	for( i = 1; i < (unsigned int)argc; i++ ) {
+		if( i + 1 == (unsigned int)argc )
+			usage( argv[0] );
+
+		if( strcmp( argv[i], "-host" ) == 0 )
+			options.host = argv[++i];
+		else if( strcmp( argv[i], "-server" ) == 0 )
+			options.server_port = (u_short)atoi( argv[++i] );
+		else if( strcmp( argv[i], "-viewer" ) == 0 )
+			options.viewer_port = (u_short)atoi( argv[++i] );
+		else if( strcmp( argv[i], "-sessions" ) == 0 )
+			options.sessions = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-concurrency" ) == 0 )
+			options.concurrency = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-id" ) == 0 )
+			options.base_id = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-bytes" ) == 0 )
+			options.bytes = strtoull( argv[++i], NULL, 10 );
+		else if( strcmp( argv[i], "-rect" ) == 0 )
+			options.rect = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-timeout" ) == 0 )
+			options.timeout = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-input" ) == 0 )
+			options.input_rate = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-interactive" ) == 0 )
+			options.interactive = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-tls" ) == 0 ) {
+			i++;
+			if( strcmp( argv[i], "server" ) == 0 )
+				options.tls = TLS_SERVER;
+			else if( strcmp( argv[i], "viewer" ) == 0 )
+				options.tls = TLS_VIEWER;
+			else if( strcmp( argv[i], "both" ) == 0 )
+				options.tls = TLS_SERVER | TLS_VIEWER;
+			else
+				usage( argv[0] );
+		} else
+			usage( argv[0] );
+	}
+
+	if( ( options.sessions == 0 ) || ( options.concurrency == 0 ) || ( options.rect == 0 ) || ( options.rect > 1024 ) )
+		usage( argv[0] );
+	if( options.interactive >= options.sessions ) {
+		fprintf(stderr, "Interactive sessions need bulk sessions to compete with.\n");
+		return 1;
+	}
+	/* Interactive sessions are there to send pointer events */
+	if( ( options.interactive > 0 ) && ( options.input_rate == 0 ) )
+		options.input_rate = 100;
+	if( options.base_id == 0 || options.base_id + options.sessions > 99999999 ) {
+		fprintf(stderr, "Repeater IDs must be between 1 and 99999999.\n");
+		return 1;
+	}
+
+	memset( &server_addr, 0, sizeof(server_addr) );
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons( options.server_port );
+	if( inet_pton( AF_INET, options.host, &server_addr.sin_addr ) != 1 ) {
+		fprintf(stderr, "Invalid address %s.\n", options.host);
+		return 1;
+	}
+	memcpy( &viewer_addr, &server_addr, sizeof(viewer_addr) );
+	viewer_addr.sin_port = htons( options.viewer_port );
+
+	if( options.tls != 0 ) {
+#ifdef HAVE_OPENSSL
+		/* The repeater's certificate is usually self-signed, it is not checked */
+		tls_ctx = SSL_CTX_new( TLS_client_method() );
+		if( tls_ctx == NULL ) {
+			ERR_print_errors_fp( stderr );
+			return 1;
+		}
+		SSL_CTX_set_options( tls_ctx, SSL_OP_ENABLE_KTLS );
+		SSL_CTX_set_verify( tls_ctx, SSL_VERIFY_NONE, NULL );
+#else
+		fprintf(stderr, "Built without OpenSSL, -tls is not available.\n");
+		return 1;
+#endif
+	}
+
+	build_update( options.rect );
+
+	input_latencies = (double *)malloc( MAX_INPUT_SAMPLES * sizeof(double) );
+	interactive_latencies = (double *)malloc( MAX_INPUT_SAMPLES * sizeof(double) );
+	if( ( input_latencies == NULL ) || ( interactive_latencies == NULL ) ) {
+		fprintf(stderr, "Not enough memory.\n");
+		return 1;
+	}
+
+	sessions = (loadgen_session *)calloc( options.sessions, sizeof(loadgen_session) );
+	if( sessions == NULL ) {
+		fprintf(stderr, "Not enough memory.\n");
+		return 1;
+	}
+	for( i = 0; i < options.sessions; i++ ) {
+		sessions[i].id = options.base_id + i;
+		sessions[i].expected = options.bytes;
+		/* Spread the interactive sessions among the bulk ones */
+		if( ( options.interactive > 0 ) && ( i % ( options.sessions / options.interactive ) == 0 )
+			&& ( i / ( options.sessions / options.interactive ) < options.interactive ) ) {
+			sessions[i].interactive = TRUE;
+			sessions[i].expected = 0;
+		}
+		sessions[i].server.fd = -1;
+		sessions[i].server.role = ROLE_SERVER;
+		sessions[i].server.session = &sessions[i];
+		sessions[i].viewer.fd = -1;
+		sessions[i].viewer.role = ROLE_VIEWER;
+		sessions[i].viewer.session = &sessions[i];
+	}
+
+	bulk_left = options.sessions - options.interactive;
+
+	epfd = epoll_create( LOADGEN_MAX_EVENTS );
+	if( epfd < 0 ) {
+		fprintf(stderr, "epoll_create() failed, errno=%d\n", errno);
+		return 1;
+	}
+
+	printf("Load generator: %u sessions against %s (server port %d%s, viewer port %d%s), %llu bytes each.\n",
+		options.sessions, options.host, options.server_port, ( options.tls & TLS_SERVER ) ? " TLS" : "",
+		options.viewer_port, ( options.tls & TLS_VIEWER ) ? " TLS" : "", options.bytes);
+
+	started = now_seconds();
+	deadline = started + options.timeout;
+	first_paired = 0;
+	last_paired = 0;
+	next_session = 0;
+
+	while( finished_count + failed_count < options.sessions ) {
+		/* Keep the handshake pipeline full */
+		while( ( connecting < options.concurrency ) && ( next_session < options.sessions ) )
+			start_session( &sessions[next_session++] );
+
+		if( now_seconds() > deadline ) {
+			fprintf(stderr, "Timed out.\n");
+			break;
+		}
+
+		/* Interactive sessions go with the last bulk one */
+		if( ( bulk_left == 0 ) && ( options.interactive > 0 ) ) {
+			for( i = 0; i < options.sessions; i++ ) {
+				if( sessions[i].interactive && ( sessions[i].finished == 0 ) )
+					finish_session( &sessions[i], sessions[i].paired == 0 );
+			}
+		}
+
+		/* Pointer events from the viewers that are being fed */
+		if( options.input_rate > 0 ) {
+			now = now_seconds();
+			for( i = 0; i < next_session; i++ ) {
+				if( ( sessions[i].viewer.state == VIEWER_RELAYING ) && ( sessions[i].next_input <= now ) )
+					send_input( &sessions[i], now );
+			}
+		}
+
+		n = epoll_wait( epfd, events, LOADGEN_MAX_EVENTS, ( options.input_rate > 0 ) ? 1 : 100 );
+		if( n < 0 ) {
+			if( errno == EINTR )
+				continue;
+			fprintf(stderr, "epoll_wait() failed, errno=%d\n", errno);
+			break;
+		}
+
+		for( i = 0; i < (unsigned int)n; i++ ) {
+			conn = (loadgen_conn *)events[i].data.ptr;
+			if( conn->session->finished != 0 )
+				continue;
+
+			if( conn->role == ROLE_SERVER )
+				rc = handle_server( conn->session, events[i].events );
+			else
+				rc = handle_viewer( conn->session, events[i].events );
+
+			if( rc != 0 ) {
+				fprintf(stderr, "Session %u failed (%s, errno=%d).\n", conn->session->id,
+					( conn->role == ROLE_SERVER ) ? "server" : "viewer", errno);
+				finish_session( conn->session, TRUE );
+			} else if( conn->session->paired != 0 ) {
+				if( first_paired == 0 )
+					first_paired = conn->session->paired;
+				if( conn->session->paired > last_paired )
+					last_paired = conn->session->paired;
+			}
+		}
+	}
+
+	report( started, first_paired, last_paired, now_seconds() );
+
+	for( i = 0; i < options.sessions; i++ ) {
+		close_connection( &sessions[i].server );
+		close_connection( &sessions[i].viewer );
+	}
+	close( epfd );
+#ifdef HAVE_OPENSSL
+	if( tls_ctx != NULL )
+		SSL_CTX_free( tls_ctx );
+#endif
+	free( sessions );
+	free( update_msg );
+	free( input_latencies );
+	free( interactive_latencies );
+
+	return ( failed_count == 0 ) ? 0 : 1;
+}
@@ -56,6 +56,10 @@ mutex_init( mutex_t * mutex )
 	int retVal;
 	pthread_mutexattr_t mutexattr;
 
+	retVal = pthread_mutexattr_init( &mutexattr );
+	if( retVal != 0 )
+		return retVal;
+
 	// Set the mutex as a recursive mutex
 	pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE_NP);
 
@@ -0,0 +1,99 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "thread.h"
+#include "mutex.h"
+#include "sockets.h"
+#include "repeater.h"
+#include "pool.h"
+
+
+int
+pool_init(idle_pool * pool, mutex_t * mutex)
+{
+	if( socket_pair( pool->wake ) != 0 )
+		return -1;
+	pool->mutex = mutex;
+	pool->threads = 0;
+	return 0;
+}
+
+void
+pool_free(idle_pool * pool)
+{
+	socket_close( pool->wake[0] );
+	socket_close( pool->wake[1] );
+	pool->wake[0] = INVALID_SOCKET;
+	pool->wake[1] = INVALID_SOCKET;
+}
+
+void
+pool_wake(idle_pool * pool, unsigned int count)
+{
+	unsigned int i;
+
+	for( i = 0; i < count; i++ )
+		send( pool->wake[1], "", 1, MSG_NOSIGNAL );
+}
+
+int
+pool_idle(idle_pool * pool, unsigned int msec)
+{
+	char buf[1];
+	int woken;
+
+	woken = ( socket_wait_timeout( pool->wake[0], msec ) != 0 );
+	/* Whoever takes the byte, every idle thread looks at the queue */
+	recv( pool->wake[0], buf, 1, 0 );
+	return woken;
+}
+
+unsigned int
+pool_stop(idle_pool * pool, unsigned int seconds, const char * name)
+{
+	unsigned int left;
+	unsigned int i;
+
+	mutex_lock( pool->mutex );
+	left = pool->threads;
+	mutex_unlock( pool->mutex );
+	pool_wake( pool, left );
+
+	for( i = 0; ( i < seconds * 20 ) && ( left > 0 ); i++ ) {
+		usleep( 50000 );
+		mutex_lock( pool->mutex );
+		left = pool->threads;
+		mutex_unlock( pool->mutex );
+	}
+
+	if( left > 0 )
+		error("%u %s threads did not exit in time.\n", left, name);
+	return left;
+}
@@ -0,0 +1,56 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+#ifndef _POOL_H
+#define _POOL_H
+
+/**
+ * What the worker and the handshake pools have in common. Their idle
+ * threads sleep on a socket pair, a byte written to it wakes them up;
+ * each thread is counted in threads, under the pool's own mutex, until
+ * it leaves.
+ */
+typedef struct _idle_pool {
+	SOCKET wake[2];
+	mutex_t * mutex;
+	unsigned int threads;
+} idle_pool;
+
+int pool_init(idle_pool * pool, mutex_t * mutex);
+void pool_free(idle_pool * pool);
+
+/* Wake up to count idle threads */
+void pool_wake(idle_pool * pool, unsigned int count);
+
+/* Sleep up to msec. Returns 0 if nothing woke the thread up. */
+int pool_idle(idle_pool * pool, unsigned int msec);
+
+/**
+ * Wake every thread and wait up to seconds for them to leave, once
+ * told to. Returns the number still running: they keep using the mutex
+ * and the sockets, which the caller is not to free then.
+ */
+unsigned int pool_stop(idle_pool * pool, unsigned int seconds, const char * name);
+
+#endif
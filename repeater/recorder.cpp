@@ -0,0 +1,565 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <io.h>
+#include <malloc.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "thread.h"
+#include "mutex.h"
+#include "sockets.h"
+#include "pool.h"
+#include "rfb.h"
+#include "repeater.h"
+#include "config.h"
+#include "recorder.h"
+
+#ifdef WIN32
+#define open _open
+#define write _write
+#define close _close
+#define snprintf _snprintf
+#endif
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define RECORDER_MAX_PATH	1024
+
+typedef struct _recorder_buffer {
+	recorder * rec;
+	char * data;                    /* RECORDER_BUFFER_SIZE + RECORDER_BLOCK, aligned */
+	unsigned int len;
+	struct _recorder_buffer * next;
+} recorder_buffer;
+
+struct _recorder {
+	unsigned long code;
+	int fd;
+	unsigned long long start;
+	unsigned long long handed;      /* Last time a buffer went to the writer */
+	unsigned long long clock;       /* Last time seen, records never go back in time */
+	recorder_buffer * fill;         /* Owned by the relay thread */
+	unsigned long long lost;        /* Not written yet as a gap record */
+
+	/* Under mutex_recorder */
+	recorder_buffer * spare;
+	unsigned int buffers;
+	unsigned int queued;            /* With the writer */
+	int closing;                    /* The last one out frees it */
+	int failed;
+};
+
+static char recorder_directory[RECORDER_MAX_PATH];
+static int recorder_running = 0;
+static thread_t recorder_thread;
+
+/* Buffers waiting for the writer, oldest first */
+static mutex_t mutex_recorder;
+static recorder_buffer * queue_head = NULL;
+static recorder_buffer * queue_tail = NULL;
+
+/* The writer sleeps on it while the queue is empty */
+static idle_pool recorder_pool;
+
+
+/*****************************************************************************
+ *
+ * Helpers
+ *
+ *****************************************************************************/
+
+static void
+recorder_put32(char * p, CARD32 value)
+{
+	p[0] = (char)( value >> 24 );
+	p[1] = (char)( value >> 16 );
+	p[2] = (char)( value >> 8 );
+	p[3] = (char)value;
+}
+
+static recorder_buffer *
+recorder_buffer_new(recorder * rec)
+{
+	recorder_buffer * buf;
+
+	buf = (recorder_buffer *)malloc( sizeof(recorder_buffer) );
+	if( buf == NULL )
+		return NULL;
+
+	/* O_DIRECT wants the memory aligned as well */
+#ifdef WIN32
+	buf->data = (char *)_aligned_malloc( RECORDER_BUFFER_SIZE + RECORDER_BLOCK, RECORDER_BLOCK );
+#else
+	if( posix_memalign( (void **)&buf->data, RECORDER_BLOCK, RECORDER_BUFFER_SIZE + RECORDER_BLOCK ) != 0 )
+		buf->data = NULL;
+#endif
+	if( buf->data == NULL ) {
+		free( buf );
+		return NULL;
+	}
+
+	buf->rec = rec;
+	buf->len = 0;
+	buf->next = NULL;
+	return buf;
+}
+
+static void
+recorder_buffer_free(recorder_buffer * buf)
+{
+#ifdef WIN32
+	_aligned_free( buf->data );
+#else
+	free( buf->data );
+#endif
+	free( buf );
+}
+
+/* Next buffer to fill, without ever waiting for the writer. -1 when there is none. */
+static int
+recorder_take(recorder * rec)
+{
+	recorder_buffer * buf;
+
+	mutex_lock( &mutex_recorder );
+	if( rec->failed ) {
+		mutex_unlock( &mutex_recorder );
+		return -1;
+	}
+	buf = rec->spare;
+	if( buf != NULL ) {
+		rec->spare = buf->next;
+	} else if( rec->buffers < RECORDER_MAX_BUFFERS ) {
+		buf = recorder_buffer_new( rec );
+		if( buf != NULL )
+			rec->buffers++;
+	}
+	mutex_unlock( &mutex_recorder );
+
+	if( buf == NULL )
+		return -1;
+
+	buf->len = 0;
+	buf->next = NULL;
+	rec->fill = buf;
+	return 0;
+}
+
+static void
+recorder_header(recorder_buffer * buf, CARD8 type, unsigned int len, unsigned long long time)
+{
+	char * p;
+
+	p = buf->data + buf->len;
+	recorder_put32( p, (CARD32)( time >> 32 ) );
+	recorder_put32( p + 4, (CARD32)time );
+	recorder_put32( p + 8, len );
+	p[12] = (char)type;
+	p[13] = p[14] = p[15] = 0;
+	buf->len += RECORDER_HEADER;
+}
+
+/* Pad the buffer to a whole number of blocks and queue it for the writer */
+static void
+recorder_hand_over(recorder * rec, unsigned long long clock)
+{
+	recorder_buffer * buf;
+	unsigned int pad;
+	int idle;
+
+	buf = rec->fill;
+	rec->fill = NULL;
+	rec->handed = clock;
+
+	pad = ( RECORDER_BLOCK - buf->len % RECORDER_BLOCK ) % RECORDER_BLOCK;
+	if( ( pad > 0 ) && ( pad < RECORDER_HEADER ) )
+		pad += RECORDER_BLOCK;
+	if( pad > 0 ) {
+		recorder_header( buf, RECORDER_PADDING, pad - RECORDER_HEADER, clock - rec->start );
+		memset( buf->data + buf->len, 0, pad - RECORDER_HEADER );
+		buf->len += pad - RECORDER_HEADER;
+	}
+
+	mutex_lock( &mutex_recorder );
+	rec->queued++;
+	idle = ( queue_tail == NULL );
+	if( queue_tail == NULL )
+		queue_head = buf;
+	else
+		queue_tail->next = buf;
+	queue_tail = buf;
+	mutex_unlock( &mutex_recorder );
+
+	/* Otherwise the writer has yet to take the one before, and sees this one too */
+	if( idle )
+		pool_wake( &recorder_pool, 1 );
+}
+
+
+/*****************************************************************************
+ *
+ * Writer
+ *
+ *****************************************************************************/
+
+/* Once the session is gone and the writer is done with it */
+static void
+recorder_destroy(recorder * rec)
+{
+	recorder_buffer * buf;
+
+	close( rec->fd );
+	while( rec->spare != NULL ) {
+		buf = rec->spare;
+		rec->spare = buf->next;
+		recorder_buffer_free( buf );
+	}
+	debug("Recording of ID %lu closed.\n", rec->code);
+	free( rec );
+}
+
+/* Back to the session, or the end of it */
+static void
+recorder_written(recorder_buffer * buf)
+{
+	recorder * rec;
+	int done;
+
+	rec = buf->rec;
+	mutex_lock( &mutex_recorder );
+	buf->next = rec->spare;
+	rec->spare = buf;
+	rec->queued--;
+	done = rec->closing && ( rec->queued == 0 );
+	mutex_unlock( &mutex_recorder );
+
+	if( done )
+		recorder_destroy( rec );
+}
+
+static THREAD_CALL
+recorder_writer(LPVOID lpParam)
+{
+	recorder_buffer * buf;
+	unsigned int done;
+	int len;
+
+	while( 1 ) {
+		mutex_lock( &mutex_recorder );
+		buf = queue_head;
+		if( buf != NULL ) {
+			queue_head = buf->next;
+			if( queue_head == NULL )
+				queue_tail = NULL;
+		}
+		mutex_unlock( &mutex_recorder );
+
+		if( buf == NULL ) {
+			if( !recorder_running )
+				break;
+			/* Until a buffer is handed over, the relay never waits for us */
+			pool_idle( &recorder_pool, RECORDER_FLUSH_INTERVAL / 1000 );
+			continue;
+		}
+
+		for( done = 0; ( done < buf->len ) && !buf->rec->failed; done += len ) {
+			len = write( buf->rec->fd, buf->data + done, buf->len - done );
+			if( len <= 0 ) {
+				if( ( len < 0 ) && ( errno == EINTR ) ) {
+					len = 0;
+					continue;
+				}
+				error("Failed to write the recording of ID %lu, errno=%d. Recording stopped.\n", buf->rec->code, errno);
+				mutex_lock( &mutex_recorder );
+				buf->rec->failed = 1;
+				mutex_unlock( &mutex_recorder );
+			}
+		}
+
+		recorder_written( buf );
+	}
+
+	return 0;
+}
+
+
+/*****************************************************************************
+ *
+ * Recorder
+ *
+ *****************************************************************************/
+
+int
+RecorderInit( void )
+{
+	const repeater_config * config;
+	const char * directory;
+
+	config = ConfigGet();
+	directory = config->record_directory;
+	if( ( directory[0] == '\0' ) || ( config->record_count == 0 ) )
+		return 0;
+
+	if( strlen( directory ) >= RECORDER_MAX_PATH ) {
+		error("The recording directory name is too long.\n");
+		return -1;
+	}
+	strcpy( recorder_directory, directory );
+
+	if( mutex_init( &mutex_recorder ) != 0 ) {
+		error("Failed to create the recorder mutex.\n");
+		return -1;
+	}
+
+	if( pool_init( &recorder_pool, &mutex_recorder ) != 0 ) {
+		error("Failed to create the wake up sockets for the recorder.\n");
+		mutex_destroy( &mutex_recorder );
+		return -1;
+	}
+
+	recorder_running = 1;
+	if( thread_create( &recorder_thread, NULL, recorder_writer, NULL ) != 0 ) {
+		error("Unable to create the thread writing the recordings.\n");
+		recorder_running = 0;
+		pool_free( &recorder_pool );
+		mutex_destroy( &mutex_recorder );
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+RecorderReload( void )
+{
+	const repeater_config * config;
+
+	if( !recorder_running )
+		return RecorderInit();
+
+	/* The ranges are looked up in the configuration at each open */
+	config = ConfigGet();
+	if( config->record_directory[0] == '\0' )
+		return 0;
+	if( strlen( config->record_directory ) >= RECORDER_MAX_PATH ) {
+		error("The recording directory name is too long.\n");
+		return -1;
+	}
+
+	mutex_lock( &mutex_recorder );
+	strcpy( recorder_directory, config->record_directory );
+	mutex_unlock( &mutex_recorder );
+	return 0;
+}
+
+void
+RecorderFree( void )
+{
+	if( recorder_running ) {
+		/* The writer drains its queue before leaving */
+		recorder_running = 0;
+		pool_wake( &recorder_pool, 1 );
+		if( thread_cleanup( recorder_thread, 30 ) != 0 )
+			error("The recording thread doesn't seem to exit cleanly.\n");
+		pool_free( &recorder_pool );
+		mutex_destroy( &mutex_recorder );
+	}
+}
+
+recorder *
+RecorderOpen(unsigned long code, unsigned long long clock)
+{
+	const repeater_config * config;
+	recorder * rec;
+	unsigned int range;
+	char directory[RECORDER_MAX_PATH];
+	char path[RECORDER_MAX_PATH + 64];
+	char stamp[32];
+	time_t now;
+	int flags;
+	int fd;
+	int i;
+
+	if( !recorder_running )
+		return NULL;
+
+	config = ConfigGet();
+	for( range = 0; range < config->record_count; range++ ) {
+		if( ( code >= config->records[range].first ) && ( code <= config->records[range].last ) )
+			break;
+	}
+	if( range == config->record_count )
+		return NULL;
+
+	mutex_lock( &mutex_recorder );
+	strcpy( directory, recorder_directory );
+	mutex_unlock( &mutex_recorder );
+
+	now = time( NULL );
+	strftime( stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime( &now ) );
+
+	/* Never overwrite an earlier recording */
+	fd = -1;
+	flags = O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_BINARY;
+	for( i = 0; ( fd < 0 ) && ( i < 100 ); i++ ) {
+		if( i == 0 )
+			snprintf( path, sizeof(path), "%s/%lu-%s.rec", directory, code, stamp );
+		else
+			snprintf( path, sizeof(path), "%s/%lu-%s-%d.rec", directory, code, stamp, i );
+
+		fd = open( path, flags | O_DIRECT, 0600 );
+		/* Not every file system takes O_DIRECT */
+		if( ( fd < 0 ) && ( errno == EINVAL ) )
+			fd = open( path, flags, 0600 );
+		if( ( fd < 0 ) && ( errno != EEXIST ) )
+			break;
+	}
+	if( fd < 0 ) {
+		error("Unable to create the recording %s, errno=%d.\n", path, errno);
+		return NULL;
+	}
+
+	rec = (recorder *)malloc( sizeof(recorder) );
+	if( rec == NULL ) {
+		error("Not enough memory to record ID %lu.\n", code);
+		close( fd );
+		return NULL;
+	}
+	memset( rec, 0, sizeof(recorder) );
+	rec->code = code;
+	rec->fd = fd;
+	rec->start = clock;
+	rec->handed = clock;
+	rec->clock = clock;
+
+	if( recorder_take( rec ) != 0 ) {
+		error("Not enough memory to record ID %lu.\n", code);
+		close( fd );
+		free( rec );
+		return NULL;
+	}
+
+	memcpy( rec->fill->data, RECORDER_MAGIC, 8 );
+	recorder_put32( rec->fill->data + 8, (CARD32)code );
+	recorder_put32( rec->fill->data + 12, (CARD32)now );
+	rec->fill->len = RECORDER_FILE_HEADER;
+
+	debug("Recording ID %lu to %s.\n", code, path);
+	return rec;
+}
+
+void
+RecorderWrite(recorder * rec, CARD8 type, const char * data, unsigned int len, unsigned long long clock)
+{
+	unsigned int room;
+
+	if( clock > rec->clock )
+		rec->clock = clock;
+	clock = rec->clock;
+
+	while( len > 0 ) {
+		if( ( rec->fill == NULL ) && ( recorder_take( rec ) != 0 ) ) {
+			rec->lost += len;
+			return;
+		}
+
+		if( rec->lost > 0 ) {
+			if( rec->fill->len + RECORDER_HEADER + 4 > RECORDER_BUFFER_SIZE ) {
+				recorder_hand_over( rec, clock );
+				continue;
+			}
+			recorder_header( rec->fill, RECORDER_GAP, 4, clock - rec->start );
+			recorder_put32( rec->fill->data + rec->fill->len, ( rec->lost > 0xffffffff ) ? 0xffffffff : (CARD32)rec->lost );
+			rec->fill->len += 4;
+			rec->lost = 0;
+		}
+
+		/* Big writes are split over several records */
+		if( rec->fill->len + RECORDER_HEADER >= RECORDER_BUFFER_SIZE ) {
+			recorder_hand_over( rec, clock );
+			continue;
+		}
+		room = RECORDER_BUFFER_SIZE - rec->fill->len - RECORDER_HEADER;
+		if( room > len )
+			room = len;
+
+		recorder_header( rec->fill, type, room, clock - rec->start );
+		memcpy( rec->fill->data + rec->fill->len, data, room );
+		rec->fill->len += room;
+		data += room;
+		len -= room;
+	}
+}
+
+void
+RecorderTick(recorder * rec, unsigned long long clock)
+{
+	if( clock > rec->clock )
+		rec->clock = clock;
+	if( ( rec->fill != NULL ) && ( rec->fill->len > 0 ) && ( rec->clock - rec->handed >= RECORDER_FLUSH_INTERVAL ) )
+		recorder_hand_over( rec, rec->clock );
+}
+
+void
+RecorderClose(recorder * rec)
+{
+	int done;
+
+	if( rec->fill != NULL ) {
+		if( rec->fill->len > 0 ) {
+			recorder_hand_over( rec, rec->clock );
+		} else {
+			mutex_lock( &mutex_recorder );
+			rec->fill->next = rec->spare;
+			rec->spare = rec->fill;
+			mutex_unlock( &mutex_recorder );
+			rec->fill = NULL;
+		}
+	}
+
+	/* The relay does not wait for the disk, the writer frees it when it is done */
+	mutex_lock( &mutex_recorder );
+	rec->closing = 1;
+	done = ( rec->queued == 0 );
+	mutex_unlock( &mutex_recorder );
+
+	if( done )
+		recorder_destroy( rec );
+}
@@ -0,0 +1,79 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+/**
+ * Capture file, all numbers big endian:
+ *
+ *   file:   "RFBREC01", CARD32 repeater ID, CARD32 start (seconds since the epoch)
+ *   record: CARD32 time (high), CARD32 time (low), CARD32 length, CARD8 type,
+ *           3 bytes of padding, then length bytes of data
+ *
+ * The time is in microseconds since the session started. The file grows in
+ * RECORDER_BLOCK steps, padding records fill the blocks up.
+ */
+#define RECORDER_MAGIC		"RFBREC01"
+#define RECORDER_FILE_HEADER	16
+#define RECORDER_HEADER		16
+
+#define RECORDER_SERVER		0	/* server => viewers */
+#define RECORDER_VIEWER		1	/* viewers => server */
+#define RECORDER_GAP		2	/* CARD32 bytes lost while the writer lagged behind */
+#define RECORDER_PADDING	255
+
+/**
+ * The relay fills aligned buffers that a background thread writes out
+ * (O_DIRECT where the file system takes it). A session holding more than
+ * RECORDER_MAX_BUFFERS loses data instead of waiting for the disk.
+ */
+#define RECORDER_BLOCK		4096
+#define RECORDER_BUFFER_SIZE	(1024 * 1024)
+#define RECORDER_MAX_BUFFERS	8
+#define RECORDER_FLUSH_INTERVAL	1000000	/* Microseconds */
+
+typedef struct _recorder recorder;
+
+/**
+ * Start the writer when the configuration names a directory and some
+ * sessions to record there.
+ */
+int RecorderInit( void );
+void RecorderFree( void );
+
+/* Follow a reloaded configuration, starting the writer if it wasn't running */
+int RecorderReload( void );
+
+/**
+ * NULL when the session is not recorded. clock is a monotonic time in
+ * microseconds, the one of the relay loop.
+ */
+recorder * RecorderOpen(unsigned long code, unsigned long long clock);
+void RecorderWrite(recorder * rec, CARD8 type, const char * data, unsigned int len, unsigned long long clock);
+
+/* Hand over what is buffered once in a while, so idle sessions reach the disk */
+void RecorderTick(recorder * rec, unsigned long long clock);
+void RecorderClose(recorder * rec);
+
+#endif
@@ -0,0 +1,2245 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <errno.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+#endif
+
+#include "thread.h"
+#include "sockets.h"
+#include "rfb.h"
+#include "vncauth.h"
+#include "repeater.h"
+#include "slots.h"
+#include "rfbstream.h"
+#include "shadow.h"
+#include "shaper.h"
+#include "recorder.h"
+#include "config.h"
+#include "workers.h"
+#include "relay.h"
+
+/* Linux 4.14 and later, the kernel reports on the error queue when it is done with a send */
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define RELAY_ZEROCOPY
+#endif
+
+/* Hot upgrade and shutdown: the sessions are woken up by a byte left in relay_wake */
+static volatile int relay_park_requested;
+static volatile int relay_stop_requested;
+static SOCKET relay_wake[2] = { INVALID_SOCKET, INVALID_SOCKET };
+
+/* Hand over state of a session */
+#define RELAY_RUNNING	0
+#define RELAY_PARKING	1               /* Flushing its buffers */
+#define RELAY_PARKED	2               /* Thread gone, nothing buffered */
+#define RELAY_STAYING	3               /* Could not park in time */
+
+
+/* Server data, shared by every viewer of the session */
+typedef struct _relay_chunk {
+	unsigned int refs;              /* Viewers positioned inside this chunk */
+	unsigned int zc_refs;           /* MSG_ZEROCOPY sends the kernel still reads from it */
+	unsigned int len;
+	struct _relay_chunk * next;
+	char data[RELAY_CHUNK_SIZE];
+} relay_chunk;
+
+/* Messages kept for a detached viewer */
+typedef struct _relay_held {
+	char * data;
+	unsigned int len;
+	unsigned int size;
+} relay_held;
+
+typedef struct _relay_viewer {
+	SOCKET sock;
+	socket_tuning tune;
+
+	/* Position in the server stream */
+	relay_chunk * chunk;
+	unsigned int offset;
+	unsigned long long sent;
+
+	/* Private data sent before the shared stream (ServerInit for late joiners) */
+	char * pending;
+	unsigned int pending_len;
+	unsigned int pending_sent;
+
+	/* Input not yet moved to the server */
+	char inbuf[RELAY_VIEWER_BUFFER];
+	unsigned int inbuf_len;
+
+	int fresh;                      /* Got the whole screen from the shadow framebuffer */
+	int hextile;                    /* Asked for Hextile, merged updates can use it */
+	/* Too slow: leaves the stream at the next boundary for merged updates */
+	int coalescing;
+	int detached;
+	shadow_region region;           /* Changed since the last merged update */
+	relay_held held_updates;        /* Messages to pass on around it */
+	relay_held held_other;
+	int closed;
+	int polled;                     /* Its entry in the poll() set of this pass, -1 if none */
+
+	/* Zero copy sends by notification ID, until the kernel is done with them */
+	int zerocopy;                   /* 0 not tried yet, 1 on, -1 off */
+	unsigned int zc_next;           /* ID of the next one */
+	unsigned int zc_done;           /* Oldest one not completed */
+	relay_chunk * zc_chunks[RELAY_ZEROCOPY_INFLIGHT];
+
+	struct _relay_viewer * next;
+} relay_viewer;
+
+/* Server message, as seen by the parser, for coalescing */
+typedef struct _relay_message {
+	unsigned long long start;
+	unsigned long long end;
+	CARD8 type;
+	int keep;                       /* Must reach the viewer as is (not pixels only) */
+	int stateful;                   /* Can not be skipped */
+	int dirty;
+	unsigned int x1, y1, x2, y2;    /* Screen area the message paints */
+	relay_chunk * chunk;            /* Where it starts, while it is parsed */
+	unsigned int offset;
+} relay_message;
+
+struct _relay_session {
+	repeaterslot * slot;
+	const repeater_config * config; /* As it was when the session started, held */
+	SOCKET server;
+	socket_tuning server_tune;
+	SOCKET wake[2];                 /* Wakes the relay up when a viewer attaches */
+
+	/* server => viewers */
+	relay_chunk * head;
+	relay_chunk * tail;
+	relay_chunk * spare;
+	unsigned long long received;
+	int parse_server;               /* Follow the server messages (broadcast, coalescing) */
+	rfb_server_stream stream;
+	shadow_framebuffer shadow;
+	int decode;                     /* Keep the shadow framebuffer up to date */
+
+	/* Recent messages, oldest first, for viewers falling behind */
+	relay_message * messages;
+	unsigned int msg_first;
+	unsigned int msg_count;
+	relay_message current;
+
+	/* viewers => server */
+	char to_server[RELAY_VIEWER_BUFFER];
+	unsigned int to_server_len;
+	int parse_viewers;              /* Only move complete client messages */
+	relay_viewer * owner;           /* Viewer streaming a message bigger than its buffer */
+	unsigned long owner_left;
+	int updates_requested;
+
+	relay_viewer * viewers;         /* The first one is the primary viewer */
+	relay_viewer * joining;         /* Attached, waiting for a message boundary */
+	unsigned int viewer_count;
+
+	shaper_session shaper;
+	unsigned long wait;             /* Until the shaper lets a direction go on, in microseconds */
+	recorder * recording;           /* Both directions, as the server sees them */
+
+	int handoff;                    /* RELAY_RUNNING, PARKING, PARKED or STAYING */
+	unsigned long park_deadline;
+	int resumed;                    /* The handshake is over, the server had its ClientInit */
+};
+
+
+/*****************************************************************************
+ *
+ * Helpers
+ *
+ *****************************************************************************/
+
+static int
+relay_would_block( void )
+{
+#ifdef WIN32
+	errno = WSAGetLastError();
+#endif
+	return ( errno == EWOULDBLOCK ) || ( errno == EAGAIN ) || ( errno == EINTR );
+}
+
+/* Adds s to the poll() set unless it waits for nothing, returns its index or -1 */
+static int
+relay_poll_add(struct pollfd * fds, unsigned int * nfds, SOCKET s, short events)
+{
+	if( events == 0 )
+		return -1;
+
+	fds[*nfds].fd = s;
+	fds[*nfds].events = events;
+	fds[*nfds].revents = 0;
+	return (int)( (*nfds)++ );
+}
+
+/* An error or hang up counts as readable, the recv() that follows reports it */
+static int
+relay_poll_readable(const struct pollfd * fds, int index)
+{
+	if( ( index < 0 ) || !( fds[index].events & POLLIN ) )
+		return 0;
+	return ( fds[index].revents & ( POLLIN | POLLERR | POLLHUP ) ) != 0;
+}
+
+static relay_chunk *
+relay_chunk_append(relay_session * session)
+{
+	relay_chunk * chunk;
+
+	if( session->spare != NULL ) {
+		chunk = session->spare;
+		session->spare = NULL;
+	} else {
+		chunk = (relay_chunk *)malloc( sizeof(relay_chunk) );
+		if( chunk == NULL ) {
+			error("Not enough memory for the relay buffers.\n");
+			return NULL;
+		}
+	}
+
+	chunk->refs = 0;
+	chunk->zc_refs = 0;
+	chunk->len = 0;
+	chunk->next = NULL;
+
+	if( session->tail != NULL )
+		session->tail->next = chunk;
+	else
+		session->head = chunk;
+	session->tail = chunk;
+	return chunk;
+}
+
+/* Release the chunks every viewer, and the kernel, has gone past */
+static void
+relay_chunk_collect(relay_session * session)
+{
+	relay_chunk * chunk;
+
+	while( ( session->head != session->tail ) && ( session->head->refs == 0 ) && ( session->head->zc_refs == 0 ) ) {
+		chunk = session->head;
+		session->head = chunk->next;
+		if( session->spare == NULL )
+			session->spare = chunk;
+		else
+			free( chunk );
+	}
+}
+
+/* Bytes the slowest viewer still has to receive */
+static unsigned long long
+relay_queued(relay_session * session)
+{
+	relay_viewer * viewer;
+	unsigned long long queued;
+
+	queued = 0;
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		if( viewer->detached )
+			continue;
+		if( session->received - viewer->sent > queued )
+			queued = session->received - viewer->sent;
+	}
+	return queued;
+}
+
+static int
+relay_viewer_has_output(relay_session * session, relay_viewer * viewer)
+{
+	if( viewer->pending_sent < viewer->pending_len )
+		return 1;
+	return !viewer->detached && ( viewer->sent < session->received );
+}
+
+static relay_viewer *
+relay_viewer_new(SOCKET sock)
+{
+	relay_viewer * viewer;
+
+	viewer = (relay_viewer *)malloc( sizeof(relay_viewer) );
+	if( viewer == NULL ) {
+		error("Not enough memory for a new viewer.\n");
+		return NULL;
+	}
+
+	memset( viewer, 0, sizeof(relay_viewer) );
+	viewer->sock = sock;
+	viewer->polled = -1;
+	socket_tune_init( &viewer->tune );
+	return viewer;
+}
+
+
+/*****************************************************************************
+ *
+ * Zero copy
+ *
+ *****************************************************************************/
+
+#ifdef RELAY_ZEROCOPY
+/* The kernel is done with the sends first to last */
+static void
+relay_zerocopy_complete(relay_viewer * viewer, unsigned int first, unsigned int last)
+{
+	relay_chunk ** sent;
+	unsigned int id;
+
+	for( id = first; ; id++ ) {
+		if( id - viewer->zc_done < viewer->zc_next - viewer->zc_done ) {
+			sent = &viewer->zc_chunks[id % RELAY_ZEROCOPY_INFLIGHT];
+			if( *sent != NULL ) {
+				(*sent)->zc_refs--;
+				*sent = NULL;
+			}
+		}
+		if( id == last )
+			break;
+	}
+
+	/* Notifications may come out of order */
+	while( ( viewer->zc_done != viewer->zc_next ) && ( viewer->zc_chunks[viewer->zc_done % RELAY_ZEROCOPY_INFLIGHT] == NULL ) )
+		viewer->zc_done++;
+}
+
+/* Read the notifications waiting on the error queue. Returns -1 on error. */
+static int
+relay_zerocopy_reap(relay_viewer * viewer)
+{
+	struct msghdr msg;
+	struct cmsghdr * cmsg;
+	struct sock_extended_err * ee;
+	char control[256];
+
+	while( viewer->zc_done != viewer->zc_next ) {
+		memset( &msg, 0, sizeof(msg) );
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if( recvmsg( viewer->sock, &msg, MSG_ERRQUEUE ) < 0 )
+			return relay_would_block() ? 0 : -1;
+
+		for( cmsg = CMSG_FIRSTHDR( &msg ); cmsg != NULL; cmsg = CMSG_NXTHDR( &msg, cmsg ) ) {
+			if( !( ( cmsg->cmsg_level == IPPROTO_IP ) && ( cmsg->cmsg_type == IP_RECVERR ) )
+				&& !( ( cmsg->cmsg_level == IPPROTO_IPV6 ) && ( cmsg->cmsg_type == IPV6_RECVERR ) ) )
+				continue;
+			ee = (struct sock_extended_err *)CMSG_DATA( cmsg );
+			if( ( ee->ee_errno != 0 ) || ( ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY ) )
+				continue;
+			/* The device could not send from our pages (loopback...): copying is cheaper */
+			if( ( ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED ) && ( viewer->zerocopy == 1 ) ) {
+				debug("do_repeater(): zero copy falls back to copies, viewer sends are copied.\n");
+				viewer->zerocopy = -1;
+			}
+			relay_zerocopy_complete( viewer, ee->ee_info, ee->ee_data );
+		}
+	}
+	return 0;
+}
+
+/* Send len bytes of chunk, from data. Large sends leave the chunk to the kernel until it is done. */
+static int
+relay_zerocopy_send(relay_session * session, relay_viewer * viewer, relay_chunk * chunk, const char * data, unsigned int len, int flags)
+{
+	int one;
+	int sent;
+
+	if( ( session->config->zerocopy_threshold == 0 ) || ( len < session->config->zerocopy_threshold )
+		|| ( viewer->zerocopy < 0 ) || ( viewer->zc_next - viewer->zc_done >= RELAY_ZEROCOPY_INFLIGHT ) )
+		return send( viewer->sock, data, len, flags );
+
+	if( viewer->zerocopy == 0 ) {
+		one = 1;
+		viewer->zerocopy = ( setsockopt( viewer->sock, SOL_SOCKET, SO_ZEROCOPY, (char *)&one, sizeof(one) ) == 0 ) ? 1 : -1;
+		if( viewer->zerocopy < 0 )
+			return send( viewer->sock, data, len, flags );
+	}
+
+	sent = send( viewer->sock, data, len, flags | MSG_ZEROCOPY );
+	if( sent < 0 ) {
+		/* kTLS encrypts into its own buffers, it does not take MSG_ZEROCOPY */
+		if( errno == EOPNOTSUPP )
+			viewer->zerocopy = -1;
+		/* Out of option memory for the notifications, this one is copied */
+		if( ( errno == ENOBUFS ) || ( errno == EOPNOTSUPP ) )
+			return send( viewer->sock, data, len, flags );
+		return sent;
+	}
+
+	/* Every send that took data has an ID, counted by the socket from 0 */
+	viewer->zc_chunks[viewer->zc_next % RELAY_ZEROCOPY_INFLIGHT] = chunk;
+	viewer->zc_next++;
+	chunk->zc_refs++;
+	return sent;
+}
+
+/* A closing viewer: wait a little for the kernel, reset the connection if it is not done */
+static void
+relay_zerocopy_release(relay_viewer * viewer)
+{
+	struct linger linger;
+	unsigned int waited;
+
+	for( waited = 0; waited < RELAY_ZEROCOPY_LINGER; waited += 10 ) {
+		if( relay_zerocopy_reap( viewer ) != 0 )
+			break;
+		if( viewer->zc_done == viewer->zc_next )
+			return;
+		socket_wait_timeout( viewer->sock, 10 );
+	}
+
+	linger.l_onoff = 1;
+	linger.l_linger = 0;
+	setsockopt( viewer->sock, SOL_SOCKET, SO_LINGER, (char *)&linger, sizeof(linger) );
+	debug("do_repeater(): viewer reset, %u zero copy sends were not done.\n", viewer->zc_next - viewer->zc_done);
+	relay_zerocopy_complete( viewer, viewer->zc_done, viewer->zc_next - 1 );
+}
+#endif
+
+
+static void
+relay_viewer_free(relay_viewer * viewer)
+{
+#ifdef RELAY_ZEROCOPY
+	if( ( viewer->zc_done != viewer->zc_next ) && ( viewer->sock != INVALID_SOCKET ) )
+		relay_zerocopy_release( viewer );
+#endif
+	if( viewer->chunk != NULL )
+		viewer->chunk->refs--;
+	if( viewer->sock != INVALID_SOCKET )
+		socket_close( viewer->sock );
+	if( viewer->pending != NULL )
+		free( viewer->pending );
+	ShadowRegionFree( &viewer->region );
+	if( viewer->held_updates.data != NULL )
+		free( viewer->held_updates.data );
+	if( viewer->held_other.data != NULL )
+		free( viewer->held_other.data );
+	free( viewer );
+}
+
+/* The viewer starts receiving the server stream at the given position */
+static void
+relay_viewer_join(relay_session * session, relay_viewer * viewer, relay_chunk * chunk, unsigned int offset, unsigned long long position)
+{
+	relay_viewer ** last;
+
+	viewer->chunk = chunk;
+	viewer->offset = offset;
+	viewer->sent = position;
+	chunk->refs++;
+
+	for( last = &session->viewers; *last != NULL; last = &(*last)->next )
+		;
+	*last = viewer;
+	session->viewer_count++;
+}
+
+/* Publish the viewer list to the slot */
+static void
+relay_update_slot(relay_session * session)
+{
+	if( LockSlots("relay_update_slot()") != 0 )
+		return;
+
+	session->slot->viewer = ( session->viewers != NULL ) ? session->viewers->sock : INVALID_SOCKET;
+	session->slot->viewers = session->viewer_count;
+
+	UnlockSlots("relay_update_slot()");
+}
+
+/*
+ * Late joiners start at a server message boundary, after a ServerInit
+ * describing the desktop as it is now and, with a shadow framebuffer, an
+ * update with the whole screen.
+ */
+static void
+relay_accept_joiners(relay_session * session, relay_chunk * chunk, unsigned int offset, unsigned long long position)
+{
+	relay_viewer * viewer;
+	relay_viewer * joining;
+	unsigned int size;
+
+	if( LockSlots("relay_accept_joiners()") != 0 )
+		return;
+	joining = session->joining;
+	session->joining = NULL;
+	UnlockSlots("relay_accept_joiners()");
+
+	if( joining == NULL )
+		return;
+
+	while( joining != NULL ) {
+		viewer = joining;
+		joining = viewer->next;
+		viewer->next = NULL;
+
+		size = sz_rfbServerInitMsg + session->stream.name_len;
+		if( ShadowValid( &session->shadow, &session->stream ) ) {
+			size += ShadowUpdateSize( &session->shadow );
+			viewer->fresh = 1;
+		}
+
+		viewer->pending = (char *)malloc( size );
+		if( viewer->pending != NULL ) {
+			viewer->pending_len = RfbServerStreamInitMessage( &session->stream, viewer->pending, size );
+			if( ( viewer->pending_len > 0 ) && viewer->fresh )
+				viewer->pending_len += ShadowUpdateMessage( &session->shadow, viewer->pending + viewer->pending_len, size - viewer->pending_len );
+		}
+		if( viewer->pending_len != size ) {
+			relay_viewer_free( viewer );
+			continue;
+		}
+
+		relay_viewer_join( session, viewer, chunk, offset, position );
+		debug("do_repeater(): viewer joined ID %lu, %u viewers.\n", session->slot->code, session->viewer_count);
+	}
+
+	relay_update_slot( session );
+}
+
+static void relay_lost_sync(relay_session * session);
+
+/*
+ * Broadcast sessions share one pixel format and a set of encodings every
+ * viewer can pick up at any message boundary. Returns 0 if the message
+ * must be dropped, or its (possibly shorter) length.
+ */
+static unsigned int
+relay_filter_viewer(relay_session * session, relay_viewer * viewer, char * msg, unsigned int len)
+{
+	unsigned int count;
+	unsigned int kept;
+	unsigned int i;
+	CARD32 encoding;
+
+	switch( (unsigned char)msg[0] ) {
+	case rfbSetPixelFormat:
+		if( !session->config->broadcast ) {
+			/* Updates already asked for would come in either format */
+			if( session->parse_server && ( session->updates_requested || ( RfbServerStreamSetFormat( &session->stream, (rfbPixelFormat *)( msg + 4 ) ) != 0 ) ) )
+				relay_lost_sync( session );
+			break;
+		}
+		/* Only the primary viewer chooses, and only before the first update */
+		if( ( viewer != session->viewers ) || session->updates_requested )
+			return 0;
+		if( RfbServerStreamSetFormat( &session->stream, (rfbPixelFormat *)( msg + 4 ) ) != 0 )
+			return 0;
+		break;
+
+	case rfbSetEncodings:
+		if( !session->parse_server )
+			break;
+		count = ( (unsigned char)msg[2] << 8 ) | (unsigned char)msg[3];
+		kept = 0;
+		viewer->hextile = 0;
+		for( i = 0; i < count; i++ ) {
+			memcpy( &encoding, msg + sz_rfbSetEncodingsMsg + i * 4, 4 );
+			if( Swap32IfLE( encoding ) == rfbEncodingHextile )
+				viewer->hextile = 1;
+			if( RfbIsStatelessEncoding( Swap32IfLE( encoding ) ) ) {
+				memmove( msg + sz_rfbSetEncodingsMsg + kept * 4, msg + sz_rfbSetEncodingsMsg + i * 4, 4 );
+				kept++;
+			}
+		}
+		msg[2] = (char)( kept >> 8 );
+		msg[3] = (char)kept;
+		return sz_rfbSetEncodingsMsg + kept * 4;
+
+	case rfbFramebufferUpdateRequest:
+		session->updates_requested = 1;
+		/* The viewer already has the screen, only ask for what changes */
+		if( viewer->fresh ) {
+			msg[1] = 1;
+			viewer->fresh = 0;
+		}
+		break;
+	}
+
+	return len;
+}
+
+/*
+ * Move the viewer input to the server buffer. Messages from different
+ * viewers never interleave: only complete messages are moved, except for
+ * one bigger than the buffer which owns the server stream until it ends.
+ * Returns -1 when the viewer must be dropped.
+ */
+static int
+relay_viewer_input(relay_session * session, relay_viewer * viewer)
+{
+	repeaterslot * slot;
+	unsigned int pos;
+	unsigned int room;
+	unsigned int take;
+	int msg_len;
+
+	slot = session->slot;
+	pos = 0;
+	while( pos < viewer->inbuf_len ) {
+		room = RELAY_VIEWER_BUFFER - session->to_server_len;
+		if( room == 0 )
+			break;
+
+		if( !session->parse_viewers ) {
+			take = ( viewer->inbuf_len - pos < room ) ? viewer->inbuf_len - pos : room;
+			memcpy( session->to_server + session->to_server_len, viewer->inbuf + pos, take );
+			session->to_server_len += take;
+			pos += take;
+			continue;
+		}
+
+		if( session->owner != NULL ) {
+			if( session->owner != viewer )
+				break;
+			take = viewer->inbuf_len - pos;
+			if( take > room )
+				take = room;
+			if( take > session->owner_left )
+				take = session->owner_left;
+			memcpy( session->to_server + session->to_server_len, viewer->inbuf + pos, take );
+			session->to_server_len += take;
+			session->owner_left -= take;
+			pos += take;
+			if( session->owner_left == 0 ) {
+				session->owner = NULL;
+			}
+			continue;
+		}
+
+		msg_len = RfbClientMessageLength( viewer->inbuf + pos, viewer->inbuf_len - pos );
+		if( msg_len == RFB_NEED_MORE )
+			break;
+		if( msg_len == RFB_UNKNOWN ) {
+			if( session->config->broadcast || ( session->viewer_count > 1 ) ) {
+				debug("do_repeater(): unknown viewer message on broadcast ID %lu.\n", slot->code);
+				return -1;
+			}
+			debug("do_repeater(): unknown viewer message, viewer parsing disabled for ID %lu.\n", slot->code);
+			session->parse_viewers = 0;
+			continue;
+		}
+
+		if( (unsigned int)msg_len > viewer->inbuf_len - pos ) {
+			if( (unsigned int)msg_len <= RELAY_VIEWER_BUFFER )
+				break;
+			/* Too big to ever fit: stream it, it can not be rewritten */
+			if( ( (unsigned char)viewer->inbuf[pos] == rfbSetEncodings ) && session->parse_server ) {
+				if( session->config->broadcast )
+					return -1;
+				relay_lost_sync( session );
+			}
+			session->owner = viewer;
+			session->owner_left = msg_len;
+			continue;
+		}
+
+		take = relay_filter_viewer( session, viewer, viewer->inbuf + pos, msg_len );
+		if( take > room )
+			break;
+		if( take > 0 ) {
+			memcpy( session->to_server + session->to_server_len, viewer->inbuf + pos, take );
+			session->to_server_len += take;
+		}
+		pos += msg_len;
+	}
+
+	if( pos > 0 ) {
+		viewer->inbuf_len -= pos;
+		if( viewer->inbuf_len > 0 )
+			memmove( viewer->inbuf, viewer->inbuf + pos, viewer->inbuf_len );
+	}
+	return 0;
+}
+
+/*
+ * Push the server stream to one viewer, at most RELAY_QUANTUM bytes per
+ * pass. Returns -1 on error.
+ */
+static int
+relay_viewer_output(relay_session * session, relay_viewer * viewer)
+{
+	relay_chunk * chunk;
+	unsigned int budget;
+	unsigned int avail;
+	int more;
+	int flags;
+	int len;
+
+	budget = RELAY_QUANTUM;
+	while( viewer->pending_sent < viewer->pending_len ) {
+		avail = viewer->pending_len - viewer->pending_sent;
+		if( avail > budget )
+			avail = budget;
+		len = send( viewer->sock, viewer->pending + viewer->pending_sent, avail, MSG_NOSIGNAL );
+		if( len < 0 ) {
+			if( relay_would_block() )
+				return 0;
+			debug("do_repeater(): send() failed, server to viewer. Socket error = %d\n", errno);
+			return -1;
+		}
+		viewer->pending_sent += len;
+		budget -= len;
+		if( budget == 0 )
+			return 0;
+	}
+
+	if( viewer->detached )
+		return 0;
+
+	while( viewer->sent < session->received ) {
+		chunk = viewer->chunk;
+		if( ( viewer->offset == chunk->len ) && ( chunk->next != NULL ) ) {
+			chunk->refs--;
+			chunk = chunk->next;
+			chunk->refs++;
+			viewer->chunk = chunk;
+			viewer->offset = 0;
+		}
+
+		avail = chunk->len - viewer->offset;
+		more = ( chunk->next != NULL );
+		if( avail > budget ) {
+			avail = budget;
+			more = 1;
+		}
+
+		/* Bulk data: batch full segments while more is queued behind */
+		flags = MSG_NOSIGNAL;
+		if( session->config->input_priority && more )
+			flags |= MSG_MORE;
+
+#ifdef RELAY_ZEROCOPY
+		len = relay_zerocopy_send( session, viewer, chunk, chunk->data + viewer->offset, avail, flags );
+#else
+		len = send( viewer->sock, chunk->data + viewer->offset, avail, flags );
+#endif
+		if( len < 0 ) {
+			if( relay_would_block() )
+				return 0;
+			debug("do_repeater(): send() failed, server to viewer. Socket error = %d\n", errno);
+			return -1;
+		}
+
+		viewer->offset += len;
+		viewer->sent += len;
+		budget -= len;
+		if( ( (unsigned int)len < avail ) || ( budget == 0 ) )
+			break;
+	}
+
+	return 0;
+}
+
+/* Close the viewers still waiting to join */
+static void
+relay_drop_joiners(relay_session * session)
+{
+	relay_viewer * viewer;
+	relay_viewer * joining;
+
+	if( LockSlots("relay_drop_joiners()") != 0 )
+		return;
+	joining = session->joining;
+	session->joining = NULL;
+	UnlockSlots("relay_drop_joiners()");
+
+	while( joining != NULL ) {
+		viewer = joining;
+		joining = viewer->next;
+		relay_viewer_free( viewer );
+	}
+}
+
+/*
+ * The server sent something the parser does not know: only the primary
+ * viewer can go on, as a plain relay.
+ */
+static void
+relay_lost_sync(relay_session * session)
+{
+	relay_viewer * viewer;
+
+	if( session->viewer_count > 1 )
+		error("do_repeater(): can not follow the server stream of ID %lu, dropping %u viewers.\n", session->slot->code, session->viewer_count - 1);
+	else
+		debug("do_repeater(): can not follow the server stream of ID %lu, broadcast disabled.\n", session->slot->code);
+
+	session->parse_server = 0;
+	session->stream.update = NULL;
+	ShadowFree( &session->shadow );
+	if( session->messages != NULL ) {
+		free( session->messages );
+		session->messages = NULL;
+	}
+	if( session->current.chunk != NULL ) {
+		session->current.chunk->refs--;
+		session->current.chunk = NULL;
+	}
+	relay_drop_joiners( session );
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		viewer->coalescing = 0;
+		/* A detached viewer has no place in the stream to go back to */
+		if( ( viewer != session->viewers ) || viewer->detached )
+			viewer->closed = 1;
+	}
+}
+
+/*****************************************************************************
+ *
+ * Coalescing
+ *
+ *****************************************************************************/
+
+static void
+relay_message_add(relay_message * msg, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	if( ( w == 0 ) || ( h == 0 ) )
+		return;
+
+	if( !msg->dirty ) {
+		msg->x1 = x;
+		msg->y1 = y;
+		msg->x2 = x + w;
+		msg->y2 = y + h;
+		msg->dirty = 1;
+		return;
+	}
+
+	if( x < msg->x1 )
+		msg->x1 = x;
+	if( y < msg->y1 )
+		msg->y1 = y;
+	if( x + w > msg->x2 )
+		msg->x2 = x + w;
+	if( y + h > msg->y2 )
+		msg->y2 = y + h;
+}
+
+/* Follows the parser: what each message paints, then the shadow framebuffer */
+static void
+relay_stream_event(void * ctx, rfb_server_stream * st, int event, const char * data, unsigned int len)
+{
+	relay_session * session;
+	relay_message * msg;
+	rfbRectangle * r;
+
+	session = (relay_session *)ctx;
+	msg = &session->current;
+	r = &st->rect;
+
+	if( event == RFB_EVENT_RECT ) {
+		switch( st->encoding ) {
+		case rfbEncodingRaw:
+		case rfbEncodingCopyRect:
+		case rfbEncodingRRE:
+		case rfbEncodingCoRRE:
+		case rfbEncodingHextile:
+		case rfbEncodingZlib:
+		case rfbEncodingZRLE:
+			relay_message_add( msg, r->x, r->y, r->w, r->h );
+			break;
+		case rfbEncodingNewFBSize:
+			msg->dirty = 0;
+			relay_message_add( msg, 0, 0, r->w, r->h );
+			msg->keep = 1;
+			break;
+		default:
+			/* Cursor shape and position are not in the shadow framebuffer */
+			msg->keep = 1;
+			break;
+		}
+	}
+
+	if( session->decode )
+		ShadowUpdate( &session->shadow, st, event, data, len );
+}
+
+/* Pass over n bytes of the server stream, copying them to buf if not NULL */
+static void
+relay_stream_read(relay_chunk ** chunk, unsigned int * offset, unsigned long long n, char * buf)
+{
+	unsigned int take;
+
+	while( n > 0 ) {
+		if( *offset == (*chunk)->len ) {
+			*chunk = (*chunk)->next;
+			*offset = 0;
+		}
+
+		take = (*chunk)->len - *offset;
+		if( take > n )
+			take = (unsigned int)n;
+		if( buf != NULL ) {
+			memcpy( buf, (*chunk)->data + *offset, take );
+			buf += take;
+		}
+		*offset += take;
+		n -= take;
+	}
+}
+
+/* Keep stream data for a detached viewer. Returns -1 if it has too much. */
+static int
+relay_hold(relay_viewer * viewer, relay_held * held, relay_chunk * chunk, unsigned int offset, unsigned long long len)
+{
+	unsigned int size;
+	char * data;
+
+	if( viewer->held_updates.len + viewer->held_other.len + len > RELAY_COALESCE_QUEUE )
+		return -1;
+
+	if( held->len + len > held->size ) {
+		size = ( held->size > 0 ) ? held->size : 256;
+		while( size < held->len + len )
+			size *= 2;
+		data = (char *)realloc( held->data, size );
+		if( data == NULL )
+			return -1;
+		held->data = data;
+		held->size = size;
+	}
+
+	relay_stream_read( &chunk, &offset, len, held->data + held->len );
+	held->len += (unsigned int)len;
+	return 0;
+}
+
+/* A detached viewer misses one more message */
+static void
+relay_detached_message(relay_session * session, relay_viewer * viewer, relay_message * msg)
+{
+	if( msg->stateful ) {
+		error("do_repeater(): viewer of ID %lu can not skip a stateful update, closing it.\n", session->slot->code);
+		viewer->closed = 1;
+		return;
+	}
+
+	if( msg->dirty )
+		ShadowRegionAdd( &viewer->region, msg->x1, msg->y1, msg->x2 - msg->x1, msg->y2 - msg->y1 );
+	if( msg->keep ) {
+		if( relay_hold( viewer, ( msg->type == rfbFramebufferUpdate ) ? &viewer->held_updates : &viewer->held_other,
+			msg->chunk, msg->offset, msg->end - msg->start ) != 0 ) {
+			error("do_repeater(): viewer of ID %lu is too far behind, closing it.\n", session->slot->code);
+			viewer->closed = 1;
+		}
+	} else {
+		session->slot->dropped_bytes += msg->end - msg->start;
+	}
+}
+
+/* A server message is over: remember where it was and what it painted */
+static void
+relay_record_message(relay_session * session, relay_chunk * chunk, unsigned int offset, unsigned long long end)
+{
+	relay_viewer * viewer;
+	relay_message * msg;
+
+	if( session->messages == NULL )
+		return;
+
+	msg = &session->current;
+	msg->end = end;
+	msg->type = session->stream.msg_type;
+	/* ServerInit and the zlib based encodings have to be seen whole */
+	msg->stateful = ( msg->start == 0 ) || session->stream.stateful;
+	if( msg->type != rfbFramebufferUpdate )
+		msg->keep = 1;
+
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		if( viewer->detached && !viewer->closed )
+			relay_detached_message( session, viewer, msg );
+	}
+
+	if( session->msg_count == RELAY_MAX_MESSAGES ) {
+		/* Viewers that far behind can not leave the stream until they catch up */
+		session->msg_first = ( session->msg_first + 1 ) % RELAY_MAX_MESSAGES;
+		session->msg_count--;
+	}
+	session->messages[( session->msg_first + session->msg_count ) % RELAY_MAX_MESSAGES] = *msg;
+	session->msg_count++;
+
+	/* The next message starts here: its chunks must stay until it is over */
+	msg->chunk->refs--;
+	memset( msg, 0, sizeof(relay_message) );
+	msg->start = end;
+	msg->chunk = chunk;
+	msg->offset = offset;
+	chunk->refs++;
+}
+
+/* Forget the messages every viewer in the stream has gone past */
+static void
+relay_forget_messages(relay_session * session)
+{
+	relay_viewer * viewer;
+	unsigned long long oldest;
+
+	if( session->messages == NULL )
+		return;
+
+	oldest = session->received;
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		if( !viewer->detached && ( viewer->sent < oldest ) )
+			oldest = viewer->sent;
+	}
+
+	while( ( session->msg_count > 0 ) && ( session->messages[session->msg_first].end <= oldest ) ) {
+		session->msg_first = ( session->msg_first + 1 ) % RELAY_MAX_MESSAGES;
+		session->msg_count--;
+	}
+}
+
+/* Viewers too far behind leave the stream at the next message boundary */
+static void
+relay_check_slow(relay_session * session)
+{
+	relay_viewer * viewer;
+
+	if( ( session->messages == NULL ) || ( session->shadow.pixels == NULL ) )
+		return;
+
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		if( viewer->coalescing || viewer->detached || viewer->closed || ( viewer->pending_sent < viewer->pending_len ) )
+			continue;
+		if( session->received - viewer->sent >= RELAY_COALESCE_LAG )
+			viewer->coalescing = 1;
+	}
+}
+
+static int
+relay_shadow_usable(relay_session * session)
+{
+	shadow_framebuffer * fb;
+
+	fb = &session->shadow;
+	return ( fb->pixels != NULL ) && ( fb->width == session->stream.width ) &&
+		( fb->height == session->stream.height ) && ( fb->bpp == session->stream.bpp );
+}
+
+/*
+ * The viewer leaves the stream at the current message boundary: the rest
+ * of the message it is in still goes out, the messages after it are
+ * replaced by a merged update.
+ */
+static void
+relay_detach_viewer(relay_session * session, relay_viewer * viewer)
+{
+	relay_message * msg;
+	relay_chunk * chunk;
+	unsigned int offset;
+	unsigned long long from;
+	unsigned long long expected;
+	unsigned int i;
+
+	if( !relay_shadow_usable( session ) ) {
+		viewer->coalescing = 0;
+		return;
+	}
+
+	/* Every message up to the boundary must be known, and skippable */
+	expected = 0;
+	for( i = 0; i < session->msg_count; i++ ) {
+		msg = &session->messages[( session->msg_first + i ) % RELAY_MAX_MESSAGES];
+		if( msg->end <= viewer->sent )
+			continue;
+		if( expected == 0 ) {
+			if( msg->start > viewer->sent )
+				break;
+		} else if( ( msg->start != expected ) || msg->stateful ) {
+			viewer->coalescing = 0;
+			return;
+		}
+		expected = msg->end;
+	}
+	if( expected != session->current.start ) {
+		/* Not all known yet, or already past: try again later */
+		if( expected != 0 )
+			viewer->coalescing = 0;
+		return;
+	}
+
+	if( ShadowRegionInit( &viewer->region, &session->shadow ) != 0 ) {
+		viewer->coalescing = 0;
+		return;
+	}
+
+	chunk = viewer->chunk;
+	offset = viewer->offset;
+	from = viewer->sent;
+	for( i = 0; i < session->msg_count; i++ ) {
+		msg = &session->messages[( session->msg_first + i ) % RELAY_MAX_MESSAGES];
+		if( msg->end <= viewer->sent )
+			continue;
+
+		if( msg->start < viewer->sent ) {
+			/* Half sent: the rest goes first, the merged update paints over it */
+			if( relay_hold( viewer, &viewer->held_updates, chunk, offset, msg->end - viewer->sent ) != 0 ) {
+				ShadowRegionFree( &viewer->region );
+				viewer->held_updates.len = 0;
+				return;
+			}
+			relay_stream_read( &chunk, &offset, msg->end - viewer->sent, NULL );
+			from = msg->end;
+			if( msg->dirty )
+				ShadowRegionAdd( &viewer->region, msg->x1, msg->y1, msg->x2 - msg->x1, msg->y2 - msg->y1 );
+			continue;
+		}
+
+		relay_stream_read( &chunk, &offset, msg->start - from, NULL );
+		msg->chunk = chunk;
+		msg->offset = offset;
+		relay_detached_message( session, viewer, msg );
+		from = msg->start;
+	}
+
+	viewer->chunk->refs--;
+	viewer->chunk = NULL;
+	viewer->coalescing = 0;
+	viewer->detached = 1;
+}
+
+/*
+ * Once its last merged update is out, a detached viewer gets the next one,
+ * or goes back to the stream if nothing changed meanwhile. Held updates go
+ * before the merged one, which paints over them, the other messages after.
+ */
+static void
+relay_resume_viewer(relay_session * session, relay_viewer * viewer, relay_chunk * chunk, unsigned int offset, unsigned long long position)
+{
+	shadow_framebuffer * fb;
+	shadow_region * region;
+	unsigned int size;
+	unsigned int len;
+	char * pending;
+
+	fb = &session->shadow;
+	region = &viewer->region;
+	if( ( region->count == 0 ) && ( viewer->held_updates.len == 0 ) && ( viewer->held_other.len == 0 ) ) {
+		ShadowRegionFree( region );
+		viewer->detached = 0;
+		viewer->chunk = chunk;
+		viewer->offset = offset;
+		viewer->sent = position;
+		chunk->refs++;
+		return;
+	}
+
+	if( !relay_shadow_usable( session ) ) {
+		error("do_repeater(): no shadow framebuffer to catch up viewer of ID %lu, closing it.\n", session->slot->code);
+		viewer->closed = 1;
+		return;
+	}
+
+	/* The desktop was resized, repaint all of it */
+	if( ( region->columns != ( fb->width + SHADOW_TILE - 1 ) / SHADOW_TILE ) || ( region->rows != ( fb->height + SHADOW_TILE - 1 ) / SHADOW_TILE ) ) {
+		ShadowRegionFree( region );
+		if( ShadowRegionInit( region, fb ) != 0 ) {
+			viewer->closed = 1;
+			return;
+		}
+		ShadowRegionAdd( region, 0, 0, fb->width, fb->height );
+	}
+
+	size = viewer->held_updates.len + viewer->held_other.len;
+	if( region->count > 0 )
+		size += ShadowRegionUpdateSize( fb, region, viewer->hextile );
+	pending = (char *)malloc( size );
+	if( pending == NULL ) {
+		error("Not enough memory to merge updates for ID %lu.\n", session->slot->code);
+		viewer->closed = 1;
+		return;
+	}
+
+	memcpy( pending, viewer->held_updates.data, viewer->held_updates.len );
+	len = viewer->held_updates.len;
+	if( region->count > 0 )
+		len += ShadowRegionUpdate( fb, region, viewer->hextile, pending + len, size - len );
+	memcpy( pending + len, viewer->held_other.data, viewer->held_other.len );
+	len += viewer->held_other.len;
+
+	if( viewer->pending != NULL )
+		free( viewer->pending );
+	viewer->pending = pending;
+	viewer->pending_len = len;
+	viewer->pending_sent = 0;
+
+	memset( region->tiles, 0, region->columns * region->rows );
+	region->count = 0;
+	viewer->held_updates.len = 0;
+	viewer->held_other.len = 0;
+}
+
+/* Slow viewers leave, or catch up with, the stream at a message boundary */
+static void
+relay_coalesce_viewers(relay_session * session, relay_chunk * chunk, unsigned int offset, unsigned long long position)
+{
+	relay_viewer * viewer;
+
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		if( viewer->closed )
+			continue;
+		if( viewer->coalescing )
+			relay_detach_viewer( session, viewer );
+		if( viewer->detached && !viewer->closed && ( viewer->pending_sent == viewer->pending_len ) )
+			relay_resume_viewer( session, viewer, chunk, offset, position );
+	}
+}
+
+static int
+relay_coalesce_waiting(relay_session * session)
+{
+	relay_viewer * viewer;
+
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		if( viewer->coalescing )
+			return 1;
+		if( viewer->detached && ( viewer->pending_sent == viewer->pending_len ) )
+			return 1;
+	}
+	return 0;
+}
+
+/* Viewers waiting while the server is quiet join, or catch up, right away */
+static int
+relay_idle_boundary(relay_session * session)
+{
+	if( !session->stream.initialized || !RfbServerStreamIdle( &session->stream ) )
+		return 0;
+	if( ( session->joining == NULL ) && !relay_coalesce_waiting( session ) )
+		return 0;
+
+	if( ( session->tail == NULL ) || ( session->tail->len == RELAY_CHUNK_SIZE ) ) {
+		if( relay_chunk_append( session ) == NULL )
+			return -1;
+	}
+
+	if( session->joining != NULL )
+		relay_accept_joiners( session, session->tail, session->tail->len, session->received );
+	relay_coalesce_viewers( session, session->tail, session->tail->len, session->received );
+	return 0;
+}
+
+
+/*
+ * Bytes the shaper lets through in a direction. Every viewer gets its own
+ * copy of the server data, so it is charged once per viewer. When the
+ * direction is throttled, session->wait gets the time to the next try.
+ */
+static unsigned int
+relay_shape(relay_session * session, int direction, unsigned int want, unsigned long long clock)
+{
+	unsigned long copies;
+	unsigned long allowed;
+	unsigned long wait;
+
+	copies = 1;
+	if( ( direction == SHAPER_DOWN ) && ( session->viewer_count > 1 ) )
+		copies = session->viewer_count;
+
+	allowed = ShaperAllow( &session->shaper, direction, want * copies, clock ) / copies;
+	if( allowed == 0 ) {
+		wait = ShaperDelay( &session->shaper, direction, clock );
+		if( wait == 0 )
+			wait = 1000;
+		if( wait < session->wait )
+			session->wait = wait;
+	}
+	return (unsigned int)allowed;
+}
+
+
+static void
+relay_shaped(relay_session * session, int direction, unsigned int len, unsigned long long clock)
+{
+	if( ( direction == SHAPER_DOWN ) && ( session->viewer_count > 1 ) )
+		len *= session->viewer_count;
+	ShaperConsume( &session->shaper, direction, len, clock );
+}
+
+
+/* Read the server and queue its data for the viewers. Returns -1 on error. */
+static int
+relay_server_input(relay_session * session, unsigned long long clock)
+{
+	relay_chunk * chunk;
+	unsigned long long position;
+	unsigned int start;
+	unsigned int pos;
+	unsigned int room;
+	int message_end;
+	int len;
+
+	chunk = session->tail;
+	if( ( chunk == NULL ) || ( chunk->len == RELAY_CHUNK_SIZE ) ) {
+		chunk = relay_chunk_append( session );
+		if( chunk == NULL )
+			return -1;
+	}
+
+	room = relay_shape( session, SHAPER_DOWN, RELAY_CHUNK_SIZE - chunk->len, clock );
+	if( room == 0 )
+		return 0;
+
+	len = recv( session->server, chunk->data + chunk->len, room, 0 );
+	if( len == 0 ) {
+		debug("do_repeater(): connection closed by server.\n");
+		return -1;
+	} else if( len < 0 ) {
+		if( relay_would_block() )
+			return 0;
+		error("Error reading from socket. Socket error = %d.\n", errno );
+		return -1;
+	}
+
+	relay_shaped( session, SHAPER_DOWN, len, clock );
+	if( session->recording != NULL )
+		RecorderWrite( session->recording, RECORDER_SERVER, chunk->data + chunk->len, len, clock );
+	start = chunk->len;
+	chunk->len += len;
+	session->received += len;
+	session->slot->server_bytes += len;
+	session->slot->server_reads++;
+
+	if( !session->parse_server )
+		return 0;
+
+	/* Stop at every message boundary so waiting viewers can join, or skip ahead, there */
+	pos = start;
+	while( pos < chunk->len ) {
+		len = RfbServerStreamFeed( &session->stream, chunk->data + pos, chunk->len - pos, &message_end );
+		if( len < 0 ) {
+			relay_lost_sync( session );
+			return 0;
+		}
+		pos += len;
+		if( !message_end )
+			continue;
+
+		position = session->received - ( chunk->len - pos );
+		relay_record_message( session, chunk, pos, position );
+		if( session->joining != NULL )
+			relay_accept_joiners( session, chunk, pos, position );
+		relay_coalesce_viewers( session, chunk, pos, position );
+	}
+
+	return 0;
+}
+
+
+/* Release everything but the slot */
+static void
+relay_session_free(relay_session * session)
+{
+	relay_viewer * viewer;
+	relay_chunk * chunk;
+
+	while( session->viewers != NULL ) {
+		viewer = session->viewers;
+		session->viewers = viewer->next;
+		relay_viewer_free( viewer );
+	}
+	while( session->joining != NULL ) {
+		viewer = session->joining;
+		session->joining = viewer->next;
+		relay_viewer_free( viewer );
+	}
+
+	while( session->head != NULL ) {
+		chunk = session->head;
+		session->head = chunk->next;
+		free( chunk );
+	}
+	if( session->spare != NULL )
+		free( session->spare );
+
+	if( session->wake[0] != INVALID_SOCKET )
+		socket_close( session->wake[0] );
+	if( session->wake[1] != INVALID_SOCKET )
+		socket_close( session->wake[1] );
+
+	RfbServerStreamFree( &session->stream );
+	ShadowFree( &session->shadow );
+	if( session->messages != NULL )
+		free( session->messages );
+	if( session->recording != NULL )
+		RecorderClose( session->recording );
+	ConfigRelease( session->config );
+	free( session );
+}
+
+/* Close the viewers that failed. Returns -1 if the session can not go on. */
+static int
+relay_remove_closed(relay_session * session)
+{
+	relay_viewer ** link;
+	relay_viewer * viewer;
+	int removed;
+	int result;
+
+	removed = 0;
+	result = 0;
+	link = &session->viewers;
+	while( *link != NULL ) {
+		viewer = *link;
+		if( !viewer->closed ) {
+			link = &viewer->next;
+			continue;
+		}
+
+		/* Half a message went to the server, its stream is broken */
+		if( session->owner == viewer )
+			result = -1;
+
+		*link = viewer->next;
+		relay_viewer_free( viewer );
+		session->viewer_count--;
+		removed++;
+	}
+
+	if( removed == 0 )
+		return result;
+
+	relay_update_slot( session );
+
+	if( session->viewer_count == 0 ) {
+		/* A broadcast server stays connected until it goes away */
+		if( session->config->broadcast && session->parse_server ) {
+			debug("do_repeater(): ID %lu waiting for viewers.\n", session->slot->code);
+		} else {
+			result = -1;
+		}
+	}
+
+	return result;
+}
+
+
+/*****************************************************************************
+ *
+ * Hot upgrade
+ *
+ *****************************************************************************/
+
+/*
+ * A parking session only reads to complete a message already started, so
+ * the new process picks both streams up at a message boundary.
+ */
+static int
+relay_park_reading_server(relay_session * session)
+{
+	return session->parse_server && ( session->received > 0 ) && !RfbServerStreamIdle( &session->stream );
+}
+
+static int
+relay_park_reading_viewer(relay_session * session, relay_viewer * viewer)
+{
+	return session->parse_viewers && ( ( viewer->inbuf_len > 0 ) || ( session->owner == viewer ) );
+}
+
+/* Nothing left in the repeater buffers */
+static int
+relay_park_ready(relay_session * session)
+{
+	relay_viewer * viewer;
+
+	if( ( session->to_server_len > 0 ) || ( session->owner != NULL ) || relay_park_reading_server( session ) )
+		return 0;
+
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		if( ( viewer->inbuf_len > 0 ) || viewer->coalescing || viewer->detached || relay_viewer_has_output( session, viewer ) )
+			return 0;
+		/* The kernel may still read zero copy sends from chunks about to go */
+		if( viewer->zc_done != viewer->zc_next )
+			return 0;
+	}
+	return 1;
+}
+
+/* Follow the hand over requests. Returns 1 once the session has parked. */
+static int
+relay_park_check(relay_session * session, unsigned long now)
+{
+	int state;
+
+	state = session->handoff;
+	if( relay_park_requested ) {
+		if( state == RELAY_RUNNING ) {
+			state = RELAY_PARKING;
+			session->park_deadline = now + RELAY_PARK_TIMEOUT;
+		}
+		if( state == RELAY_PARKING ) {
+			if( relay_park_ready( session ) ) {
+				state = RELAY_PARKED;
+			} else if( now >= session->park_deadline ) {
+				error("do_repeater(): ID %lu could not be parked in time, it stays.\n", session->slot->code);
+				state = RELAY_STAYING;
+			}
+		}
+	} else {
+		state = RELAY_RUNNING;
+	}
+
+	if( state != session->handoff ) {
+		/* The main thread watches the state, and withdraws the request, under the lock */
+		if( LockSlots("relay_park_check()") != 0 )
+			return 0;
+		if( !relay_park_requested )
+			state = RELAY_RUNNING;
+		session->handoff = state;
+		if( state == RELAY_PARKED )
+			debug("do_repeater(): ID %lu parked.\n", session->slot->code);
+		UnlockSlots("relay_park_check()");
+	}
+
+	return ( state == RELAY_PARKED );
+}
+
+
+/*
+ * Fit the socket buffers to each path, once a second, and keep the figures
+ * of the slowest viewer for the admin port. server_rate is what the server
+ * sent over the last second.
+ */
+static void
+relay_tune(relay_session * session, unsigned long server_rate)
+{
+	relay_viewer * viewer;
+	repeaterslot * slot;
+	unsigned int rtt;
+	unsigned int sndbuf;
+	unsigned int lowat;
+
+	if( !session->config->tune_sockets )
+		return;
+
+	slot = session->slot;
+	socket_tune( session->server, &session->server_tune, server_rate );
+	rtt = 0;
+	sndbuf = 0;
+	lowat = 0;
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		socket_tune( viewer->sock, &viewer->tune, 0 );
+		if( viewer->tune.rtt >= rtt ) {
+			rtt = viewer->tune.rtt;
+			sndbuf = viewer->tune.sndbuf;
+			lowat = viewer->tune.lowat;
+		}
+	}
+
+	slot->rtt = rtt;
+	slot->sndbuf = sndbuf;
+	slot->lowat = lowat;
+	slot->rcvbuf = session->server_tune.rcvbuf;
+}
+
+
+/*****************************************************************************
+ *
+ * Threads
+ *
+ *****************************************************************************/
+
+/* Runs on a pool worker, for as long as the session lasts */
+static void
+do_repeater(void * lpParam)
+{
+	relay_session *session;
+	repeaterslot *slot;
+	relay_viewer *viewer;
+	int running;
+	int parked;
+	int len;
+	int flags;
+	struct pollfd fds[RELAY_MAX_VIEWERS + 3];
+	unsigned int nfds;
+	int wake_polled;
+	int server_polled;
+	short events;
+	int selres;
+	CARD8 client_init;
+	char wake_buf[16];
+	unsigned int viewerbuf_len;
+	unsigned long long clock;
+	unsigned int allowed;
+
+	/** traffic accounting **/
+	unsigned long now;
+	unsigned long sample_time;
+	unsigned long long sample_bytes;
+	unsigned long long sample_received;
+
+	session = (relay_session *)lpParam;
+	slot = session->slot;
+
+	now = (unsigned long)time(NULL);
+	slot->last_activity = now;
+	sample_time = now;
+	sample_bytes = slot->server_bytes + slot->viewer_bytes;
+	sample_received = session->received;
+	running = 1;
+	parked = 0;
+
+	if( !session->resumed ) {
+		debug("do_reapeater(): Starting repeater for ID %lu.\n", slot->code);
+		slot->started = now;
+
+		// Send ClientInit to the server to start repeating
+		client_init = 1;
+		if( WriteExact(slot->server, (char *)&client_init, 1) < 0 ) {
+			error("do_repeater(): Writting ClientInit error.\n");
+			running = 0;
+		}
+		if( session->recording != NULL )
+			RecorderWrite( session->recording, RECORDER_VIEWER, (char *)&client_init, 1, ShaperNow() );
+	} else {
+		debug("do_reapeater(): Resuming repeater for ID %lu.\n", slot->code);
+	}
+
+	// Start the repeater loop.
+	while( running )
+	{
+		/* Sample the bandwidth once per second */
+		now = (unsigned long)time(NULL);
+		if( now != sample_time ) {
+			slot->bandwidth = (unsigned long)( ( slot->server_bytes + slot->viewer_bytes - sample_bytes ) / ( now - sample_time ) );
+			sample_bytes = slot->server_bytes + slot->viewer_bytes;
+			relay_tune( session, (unsigned long)( ( session->received - sample_received ) / ( now - sample_time ) ) );
+			sample_received = session->received;
+			sample_time = now;
+		}
+
+		if( relay_idle_boundary( session ) != 0 )
+			break;
+
+		/* Shutting down: the session ends as if its peers had left */
+		if( relay_stop_requested ) {
+			debug("do_repeater(): ID %lu closed, the repeater is shutting down.\n", slot->code);
+			break;
+		}
+
+		if( relay_park_check( session, now ) ) {
+			parked = 1;
+			break;
+		}
+
+		/*
+		 * Both directions are independent: the viewers are always read while
+		 * there is room for their input, even if framebuffer data is still
+		 * waiting for them to drain.
+		 */
+		nfds = 0;
+		wake_polled = -1;
+		if( session->wake[0] != INVALID_SOCKET )
+			wake_polled = relay_poll_add( fds, &nfds, session->wake[0], POLLIN );
+
+		/* The byte stays there until every session has seen it */
+		if( ( session->handoff == RELAY_RUNNING ) && ( relay_wake[0] != INVALID_SOCKET ) )
+			relay_poll_add( fds, &nfds, relay_wake[0], POLLIN );
+
+		/*
+		 * prepare for reading server input, the slowest viewer holds it back.
+		 * A direction throttled by the shaper is left out of poll(), whose
+		 * timeout then brings it back when its buckets have refilled.
+		 */
+		clock = ShaperNow();
+		session->wait = 1000000;
+		if( session->recording != NULL )
+			RecorderTick( session->recording, clock );
+		events = 0;
+		if( ( relay_queued( session ) < ( ( session->messages != NULL ) ? RELAY_COALESCE_QUEUE : RELAY_QUEUE_LIMIT ) )
+			&& ( ( session->handoff != RELAY_PARKING ) || relay_park_reading_server( session ) )
+			&& ( relay_shape( session, SHAPER_DOWN, RELAY_CHUNK_SIZE, clock ) > 0 ) )
+			events |= POLLIN;
+		if( ( session->to_server_len > 0 ) && ( relay_shape( session, SHAPER_UP, session->to_server_len, clock ) > 0 ) )
+			events |= POLLOUT;
+		server_polled = relay_poll_add( fds, &nfds, session->server, events );
+
+		for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+			events = 0;
+			if( ( viewer->inbuf_len < RELAY_VIEWER_BUFFER )
+				&& ( ( session->handoff != RELAY_PARKING ) || relay_park_reading_viewer( session, viewer ) ) )
+				events |= POLLIN;
+			if( relay_viewer_has_output( session, viewer ) )
+				events |= POLLOUT;
+			viewer->polled = relay_poll_add( fds, &nfds, viewer->sock, events );
+		}
+
+		/* Rounded up, a shorter wait would only spin until the buckets refill */
+		selres = poll( fds, nfds, (int)( ( session->wait + 999 ) / 1000 ) );
+		if( selres == -1 ) {
+			if( errno == EINTR )
+				continue;
+			/* some error */
+			error("do_repeater(): poll() failed, errno=%d\n", errno);
+			break;
+		} else if( selres == 0 ) {
+			/*Timeout */
+			continue;
+		}
+
+		if( relay_poll_readable( fds, wake_polled ) ) {
+			while( recv( session->wake[0], wake_buf, sizeof(wake_buf), 0 ) > 0 )
+				;
+		}
+
+#ifdef RELAY_ZEROCOPY
+		/* The notifications make the viewer sockets readable, they are read on every pass */
+		for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+			if( ( viewer->zc_done != viewer->zc_next ) && ( relay_zerocopy_reap( viewer ) != 0 ) ) {
+				error("Error reading the zero copy notifications. Socket error = %d.\n", errno );
+				viewer->closed = 1;
+			}
+		}
+#endif
+
+		/* viewers => server goes first: it carries the keyboard and pointer events */ 
+		for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+			if( !relay_poll_readable( fds, viewer->polled ) )
+				continue;
+
+			len = recv( viewer->sock, viewer->inbuf + viewer->inbuf_len, RELAY_VIEWER_BUFFER - viewer->inbuf_len, 0 );
+			if( len == 0 ) {
+				debug("do_repeater(): connection closed by viewer.\n");
+				viewer->closed = 1;
+			} else if( len < 0 ) {
+				if( !relay_would_block() ) {
+					error("Error reading from socket. Socket error = %d.\n", errno );
+					viewer->closed = 1;
+				}
+			} else {
+				viewer->inbuf_len += len;
+				slot->viewer_bytes += len;
+				slot->viewer_reads++;
+				slot->last_activity = now;
+			}
+		}
+
+		/* flush the viewer input to the server, as long as it takes it */
+		clock = ShaperNow();
+		while( running ) {
+			for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+				if( viewer->closed || ( viewer->inbuf_len == 0 ) )
+					continue;
+				if( relay_viewer_input( session, viewer ) != 0 )
+					viewer->closed = 1;
+			}
+
+			if( session->to_server_len == 0 )
+				break;
+			allowed = relay_shape( session, SHAPER_UP, session->to_server_len, clock );
+			if( allowed == 0 )
+				break;
+
+			/* Complete messages are pushed at once, a partial one waits for its tail */
+			flags = MSG_NOSIGNAL;
+			if( ( session->owner != NULL ) || ( allowed < session->to_server_len ) )
+				flags |= MSG_MORE;
+
+			len = send( session->server, session->to_server, allowed, flags );
+			if( len < 0 ) {
+				if( !relay_would_block() ) {
+					debug("do_repeater(): send() failed, viewer to server. Socket error = %d\n", errno);
+					running = 0;
+				}
+				break;
+			}
+
+			relay_shaped( session, SHAPER_UP, len, clock );
+			if( session->recording != NULL )
+				RecorderWrite( session->recording, RECORDER_VIEWER, session->to_server, len, clock );
+			session->to_server_len -= len;
+			if( session->to_server_len > 0 ) {
+				memmove( session->to_server, session->to_server + len, session->to_server_len );
+				break;
+			}
+		}
+
+		/* server => viewers */ 
+		if( running && relay_poll_readable( fds, server_polled ) ) {
+			if( relay_server_input( session, clock ) != 0 )
+				running = 0;
+			else
+				slot->last_activity = now;
+		}
+
+		for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+			if( viewer->closed )
+				continue;
+			if( relay_viewer_has_output( session, viewer ) ) {
+				if( relay_viewer_output( session, viewer ) != 0 )
+					viewer->closed = 1;
+			}
+		}
+		relay_check_slow( session );
+
+		if( relay_remove_closed( session ) != 0 )
+			running = 0;
+		relay_chunk_collect( session );
+		relay_forget_messages( session );
+
+		/* Buffer occupancy */
+		viewerbuf_len = session->to_server_len;
+		for( viewer = session->viewers; viewer != NULL; viewer = viewer->next )
+			viewerbuf_len += viewer->inbuf_len;
+		slot->viewerbuf_len = viewerbuf_len;
+		slot->serverbuf_len = (unsigned int)relay_queued( session );
+	}
+
+	/* The main thread hands the session over, or restarts it */
+	if( parked )
+		return;
+
+	/** When the thread exits **/
+	if( LockSlots("do_repeater()") == 0 ) {
+		/* Nobody can attach anymore, the sockets go before the slot does */
+		slot->relay = NULL;
+		slot->viewer = INVALID_SOCKET;
+		relay_session_free( session );
+		FreeSlot( slot );
+		UnlockSlots("do_repeater()");
+	}
+
+	debug("Repeater thread closed.\n");
+}
+
+
+/*****************************************************************************
+ *
+ * Sessions
+ *
+ *****************************************************************************/
+
+/* A session for the slot, with no viewer yet. It holds config, from ConfigAcquire(), even if it fails. */
+static relay_session *
+relay_session_new(repeaterslot * slot, const repeater_config * config, int parse_server, int parse_viewers)
+{
+	relay_session * session;
+
+	session = (relay_session *)malloc( sizeof(relay_session) );
+	if( session == NULL ) {
+		error("Not enough memory for a new session.\n");
+		ConfigRelease( config );
+		return NULL;
+	}
+
+	memset( session, 0, sizeof(relay_session) );
+	session->slot = slot;
+	session->config = config;
+	session->server = slot->server;
+	socket_tune_init( &session->server_tune );
+	session->wake[0] = INVALID_SOCKET;
+	session->wake[1] = INVALID_SOCKET;
+	session->parse_server = parse_server;
+	session->parse_viewers = parse_viewers;
+	session->decode = parse_server && ( config->shadow || config->coalesce );
+	ShaperSessionInit( &session->shaper, slot->code );
+	session->recording = RecorderOpen( slot->code, ShaperNow() );
+	RfbServerStreamInit( &session->stream );
+	if( parse_server && config->coalesce ) {
+		session->messages = (relay_message *)malloc( RELAY_MAX_MESSAGES * sizeof(relay_message) );
+		if( session->messages == NULL ) {
+			error("Not enough memory for a new session.\n");
+			relay_session_free( session );
+			return NULL;
+		}
+	}
+
+	/* Only broadcast sessions have viewers attaching later on */
+	if( config->broadcast && ( socket_pair( session->wake ) != 0 ) ) {
+		error("Failed to create the wake up sockets for ID %lu.\n", slot->code);
+		relay_session_free( session );
+		return NULL;
+	}
+
+	if( relay_chunk_append( session ) == NULL ) {
+		relay_session_free( session );
+		return NULL;
+	}
+
+	return session;
+}
+
+/* The viewers are in: follow the server stream from here */
+static void
+relay_session_follow(relay_session * session)
+{
+	if( session->parse_server ) {
+		session->stream.update = relay_stream_event;
+		session->stream.update_ctx = session;
+	}
+	if( session->messages != NULL ) {
+		session->current.start = session->received;
+		session->current.chunk = session->head;
+		session->head->refs++;
+	}
+}
+
+/* Free a session that never ran, its sockets still belong to their owners */
+static void
+relay_session_discard(relay_session * session)
+{
+	relay_viewer * viewer;
+
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next )
+		viewer->sock = INVALID_SOCKET;
+	for( viewer = session->joining; viewer != NULL; viewer = viewer->next )
+		viewer->sock = INVALID_SOCKET;
+	relay_session_free( session );
+}
+
+static int
+relay_session_start(relay_session * session)
+{
+	session->slot->relay = session;
+	session->slot->viewers = session->viewer_count;
+	if( WorkerSubmit( do_repeater, session ) == 0 )
+		return 0;
+
+	session->slot->relay = NULL;
+	session->slot->viewers = 0;
+	relay_session_discard( session );
+	return -1;
+}
+
+int
+RelayStart(repeaterslot * slot)
+{
+	const repeater_config * config;
+	relay_session * session;
+	relay_viewer * viewer;
+	int parse_server;
+
+	config = ConfigAcquire();
+	parse_server = config->broadcast || config->coalesce;
+	session = relay_session_new( slot, config, parse_server, config->input_priority || parse_server );
+	if( session == NULL )
+		return -1;
+
+	viewer = relay_viewer_new( slot->viewer );
+	if( viewer == NULL ) {
+		relay_session_free( session );
+		return -1;
+	}
+	relay_viewer_join( session, viewer, session->head, 0, 0 );
+	relay_session_follow( session );
+
+	return relay_session_start( session );
+}
+
+
+int
+RelayAttachViewer(relay_session * session, SOCKET sock)
+{
+	relay_viewer * viewer;
+	relay_viewer ** last;
+	unsigned int count;
+
+	if( !session->config->broadcast || !session->parse_server )
+		return -1;
+	/* The viewer of a Mode I session authenticated with the server itself */
+	if( session->slot->modei )
+		return -1;
+
+	count = session->viewer_count;
+	for( last = &session->joining; *last != NULL; last = &(*last)->next )
+		count++;
+	if( count >= RELAY_MAX_VIEWERS ) {
+		error("Too many viewers for ID %lu.\n", session->slot->code);
+		return -1;
+	}
+
+	viewer = relay_viewer_new( sock );
+	if( viewer == NULL )
+		return -1;
+	*last = viewer;
+
+	/* Wake the relay up, it picks the viewer at the next message boundary */
+	send( session->wake[1], "", 1, MSG_NOSIGNAL );
+	return 0;
+}
+
+
+/*****************************************************************************
+ *
+ * Hot upgrade
+ *
+ *****************************************************************************/
+
+int
+RelayInit( void )
+{
+	if( socket_pair( relay_wake ) != 0 ) {
+		error("Failed to create the wake up sockets for the sessions.\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+void
+RelayFree( void )
+{
+	if( relay_wake[0] != INVALID_SOCKET )
+		socket_close( relay_wake[0] );
+	if( relay_wake[1] != INVALID_SOCKET )
+		socket_close( relay_wake[1] );
+	relay_wake[0] = INVALID_SOCKET;
+	relay_wake[1] = INVALID_SOCKET;
+}
+
+
+void
+RelayPark(int park)
+{
+	char buf[16];
+
+	relay_park_requested = park;
+	if( relay_wake[0] == INVALID_SOCKET )
+		return;
+
+	if( park )
+		send( relay_wake[1], "", 1, MSG_NOSIGNAL );
+	else
+		while( recv( relay_wake[0], buf, sizeof(buf), 0 ) > 0 )
+			;
+}
+
+
+void
+RelayStop( void )
+{
+	relay_stop_requested = 1;
+	if( relay_wake[1] != INVALID_SOCKET )
+		send( relay_wake[1], "", 1, MSG_NOSIGNAL );
+}
+
+
+int
+RelayParked(relay_session * session)
+{
+	if( session->handoff == RELAY_PARKED )
+		return 1;
+	if( session->handoff == RELAY_STAYING )
+		return -1;
+	return 0;
+}
+
+
+int
+RelayExport(relay_session * session, relay_state * state)
+{
+	relay_viewer * viewer;
+	unsigned int size;
+
+	memset( state, 0, sizeof(relay_state) );
+	state->received = session->received;
+	state->parse_server = session->parse_server;
+	state->parse_viewers = session->parse_viewers;
+	state->updates_requested = session->updates_requested;
+
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		state->viewers[state->viewer_count] = viewer->sock;
+		if( viewer->hextile )
+			state->viewer_flags[state->viewer_count] |= RELAY_VIEWER_HEXTILE;
+		if( viewer->fresh )
+			state->viewer_flags[state->viewer_count] |= RELAY_VIEWER_FRESH;
+		state->viewer_count++;
+	}
+	for( viewer = session->joining; viewer != NULL; viewer = viewer->next ) {
+		state->viewers[state->viewer_count + state->joining_count] = viewer->sock;
+		state->joining_count++;
+	}
+
+	if( session->parse_server && session->stream.initialized ) {
+		size = sz_rfbServerInitMsg + session->stream.name_len;
+		state->init = (char *)malloc( size );
+		if( state->init == NULL ) {
+			error("Not enough memory to hand ID %lu over.\n", session->slot->code);
+			return -1;
+		}
+		state->init_len = RfbServerStreamInitMessage( &session->stream, state->init, size );
+	}
+
+	return 0;
+}
+
+
+void
+RelayRelease(repeaterslot * slot)
+{
+	relay_session * session;
+	relay_viewer * viewer;
+
+	session = slot->relay;
+	for( viewer = session->viewers; viewer != NULL; viewer = viewer->next ) {
+		socket_release( viewer->sock );
+		viewer->sock = INVALID_SOCKET;
+	}
+	for( viewer = session->joining; viewer != NULL; viewer = viewer->next ) {
+		socket_release( viewer->sock );
+		viewer->sock = INVALID_SOCKET;
+	}
+	socket_release( slot->server );
+	slot->server = INVALID_SOCKET;
+	slot->viewer = INVALID_SOCKET;
+	slot->relay = NULL;
+
+	relay_session_free( session );
+	FreeSlot( slot );
+}
+
+
+int
+RelayRestart(relay_session * session)
+{
+	repeaterslot * slot;
+
+	session->handoff = RELAY_RUNNING;
+	session->resumed = 1;
+	if( WorkerSubmit( do_repeater, session ) == 0 )
+		return 0;
+
+	error("Unable to restart the repeater thread for ID %lu.\n", session->slot->code);
+	slot = session->slot;
+	slot->relay = NULL;
+	slot->viewer = INVALID_SOCKET;
+	relay_session_free( session );
+	FreeSlot( slot );
+	return -1;
+}
+
+
+/* Close the viewers of a session that could not be resumed */
+static void
+relay_state_close(relay_state * state)
+{
+	unsigned int i;
+
+	for( i = 0; i < state->viewer_count + state->joining_count; i++ ) {
+		if( state->viewers[i] != INVALID_SOCKET )
+			socket_close( state->viewers[i] );
+		state->viewers[i] = INVALID_SOCKET;
+	}
+}
+
+
+int
+RelayResume(repeaterslot * slot, relay_state * state)
+{
+	const repeater_config * config;
+	relay_session * session;
+	relay_viewer * viewer;
+	relay_viewer ** last;
+	rfbFramebufferUpdateRequestMsg request;
+	unsigned int total;
+	unsigned int pos;
+	unsigned int i;
+	int message_end;
+	int len;
+
+	total = state->viewer_count + state->joining_count;
+	config = ConfigAcquire();
+	session = relay_session_new( slot, config, state->parse_server && ( config->broadcast || config->coalesce ),
+		state->parse_viewers && ( config->input_priority || config->broadcast || config->coalesce ) );
+	if( session == NULL ) {
+		relay_state_close( state );
+		return -1;
+	}
+
+	session->resumed = 1;
+	session->received = state->received;
+	session->updates_requested = state->updates_requested;
+
+	/* Only a broadcast session takes more than one viewer */
+	last = &session->joining;
+	for( i = 0; i < total; i++ ) {
+		if( ( i > 0 ) && !( session->config->broadcast && session->parse_server ) ) {
+			debug("Broadcast is off, closing viewer %u of ID %lu.\n", i, slot->code);
+			socket_close( state->viewers[i] );
+			state->viewers[i] = INVALID_SOCKET;
+			continue;
+		}
+
+		viewer = relay_viewer_new( state->viewers[i] );
+		if( viewer == NULL ) {
+			relay_session_discard( session );
+			relay_state_close( state );
+			return -1;
+		}
+		/* The socket counts its zero copy sends on from the old process, the IDs would not match */
+		viewer->zerocopy = -1;
+
+		if( i < state->viewer_count ) {
+			viewer->hextile = ( state->viewer_flags[i] & RELAY_VIEWER_HEXTILE ) != 0;
+			viewer->fresh = ( state->viewer_flags[i] & RELAY_VIEWER_FRESH ) != 0;
+			relay_viewer_join( session, viewer, session->head, 0, session->received );
+		} else {
+			*last = viewer;
+			last = &viewer->next;
+		}
+	}
+
+	/* The parser picks the stream up where the old process left it */
+	if( session->parse_server && ( state->init_len > 0 ) ) {
+		pos = 0;
+		message_end = 0;
+		while( ( pos < state->init_len ) && !message_end ) {
+			len = RfbServerStreamFeed( &session->stream, state->init + pos, state->init_len - pos, &message_end );
+			if( len < 0 )
+				break;
+			pos += len;
+		}
+		if( ( pos != state->init_len ) || !message_end )
+			relay_lost_sync( session );
+	}
+	relay_session_follow( session );
+
+	/* The shadow framebuffer is empty, have the server paint all of it */
+	if( session->decode && session->updates_requested && session->stream.initialized ) {
+		request.type = rfbFramebufferUpdateRequest;
+		request.incremental = 0;
+		request.x = 0;
+		request.y = 0;
+		request.w = Swap16IfLE( session->stream.width );
+		request.h = Swap16IfLE( session->stream.height );
+		memcpy( session->to_server, &request, sz_rfbFramebufferUpdateRequestMsg );
+		session->to_server_len = sz_rfbFramebufferUpdateRequestMsg;
+	}
+
+	if( relay_session_start( session ) != 0 ) {
+		relay_state_close( state );
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef _RELAY_H
+#define _RELAY_H
+
+/**
+ * Relay buffer sizes. Viewer input is small (events and requests), the
+ * server sends bulk framebuffer data, queued in chunks shared by all the
+ * viewers of the session.
+ */
+#define RELAY_VIEWER_BUFFER	4096
+#define RELAY_CHUNK_SIZE	(64 * 1024)
+#define RELAY_QUEUE_LIMIT	(4 * RELAY_CHUNK_SIZE)
+
+/**
+ * Each pass of the relay loop sends at most a quantum of bytes to every
+ * viewer, so a long update stream does not keep the session from reading
+ * its viewers' input and the server in between. Sessions are separate
+ * threads, sharing the CPU between them is left to the system scheduler.
+ */
+#define RELAY_QUANTUM		RELAY_CHUNK_SIZE
+
+/**
+ * Update coalescing: a viewer this far behind skips to the newest message
+ * boundary and gets one merged update instead. The queue is allowed to
+ * grow up to RELAY_COALESCE_QUEUE before the server is held back.
+ */
+#define RELAY_COALESCE_LAG	RELAY_QUEUE_LIMIT
+#define RELAY_COALESCE_QUEUE	(16 * RELAY_CHUNK_SIZE)
+#define RELAY_MAX_MESSAGES	1024
+
+/**
+ * Broadcast sessions keep the server connected while no viewer is watching
+ */
+#define RELAY_MAX_VIEWERS	64
+
+/**
+ * MSG_ZEROCOPY (see ZeroCopyThreshold): a viewer with this many sends the
+ * kernel has not finished with copies the next ones, and a viewer closing
+ * waits up to RELAY_ZEROCOPY_LINGER milliseconds for them before its
+ * connection is reset, so the kernel never sends a chunk that was reused.
+ */
+#define RELAY_ZEROCOPY_INFLIGHT	256
+#define RELAY_ZEROCOPY_LINGER	200
+
+/**
+ * Hot upgrade: a session parks once nothing is left in the repeater
+ * buffers, or goes on in the old process if that takes longer than this.
+ */
+#define RELAY_PARK_TIMEOUT	10
+
+typedef struct _relay_session relay_session;
+
+/**
+ * Start relaying a paired slot. Called with the slots locked.
+ */
+int RelayStart(repeaterslot * slot);
+
+/**
+ * Hand an extra viewer to a running session. Called with the slots locked.
+ */
+int RelayAttachViewer(relay_session * session, SOCKET viewer);
+
+int RelayInit( void );
+void RelayFree( void );
+
+/**
+ * What a parked session needs to go on in another process. The viewer
+ * sockets are the viewers in the stream, the primary first, then the ones
+ * still waiting to join.
+ */
+#define RELAY_VIEWER_HEXTILE	1
+#define RELAY_VIEWER_FRESH	2
+
+typedef struct _relay_state {
+	unsigned long long received;    /* Server bytes relayed so far */
+	int parse_server;
+	int parse_viewers;
+	int updates_requested;
+	unsigned int viewer_count;
+	unsigned int joining_count;
+	SOCKET viewers[RELAY_MAX_VIEWERS];
+	int viewer_flags[RELAY_MAX_VIEWERS];
+	char * init;                    /* ServerInit for the desktop as it is now, if known */
+	unsigned int init_len;
+} relay_state;
+
+/**
+ * Close every running session at its next pass, the threads free their
+ * slots on their way out. There is no going back.
+ */
+void RelayStop( void );
+
+/**
+ * Ask every session to park (or to go on again). A parked session has no
+ * thread and nothing buffered, its sockets are ready to be handed over.
+ */
+void RelayPark(int park);
+
+/**
+ * 1 once the session has parked, 0 while on its way and -1 if it stays.
+ * Called with the slots locked.
+ */
+int RelayParked(relay_session * session);
+
+/**
+ * Describe a parked session. state->init must be freed by the caller.
+ */
+int RelayExport(relay_session * session, relay_state * state);
+
+/**
+ * The parked session now belongs to another process: drop this process'
+ * handles on its sockets and free the slot. Called with the slots locked.
+ */
+void RelayRelease(repeaterslot * slot);
+
+/**
+ * Go on relaying a parked session. Called with the slots locked.
+ */
+int RelayRestart(relay_session * session);
+
+/**
+ * Start relaying a session handed over by another process, the slot owns
+ * the server socket. Called with the slots locked.
+ */
+int RelayResume(repeaterslot * slot, relay_state * state);
+
+#endif
@@ -47,7 +47,18 @@
 #include "vncauth.h"
 #include "repeater.h"
 #include "slots.h"
+#include "relay.h"
+#include "shaper.h"
+#include "recorder.h"
+#include "upgrade.h"
 #include "config.h"
+#include "admin.h"
+#include "workers.h"
+#include "tls.h"
+#include "limiter.h"
+#include "admission.h"
+#include "handshake.h"
+#include "resolver.h"
 #include "version.h"
 
 // Defines
@@ -58,25 +69,38 @@
 #define TRUE	1
 #define FALSE	0 
 
-#define MAX_HOST_NAME_LEN	250
+/* Seconds the sessions get to close once stopped */
+#define STOP_TIMEOUT	5
 
-// Structures
-
-typedef struct _listener_thread_params {
-	u_short	port;
-	SOCKET	sock;
-} listener_thread_params;
+/* Milliseconds a peer gets for each step of its handshake */
+#define HANDSHAKE_TIMEOUT	10000
 
 // Global variables
 int notstopped;
 
+/* The signal handler passes the signal number on to the main loop through this pair */
+static SOCKET signal_wake[2] = { INVALID_SOCKET, INVALID_SOCKET };
+
+/* The ports read from the file at start, the command line may have changed them */
+static u_short file_ports[UPGRADE_LISTENERS];
+
+/* AcceptRate, each listener thread has its own table */
+static accept_limiter server_limiter;
+static accept_limiter viewer_limiter;
+static accept_limiter modei_limiter;
+
+/* Under mutex_slots: Mode I viewers whose server is being connected to */
+static unsigned int modei_connecting = 0;
+
+/* Under mutex_slots: set while the listeners are stopped, the slots may be counted or handed over */
+static int slots_closed = FALSE;
+
 // Prototypes
-int ParseDisplay(char *display, char *phost, int hostlen, char *pport);
 void ExitRepeater(int sig);
 void usage(char * appname);
-THREAD_CALL do_repeater(LPVOID lpParam);
 THREAD_CALL server_listen(LPVOID lpParam);
 THREAD_CALL viewer_listen(LPVOID lpParam);
+THREAD_CALL modei_listen(LPVOID lpParam);
 #ifdef WIN32
 void ThreadCleanup(HANDLE hThread, DWORD dwMilliseconds);
 //DWORD WINAPI do_repeater(LPVOID lpParam);
@@ -92,6 +116,9 @@ void ThreadCleanup(HANDLE hThread, DWORD dwMilliseconds);
 void debug(const char *fmt, ...)
 {
 	va_list args;
+
+	if( ConfigGet()->log_level < 1 )
+		return;
 	va_start(args, fmt);
 	fprintf(stderr, "UltraVNC> ");
 	vfprintf(stderr, fmt, args);
@@ -138,435 +165,878 @@ void report_bytes(char *prefix, char *buf, int len)
 
 /*****************************************************************************
  *
- * Helpers / Misc.
+ * Threads
  *
  *****************************************************************************/
 
-int ParseDisplay(char *display, char *phost, int hostlen, int *pport, unsigned char *challengedid) 
+/*
+ * Reset a connection over AcceptRate before anything is spent on it.
+ * Returns 0 if it may go on.
+ */
+static int
+accept_limit(accept_limiter * limiter, SOCKET connection, struct sockaddr * client, const char * who)
 {
-	unsigned char challenge[CHALLENGESIZE];
-	char tmp_id[MAX_HOST_NAME_LEN + 1];
-	char *colonpos = strchr(display, ':');
-	int tmp_code;
-
-	if( hostlen < (int)strlen(display) ) return FALSE;
-
-	if( colonpos == NULL ) return FALSE;
-
-	strncpy(phost, display, colonpos - display);
-	phost[colonpos - display]  = '\0';
-
-	memset(&tmp_id, 0, sizeof(tmp_id));
-	if( sscanf(colonpos + 1, "%d", &tmp_code) != 1 ) return FALSE;
-	if( sscanf(colonpos + 1, "%s", (char *)&tmp_id) != 1 ) return FALSE;
-
-	// encrypt
-	memcpy(&challenge, challenge_key, CHALLENGESIZE);
-	vncEncryptBytes(challenge, tmp_id);
+	const repeater_config * config;
+	struct in_addr addr;
+	unsigned int refused;
+
+	config = ConfigGet();
+	addr = ((struct sockaddr_in *)client)->sin_addr;
+	if( LimiterAllow( limiter, addr.s_addr, config->accept_rate, config->accept_burst, ShaperNow(), &refused ) ) {
+		if( refused > 0 )
+			debug("%u %s connections from %s were refused.\n", refused, who, inet_ntoa( addr ));
+		return 0;
+	}
 
-	memcpy((unsigned char *)challengedid, challenge, CHALLENGESIZE);
-	*pport = tmp_code;
-	return TRUE;
+	/* Once per burst, the log is not to be flooded either */
+	if( refused == 1 )
+		debug("Too many %s connections from %s, refusing them for now.\n", who, inet_ntoa( addr ));
+	socket_reset( connection );
+	return -1;
 }
 
+/*
+ * Both ends are in the slot, mutex_slots held. A session that fails to
+ * start (workers queue full, out of descriptors or memory) only costs its
+ * own slot: both ends are closed, the other sessions go on.
+ */
+static void
+start_session(repeaterslot * slot)
+{
+	if( RelayStart( slot ) != 0 ) {
+		error("Unable to start the session for ID %lu, closing it.\n", slot->code);
+		FreeSlot( slot );
+	}
+}
 
-/*****************************************************************************
- *
- * Threads
- *
- *****************************************************************************/
+/*
+ * AddSlot() for a handshake, mutex_slots held. A handshake still running
+ * once the listeners have stopped gets no slot: the waiting slots are
+ * being handed over or freed, one added now could never pair.
+ */
+static repeaterslot *
+handshake_slot(repeaterslot * slot)
+{
+	if( slots_closed ) {
+		debug("Handshake over after the listeners stopped, connection closed.\n");
+		return NULL;
+	}
+	return AddSlot( slot );
+}
 
-THREAD_CALL 
-do_repeater(LPVOID lpParam)
+/*
+ * The server handshake, up to its slot, on a handshake thread.
+ */
+static void
+server_handshake(SOCKET connection)
 {
-	/** vars for viewer input data **/
-	char viewerbuf[1024];        /* viewer input buffer */
-	unsigned int viewerbuf_len;  /* available data in viewerbuf */
-	int f_viewer;                /* read viewer input more? */ 
-
-	/** vars for server input data **/
-	char serverbuf[1024];        /* server input buffer */
-	unsigned int serverbuf_len;  /* available data in serverbuf */
-	int f_server;                /* read server input more? */
-
-	/** other variables **/
-	int nfds, len;
-	fd_set ifds;
-	fd_set ofds; 
-	CARD8 client_init;
+	rfbProtocolVersionMsg protocol_version; 
+	char host_id[MAX_HOST_NAME_LEN + 1];
+	char phost[MAX_HOST_NAME_LEN + 1];
+	socket_buffer input;
+	socket_chunk reply[1];
+	CARD32 auth_type;
+	unsigned char challenge[CHALLENGESIZE];
+	unsigned long code;
+	int id;
 	repeaterslot *slot;
-	struct timeval tm;
-	int selres;
-
-	slot = (repeaterslot *)lpParam;
-	
-	viewerbuf_len = 0;
-	serverbuf_len = 0;
+	repeaterslot *current;
 
-	// Timeout
-	tm.tv_sec= 0;
-	tm.tv_usec = 50;
+	/* TLS first, the kernel carries it from there on */
+	if( ConfigGet()->server_tls && ( TlsAccept( connection, HANDSHAKE_TIMEOUT ) != 0 ) ) {
+		socket_close( connection );
+		return;
+	}
 
-	debug("do_reapeater(): Starting repeater for ID %lu.\n", slot->code);
+	// First thing is first: Get the repeater ID...
+	// The protocol version follows right away, it usually comes along.
+	socket_buffer_init( &input, connection );
+	if( socket_buffer_read( &input, host_id, MAX_HOST_NAME_LEN, sz_rfbProtocolVersionMsg, HANDSHAKE_TIMEOUT ) < 0 ) {
+		if( ( errno == ECONNRESET )  || ( errno == ENOTCONN ) ) {
+#ifndef _DEBUG
+			debug("Connection closed by server.\n");
+#else
+			debug("Connection closed by server (socket=%d) while trying to read the host id.\n", connection);
+#endif
+		} else {
+#ifndef _DEBUG
+			debug("Reading host id from server return socket error %d.\n", errno);
+#else
+			debug("Reading host id from server (socket=%d) return socket error %d.\n", connection, errno);
+#endif
+		}
+		socket_close( connection ); 
+		return;
+	}
 
-	// Send ClientInit to the server to start repeating
-	client_init = 1;
-	if( WriteExact(slot->server, (char *)&client_init, 1) < 0 ) {
-		error("do_repeater(): Writting ClientInit error.\n");
-		f_viewer = 0;              /* no, don't read from viewer */
-		f_server = 0;              /* no, don't read from server */
-	} else {
-		/* repeater between stdin/out and socket  */
-		nfds = ((slot->viewer < slot->server) ? slot->server : slot->viewer) + 1;
+	// Check and cypher the ID
+	memset((char *)&challenge, 0, CHALLENGESIZE);
+	if( ParseDisplay(host_id, phost, MAX_HOST_NAME_LEN, &id, (unsigned char *)&challenge) == FALSE ) {
+		debug("server_handshake(): Reading Proxy settings error");
+		socket_close( connection ); 
+		return;
+	}
+	code = (unsigned long)id;
+#ifdef _DEBUG
+	debug("Server (socket=%d) sent the host ID:%lu.\n", connection, code );
+#endif
 
-		viewerbuf_len = 0;
-		serverbuf_len = 0;
+	// Continue with the handshake until ClientInit.
+	// Read the Protocol Version
+	if( socket_buffer_read( &input, protocol_version, sz_rfbProtocolVersionMsg, 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		if( ( errno == ECONNRESET )  || ( errno == ENOTCONN ) ) {
+#ifndef _DEBUG
+			debug("Connection closed by server.\n");
+#else
+			debug("Connection closed by server (socket=%d) while trying to read the protocol version.\n", connection);
+#endif
+		} else {
+#ifndef _DEBUG
+			debug("Reading protocol version from server return socket error %d.\n", errno);
+#else
+			debug("Reading protocol version from server (socket=%d) return socket error %d.\n", connection, errno);
+#endif
+		}
+		socket_close( connection );
+		return;
+	}
+#ifdef _DEBUG
+	else {
+		debug("Server (socket=%d) sent protocol version.\n", connection);
+	}
+#endif
+	// ToDo: Make sure the version is OK!
+
+	// Tell the server we are using Protocol Version 3.3
+	sprintf(protocol_version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
+	reply[0].data = protocol_version;
+	reply[0].len = sz_rfbProtocolVersionMsg;
+	if( socket_write_chunks( connection, reply, 1, HANDSHAKE_TIMEOUT ) < 0 ) {
+		if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
+#ifndef _DEBUG
+			debug("Connection closed by server.\n");
+#else
+			debug("Connection closed by server (socket=%d) while trying to write protocol version.\n", connection);
+#endif
+		} else {
+#ifndef _DEBUG
+			debug("Writting protocol version to server returned socket error %d.\n", errno);
+#else
+			debug("Writting protocol version to server (socket=%d) returned socket error %d.\n", connection, errno);
+#endif
+		}
+		socket_close(connection);
+		return;
+	} 
+#ifdef _DEBUG
+	else {
+		debug("Protocol version sent to server (socket=%d).\n", connection);
+	}
+#endif
 
-		f_viewer = 1;              /* yes, read from viewer */
-		f_server = 1;              /* yes, read from server */
+	// The server should send the authentication type it whises to use.
+	// ToDo: We could add a password this would restrict other servers from
+	//       connecting to our repeater, in the meanwhile, assume no auth
+	//       is the only scheme allowed.
+	if( socket_buffer_read( &input, (char *)&auth_type, sizeof(auth_type), 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		if( ( errno == ECONNRESET )  || ( errno == ENOTCONN ) ) {
+#ifndef _DEBUG
+			debug("Connection closed by server.\n");
+#else
+			debug("Connection closed by server (socket=%d) while trying to read the authentication scheme.\n", connection);
+#endif
+		} else {
+#ifndef _DEBUG
+			debug("Reading authentication scheme from server return socket error %d.\n", errno);
+#else
+			debug("Reading authentication scheme from server (socket=%d) return socket error %d.\n", connection, errno);
+#endif
+		}
+		socket_close( connection );
+		return;
 	}
+#ifdef _DEBUG
+	else {
+		debug("Server (socket=%d) sent authentication scheme.\n", connection);
+	}
+#endif
 
-	// Start the repeater loop.
-	while( f_viewer && f_server)
-	{
-		/* Bypass reading if there is still data to be sent in the buffers */
-		if( ( serverbuf_len == 0 ) && ( viewerbuf_len == 0 ) ) {
-			FD_ZERO( &ifds );
-			FD_ZERO( &ofds ); 
-
-			/** prepare for reading viewer input **/ 
-			if (f_viewer && (viewerbuf_len < sizeof(viewerbuf))) {
-				FD_SET(slot->viewer, &ifds);
-			} 
-
-			/** prepare for reading server input **/
-			if (f_server && (serverbuf_len < sizeof(serverbuf))) {
-				FD_SET(slot->server, &ifds);
-			} 
-
-			selres = select(nfds, &ifds, &ofds, NULL, &tm);
-			if( selres == -1 ) {
-				/* some error */
-				error("do_repeater(): select() failed, errno=%d\n", errno);
-				f_viewer = 0;              /* no, don't read from viewer */
-				f_server = 0;              /* no, don't read from server */
-				continue;
-			} else if( selres == 0 ) {
-				/*Timeout */
-				continue;
-			}
-		
+	auth_type = Swap32IfLE(auth_type);
+	if( auth_type != rfbNoAuth ) {
+#ifndef _DEBUG
+		debug("Invalid authentication scheme sent by server.\n");
+#else
+		debug("Invalid authentication scheme sent by server (socket=%d).\n", connection);
+#endif
+		socket_close( connection );
+		return;
+	}
 
-			/* server => viewer */ 
-			if (FD_ISSET(slot->server, &ifds) && (serverbuf_len < sizeof(serverbuf))) { 
-				len = recv(slot->server, serverbuf + serverbuf_len, sizeof(serverbuf) - serverbuf_len, 0); 
+	// Prepare the reapeaterinfo structure for the viewer
+	/* Initialize the slot */
+	slot = (repeaterslot *)malloc( sizeof(repeaterslot) );
+	memset(slot, 0, sizeof(repeaterslot));
+
+	slot->server = connection;
+	slot->viewer = INVALID_SOCKET;
+	slot->timestamp = (unsigned long)time(NULL);
+	memcpy(slot->challenge, challenge, CHALLENGESIZE);
+	slot->code = code;
+	slot->next = NULL;
+	
+	/* Keep the slot stable until the session owns it */
+	LockSlots("server_handshake()");
+	current = handshake_slot( slot );
+	if( current == NULL ) {
+		UnlockSlots("server_handshake()");
+		free( slot );
+		socket_close( connection );
+		return;
+	}
 
-				if (len == 0) { 
-					debug("do_repeater(): connection closed by server.\n");
-					f_server = 0;              /* no, don't read from server */
-					continue;
-				} else if ( len == -1 ) {
-					/* error on reading from stdin */
-#ifdef WIN32
-					errno = WSAGetLastError();
-#endif
-					error("Error reading from socket. Socket error = %d.\n", errno );
-					f_server = 0;              /* no, don't read from server */
-					continue;
-				} else {
-					/* repeat */
-					serverbuf_len += len; 
-				}
-			}
+	/* AddSlot() keeps its own copy unless the slot was inserted as is */
+	if( current != slot )
+		free( slot );
 
-			/* viewer => server */ 
-			if( FD_ISSET(slot->viewer, &ifds)  && (viewerbuf_len < sizeof(viewerbuf)) ) {
-				len = recv(slot->viewer, viewerbuf + viewerbuf_len, sizeof(viewerbuf) - viewerbuf_len, 0);
-
-				if (len == 0) { 
-					debug("do_repeater(): connection closed by viewer.\n");
-					// ToDo: Leave ready, but don't remove it...
-					f_viewer = 0;
-					continue;
-				} else if ( len == -1 ) {
-					/* error on reading from stdin */
-#ifdef WIN32
-					errno = WSAGetLastError();
+	if( ( current->viewer != INVALID_SOCKET ) && ( current->server != INVALID_SOCKET ) ) {
+		if( notstopped )
+			start_session( current );
+	} else {
+#ifndef _DEBUG
+		debug("Server waiting for viewer to connect...\n");
+#else
+		debug("Server (socket=%d) waiting for viewer to connect...\n", current->server);
 #endif
-					error("Error reading from socket. Socket error = %d.\n", errno );
-					f_viewer = 0;
-					continue;
-				} else {
-					/* repeat */
-					viewerbuf_len += len; 
-				}
-			}
-		}
+	}
+	UnlockSlots("server_handshake()");
+}
 
-		/* flush data in viewerbuffer to server */ 
-		if( 0 < viewerbuf_len ) { 
-			
-			len = send(slot->server, viewerbuf, viewerbuf_len, 0); 
-			if( len == -1 ) {
-#ifdef WIN32
-				errno = WSAGetLastError();
-#endif
-				if( errno != EWOULDBLOCK ) {
-					debug("do_repeater(): send() failed, viewer to server. Socket error = %d\n", errno);
-					f_server = 0;
-				}
-				continue;
-			} else if ( 0 < len ) {
-				/* move data on to top of buffer */ 
-				viewerbuf_len -= len;
 
-				if( 0 < viewerbuf_len ) 
-					memcpy(viewerbuf, viewerbuf + len, viewerbuf_len);
 
-				assert(0 <= viewerbuf_len); 
-			}
-		}
+/*
+ * A viewer through with its handshake: pair it with its server, or let it
+ * wait for one. connection belongs to the slot, or is closed.
+ */
+static void
+viewer_slot(SOCKET connection, unsigned char * challenge)
+{
+	repeaterslot *slot;
+	repeaterslot *current;
 
-		/* flush data in serverbuffer to viewer */
-		if( 0 < serverbuf_len ) { 
-			len = send(slot->viewer, serverbuf, serverbuf_len, 0);
+	// Prepare the reapeaterinfo structure for the viewer
+	slot = (repeaterslot *)malloc( sizeof(repeaterslot) );
+	memset(slot, 0, sizeof(repeaterslot));
 
-			if( len == -1 ) {
-#ifdef WIN32
-				errno = WSAGetLastError();
-#endif
-				if( errno != EWOULDBLOCK ) {
-					debug("do_repeater(): send() failed, server to viewer. Socket error = %d\n", errno);
-					f_viewer = 0;
-				}
-				continue;
-			} else if ( 0 < len ) {
-				/* move data on to top of buffer */ 
-				serverbuf_len -= len;
+	slot->server = INVALID_SOCKET;
+	slot->viewer = connection;
+	slot->timestamp = (unsigned long)time(NULL);
+	memcpy(slot->challenge, challenge, CHALLENGESIZE);
+	slot->next = NULL;
+	
+	/* Keep the slot stable until the session owns it */
+	LockSlots("viewer_slot()");
+	current = handshake_slot( slot );
+	if( current == NULL ) {
+		UnlockSlots("viewer_slot()");
+		free( slot );
+		socket_close( connection );
+		return;
+	}
 
-				if( len < (int)serverbuf_len )
-					memcpy(serverbuf, serverbuf + len, serverbuf_len);
+	/* AddSlot() keeps its own copy unless the slot was inserted as is */
+	if( current != slot )
+		free( slot );
 
-				assert(0 <= serverbuf_len); 
-			}
+	if( current->relay != NULL ) {
+		/* The server is already relayed: watch it as well */
+		if( RelayAttachViewer( current->relay, connection ) != 0 ) {
+			if( current->viewer == connection )
+				current->viewer = INVALID_SOCKET;
+			socket_close( connection );
 		}
+	} else if( ( current->server != INVALID_SOCKET ) && ( current->viewer != INVALID_SOCKET ) ) {
+		if( notstopped )
+			start_session( current );
+	} else {
+#ifndef _DEBUG
+		debug("Viewer waiting for server to connect...\n");
+#else
+		debug("Viewer (socket=%d) waiting for server to connect...\n", current->viewer);
+#endif
 	}
-
-	/** When the thread exits **/
-	FreeSlot( slot );
-	debug("Repeater thread closed.\n");
-	return 0;
+	UnlockSlots("viewer_slot()");
 }
 
 
 
-THREAD_CALL
-server_listen(LPVOID lpParam)
+/*
+ * The viewer handshake, up to its slot, on a handshake thread.
+ */
+static void
+viewer_handshake(SOCKET connection)
 {
-	listener_thread_params *thread_params;
-	SOCKET connection;
-	struct sockaddr client;
-	socklen_t socklen;
 	rfbProtocolVersionMsg protocol_version; 
-	char host_id[MAX_HOST_NAME_LEN + 1];
-	char phost[MAX_HOST_NAME_LEN + 1];
 	CARD32 auth_type;
+	CARD32 auth_response;
+	CARD8 client_init;
+	socket_buffer input;
+	socket_chunk reply[2];
 	unsigned char challenge[CHALLENGESIZE];
-	unsigned long code;
-	repeaterslot *slot;
-	repeaterslot *current;
-	char * ip_addr;
-	thread_t repeater_thread; 
 
-	thread_params = (listener_thread_params *)lpParam;
-	thread_params->sock = CreateListenerSocket( thread_params->port );
-	if ( thread_params->sock == INVALID_SOCKET ) {
-		notstopped = FALSE;
-	} else {
-		debug("Listening for incoming server connections on port %d.\n", thread_params->port);
-		socklen = sizeof(client);
+	if( ConfigGet()->viewer_tls && ( TlsAccept( connection, HANDSHAKE_TIMEOUT ) != 0 ) ) {
+		socket_close( connection );
+		return;
 	}
 
-	while( notstopped )
-	{
-		connection = socket_accept(thread_params->sock, &client, &socklen);
-		if( connection == INVALID_SOCKET ) {
-			if( notstopped )
-				debug("server_listen(): accept() failed, errno=%d\n", errno);
-			else
-				break;
+	// Act like a server until the authentication phase is over.
+	// Send the protocol version.
+	sprintf(protocol_version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
+	reply[0].data = protocol_version;
+	reply[0].len = sz_rfbProtocolVersionMsg;
+	if( socket_write_chunks( connection, reply, 1, HANDSHAKE_TIMEOUT ) < 0 ) {
+		if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
+#ifndef _DEBUG
+			debug("Connection closed by viewer.\n");
+#else
+			debug("Connection closed by viewer (socket=%d) while trying to write protocol version.\n", connection);
+#endif
 		} else {
-			/* IP Address for monitoring purposes */
-			ip_addr = inet_ntoa( ((struct sockaddr_in *)&client)->sin_addr );
 #ifndef _DEBUG
-			debug("Server connection accepted from %s.\n", ip_addr);
+			debug("Writting protocol version to viewer returned socket error %d.\n", errno);
 #else
-			debug("Server (socket=%d) connection accepted from %s.\n", connection, ip_addr);
+			debug("Writting protocol version to viewer (socket=%d) returned socket error %d.\n", connection, errno);
+#endif
+		}
+		socket_close( connection );
+		return;
+	}
+#ifdef _DEBUG
+	else {
+		debug("Protocol version sent to viewer (socket=%d).\n", connection);
+	}
 #endif
 
-			// First thing is first: Get the repeater ID...
-			if( socket_read_exact(connection, host_id, MAX_HOST_NAME_LEN) < 0 ) {
-				if( ( errno == ECONNRESET )  || ( errno == ENOTCONN ) ) {
+
+	// Read the protocol version the client suggests (Must be 3.3)
+	socket_buffer_init( &input, connection );
+	if( socket_buffer_read( &input, protocol_version, sz_rfbProtocolVersionMsg, 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
 #ifndef _DEBUG
-					debug("Connection closed by server.\n");
+			debug("Connection closed by viewer.\n");
 #else
-					debug("Connection closed by server (socket=%d) while trying to read the host id.\n", connection);
+			debug("Connection closed by viewer (socket=%d) while trying to read protocol version.\n", connection);
 #endif
-				} else {
+		} else {
 #ifndef _DEBUG
-					debug("Reading host id from server return socket error %d.\n", errno);
+			debug("Reading protocol version from viewer returned socket error %d.\n", errno);
 #else
-					debug("Reading host id from server (socket=%d) return socket error %d.\n", connection, errno);
+			debug("Reading protocol version from viewer (socket=%d) returned socket error %d.\n", connection, errno);
 #endif
-				}
-				socket_close( connection ); 
-				continue;
-			}
-
-			// Check and cypher the ID
-			memset((char *)&challenge, 0, CHALLENGESIZE);
-			if( ParseDisplay(host_id, phost, MAX_HOST_NAME_LEN, (int *)&code, (unsigned char *)&challenge) == FALSE ) {
-				debug("server_listen(): Reading Proxy settings error");
-				socket_close( connection ); 
-				continue;
-			}
+		}
+		socket_close( connection );
+		return;
+	}
 #ifdef _DEBUG
-			else {
-				debug("Server (socket=%d) sent the host ID:%lu.\n", connection, code );
-			}
+	else {
+		debug("Viewer (socket=%d) sent protocol version.\n", connection);
+	}
 #endif
 
-			// Continue with the handshake until ClientInit.
-			// Read the Protocol Version
-			if( socket_read_exact(connection, protocol_version, sz_rfbProtocolVersionMsg) < 0 ) {
-				if( ( errno == ECONNRESET )  || ( errno == ENOTCONN ) ) {
+	// Send Authentication Type (VNC Authentication to keep it standard)
+	// along with the 16 bytes challenge key, in a single segment.
+	// In order for this to work the challenge must be always the same.
+	auth_type = Swap32IfLE(rfbVncAuth);
+	reply[0].data = (char *)&auth_type;
+	reply[0].len = sizeof(auth_type);
+	reply[1].data = (char *)&challenge_key;
+	reply[1].len = CHALLENGESIZE;
+	if( socket_write_chunks( connection, reply, 2, HANDSHAKE_TIMEOUT ) < 0 ) {
+		if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
 #ifndef _DEBUG
-					debug("Connection closed by server.\n");
+			debug("Connection closed by viewer.\n");
 #else
-					debug("Connection closed by server (socket=%d) while trying to read the protocol version.\n", connection);
+			debug("Connection closed by viewer (socket=%d) while trying to write authentication scheme and challenge key.\n", connection);
 #endif
-				} else {
+		} else {
 #ifndef _DEBUG
-					debug("Reading protocol version from server return socket error %d.\n", errno);
+			debug("Writting authentication scheme and challenge key to viewer returned socket error %d.\n", errno);
 #else
-					debug("Reading protocol version from server (socket=%d) return socket error %d.\n", connection, errno);
+			debug("Writting authentication scheme and challenge key to viewer (socket=%d) returned socket error %d.\n", connection, errno);
 #endif
-				}
-				socket_close( connection );
-				continue;
-			}
+		}
+		socket_close( connection );
+		return;
+	}
 #ifdef _DEBUG
-			else {
-				debug("Server (socket=%d) sent protocol version.\n", connection);
-			}
+	else {
+		debug("Authentication scheme and challenge sent to viewer (socket=%d).\n", connection );
+	}
 #endif
-			// ToDo: Make sure the version is OK!
 
-			// Tell the server we are using Protocol Version 3.3
-			sprintf(protocol_version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
-			if( socket_write_exact(connection, protocol_version, sz_rfbProtocolVersionMsg) < 0 ) {
-				if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
+	// Read the password.
+	// It will be treated as the repeater IDentifier.
+	memset(&challenge, 0, CHALLENGESIZE);
+	if( socket_buffer_read( &input, (char *)&challenge, CHALLENGESIZE, 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		if( ( errno == ECONNRESET )  || ( errno == ENOTCONN ) ) {
 #ifndef _DEBUG
-					debug("Connection closed by server.\n");
+			debug("Connection closed by viewer.\n");
 #else
-					debug("Connection closed by server (socket=%d) while trying to write protocol version.\n", connection);
+			debug("Connection closed by viewer (socket=%d) while trying to read challenge response.\n", connection);
 #endif
-				} else {
+		} else {
 #ifndef _DEBUG
-					debug("Writting protocol version to server returned socket error %d.\n", errno);
+			debug("Reading challenge response from viewer return socket error %d.\n", errno);
 #else
-					debug("Writting protocol version to server (socket=%d) returned socket error %d.\n", connection, errno);
+			debug("Reading challenge response from viewer (socket=%d) return socket error %d.\n", connection, errno);
 #endif
-				}
-				socket_close(connection);
-				continue;
-			} 
+		}
+		socket_close( connection );
+		return;
+	}
 #ifdef _DEBUG
-			else {
-				debug("Protocol version sent to server (socket=%d).\n", connection);
-			}
+	else {
+		debug("Viewer (socket=%d) sent challenge response.\n", connection);
+	}
 #endif
 
-			// The server should send the authentication type it whises to use.
-			// ToDo: We could add a password this would restrict other servers from
-			//       connecting to our repeater, in the meanwhile, assume no auth
-			//       is the only scheme allowed.
-			if( socket_read_exact(connection, (char *)&auth_type, sizeof(auth_type)) < 0 ) {
-				if( ( errno == ECONNRESET )  || ( errno == ENOTCONN ) ) {
+	// Send Authentication response
+	auth_response = Swap32IfLE(rfbVncAuthOK);
+	reply[0].data = (char *)&auth_response;
+	reply[0].len = sizeof(auth_response);
+	if( socket_write_chunks( connection, reply, 1, HANDSHAKE_TIMEOUT ) < 0 ) {
+		if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
 #ifndef _DEBUG
-					debug("Connection closed by server.\n");
+			debug("Connection closed by viewer.\n");
 #else
-					debug("Connection closed by server (socket=%d) while trying to read the authentication scheme.\n", connection);
+			debug("Connection closed by viewer (socket=%d) while trying to write authentication response.\n", connection);
 #endif
-				} else {
+		} else {
 #ifndef _DEBUG
-					debug("Reading authentication scheme from server return socket error %d.\n", errno);
+			debug("Writting authentication response to viewer returned socket error %d.\n", errno);
 #else
-					debug("Reading authentication scheme from server (socket=%d) return socket error %d.\n", connection, errno);
+			debug("Writting authentication response to viewer (socket=%d) returned socket error %d.\n", connection, errno);
 #endif
-				}
-				socket_close( connection );
-				continue;
-			}
+		}
+		socket_close( connection );
+		return;
+	}
 #ifdef _DEBUG
-			else {
-				debug("Server (socket=%d) sent authentication scheme.\n", connection);
-			}
+	else {
+		debug("Authentication response sent to viewer (socket=%d).\n", connection);
+	}
 #endif
 
-			auth_type = Swap32IfLE(auth_type);
-			if( auth_type != rfbNoAuth ) {
+	// Retrieve ClientInit and save it inside the structure.
+	if( socket_buffer_read( &input, (char *)&client_init, sizeof(client_init), 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		if( ( errno == ECONNRESET )  || ( errno == ENOTCONN ) ) {
+#ifndef _DEBUG
+			debug("Connection closed by viewer.\n");
+#else
+			debug("Connection closed by viewer (socket=%d) while trying to read ClientInit.\n", connection);
+#endif
+		} else {
 #ifndef _DEBUG
-				debug("Invalid authentication scheme sent by server.\n");
+			debug("Reading ClientInit from viewer return socket error %d.\n", errno);
 #else
-				debug("Invalid authentication scheme sent by server (socket=%d).\n", connection);
+			debug("Reading ClientInit from viewer (socket=%d) return socket error %d.\n", connection, errno);
+#endif
+		}
+		socket_close( connection );
+		return;
+	} 
+#ifdef _DEBUG
+	else {
+		debug("Viewer (socket=%d) sent ClientInit message.\n", connection);
+	}
 #endif
-				socket_close( connection );
+
+	viewer_slot( connection, challenge );
+}
+
+
+
+/* A Mode I handshake went wrong at step: drop both ends */
+static void
+modei_failed(const char * step, SOCKET viewer, SOCKET server)
+{
+	if( ( errno == ECONNRESET ) || ( errno == ENOTCONN ) )
+		debug("Mode I: connection closed while %s.\n", step);
+	else
+		debug("Mode I: %s failed, errno=%d.\n", step, errno);
+	socket_close( viewer );
+	if( server != INVALID_SOCKET )
+		socket_close( server );
+}
+
+/* ModeIAllow: whether the viewers may connect to addr */
+static int
+modei_allowed(const struct sockaddr_in * addr)
+{
+	const repeater_config * config;
+	unsigned long address;
+	unsigned int port;
+	unsigned int i;
+
+	config = ConfigGet();
+	address = ntohl( addr->sin_addr.s_addr );
+	port = ntohs( addr->sin_port );
+	for( i = 0; i < config->modei_allow_count; i++ ) {
+		if( ( ( address & config->modei_allow[i].mask ) == config->modei_allow[i].address )
+			&& ( port >= config->modei_allow[i].port_first ) && ( port <= config->modei_allow[i].port_last ) )
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * A handshake thread taking on a Mode I connect. They may wait on DNS and
+ * on connect() for long, ModeIConnects keeps the other handshakes enough
+ * threads. Returns -1 when that many are under way already.
+ */
+static int
+modei_enter( void )
+{
+	unsigned int limit;
+	int result;
+
+	limit = ConfigGet()->modei_connects;
+	LockSlots("modei_enter()");
+	result = ( ( limit > 0 ) && ( modei_connecting >= limit ) ) ? -1 : 0;
+	if( result == 0 )
+		modei_connecting++;
+	UnlockSlots("modei_enter()");
+	return result;
+}
+
+static void
+modei_leave( void )
+{
+	LockSlots("modei_leave()");
+	modei_connecting--;
+	UnlockSlots("modei_leave()");
+}
+
+/*
+ * Connect the viewer to the server at host:port, as the UltraVNC repeater
+ * does in Mode I. The repeater speaks protocol 3.3 to both and passes the
+ * server's authentication through, so the viewer answers the server's own
+ * challenge.
+ */
+static void
+modei_connect(SOCKET connection, socket_buffer * input, char * request)
+{
+	rfbProtocolVersionMsg protocol_version;
+	char host[MAX_HOST_NAME_LEN + 1];
+	unsigned char challenge[CHALLENGESIZE];
+	struct sockaddr_in addr;
+	socket_buffer server_input;
+	socket_chunk reply[2];
+	CARD32 auth_type;
+	CARD32 auth_result;
+	CARD8 client_init;
+	SOCKET server;
+	repeaterslot *slot;
+	repeaterslot *current;
+	int port;
+
+	/* Ports under 100 are display numbers */
+	if( ParseDisplay( request, host, MAX_HOST_NAME_LEN, &port, challenge ) == FALSE ) {
+		debug("Mode I: invalid request from the viewer.\n");
+		socket_close( connection );
+		return;
+	}
+	if( port < 100 )
+		port += 5900;
+	if( ( host[0] == '\0' ) || ( port <= 0 ) || ( port > 65535 ) ) {
+		debug("Mode I: invalid server %s:%d.\n", host, port);
+		socket_close( connection );
+		return;
+	}
+	/* Nothing allowed, not even a lookup */
+	if( ConfigGet()->modei_allow_count == 0 ) {
+		debug("Mode I: %s:%d refused, ModeIAllow is not set.\n", host, port);
+		socket_close( connection );
+		return;
+	}
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( (u_short)port );
+	if( ResolverLookup( host, &addr.sin_addr ) != 0 ) {
+		debug("Mode I: %s does not resolve.\n", host);
+		socket_close( connection );
+		return;
+	}
+	/* The address the name resolved to is the one checked */
+	if( !modei_allowed( &addr ) ) {
+		debug("Mode I: %s:%d (%s) is not in ModeIAllow.\n", host, port, inet_ntoa( addr.sin_addr ));
+		socket_close( connection );
+		return;
+	}
+	server = socket_connect( &addr, HANDSHAKE_TIMEOUT );
+	if( server == INVALID_SOCKET ) {
+		debug("Mode I: can't connect to %s:%d, errno=%d.\n", host, port, errno);
+		socket_close( connection );
+		return;
+	}
+	debug("Mode I: connected to %s:%d.\n", host, port);
+
+	/* The server first, up to the authentication it asks for */
+	socket_buffer_init( &server_input, server );
+	if( socket_buffer_read( &server_input, protocol_version, sz_rfbProtocolVersionMsg, 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "reading the server protocol version", connection, server );
+		return;
+	}
+	sprintf(protocol_version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
+	reply[0].data = protocol_version;
+	reply[0].len = sz_rfbProtocolVersionMsg;
+	if( socket_write_chunks( server, reply, 1, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "writing the server protocol version", connection, server );
+		return;
+	}
+	if( socket_buffer_read( &server_input, (char *)&auth_type, sizeof(auth_type), 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "reading the server authentication scheme", connection, server );
+		return;
+	}
+	if( ( Swap32IfLE(auth_type) != rfbNoAuth ) && ( Swap32IfLE(auth_type) != rfbVncAuth ) ) {
+		debug("Mode I: %s:%d refused the connection or asks for an unknown authentication.\n", host, port);
+		socket_close( connection );
+		socket_close( server );
+		return;
+	}
+	if( Swap32IfLE(auth_type) == rfbVncAuth ) {
+		if( socket_buffer_read( &server_input, (char *)challenge, CHALLENGESIZE, 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+			modei_failed( "reading the server challenge", connection, server );
+			return;
+		}
+	}
+
+	/* Then the viewer, which already had the repeater's greeting */
+	if( socket_write_chunks( connection, reply, 1, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "writing the viewer protocol version", connection, server );
+		return;
+	}
+	if( socket_buffer_read( input, protocol_version, sz_rfbProtocolVersionMsg, 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "reading the viewer protocol version", connection, server );
+		return;
+	}
+	reply[0].data = (char *)&auth_type;
+	reply[0].len = sizeof(auth_type);
+	reply[1].data = (char *)challenge;
+	reply[1].len = CHALLENGESIZE;
+	if( socket_write_chunks( connection, reply, ( Swap32IfLE(auth_type) == rfbVncAuth ) ? 2 : 1, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "writing the viewer authentication scheme", connection, server );
+		return;
+	}
+
+	if( Swap32IfLE(auth_type) == rfbVncAuth ) {
+		if( socket_buffer_read( input, (char *)challenge, CHALLENGESIZE, 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+			modei_failed( "reading the viewer challenge response", connection, server );
+			return;
+		}
+		reply[0].data = (char *)challenge;
+		reply[0].len = CHALLENGESIZE;
+		if( socket_write_chunks( server, reply, 1, HANDSHAKE_TIMEOUT ) < 0 ) {
+			modei_failed( "writing the server challenge response", connection, server );
+			return;
+		}
+		if( socket_buffer_read( &server_input, (char *)&auth_result, sizeof(auth_result), 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+			modei_failed( "reading the server authentication result", connection, server );
+			return;
+		}
+		reply[0].data = (char *)&auth_result;
+		reply[0].len = sizeof(auth_result);
+		socket_write_chunks( connection, reply, 1, HANDSHAKE_TIMEOUT );
+		if( Swap32IfLE(auth_result) != rfbVncAuthOK ) {
+			debug("Mode I: the viewer failed to authenticate with %s:%d.\n", host, port);
+			socket_close( connection );
+			socket_close( server );
+			return;
+		}
+	}
+
+	/* The relay sends its own ClientInit to the server */
+	if( socket_buffer_read( input, (char *)&client_init, sizeof(client_init), 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "reading ClientInit", connection, server );
+		return;
+	}
+
+	slot = (repeaterslot *)malloc( sizeof(repeaterslot) );
+	memset(slot, 0, sizeof(repeaterslot));
+	slot->server = server;
+	slot->viewer = connection;
+	slot->timestamp = (unsigned long)time(NULL);
+	slot->code = 0;
+	slot->modei = 1;
+	slot->next = NULL;
+
+	LockSlots("modei_connect()");
+	current = handshake_slot( slot );
+	if( current == NULL ) {
+		UnlockSlots("modei_connect()");
+		free( slot );
+		socket_close( connection );
+		socket_close( server );
+		return;
+	}
+	if( current != slot )
+		free( slot );
+	if( notstopped )
+		start_session( current );
+	UnlockSlots("modei_connect()");
+}
+
+/*
+ * A viewer on the Mode I port: the UltraVNC repeater protocol, where the
+ * repeater greets with version 0.0 and the viewer answers with 250 bytes
+ * naming either "ID:n", to pair with a server as on the viewer port, or
+ * the "host:port" of the server to connect to.
+ */
+static void
+modei_handshake(SOCKET connection)
+{
+	rfbProtocolVersionMsg protocol_version;
+	char request[MAX_HOST_NAME_LEN + 1];
+	char phost[MAX_HOST_NAME_LEN + 1];
+	unsigned char challenge[CHALLENGESIZE];
+	socket_buffer input;
+	socket_chunk reply[1];
+	CARD32 auth_type;
+	CARD8 client_init;
+	int id;
+
+	if( ConfigGet()->viewer_tls && ( TlsAccept( connection, HANDSHAKE_TIMEOUT ) != 0 ) ) {
+		socket_close( connection );
+		return;
+	}
+
+	sprintf(protocol_version, rfbProtocolVersionFormat, 0, 0);
+	reply[0].data = protocol_version;
+	reply[0].len = sz_rfbProtocolVersionMsg;
+	if( socket_write_chunks( connection, reply, 1, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "writing the repeater greeting", connection, INVALID_SOCKET );
+		return;
+	}
+
+	socket_buffer_init( &input, connection );
+	if( socket_buffer_read( &input, request, MAX_HOST_NAME_LEN, 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "reading the viewer request", connection, INVALID_SOCKET );
+		return;
+	}
+	request[MAX_HOST_NAME_LEN] = '\0';
+
+	if( strncmp( request, "ID:", 3 ) != 0 ) {
+		if( modei_enter() != 0 ) {
+			debug("Mode I: %u servers being connected to already, request refused.\n", ConfigGet()->modei_connects);
+			socket_close( connection );
+			return;
+		}
+		modei_connect( connection, &input, request );
+		modei_leave();
+		return;
+	}
+
+	/* The ID is known already: act as a server without authentication */
+	memset( challenge, 0, CHALLENGESIZE );
+	if( ParseDisplay( request, phost, MAX_HOST_NAME_LEN, &id, challenge ) == FALSE ) {
+		debug("Mode I: invalid ID from the viewer.\n");
+		socket_close( connection );
+		return;
+	}
+	sprintf(protocol_version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
+	if( socket_write_chunks( connection, reply, 1, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "writing the viewer protocol version", connection, INVALID_SOCKET );
+		return;
+	}
+	if( socket_buffer_read( &input, protocol_version, sz_rfbProtocolVersionMsg, 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "reading the viewer protocol version", connection, INVALID_SOCKET );
+		return;
+	}
+	auth_type = Swap32IfLE(rfbNoAuth);
+	reply[0].data = (char *)&auth_type;
+	reply[0].len = sizeof(auth_type);
+	if( socket_write_chunks( connection, reply, 1, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "writing the viewer authentication scheme", connection, INVALID_SOCKET );
+		return;
+	}
+	if( socket_buffer_read( &input, (char *)&client_init, sizeof(client_init), 0, HANDSHAKE_TIMEOUT ) < 0 ) {
+		modei_failed( "reading ClientInit", connection, INVALID_SOCKET );
+		return;
+	}
+
+	viewer_slot( connection, challenge );
+}
+
+
+
+THREAD_CALL
+server_listen(LPVOID lpParam)
+{
+	listener_thread_params *thread_params;
+	SOCKET connection;
+	struct sockaddr client;
+	socklen_t socklen;
+	char * ip_addr;
+	int ready;
+
+	thread_params = (listener_thread_params *)lpParam;
+	/* Handed over by the repeater this one took over, or a new one */
+	if( thread_params->sock == INVALID_SOCKET )
+		thread_params->sock = CreateListenerSocket( thread_params->port );
+	if ( thread_params->sock == INVALID_SOCKET ) {
+		notstopped = FALSE;
+	} else {
+		debug("Listening for incoming server connections on port %d.\n", thread_params->port);
+		/* Servers speak first, viewers wait for the repeater */
+		socket_listener_options( thread_params->sock, ConfigGet()->defer_accept, ConfigGet()->fast_open );
+		socklen = sizeof(client);
+	}
+
+	while( notstopped )
+	{
+		/* Overloaded: the connections wait in the backlog meanwhile */
+		if( AdmissionPaused() ) {
+			ready = socket_wait_timeout( thread_params->wake, ADMISSION_POLL );
+			if( ready == 0 )
 				continue;
+			if( ready < 0 ) {
+				error("server_listen(): poll() failed, errno=%d\n", errno);
+				notstopped = FALSE;
+			}
+			break;
+		}
+
+		/* Woken up to stop, the socket stays open */
+		ready = socket_wait( thread_params->sock, thread_params->wake );
+		if( ready <= 0 ) {
+			if( ready < 0 ) {
+				error("server_listen(): poll() failed, errno=%d\n", errno);
+				notstopped = FALSE;
 			}
+			break;
+		}
 
-			// Screws LINUX!
-			// shutdown(thread_params->sock, 2);
-
-			// Prepare the reapeaterinfo structure for the viewer
-			/* Initialize the slot */
-			slot = (repeaterslot *)malloc( sizeof(repeaterslot) );
-			memset(slot, 0, sizeof(repeaterslot));
-
-			slot->server = connection;
-			slot->viewer = INVALID_SOCKET;
-			slot->timestamp = (unsigned long)time(NULL);
-			memcpy(slot->challenge, challenge, CHALLENGESIZE);
-			slot->code = code;
-			slot->next = NULL;
-			
-			current = AddSlot(slot);
-			if( current == NULL ) {
-				free( slot );
-				socket_close( connection );
-				continue;
-			} else if( ( current->viewer != INVALID_SOCKET ) && ( current->server != INVALID_SOCKET ) ) {
-				// Thread...
-				// ToDo: repeater_thread should be stored inside the slot in order to access it
-				if( notstopped ) {
-					if( thread_create(&repeater_thread, NULL, do_repeater, (LPVOID)current) != 0 ) {
-						fatal("Unable to create the repeater thread.\n");
-						notstopped = 0;
-					}
-				}
-			} else {
+		connection = socket_accept(thread_params->sock, &client, &socklen);
+		if( connection == INVALID_SOCKET ) {
+			if( notstopped ) {
+				debug("server_listen(): accept() failed, errno=%d\n", errno);
+				AdmissionAcceptFailed( errno );
+			} else
+				break;
+		} else if( accept_limit( &server_limiter, connection, &client, "server" ) == 0 ) {
+			/* IP Address for monitoring purposes */
+			ip_addr = inet_ntoa( ((struct sockaddr_in *)&client)->sin_addr );
 #ifndef _DEBUG
-				debug("Server waiting for viewer to connect...\n");
+			debug("Server connection accepted from %s.\n", ip_addr);
 #else
-				debug("Server (socket=%d) waiting for viewer to connect...\n", current->server);
+			debug("Server (socket=%d) connection accepted from %s.\n", connection, ip_addr);
 #endif
-			}
+
+			if( HandshakeSubmit( server_handshake, connection ) != 0 )
+				socket_reset( connection );
 		}
 	}
 
-	notstopped = FALSE;
-	shutdown( thread_params->sock, 2);
-	socket_close(thread_params->sock);
 #ifdef _DEBUG
 	debug("Server listening thread has exited.\n");
 #endif
@@ -582,35 +1052,55 @@ viewer_listen(LPVOID lpParam)
 	SOCKET connection;
 	struct sockaddr client;
 	socklen_t socklen;
-	rfbProtocolVersionMsg protocol_version; 
-	CARD32 auth_type;
-	CARD32 auth_response;
-	CARD8 client_init;
-	unsigned char challenge[CHALLENGESIZE];
-	repeaterslot *slot;
-	repeaterslot *current;
 	char * ip_addr;
-	thread_t repeater_thread; 
+	int ready;
 
 	thread_params = (listener_thread_params *)lpParam;
-	thread_params->sock = CreateListenerSocket( thread_params->port );
+	/* Handed over by the repeater this one took over, or a new one */
+	if( thread_params->sock == INVALID_SOCKET )
+		thread_params->sock = CreateListenerSocket( thread_params->port );
 	if ( thread_params->sock == INVALID_SOCKET ) {
 		notstopped = FALSE;
 	} else {
 		debug("Listening for incoming viewer connections on port %d.\n", thread_params->port);
+		/* Viewers wait for the repeater to speak first, accept() can't wait for them */
+		socket_listener_options( thread_params->sock, 0, ConfigGet()->fast_open );
 		socklen = sizeof(client);
 	}
 
 	// Main loop
 	while( notstopped )
 	{
+		/* Overloaded: the connections wait in the backlog meanwhile */
+		if( AdmissionPaused() ) {
+			ready = socket_wait_timeout( thread_params->wake, ADMISSION_POLL );
+			if( ready == 0 )
+				continue;
+			if( ready < 0 ) {
+				error("viewer_listen(): poll() failed, errno=%d\n", errno);
+				notstopped = FALSE;
+			}
+			break;
+		}
+
+		/* Woken up to stop, the socket stays open */
+		ready = socket_wait( thread_params->sock, thread_params->wake );
+		if( ready <= 0 ) {
+			if( ready < 0 ) {
+				error("viewer_listen(): poll() failed, errno=%d\n", errno);
+				notstopped = FALSE;
+			}
+			break;
+		}
+
 		connection = socket_accept(thread_params->sock, &client, &socklen);
 		if( connection == INVALID_SOCKET ) {
-			if( notstopped ) 
+			if( notstopped ) {
 				debug("viewer_listen(): accept() failed, errno=%d\n", errno);
-			else 
+				AdmissionAcceptFailed( errno );
+			} else
 				break;
-		} else {
+		} else if( accept_limit( &viewer_limiter, connection, &client, "viewer" ) == 0 ) {
 			/* IP Address for monitoring purposes */
 			ip_addr = inet_ntoa( ((struct sockaddr_in *)&client)->sin_addr );
 #ifndef _DEBUG
@@ -619,251 +1109,307 @@ viewer_listen(LPVOID lpParam)
 			debug("Viewer (socket=%d) connection accepted from %s.\n", connection, ip_addr);
 #endif
 
-			// Act like a server until the authentication phase is over.
-			// Send the protocol version.
-			sprintf(protocol_version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
-			if( socket_write_exact(connection, protocol_version, sz_rfbProtocolVersionMsg) < 0 ) {
-				if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
-#ifndef _DEBUG
-					debug("Connection closed by viewer.\n");
-#else
-					debug("Connection closed by viewer (socket=%d) while trying to write protocol version.\n", connection);
-#endif
-				} else {
-#ifndef _DEBUG
-					debug("Writting protocol version to viewer returned socket error %d.\n", errno);
-#else
-					debug("Writting protocol version to viewer (socket=%d) returned socket error %d.\n", connection, errno);
-#endif
-				}
-				socket_close( connection );
-				continue;
-			}
+			if( HandshakeSubmit( viewer_handshake, connection ) != 0 )
+				socket_reset( connection );
+		}
+	}
+
 #ifdef _DEBUG
-			else {
-				debug("Protocol version sent to viewer (socket=%d).\n", connection);
-			}
+	debug("Viewer listening thread has exited.\n");
 #endif
+	return 0;
+}
 
 
-			// Read the protocol version the client suggests (Must be 3.3)
-			if( socket_read_exact(connection, protocol_version, sz_rfbProtocolVersionMsg) < 0 ) {
-				if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
-#ifndef _DEBUG
-					debug("Connection closed by viewer.\n");
-#else
-					debug("Connection closed by viewer (socket=%d) while trying to read protocol version.\n", connection);
-#endif
-				} else {
-#ifndef _DEBUG
-					debug("Reading protocol version from viewer returned socket error %d.\n", errno);
-#else
-					debug("Reading protocol version from viewer (socket=%d) returned socket error %d.\n", connection, errno);
-#endif
-				}
-				socket_close( connection );
-				continue;
-			}
-#ifdef _DEBUG
-			else {
-				debug("Viewer (socket=%d) sent protocol version.\n", connection);
-			}
-#endif
 
-			// Send Authentication Type (VNC Authentication to keep it standard)
-			auth_type = Swap32IfLE(rfbVncAuth);
-			if( socket_write_exact(connection, (char *)&auth_type, sizeof(auth_type)) < 0 ) {
-				if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
-#ifndef _DEBUG
-					debug("Connection closed by viewer.\n");
-#else
-					debug("Connection closed by viewer (socket=%d) while trying to write authentication scheme.\n", connection);
-#endif
-				} else {
-#ifndef _DEBUG
-					debug("Writting authentication scheme to viewer returned socket error %d.\n", errno);
-#else
-					debug("Writting authentication scheme to viewer (socket=%d) returned socket error %d.\n", connection, errno);
-#endif
-				}
-				socket_close( connection );
-				continue;
-			}
-#ifdef _DEBUG
-			else {
-				debug("Authentication scheme sent to viewer (socket=%d).\n", connection);
-			}
-#endif
+THREAD_CALL
+modei_listen(LPVOID lpParam)
+{
+	listener_thread_params *thread_params;
+	SOCKET connection;
+	struct sockaddr client;
+	socklen_t socklen;
+	char * ip_addr;
+	int ready;
 
-			// We must send the 16 bytes challenge key.
-			// In order for this to work the challenge must be always the same.
-			if( socket_write_exact(connection, (char *)&challenge_key, CHALLENGESIZE) < 0 ) {
-				if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
-#ifndef _DEBUG
-					debug("Connection closed by viewer.\n");
-#else
-					debug("Connection closed by viewer (socket=%d) while trying to write challenge key.\n", connection);
-#endif
-				} else {
-#ifndef _DEBUG
-					debug("Writting challenge key to viewer returned socket error %d.\n", errno);
-#else
-					debug("Writting challenge key to viewer (socket=%d) returned socket error %d.\n", connection, errno);
-#endif
-				}
-				socket_close( connection );
-				continue;
-			}
-#ifdef _DEBUG
-			else {
-				debug("Challenge sent to viewer (socket=%d).\n", connection );
-			}
-#endif
+	thread_params = (listener_thread_params *)lpParam;
+	/* Handed over by the repeater this one took over, or a new one */
+	if( thread_params->sock == INVALID_SOCKET )
+		thread_params->sock = CreateListenerSocket( thread_params->port );
+	if ( thread_params->sock == INVALID_SOCKET ) {
+		notstopped = FALSE;
+	} else {
+		debug("Listening for incoming Mode I viewer connections on port %d.\n", thread_params->port);
+		/* Viewers wait for the repeater to speak first, accept() can't wait for them */
+		socket_listener_options( thread_params->sock, 0, ConfigGet()->fast_open );
+		socklen = sizeof(client);
+	}
 
-			// Read the password.
-			// It will be treated as the repeater IDentifier.
-			memset(&challenge, 0, CHALLENGESIZE);
-			if( socket_read_exact(connection, (char *)&challenge, CHALLENGESIZE) < 0 ) {
-				if( ( errno == ECONNRESET )  || ( errno == ENOTCONN ) ) {
-#ifndef _DEBUG
-					debug("Connection closed by viewer.\n");
-#else
-					debug("Connection closed by viewer (socket=%d) while trying to read challenge response.\n", connection);
-#endif
-				} else {
-#ifndef _DEBUG
-					debug("Reading challenge response from viewer return socket error %d.\n", errno);
-#else
-					debug("Reading challenge response from viewer (socket=%d) return socket error %d.\n", connection, errno);
-#endif
-				}
-				socket_close( connection );
+	// Main loop
+	while( notstopped )
+	{
+		/* Overloaded: the connections wait in the backlog meanwhile */
+		if( AdmissionPaused() ) {
+			ready = socket_wait_timeout( thread_params->wake, ADMISSION_POLL );
+			if( ready == 0 )
 				continue;
+			if( ready < 0 ) {
+				error("modei_listen(): poll() failed, errno=%d\n", errno);
+				notstopped = FALSE;
 			}
-#ifdef _DEBUG
-			else {
-				debug("Viewer (socket=%d) sent challenge response.\n", connection);
-			}
-#endif
+			break;
+		}
 
-			// Send Authentication response
-			auth_response = Swap32IfLE(rfbVncAuthOK);
-			if( socket_write_exact(connection, (char *)&auth_response, sizeof(auth_response)) < 0 ) {
-				if( ( errno == ECONNRESET  ) || ( errno == ENOTCONN ) ) {
-#ifndef _DEBUG
-					debug("Connection closed by viewer.\n");
-#else
-					debug("Connection closed by viewer (socket=%d) while trying to write authentication response.\n", connection);
-#endif
-				} else {
-#ifndef _DEBUG
-					debug("Writting authentication response to viewer returned socket error %d.\n", errno);
-#else
-					debug("Writting authentication response to viewer (socket=%d) returned socket error %d.\n", connection, errno);
-#endif
-				}
-				socket_close( connection );
-				continue;
-			}
-#ifdef _DEBUG
-			else {
-				debug("Authentication response sent to viewer (socket=%d).\n", connection);
+		/* Woken up to stop, the socket stays open */
+		ready = socket_wait( thread_params->sock, thread_params->wake );
+		if( ready <= 0 ) {
+			if( ready < 0 ) {
+				error("modei_listen(): poll() failed, errno=%d\n", errno);
+				notstopped = FALSE;
 			}
-#endif
+			break;
+		}
 
-			// Retrieve ClientInit and save it inside the structure.
-			if( socket_read_exact(connection, (char *)&client_init, sizeof(client_init)) < 0 ) {
-				if( ( errno == ECONNRESET )  || ( errno == ENOTCONN ) ) {
-#ifndef _DEBUG
-					debug("Connection closed by viewer.\n");
-#else
-					debug("Connection closed by viewer (socket=%d) while trying to read ClientInit.\n", connection);
-#endif
-				} else {
+		connection = socket_accept(thread_params->sock, &client, &socklen);
+		if( connection == INVALID_SOCKET ) {
+			if( notstopped ) {
+				debug("modei_listen(): accept() failed, errno=%d\n", errno);
+				AdmissionAcceptFailed( errno );
+			} else
+				break;
+		} else if( accept_limit( &modei_limiter, connection, &client, "Mode I viewer" ) == 0 ) {
+			/* IP Address for monitoring purposes */
+			ip_addr = inet_ntoa( ((struct sockaddr_in *)&client)->sin_addr );
 #ifndef _DEBUG
-					debug("Reading ClientInit from viewer return socket error %d.\n", errno);
+			debug("Mode I viewer connection accepted from %s.\n", ip_addr);
 #else
-					debug("Reading ClientInit from viewer (socket=%d) return socket error %d.\n", connection, errno);
-#endif
-				}
-				socket_close( connection );
-				continue;
-			} 
-#ifdef _DEBUG
-			else {
-				debug("Viewer (socket=%d) sent ClientInit message.\n", connection);
-			}
+			debug("Mode I viewer (socket=%d) connection accepted from %s.\n", connection, ip_addr);
 #endif
 
-			// Screws LINUX!
-			//shutdown(thread_params->sock, 2);
-
-			// Prepare the reapeaterinfo structure for the viewer
-			slot = (repeaterslot *)malloc( sizeof(repeaterslot) );
-			memset(slot, 0, sizeof(repeaterslot));
-
-			slot->server = INVALID_SOCKET;
-			slot->viewer = connection;
-			slot->timestamp = (unsigned long)time(NULL);
-			memcpy(slot->challenge, challenge, CHALLENGESIZE);
-			slot->next = NULL;
-			
-			current = AddSlot( slot );
-			if( current == NULL ) {
-				free( slot );
-				socket_close( connection );
-				continue;
-			} else if( ( current->server != INVALID_SOCKET ) && ( current->viewer != INVALID_SOCKET ) ) {
-				// Thread...
-				// ToDo: repeater_thread should be stored inside the slot in order to access it
-				if( notstopped ) {
-					if( thread_create(&repeater_thread, NULL, do_repeater, (LPVOID)current) != 0 ) {
-						fatal("Unable to create the repeater thread.\n");
-						notstopped = 0;
-					}
-				}
-			} else {
-#ifndef _DEBUG
-				debug("Viewer waiting for server to connect...\n");
-#else
-				debug("Viewer (socket=%d) waiting for server to connect...\n", current->viewer);
-#endif
-			}
+			if( HandshakeSubmit( modei_handshake, connection ) != 0 )
+				socket_reset( connection );
 		}
 	}
 
-	notstopped = FALSE;
-	shutdown( thread_params->sock, 2);
-	socket_close( thread_params->sock );
 #ifdef _DEBUG
-	debug("Viewer listening thread has exited.\n");
+	debug("Mode I listening thread has exited.\n");
 #endif
 	return 0;
 }
 
 
 
+/*
+ * SIGTERM drains the repeater, SIGINT (or a second SIGTERM) stops it at once
+ * and SIGHUP reloads the configuration. Nothing but a send() in here, the main
+ * loop does the work.
+ */
 void 
 ExitRepeater(int sig)
 {
-#ifdef _DEBUG
-	debug("Exit signal trapped.\n");
+	int saved_errno;
+	char c;
+
+	saved_errno = errno;
+	c = (char)sig;
+	if( ( signal_wake[1] == INVALID_SOCKET ) || ( send( signal_wake[1], &c, 1, 0 ) != 1 ) ) {
+#ifdef SIGHUP
+		if( sig != SIGHUP )
 #endif
-	notstopped = FALSE;
+			notstopped = FALSE;
+	}
+	errno = saved_errno;
 }
 
 
 
 void usage(char * appname)
 {
-	fprintf(stderr, "\nUsage: %s [-server port] [-viewer port]\n\n", appname);
+	fprintf(stderr, "\nUsage: %s [-server port] [-viewer port] [-admin port] [-upgrade]\n\n", appname);
 	fprintf(stderr, "  -server port  Defines the listening port for incoming VNC Server connections.\n");
 	fprintf(stderr, "  -viewer port  Defines the listening port for incoming VNC viewer connections.\n");
+	fprintf(stderr, "  -admin port   Defines the loopback port for admin commands (0 disables it).\n");
+	fprintf(stderr, "  -upgrade      Takes the listeners and the sessions over from the running repeater.\n");
 	fprintf(stderr, "\nFor more information please visit http://code.google.com/p/vncrepeater\n\n");
 
 	exit(1);
 }
 
+
+
+/*
+ * The listener threads stop once the wake up socket is readable, and leave
+ * their sockets open: on hot upgrades they go to the new repeater.
+ */
+static int
+start_listeners(listener_thread_params * params[UPGRADE_LISTENERS], thread_t threads[UPGRADE_LISTENERS], int started[UPGRADE_LISTENERS])
+{
+	LockSlots("start_listeners()");
+	slots_closed = FALSE;
+	UnlockSlots("start_listeners()");
+
+	if( thread_create(&threads[UPGRADE_SERVER_LISTENER], NULL, server_listen, (LPVOID)params[UPGRADE_SERVER_LISTENER]) != 0 ) {
+		fatal("Unable to create the thread to listen for servers.\n");
+		return -1;
+	}
+	started[UPGRADE_SERVER_LISTENER] = TRUE;
+
+	if( thread_create(&threads[UPGRADE_VIEWER_LISTENER], NULL, viewer_listen, (LPVOID)params[UPGRADE_VIEWER_LISTENER]) != 0 ) {
+		fatal("Unable to create the thread to listen for viewers.\n");
+		return -1;
+	}
+	started[UPGRADE_VIEWER_LISTENER] = TRUE;
+
+	if( params[UPGRADE_MODEI_LISTENER]->port != 0 ) {
+		if( thread_create(&threads[UPGRADE_MODEI_LISTENER], NULL, modei_listen, (LPVOID)params[UPGRADE_MODEI_LISTENER]) != 0 ) {
+			fatal("Unable to create the thread to listen for Mode I viewers.\n");
+			return -1;
+		}
+		started[UPGRADE_MODEI_LISTENER] = TRUE;
+	}
+
+	if( params[UPGRADE_ADMIN_LISTENER]->port != 0 ) {
+		if( thread_create(&threads[UPGRADE_ADMIN_LISTENER], NULL, admin_listen, (LPVOID)params[UPGRADE_ADMIN_LISTENER]) != 0 ) {
+			error("Unable to create the thread to listen for admin commands.\n");
+		} else {
+			started[UPGRADE_ADMIN_LISTENER] = TRUE;
+		}
+	}
+
+	return 0;
+}
+
+
+
+static void
+stop_listeners(SOCKET wake[2], thread_t threads[UPGRADE_LISTENERS], int started[UPGRADE_LISTENERS])
+{
+	const char * names[UPGRADE_LISTENERS] = { "server", "viewer", "admin", "Mode I" };
+	char buf[16];
+	int i;
+
+	if( wake[1] != INVALID_SOCKET )
+		send( wake[1], "", 1, 0 );
+	for( i = 0; i < UPGRADE_LISTENERS; i++ ) {
+		if( started[i] && ( thread_cleanup( threads[i], 30) != 0 ) )
+			error("The %s listener thread doesn't seem to exit cleanlly.\n", names[i]);
+		started[i] = FALSE;
+	}
+
+	/* The connections already accepted get their slot before anyone counts them */
+	HandshakeWait( HANDSHAKE_STOP_TIMEOUT );
+	LockSlots("stop_listeners()");
+	slots_closed = TRUE;
+	UnlockSlots("stop_listeners()");
+
+	while( ( wake[0] != INVALID_SOCKET ) && ( recv( wake[0], buf, sizeof(buf), 0 ) > 0 ) )
+		;
+}
+
+/* Stopping beats draining, which beats reloading */
+static int
+signal_rank(int sig)
+{
+	if( sig == 0 )
+		return 0;
+#ifdef SIGHUP
+	if( sig == SIGHUP )
+		return 1;
+#endif
+	if( sig == SIGTERM )
+		return 2;
+	return 3;
+}
+
+/* Nap for up to msec, returns the most urgent signal trapped meanwhile or 0 */
+static int
+wait_signal(SOCKET wake, unsigned int msec)
+{
+	char buf[16];
+	int len;
+	int sig;
+	int i;
+
+	if( ( wake == INVALID_SOCKET ) || ( socket_wait_timeout( wake, msec ) <= 0 ) )
+		return 0;
+
+	sig = 0;
+	while( ( len = recv( wake, buf, sizeof(buf), 0 ) ) > 0 ) {
+		for( i = 0; i < len; i++ ) {
+			if( signal_rank( (unsigned char)buf[i] ) > signal_rank( sig ) )
+				sig = (unsigned char)buf[i];
+		}
+	}
+	return sig;
+}
+
+
+
+/*
+ * Read the file again and publish it. The sessions pick the limits up as they
+ * go, nothing waits on them nor on mutex_slots. What a restart is needed for
+ * is kept as it is.
+ */
+static void
+reload_config( void )
+{
+	const repeater_config * current;
+	repeater_config * config;
+
+	config = ConfigLoad();
+	if( config == NULL ) {
+		error("The configuration could not be reloaded, kept the current one.\n");
+		return;
+	}
+
+	current = ConfigGet();
+	if( ( config->server_port != file_ports[0] ) || ( config->viewer_port != file_ports[1] ) || ( config->admin_port != file_ports[2] ) || ( config->modei_port != file_ports[3] ) )
+		error("The ports can't be changed by a reload, restart the repeater instead.\n");
+	if( strcmp( config->upgrade_path, current->upgrade_path ) != 0 )
+		error("UpgradeSocket can't be changed by a reload, restart the repeater instead.\n");
+	config->server_port = current->server_port;
+	config->viewer_port = current->viewer_port;
+	config->admin_port = current->admin_port;
+	config->modei_port = current->modei_port;
+	strcpy( config->upgrade_path, current->upgrade_path );
+
+	ConfigPublish( config );
+	SetMaxSlots( config->max_sessions );
+	WorkersSetLimit( config->max_sessions );
+	if( ShaperReload() != 0 )
+		error("The rate limits could not be reloaded.\n");
+	if( RecorderReload() != 0 )
+		error("The recordings could not be reloaded.\n");
+	if( TlsReload() != 0 )
+		error("The TLS certificate could not be reloaded.\n");
+	debug("Configuration reloaded.\n");
+}
+
+
+
+/*
+ * Stop accepting and let the running sessions end on their own. The listening
+ * sockets are closed so a load balancer sees the host go, and the servers and
+ * viewers still waiting have nobody left to pair with.
+ */
+static void
+start_drain(listener_thread_params * params[UPGRADE_LISTENERS], SOCKET wake[2], thread_t threads[UPGRADE_LISTENERS], int started[UPGRADE_LISTENERS], int handed_over)
+{
+	unsigned int waiting;
+	int i;
+
+	stop_listeners( wake, threads, started );
+	for( i = 0; i < UPGRADE_LISTENERS; i++ ) {
+		if( params[i]->sock != INVALID_SOCKET )
+			socket_close( params[i]->sock );
+		params[i]->sock = INVALID_SOCKET;
+	}
+	UpgradeFree( handed_over );
+
+	waiting = FreeWaitingSlots();
+	debug("Draining: %u sessions left, %u waiting servers and viewers closed.\n", CountSessions(), waiting);
+}
+
 /*****************************************************************************
  *
  * Main entry point
@@ -874,17 +1420,41 @@ int main(int argc, char **argv)
 {
 	listener_thread_params *server_thread_params;
 	listener_thread_params *viewer_thread_params;
+	listener_thread_params *admin_thread_params;
+	listener_thread_params *modei_thread_params;
+	listener_thread_params *listener_params[UPGRADE_LISTENERS];
+	SOCKET listeners[UPGRADE_LISTENERS];
+	u_short ports[UPGRADE_LISTENERS];
+	SOCKET listener_wake[2];
 	u_short server_port;
 	u_short viewer_port;
+	u_short admin_port;
 	int t_result;
-	thread_t hServerThread;
-	thread_t hViewerThread;
+	thread_t listener_threads[UPGRADE_LISTENERS];
+	int listener_started[UPGRADE_LISTENERS];
+	repeater_config * config;
+	int upgrade;
+	int handed_over;
+	int draining;
+	unsigned long drain_deadline;
+	unsigned int drain_timeout;
+	unsigned int sessions;
+	int i;
 
 	/* Load configuration file */
-	if( GetConfigurationPort("ServerPort", &server_port) == 0 )
-		server_port = 5500;
-	if( GetConfigurationPort("ViewerPort", &viewer_port) == 0 )
-		viewer_port = 5900;
+	config = ConfigLoad();
+	if( config == NULL )
+		return 1;
+	server_port = config->server_port;
+	viewer_port = config->viewer_port;
+	admin_port = config->admin_port;
+	file_ports[0] = server_port;
+	file_ports[1] = viewer_port;
+	file_ports[2] = admin_port;
+	file_ports[3] = config->modei_port;
+	upgrade = FALSE;
+	listener_wake[0] = INVALID_SOCKET;
+	listener_wake[1] = INVALID_SOCKET;
 
 	/* Arguments */
 	if( argc > 1 ) {
@@ -929,6 +1499,22 @@ int main(int argc, char **argv)
 				}
 
 				i++;
+			} else if( _stricmp( argv[i], "-admin" ) == 0 ) {
+				/* Requires argument */
+				if( (i+1) == argc ) {
+					usage( argv[0] );
+					return 1;
+				}
+
+				if( argv[(i+1)][0] == '-' ) {
+					usage( argv[0] );
+					return 1;
+				}
+				admin_port = atoi( argv[(i+1)] );
+
+				i++;
+			} else if( _stricmp( argv[i], "-upgrade" ) == 0 ) {
+				upgrade = TRUE;
 			} else {
 				usage( argv[0] );
 				return 1;
@@ -947,20 +1533,51 @@ int main(int argc, char **argv)
 	printf("Copyright (C) 2010 Juan Pedro Gonzalez Gutierrez. Licensed under GPL v2.\n");
 	printf("Get the latest version at http://code.google.com/p/vncrepeater/\n\n");
 
+	/* The command line wins over the file, reloads keep the ports as they are */
+	config->server_port = server_port;
+	config->viewer_port = viewer_port;
+	config->admin_port = admin_port;
+	ConfigPublish( config );
+
 	/* Initialize some variables */
 	notstopped = TRUE;
-	InitializeSlots( 20 );
+	InitializeSlots( config->max_sessions );
+	LimiterInit( &server_limiter );
+	LimiterInit( &viewer_limiter );
+	LimiterInit( &modei_limiter );
 
 	/* Trap signal in order to exit cleanlly */
 	signal(SIGINT, ExitRepeater);
+	signal(SIGTERM, ExitRepeater);
+#ifdef SIGHUP
+	signal(SIGHUP, ExitRepeater);
+#endif
 
 	server_thread_params = (listener_thread_params *)malloc(sizeof(listener_thread_params));
 	memset(server_thread_params, 0, sizeof(listener_thread_params));
 	viewer_thread_params = (listener_thread_params *)malloc(sizeof(listener_thread_params));
 	memset(viewer_thread_params, 0, sizeof(listener_thread_params));
+	admin_thread_params = (listener_thread_params *)malloc(sizeof(listener_thread_params));
+	memset(admin_thread_params, 0, sizeof(listener_thread_params));
+	modei_thread_params = (listener_thread_params *)malloc(sizeof(listener_thread_params));
+	memset(modei_thread_params, 0, sizeof(listener_thread_params));
 
 	server_thread_params->port = server_port;
 	viewer_thread_params->port = viewer_port;
+	admin_thread_params->port = admin_port;
+	modei_thread_params->port = config->modei_port;
+	server_thread_params->sock = INVALID_SOCKET;
+	viewer_thread_params->sock = INVALID_SOCKET;
+	admin_thread_params->sock = INVALID_SOCKET;
+	modei_thread_params->sock = INVALID_SOCKET;
+	listener_params[UPGRADE_SERVER_LISTENER] = server_thread_params;
+	listener_params[UPGRADE_VIEWER_LISTENER] = viewer_thread_params;
+	listener_params[UPGRADE_ADMIN_LISTENER] = admin_thread_params;
+	listener_params[UPGRADE_MODEI_LISTENER] = modei_thread_params;
+	for( i = 0; i < UPGRADE_LISTENERS; i++ ) {
+		ports[i] = listener_params[i]->port;
+		listener_started[i] = FALSE;
+	}
 
 
 	// Start multithreading...
@@ -975,58 +1592,169 @@ int main(int argc, char **argv)
 		notstopped = 0;
 	}
 
-	// Tying new threads ;)
-	if( notstopped ) {
-		if( thread_create(&hServerThread, NULL, server_listen, (LPVOID)server_thread_params) != 0 ) {
-			fatal("Unable to create the thread to listen for servers.\n");
-			notstopped = 0;
-		}
+	if( notstopped && ( ShaperInit() != 0 ) )
+		notstopped = 0;
+	if( notstopped && ( RecorderInit() != 0 ) )
+		notstopped = 0;
+	if( notstopped && ( TlsInit() != 0 ) )
+		notstopped = 0;
+	if( notstopped && ( AdmissionInit() != 0 ) )
+		notstopped = 0;
+	if( notstopped && ( ResolverInit() != 0 ) )
+		notstopped = 0;
+
+	if( notstopped && ( RelayInit() != 0 ) )
+		notstopped = 0;
+	if( notstopped && ( WorkersInit( config->max_sessions ) != 0 ) )
+		notstopped = 0;
+	if( notstopped && ( HandshakeInit( config->handshake_threads ) != 0 ) )
+		notstopped = 0;
+	if( notstopped && ( socket_pair( listener_wake ) != 0 ) ) {
+		error("Failed to create the wake up sockets for the listeners.\n");
+		notstopped = 0;
+	}
+	for( i = 0; i < UPGRADE_LISTENERS; i++ )
+		listener_params[i]->wake = listener_wake[0];
+	if( notstopped && ( socket_pair( signal_wake ) != 0 ) ) {
+		error("Failed to create the wake up sockets for the signals.\n");
+		notstopped = 0;
 	}
 
-	if( notstopped ) {
-		if( thread_create(&hViewerThread, NULL, viewer_listen, (LPVOID)viewer_thread_params) != 0 ) {
-			fatal("Unable to create the thread to listen for viewers.\n");
+	/* Take the listeners and the sessions over from the running repeater */
+	if( notstopped && upgrade ) {
+		if( UpgradeReceive( config->upgrade_path, listeners, ports ) != 0 ) {
 			notstopped = 0;
+		} else {
+			for( i = 0; i < UPGRADE_LISTENERS; i++ )
+				listener_params[i]->sock = listeners[i];
 		}
 	}
+	if( notstopped && ( UpgradeInit( config->upgrade_path ) != 0 ) )
+		notstopped = 0;
+
+	// Tying new threads ;)
+	if( notstopped && ( start_listeners( listener_params, listener_threads, listener_started ) != 0 ) )
+		notstopped = 0;
 
 	// Main loop
+	handed_over = FALSE;
+	draining = FALSE;
+	drain_deadline = 0;
 	while( notstopped ) 
 	{ 
 		/* Clean slots: Free slots where the endpoint has disconnected */
 		CleanupSlots();
+
+		/* A new repeater takes the listeners and the sessions over */
+		if( !handed_over && !draining && UpgradeRequested() ) {
+			stop_listeners( listener_wake, listener_threads, listener_started );
+			for( i = 0; i < UPGRADE_LISTENERS; i++ )
+				listeners[i] = listener_params[i]->sock;
+
+			if( UpgradeSend( listeners, ports ) == 0 ) {
+				handed_over = TRUE;
+				for( i = 0; i < UPGRADE_LISTENERS; i++ )
+					listener_params[i]->sock = INVALID_SOCKET;
+				debug("Handed over, waiting for the sessions left to end.\n");
+			} else if( start_listeners( listener_params, listener_threads, listener_started ) != 0 ) {
+				notstopped = 0;
+			}
+		}
+
+		/* The sessions that could not be parked, or are drained, run to their end */
+		if( ( handed_over || draining ) && ( LockSlots("main()") == 0 ) ) {
+			if( Slots == NULL )
+				notstopped = FALSE;
+			UnlockSlots("main()");
+		}
+		if( draining && notstopped && ( (unsigned long)time(NULL) >= drain_deadline ) ) {
+			debug("Drain timeout, closing the sessions left.\n");
+			notstopped = FALSE;
+		}
 		
-		/* Take a "nap" so CPU usage doesn't go up. */
-#ifdef WIN32
-		Sleep( 50 );
-#else
-		usleep( 50 );
+		/* Stop accepting before the descriptors or the memory run out */
+		AdmissionCheck( ShaperNow() );
+
+		/* Take a "nap" so CPU usage doesn't go up, signals cut it short. */
+		switch( wait_signal( signal_wake[0], 50 ) ) {
+		case 0:
+			break;
+#ifdef SIGHUP
+		case SIGHUP:
+			reload_config();
+			break;
 #endif
+		case SIGTERM:
+			if( !draining ) {
+				/* Not config: a reload may have retired it */
+				drain_timeout = ConfigGet()->drain_timeout;
+				debug("SIGTERM trapped, draining for up to %u seconds.\n", drain_timeout);
+				start_drain( listener_params, listener_wake, listener_threads, listener_started, handed_over );
+				draining = TRUE;
+				drain_deadline = (unsigned long)time(NULL) + drain_timeout;
+				break;
+			}
+			/* A second one stops at once */
+		default:
+			debug("Exit signal trapped.\n");
+			notstopped = FALSE;
+			break;
+		}
 	}
 
 	printf("\nExiting VNC Repeater...\n");
 
 	notstopped = FALSE;
 
+	/* Make sure the threads have finalized */
+	stop_listeners( listener_wake, listener_threads, listener_started );
+	HandshakeFree();
+
+	/* The sessions left close their sockets and free their slots themselves */
+	RelayStop();
+	for( i = 0; ( i < STOP_TIMEOUT * 20 ) && ( ( sessions = CountSessions() ) > 0 ); i++ )
+		wait_signal( signal_wake[0], 50 );
+	if( sessions > 0 )
+		error("%u sessions did not close in time.\n", sessions);
+	else
+		WorkersFree();
+
 	/* Free the repeater slots */
 	FreeSlots();
 
 	/* Close the sockets used for the listeners */
-	socket_close( server_thread_params->sock );
-	socket_close( viewer_thread_params->sock );
-	
-	/* Free allocated memory for the thread parameters */
-	free( server_thread_params );
-	free( viewer_thread_params );
-
-	/* Make sure the threads have finalized */
-	if( thread_cleanup( hServerThread, 30) != 0 ) {
-		error("The server listener thread doesn't seem to exit cleanlly.\n");
+	for( i = 0; i < UPGRADE_LISTENERS; i++ ) {
+		if( listener_params[i]->sock != INVALID_SOCKET )
+			socket_close( listener_params[i]->sock );
+	}
+	if( listener_wake[0] != INVALID_SOCKET ) {
+		socket_close( listener_wake[0] );
+		socket_close( listener_wake[1] );
 	}
-	if( thread_cleanup( hViewerThread, 30) != 0 ) {
-		error("The viewer listener thread doesn't seem to exit cleanlly.\n");
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+#ifdef SIGHUP
+	signal(SIGHUP, SIG_DFL);
+#endif
+	if( signal_wake[0] != INVALID_SOCKET ) {
+		socket_close( signal_wake[0] );
+		socket_close( signal_wake[1] );
 	}
+	UpgradeFree( handed_over );
 
+	/* Free allocated memory for the thread parameters */
+	free( server_thread_params );
+	free( viewer_thread_params );
+	free( admin_thread_params );
+	free( modei_thread_params );
+
+	ShaperFree();
+	RecorderFree();
+	TlsFree();
+	AdmissionFree();
+	ResolverFree();
+	RelayFree();
+	ConfigFree();
 
 
 	 // Destroy mutex
@@ -0,0 +1,1056 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+/*
+ * replay - Replays recorded sessions through the repeater.
+ *
+ * Maps the captures written by the repeater ("Record" in vncrepeater.conf)
+ * and plays each of them back as a fake UltraVNC server and a fake viewer,
+ * with the original timing, faster, or as fast as the repeater takes it.
+ * Reports the relay throughput, how long every record takes to cross the
+ * repeater in each direction and how far the playback fell behind its
+ * schedule. What the viewer gets is checked against the capture. Linux
+ * only (epoll, mmap).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "rfb.h"
+#include "vncauth.h"
+#include "recorder.h"
+
+#define TRUE	1
+#define FALSE	0
+
+#define MAX_HOST_NAME_LEN	250
+
+#define REPLAY_MAX_EVENTS	256
+#define REPLAY_READ_SIZE	(64 * 1024)
+
+/* Server handshake: ID + version out, version in, auth out, ClientInit in */
+#define SERVER_CONNECTING	0
+#define SERVER_READ_VERSION	1
+#define SERVER_WAIT_INIT	2
+#define SERVER_PLAYING		3
+#define SERVER_DONE			4
+
+/* Viewer handshake: the repeater acts as a VNC server with VNC authentication */
+#define VIEWER_IDLE			0
+#define VIEWER_CONNECTING	1
+#define VIEWER_READ_VERSION	2
+#define VIEWER_READ_AUTH	3
+#define VIEWER_READ_RESULT	4
+#define VIEWER_PLAYING		5
+#define VIEWER_DONE			6
+
+/* Directions, as in the capture */
+#define DOWN	RECORDER_SERVER	/* Played by the fake server */
+#define UP		RECORDER_VIEWER	/* Played by the fake viewer */
+
+/* Records in flight per direction, to time their delivery */
+#define REPLAY_MARKS		1024
+#define MAX_SAMPLES			(1024 * 1024)
+
+// Structures
+
+typedef struct _replay_capture {
+	const char * path;
+	const char * data;           /* The whole file, mapped */
+	size_t size;
+	unsigned int id;
+	unsigned int records;
+	unsigned long long bytes[2];
+	unsigned long long lost;     /* Gaps left by the recorder */
+	unsigned long long duration; /* Microseconds */
+} replay_capture;
+
+/* Walks the records of one direction */
+typedef struct _replay_cursor {
+	const replay_capture * capture;
+	CARD8 type;
+	size_t next;                 /* Next record header */
+	const char * data;           /* Current record */
+	unsigned int len;
+	unsigned int pos;
+	unsigned long long time;
+	int done;
+} replay_cursor;
+
+typedef struct _replay_mark {
+	unsigned long long end;      /* Stream offset right after the record */
+	double sent;
+} replay_mark;
+
+typedef struct _replay_session replay_session;
+
+typedef struct _replay_conn {
+	int fd;
+	int role;
+	int state;
+	int blocked;                 /* Waiting for EPOLLOUT */
+	char in[MAX_HOST_NAME_LEN + 64];   /* Handshake input */
+	unsigned int in_len;
+	char out[MAX_HOST_NAME_LEN + 64];  /* Handshake output */
+	unsigned int out_len;
+	unsigned int out_pos;
+	replay_session * session;
+} replay_conn;
+
+struct _replay_session {
+	unsigned int id;
+	replay_capture * capture;
+	replay_conn server;
+	replay_conn viewer;
+	double start;
+	double paired;               /* Time zero of the capture */
+	double finished;
+	int failed;
+	replay_cursor play[2];       /* What each side sends */
+	replay_cursor check;         /* What the viewer should get */
+	unsigned long long sent[2];
+	unsigned long long received[2];
+	unsigned long long mismatches;
+	replay_mark marks[2][REPLAY_MARKS];
+	unsigned int mark_first[2];
+	unsigned int mark_count[2];
+};
+
+typedef struct _replay_options {
+	const char * host;
+	u_short server_port;
+	u_short viewer_port;
+	unsigned int base_id;
+	unsigned int copies;
+	double speed;                /* 0 for as fast as possible */
+	unsigned int timeout;
+} replay_options;
+
+// Global variables
+replay_options options;
+replay_capture * captures;
+unsigned int capture_count;
+replay_session * sessions;
+unsigned int session_count;
+int epfd;
+struct sockaddr_in server_addr;
+struct sockaddr_in viewer_addr;
+
+unsigned int paired_count;
+unsigned int finished_count;
+unsigned int failed_count;
+
+double * latencies[2];       /* Record delivery, per direction */
+unsigned int latency_count[2];
+double * lags;               /* How late records left, against the capture */
+unsigned int lag_count;
+
+
+/*****************************************************************************
+ *
+ * Helpers / Misc.
+ *
+ *****************************************************************************/
+
+double
+now_seconds( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void
+usage(char * appname)
+{
+	fprintf(stderr, "\nUsage: %s [options] capture.rec [...]\n\n", appname);
+	fprintf(stderr, "  -host addr        Repeater address (default 127.0.0.1).\n");
+	fprintf(stderr, "  -server port      Repeater port for VNC servers (default 5500).\n");
+	fprintf(stderr, "  -viewer port      Repeater port for VNC viewers (default 5900).\n");
+	fprintf(stderr, "  -id n             First repeater ID (default 1000).\n");
+	fprintf(stderr, "  -copies n         Sessions playing each capture at once (default 1).\n");
+	fprintf(stderr, "  -speed x          Playback speed, 0 for as fast as possible (default 1).\n");
+	fprintf(stderr, "  -timeout s        Give up after s seconds (default 120).\n\n");
+	exit(1);
+}
+
+CARD32
+get32( const char * p )
+{
+	const unsigned char * u = (const unsigned char *)p;
+
+	return ( (CARD32)u[0] << 24 ) | ( (CARD32)u[1] << 16 ) | ( (CARD32)u[2] << 8 ) | u[3];
+}
+
+void
+add_sample( double * samples, unsigned int * count, double value )
+{
+	if( *count < MAX_SAMPLES )
+		samples[(*count)++] = value;
+}
+
+
+/*****************************************************************************
+ *
+ * Captures
+ *
+ *****************************************************************************/
+
+/* Map a capture and check its records. -1 if it is not one. */
+int
+load_capture( replay_capture * capture, const char * path )
+{
+	struct stat st;
+	unsigned long long time;
+	size_t pos;
+	CARD32 len;
+	CARD8 type;
+	void * data;
+	int fd;
+
+	memset( capture, 0, sizeof(replay_capture) );
+	capture->path = path;
+
+	fd = open( path, O_RDONLY );
+	if( fd < 0 ) {
+		fprintf(stderr, "Unable to open %s, errno=%d\n", path, errno);
+		return -1;
+	}
+	if( ( fstat( fd, &st ) != 0 ) || ( st.st_size < RECORDER_FILE_HEADER ) ) {
+		fprintf(stderr, "%s is not a capture.\n", path);
+		close( fd );
+		return -1;
+	}
+
+	data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( data == MAP_FAILED ) {
+		fprintf(stderr, "Unable to map %s, errno=%d\n", path, errno);
+		return -1;
+	}
+	madvise( data, st.st_size, MADV_SEQUENTIAL );
+
+	capture->data = (const char *)data;
+	capture->size = st.st_size;
+	if( memcmp( capture->data, RECORDER_MAGIC, 8 ) != 0 ) {
+		fprintf(stderr, "%s is not a capture.\n", path);
+		return -1;
+	}
+	capture->id = get32( capture->data + 8 );
+
+	for( pos = RECORDER_FILE_HEADER; pos + RECORDER_HEADER <= capture->size; pos += RECORDER_HEADER + len ) {
+		time = ( (unsigned long long)get32( capture->data + pos ) << 32 ) | get32( capture->data + pos + 4 );
+		len = get32( capture->data + pos + 8 );
+		type = (CARD8)capture->data[pos + 12];
+		if( len > capture->size - pos - RECORDER_HEADER )
+			break;
+
+		if( ( type == RECORDER_SERVER ) || ( type == RECORDER_VIEWER ) ) {
+			capture->bytes[type] += len;
+			capture->records++;
+			capture->duration = time;
+		} else if( ( type == RECORDER_GAP ) && ( len >= 4 ) ) {
+			capture->lost += get32( capture->data + pos + RECORDER_HEADER );
+		}
+	}
+	if( pos != capture->size )
+		fprintf(stderr, "%s is truncated, replaying the complete records only.\n", path);
+	if( capture->lost > 0 )
+		fprintf(stderr, "%s lost %llu bytes while recording, its viewer may not follow.\n", path, capture->lost);
+
+	return 0;
+}
+
+/* Move to the next record of the cursor direction */
+void
+cursor_next( replay_cursor * cursor )
+{
+	const replay_capture * capture = cursor->capture;
+	CARD32 len;
+
+	while( cursor->next + RECORDER_HEADER <= capture->size ) {
+		len = get32( capture->data + cursor->next + 8 );
+		if( len > capture->size - cursor->next - RECORDER_HEADER )
+			break;
+
+		if( ( (CARD8)capture->data[cursor->next + 12] == cursor->type ) && ( len > 0 ) ) {
+			cursor->time = ( (unsigned long long)get32( capture->data + cursor->next ) << 32 ) | get32( capture->data + cursor->next + 4 );
+			cursor->data = capture->data + cursor->next + RECORDER_HEADER;
+			cursor->len = len;
+			cursor->pos = 0;
+			cursor->next += RECORDER_HEADER + len;
+			return;
+		}
+		cursor->next += RECORDER_HEADER + len;
+	}
+
+	cursor->done = TRUE;
+}
+
+void
+cursor_init( replay_cursor * cursor, const replay_capture * capture, CARD8 type )
+{
+	memset( cursor, 0, sizeof(replay_cursor) );
+	cursor->capture = capture;
+	cursor->type = type;
+	cursor->next = RECORDER_FILE_HEADER;
+	cursor_next( cursor );
+}
+
+
+/*****************************************************************************
+ *
+ * Connections
+ *
+ *****************************************************************************/
+
+int
+open_connection( replay_conn * conn, struct sockaddr_in * addr )
+{
+	const int one = 1;
+	struct epoll_event ev;
+
+	conn->fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if( conn->fd < 0 ) {
+		fprintf(stderr, "socket() failed, errno=%d\n", errno);
+		return -1;
+	}
+
+	setsockopt( conn->fd, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof( one ));
+	fcntl( conn->fd, F_SETFL, O_NONBLOCK );
+
+	if( ( connect( conn->fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in) ) < 0 ) && ( errno != EINPROGRESS ) ) {
+		fprintf(stderr, "connect() failed, errno=%d\n", errno);
+		close( conn->fd );
+		conn->fd = -1;
+		return -1;
+	}
+
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = conn;
+	epoll_ctl( epfd, EPOLL_CTL_ADD, conn->fd, &ev );
+	return 0;
+}
+
+void
+set_events( replay_conn * conn, unsigned int events )
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = conn;
+	epoll_ctl( epfd, EPOLL_CTL_MOD, conn->fd, &ev );
+}
+
+void
+close_connection( replay_conn * conn )
+{
+	if( conn->fd >= 0 ) {
+		epoll_ctl( epfd, EPOLL_CTL_DEL, conn->fd, NULL );
+		close( conn->fd );
+		conn->fd = -1;
+	}
+}
+
+void
+finish_session( replay_session * session, int failed )
+{
+	if( session->finished != 0 )
+		return;
+
+	session->finished = now_seconds();
+	session->failed = failed;
+	session->server.state = SERVER_DONE;
+	session->viewer.state = VIEWER_DONE;
+	close_connection( &session->server );
+	close_connection( &session->viewer );
+
+	if( failed )
+		failed_count++;
+	else
+		finished_count++;
+}
+
+int
+queue_output( replay_conn * conn, const char * buf, unsigned int len )
+{
+	memcpy( conn->out + conn->out_len, buf, len );
+	conn->out_len += len;
+	return 0;
+}
+
+int
+flush_output( replay_conn * conn )
+{
+	int n;
+
+	while( conn->out_pos < conn->out_len ) {
+		n = send( conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos, MSG_NOSIGNAL );
+		if( n < 0 ) {
+			if( errno == EAGAIN )
+				return 0;
+			return -1;
+		}
+		conn->out_pos += n;
+	}
+
+	conn->out_len = 0;
+	conn->out_pos = 0;
+	return 0;
+}
+
+/* Read until the handshake input buffer holds len bytes. 1 when complete. */
+int
+fill_input( replay_conn * conn, unsigned int len )
+{
+	int n;
+
+	while( conn->in_len < len ) {
+		n = recv( conn->fd, conn->in + conn->in_len, len - conn->in_len, 0 );
+		if( n == 0 )
+			return -1;
+		if( n < 0 )
+			return ( errno == EAGAIN ) ? 0 : -1;
+		conn->in_len += n;
+	}
+
+	return 1;
+}
+
+int
+connect_done( replay_conn * conn )
+{
+	int err;
+	socklen_t len;
+
+	len = sizeof(err);
+	if( ( getsockopt( conn->fd, SOL_SOCKET, SO_ERROR, &err, &len ) < 0 ) || ( err != 0 ) )
+		return -1;
+	return 0;
+}
+
+
+/*****************************************************************************
+ *
+ * Playback
+ *
+ *****************************************************************************/
+
+/*
+ * Send the records of one direction that are due. Returns -1 on error,
+ * and lowers *wake to the time the next record is due.
+ */
+int
+play( replay_session * session, int dir, double now, double * wake )
+{
+	replay_cursor * cursor = &session->play[dir];
+	replay_conn * conn = ( dir == DOWN ) ? &session->server : &session->viewer;
+	replay_mark * mark;
+	double due;
+	int n;
+
+	if( conn->blocked )
+		return 0;
+
+	while( !cursor->done ) {
+		due = session->paired;
+		if( options.speed > 0 ) {
+			due += cursor->time / 1e6 / options.speed;
+			if( due > now ) {
+				if( due < *wake )
+					*wake = due;
+				return 0;
+			}
+		}
+		if( ( cursor->pos == 0 ) && ( options.speed > 0 ) )
+			add_sample( lags, &lag_count, ( now - due ) * 1000.0 );
+
+		n = send( conn->fd, cursor->data + cursor->pos, cursor->len - cursor->pos, MSG_NOSIGNAL );
+		if( n < 0 ) {
+			if( errno != EAGAIN )
+				return -1;
+			conn->blocked = TRUE;
+			set_events( conn, EPOLLIN | EPOLLOUT );
+			return 0;
+		}
+
+		cursor->pos += n;
+		session->sent[dir] += n;
+		if( cursor->pos < cursor->len )
+			continue;
+
+		/* Timed once the other side has all of it */
+		if( session->mark_count[dir] < REPLAY_MARKS ) {
+			mark = &session->marks[dir][( session->mark_first[dir] + session->mark_count[dir] ) % REPLAY_MARKS];
+			mark->end = session->sent[dir];
+			mark->sent = now;
+			session->mark_count[dir]++;
+		}
+		cursor_next( cursor );
+	}
+
+	return 0;
+}
+
+/* Data that crossed the repeater, in either direction */
+void
+delivered( replay_session * session, int dir, const char * buf, unsigned int len, double now )
+{
+	replay_cursor * check = &session->check;
+	replay_mark * mark;
+	unsigned int take;
+
+	session->received[dir] += len;
+
+	/* What the viewer gets must be what the server sent when recorded */
+	while( ( dir == DOWN ) && ( len > 0 ) ) {
+		if( check->done ) {
+			session->mismatches += len;
+			break;
+		}
+		take = check->len - check->pos;
+		if( take > len )
+			take = len;
+		if( memcmp( check->data + check->pos, buf, take ) != 0 )
+			session->mismatches += take;
+		check->pos += take;
+		buf += take;
+		len -= take;
+		if( check->pos == check->len )
+			cursor_next( check );
+	}
+
+	while( session->mark_count[dir] > 0 ) {
+		mark = &session->marks[dir][session->mark_first[dir]];
+		if( mark->end > session->received[dir] )
+			break;
+		add_sample( latencies[dir], &latency_count[dir], ( now - mark->sent ) * 1000.0 );
+		session->mark_first[dir] = ( session->mark_first[dir] + 1 ) % REPLAY_MARKS;
+		session->mark_count[dir]--;
+	}
+}
+
+/* Both sides played everything and got everything */
+void
+check_done( replay_session * session )
+{
+	if( session->play[DOWN].done && session->play[UP].done
+		&& ( session->received[DOWN] >= session->sent[DOWN] ) && ( session->received[UP] >= session->sent[UP] ) )
+		finish_session( session, FALSE );
+}
+
+int
+receive( replay_session * session, replay_conn * conn, int dir )
+{
+	char buf[REPLAY_READ_SIZE];
+	double now;
+	int n;
+
+	while( ( n = recv( conn->fd, buf, sizeof(buf), 0 ) ) > 0 ) {
+		now = now_seconds();
+		delivered( session, dir, buf, n, now );
+	}
+	if( ( n == 0 ) || ( errno != EAGAIN ) )
+		return -1;
+
+	check_done( session );
+	return 0;
+}
+
+/* Writable again after a short send() */
+int
+unblock( replay_session * session, replay_conn * conn, int dir )
+{
+	double wake;
+
+	conn->blocked = FALSE;
+	set_events( conn, EPOLLIN );
+	wake = 0;
+	return play( session, dir, now_seconds(), &wake );
+}
+
+
+/*****************************************************************************
+ *
+ * Fake VNC server
+ *
+ *****************************************************************************/
+
+void start_viewer( replay_session * session );
+
+void
+start_session( replay_session * session )
+{
+	char host_id[MAX_HOST_NAME_LEN];
+	rfbProtocolVersionMsg protocol_version;
+
+	session->start = now_seconds();
+	session->server.state = SERVER_CONNECTING;
+	if( open_connection( &session->server, &server_addr ) != 0 ) {
+		finish_session( session, TRUE );
+		return;
+	}
+
+	/* Host ID followed by our protocol version */
+	memset( host_id, 0, sizeof(host_id) );
+	snprintf( host_id, sizeof(host_id), "ID:%u", session->id );
+	queue_output( &session->server, host_id, MAX_HOST_NAME_LEN );
+	sprintf( protocol_version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion );
+	queue_output( &session->server, protocol_version, sz_rfbProtocolVersionMsg );
+}
+
+int
+handle_server( replay_session * session, unsigned int events )
+{
+	replay_conn * conn = &session->server;
+	CARD32 auth_type;
+	double wake;
+	int n;
+
+	if( conn->state == SERVER_CONNECTING ) {
+		if( !( events & EPOLLOUT ) )
+			return 0;
+		if( connect_done( conn ) != 0 )
+			return -1;
+		conn->state = SERVER_READ_VERSION;
+	}
+
+	if( conn->state == SERVER_PLAYING ) {
+		if( ( events & EPOLLOUT ) && conn->blocked && ( unblock( session, conn, DOWN ) != 0 ) )
+			return -1;
+		if( events & EPOLLIN )
+			return receive( session, conn, UP );
+		return 0;
+	}
+
+	if( flush_output( conn ) != 0 )
+		return -1;
+
+	switch( conn->state ) {
+	case SERVER_READ_VERSION:
+		n = fill_input( conn, sz_rfbProtocolVersionMsg );
+		if( n <= 0 )
+			return n;
+		conn->in_len = 0;
+
+		/* No authentication between the repeater and the server */
+		auth_type = Swap32IfLE(rfbNoAuth);
+		queue_output( conn, (char *)&auth_type, sizeof(auth_type) );
+		if( flush_output( conn ) != 0 )
+			return -1;
+		conn->state = SERVER_WAIT_INIT;
+		set_events( conn, EPOLLIN );
+
+		/* The viewer can go now */
+		start_viewer( session );
+		return 0;
+
+	case SERVER_WAIT_INIT:
+		/* The repeater sends ClientInit, the capture starts with it */
+		n = fill_input( conn, 1 );
+		if( n <= 0 )
+			return n;
+		conn->in_len = 0;
+
+		session->paired = now_seconds();
+		paired_count++;
+		conn->state = SERVER_PLAYING;
+		wake = 0;
+		return play( session, DOWN, session->paired, &wake );
+	}
+
+	return 0;
+}
+
+
+/*****************************************************************************
+ *
+ * Fake VNC viewer
+ *
+ *****************************************************************************/
+
+void
+start_viewer( replay_session * session )
+{
+	session->viewer.state = VIEWER_CONNECTING;
+	if( open_connection( &session->viewer, &viewer_addr ) != 0 )
+		finish_session( session, TRUE );
+}
+
+int
+handle_viewer( replay_session * session, unsigned int events )
+{
+	replay_conn * conn = &session->viewer;
+	rfbProtocolVersionMsg protocol_version;
+	char password[16];
+	unsigned char challenge[CHALLENGESIZE];
+	CARD32 value;
+	CARD8 client_init;
+	int n;
+
+	if( conn->state == VIEWER_CONNECTING ) {
+		if( !( events & EPOLLOUT ) )
+			return 0;
+		if( connect_done( conn ) != 0 )
+			return -1;
+		conn->state = VIEWER_READ_VERSION;
+		set_events( conn, EPOLLIN );
+	}
+
+	if( conn->state == VIEWER_PLAYING ) {
+		if( ( events & EPOLLOUT ) && conn->blocked && ( unblock( session, conn, UP ) != 0 ) )
+			return -1;
+		if( events & EPOLLIN )
+			return receive( session, conn, DOWN );
+		return 0;
+	}
+
+	if( flush_output( conn ) != 0 )
+		return -1;
+
+	switch( conn->state ) {
+	case VIEWER_READ_VERSION:
+		n = fill_input( conn, sz_rfbProtocolVersionMsg );
+		if( n <= 0 )
+			return n;
+		conn->in_len = 0;
+
+		sprintf( protocol_version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion );
+		queue_output( conn, protocol_version, sz_rfbProtocolVersionMsg );
+		conn->state = VIEWER_READ_AUTH;
+		return flush_output( conn );
+
+	case VIEWER_READ_AUTH:
+		/* Authentication scheme and challenge */
+		n = fill_input( conn, sizeof(CARD32) + CHALLENGESIZE );
+		if( n <= 0 )
+			return n;
+		conn->in_len = 0;
+
+		memcpy( &value, conn->in, sizeof(CARD32) );
+		if( Swap32IfLE(value) != rfbVncAuth )
+			return -1;
+
+		/* The password is the repeater ID */
+		memcpy( challenge, conn->in + sizeof(CARD32), CHALLENGESIZE );
+		snprintf( password, sizeof(password), "%u", session->id );
+		vncEncryptBytes( challenge, password );
+		queue_output( conn, (char *)challenge, CHALLENGESIZE );
+		conn->state = VIEWER_READ_RESULT;
+		return flush_output( conn );
+
+	case VIEWER_READ_RESULT:
+		n = fill_input( conn, sizeof(CARD32) );
+		if( n <= 0 )
+			return n;
+		conn->in_len = 0;
+
+		memcpy( &value, conn->in, sizeof(CARD32) );
+		if( Swap32IfLE(value) != rfbVncAuthOK )
+			return -1;
+
+		/* Shared session */
+		client_init = 1;
+		queue_output( conn, (char *)&client_init, sizeof(client_init) );
+		conn->state = VIEWER_PLAYING;
+		return flush_output( conn );
+	}
+
+	return 0;
+}
+
+
+/*****************************************************************************
+ *
+ * Report
+ *
+ *****************************************************************************/
+
+int
+compare_double(const void * a, const void * b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return ( x < y ) ? -1 : ( ( x > y ) ? 1 : 0 );
+}
+
+double
+percentile( double * values, unsigned int count, double p )
+{
+	unsigned int index;
+
+	if( count == 0 )
+		return 0;
+	index = (unsigned int)( p * ( count - 1 ) + 0.5 );
+	return values[index];
+}
+
+void
+print_latency( const char * name, double * values, unsigned int count )
+{
+	qsort( values, count, sizeof(double), compare_double );
+	printf("%s p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms (%u records)\n", name,
+		percentile( values, count, 0.50 ),
+		percentile( values, count, 0.90 ),
+		percentile( values, count, 0.99 ),
+		percentile( values, count, 1.00 ),
+		count);
+}
+
+void
+report( double first_paired, double ended )
+{
+	unsigned long long received;
+	unsigned long long mismatches;
+	unsigned int i;
+
+	received = 0;
+	mismatches = 0;
+	for( i = 0; i < session_count; i++ ) {
+		received += sessions[i].received[DOWN] + sessions[i].received[UP];
+		mismatches += sessions[i].mismatches;
+	}
+
+	printf("sessions:          %u (%u completed, %u failed)\n", session_count, finished_count, failed_count);
+	printf("paired:            %u\n", paired_count);
+	print_latency("server to viewer: ", latencies[DOWN], latency_count[DOWN]);
+	print_latency("viewer to server: ", latencies[UP], latency_count[UP]);
+	if( options.speed > 0 )
+		print_latency("schedule lag:     ", lags, lag_count);
+	printf("relayed:           %llu bytes in %.3f s\n", received,
+		( first_paired != 0 ) ? ended - first_paired : 0.0);
+	printf("relay throughput:  %.1f MiB/s\n",
+		( ( first_paired != 0 ) && ( ended > first_paired ) ) ? received / ( ended - first_paired ) / ( 1024.0 * 1024.0 ) : 0.0);
+	printf("mismatched bytes:  %llu\n", mismatches);
+}
+
+
+/*****************************************************************************
+ *
+ * Main entry point
+ *
+ *****************************************************************************/
+
+int main(int argc, char **argv)
+{
+	struct epoll_event events[REPLAY_MAX_EVENTS];
+	replay_conn * conn;
+	replay_session * session;
+	double first_paired, deadline, now, wake;
+	unsigned int i;
+	int first_file;
+	int timeout;
+	int n, rc;
+
+	options.host = "127.0.0.1";
+	options.server_port = 5500;
+	options.viewer_port = 5900;
+	options.base_id = 1000;
+	options.copies = 1;
+	options.speed = 1.0;
+	options.timeout = 120;
+
+	for( i = 1; ( i < (unsigned int)argc ) && ( argv[i][0] == '-' ); i++ ) {
+		if( i + 1 == (unsigned int)argc )
+			usage( argv[0] );
+
+		if( strcmp( argv[i], "-host" ) == 0 )
+			options.host = argv[++i];
+		else if( strcmp( argv[i], "-server" ) == 0 )
+			options.server_port = (u_short)atoi( argv[++i] );
+		else if( strcmp( argv[i], "-viewer" ) == 0 )
+			options.viewer_port = (u_short)atoi( argv[++i] );
+		else if( strcmp( argv[i], "-id" ) == 0 )
+			options.base_id = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-copies" ) == 0 )
+			options.copies = atoi( argv[++i] );
+		else if( strcmp( argv[i], "-speed" ) == 0 )
+			options.speed = atof( argv[++i] );
+		else if( strcmp( argv[i], "-timeout" ) == 0 )
+			options.timeout = atoi( argv[++i] );
+		else
+			usage( argv[0] );
+	}
+	first_file = i;
+
+	if( ( first_file == argc ) || ( options.copies == 0 ) || ( options.speed < 0 ) )
+		usage( argv[0] );
+
+	capture_count = argc - first_file;
+	session_count = capture_count * options.copies;
+	if( options.base_id == 0 || options.base_id + session_count > 99999999 ) {
+		fprintf(stderr, "Repeater IDs must be between 1 and 99999999.\n");
+		return 1;
+	}
+
+	memset( &server_addr, 0, sizeof(server_addr) );
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons( options.server_port );
+	if( inet_pton( AF_INET, options.host, &server_addr.sin_addr ) != 1 ) {
+		fprintf(stderr, "Invalid address %s.\n", options.host);
+		return 1;
+	}
+	memcpy( &viewer_addr, &server_addr, sizeof(viewer_addr) );
+	viewer_addr.sin_port = htons( options.viewer_port );
+
+	captures = (replay_capture *)calloc( capture_count, sizeof(replay_capture) );
+	sessions = (replay_session *)calloc( session_count, sizeof(replay_session) );
+	latencies[DOWN] = (double *)malloc( MAX_SAMPLES * sizeof(double) );
+	latencies[UP] = (double *)malloc( MAX_SAMPLES * sizeof(double) );
+	lags = (double *)malloc( MAX_SAMPLES * sizeof(double) );
+	if( ( captures == NULL ) || ( sessions == NULL ) || ( latencies[DOWN] == NULL ) || ( latencies[UP] == NULL ) || ( lags == NULL ) ) {
+		fprintf(stderr, "Not enough memory.\n");
+		return 1;
+	}
+
+	for( i = 0; i < capture_count; i++ ) {
+		if( load_capture( &captures[i], argv[first_file + i] ) != 0 )
+			return 1;
+		printf("%s: ID %u, %u records, %llu bytes from the server, %llu from the viewer, %.3f s\n",
+			captures[i].path, captures[i].id, captures[i].records,
+			captures[i].bytes[RECORDER_SERVER], captures[i].bytes[RECORDER_VIEWER], captures[i].duration / 1e6);
+	}
+
+	for( i = 0; i < session_count; i++ ) {
+		session = &sessions[i];
+		session->id = options.base_id + i;
+		session->capture = &captures[i % capture_count];
+		session->server.fd = -1;
+		session->server.role = DOWN;
+		session->server.session = session;
+		session->viewer.fd = -1;
+		session->viewer.role = UP;
+		session->viewer.session = session;
+		cursor_init( &session->play[DOWN], session->capture, RECORDER_SERVER );
+		cursor_init( &session->check, session->capture, RECORDER_SERVER );
+		cursor_init( &session->play[UP], session->capture, RECORDER_VIEWER );
+
+		/* ClientInit came from the repeater itself */
+		if( !session->play[UP].done && ( session->play[UP].len == 1 ) )
+			cursor_next( &session->play[UP] );
+	}
+
+	epfd = epoll_create( REPLAY_MAX_EVENTS );
+	if( epfd < 0 ) {
+		fprintf(stderr, "epoll_create() failed, errno=%d\n", errno);
+		return 1;
+	}
+
+	printf("Replay: %u sessions against %s (server port %d, viewer port %d), speed %g.\n",
+		session_count, options.host, options.server_port, options.viewer_port, options.speed);
+
+	deadline = now_seconds() + options.timeout;
+	first_paired = 0;
+	for( i = 0; i < session_count; i++ )
+		start_session( &sessions[i] );
+
+	while( finished_count + failed_count < session_count ) {
+		now = now_seconds();
+		if( now > deadline ) {
+			fprintf(stderr, "Timed out.\n");
+			break;
+		}
+
+		/* Records coming due */
+		wake = now + 0.1;
+		for( i = 0; i < session_count; i++ ) {
+			session = &sessions[i];
+			if( ( session->finished != 0 ) || ( session->server.state != SERVER_PLAYING ) )
+				continue;
+			if( first_paired == 0 )
+				first_paired = session->paired;
+			if( session->paired < first_paired )
+				first_paired = session->paired;
+
+			rc = play( session, DOWN, now, &wake );
+			if( ( rc == 0 ) && ( session->viewer.state == VIEWER_PLAYING ) )
+				rc = play( session, UP, now, &wake );
+			if( rc != 0 ) {
+				fprintf(stderr, "Session %u failed (send, errno=%d).\n", session->id, errno);
+				finish_session( session, TRUE );
+				continue;
+			}
+			check_done( session );
+		}
+
+		timeout = (int)( ( wake - now_seconds() ) * 1000.0 + 0.999 );
+		if( timeout < 0 )
+			timeout = 0;
+		n = epoll_wait( epfd, events, REPLAY_MAX_EVENTS, timeout );
+		if( n < 0 ) {
+			if( errno == EINTR )
+				continue;
+			fprintf(stderr, "epoll_wait() failed, errno=%d\n", errno);
+			break;
+		}
+
+		for( i = 0; i < (unsigned int)n; i++ ) {
+			conn = (replay_conn *)events[i].data.ptr;
+			if( conn->session->finished != 0 )
+				continue;
+
+			if( conn->role == DOWN )
+				rc = handle_server( conn->session, events[i].events );
+			else
+				rc = handle_viewer( conn->session, events[i].events );
+
+			if( rc != 0 ) {
+				fprintf(stderr, "Session %u failed (%s, errno=%d).\n", conn->session->id,
+					( conn->role == DOWN ) ? "server" : "viewer", errno);
+				finish_session( conn->session, TRUE );
+			}
+		}
+	}
+
+	report( first_paired, now_seconds() );
+
+	for( i = 0; i < session_count; i++ ) {
+		close_connection( &sessions[i].server );
+		close_connection( &sessions[i].viewer );
+	}
+	for( i = 0; i < capture_count; i++ ) {
+		if( captures[i].data != NULL )
+			munmap( (void *)captures[i].data, captures[i].size );
+	}
+	close( epfd );
+	free( sessions );
+	free( captures );
+	free( latencies[DOWN] );
+	free( latencies[UP] );
+	free( lags );
+
+	return ( failed_count == 0 ) ? 0 : 1;
+}
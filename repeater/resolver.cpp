@@ -0,0 +1,212 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mutex.h"
+#include "sockets.h"
+#include "repeater.h"
+#include "rfb.h"        /* CARD8 */
+#include "vncauth.h"    /* CHALLENGESIZE */
+#include "slots.h"      /* MAX_HOST_NAME_LEN */
+#include "resolver.h"
+
+
+typedef struct _resolver_entry {
+	char host[MAX_HOST_NAME_LEN + 1];
+	struct in_addr addr;
+	unsigned long expires;          /* 0 for a free entry */
+	int failed;
+} resolver_entry;
+
+/* Everything below is under mutex_resolver */
+static resolver_entry resolver_cache[RESOLVER_ENTRIES];
+static resolver_stats resolver;
+static mutex_t mutex_resolver;
+static int resolver_running = 0;
+
+
+/*****************************************************************************
+ *
+ * Cache
+ *
+ *****************************************************************************/
+
+/* Called under mutex_resolver. The entry for host, or NULL. */
+static resolver_entry *
+resolver_find(const char * host, unsigned long now)
+{
+	unsigned int i;
+
+	for( i = 0; i < RESOLVER_ENTRIES; i++ ) {
+		if( ( resolver_cache[i].expires > now ) && ( strcmp( resolver_cache[i].host, host ) == 0 ) )
+			return &resolver_cache[i];
+	}
+	return NULL;
+}
+
+/* Called under mutex_resolver. A free or expired entry, else the one closest to expiring. */
+static resolver_entry *
+resolver_victim(unsigned long now)
+{
+	resolver_entry * victim;
+	unsigned int i;
+
+	victim = &resolver_cache[0];
+	for( i = 0; i < RESOLVER_ENTRIES; i++ ) {
+		if( resolver_cache[i].expires <= now )
+			return &resolver_cache[i];
+		if( resolver_cache[i].expires < victim->expires )
+			victim = &resolver_cache[i];
+	}
+	return victim;
+}
+
+/* The lookup itself, without the lock: other threads go on meanwhile */
+static int
+resolver_resolve(const char * host, struct in_addr * addr)
+{
+#ifdef WIN32
+	struct hostent * entry;
+
+	entry = gethostbyname( host );
+	if( ( entry == NULL ) || ( entry->h_addrtype != AF_INET ) )
+		return -1;
+	memcpy( addr, entry->h_addr_list[0], sizeof(struct in_addr) );
+	return 0;
+#else
+	struct addrinfo hints;
+	struct addrinfo * result;
+
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if( ( getaddrinfo( host, NULL, &hints, &result ) != 0 ) || ( result == NULL ) )
+		return -1;
+	*addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+	freeaddrinfo( result );
+	return 0;
+#endif
+}
+
+
+/*****************************************************************************
+ *
+ * Resolver
+ *
+ *****************************************************************************/
+
+int
+ResolverInit( void )
+{
+	if( mutex_init( &mutex_resolver ) != 0 ) {
+		error("Failed to create the resolver mutex.\n");
+		return -1;
+	}
+	memset( resolver_cache, 0, sizeof(resolver_cache) );
+	memset( &resolver, 0, sizeof(resolver) );
+	resolver_running = 1;
+	return 0;
+}
+
+void
+ResolverFree( void )
+{
+	if( resolver_running ) {
+		resolver_running = 0;
+		mutex_destroy( &mutex_resolver );
+	}
+}
+
+int
+ResolverLookup(const char * host, struct in_addr * addr)
+{
+	resolver_entry * entry;
+	unsigned long now;
+	int result;
+
+	addr->s_addr = inet_addr( host );
+	if( addr->s_addr != INADDR_NONE )
+		return 0;
+	if( !resolver_running || ( strlen( host ) > MAX_HOST_NAME_LEN ) )
+		return -1;
+
+	now = (unsigned long)time(NULL);
+	mutex_lock( &mutex_resolver );
+	entry = resolver_find( host, now );
+	if( entry != NULL ) {
+		resolver.hits++;
+		*addr = entry->addr;
+		result = entry->failed ? -1 : 0;
+		mutex_unlock( &mutex_resolver );
+		return result;
+	}
+	resolver.misses++;
+	mutex_unlock( &mutex_resolver );
+
+	/* Two viewers asking at once both resolve, the second answer stays */
+	result = resolver_resolve( host, addr );
+
+	now = (unsigned long)time(NULL);
+	mutex_lock( &mutex_resolver );
+	entry = resolver_find( host, now );
+	if( entry == NULL ) {
+		entry = resolver_victim( now );
+		strcpy( entry->host, host );
+	}
+	entry->addr = *addr;
+	entry->failed = ( result != 0 );
+	entry->expires = now + ( ( result != 0 ) ? RESOLVER_NEGATIVE_TTL : RESOLVER_TTL );
+	if( result != 0 )
+		resolver.failures++;
+	mutex_unlock( &mutex_resolver );
+
+	return result;
+}
+
+void
+ResolverGetStats(resolver_stats * stats)
+{
+	unsigned long now;
+	unsigned int i;
+
+	if( !resolver_running ) {
+		memset( stats, 0, sizeof(resolver_stats) );
+		return;
+	}
+
+	now = (unsigned long)time(NULL);
+	mutex_lock( &mutex_resolver );
+	*stats = resolver;
+	stats->entries = 0;
+	for( i = 0; i < RESOLVER_ENTRIES; i++ ) {
+		if( resolver_cache[i].expires > now )
+			stats->entries++;
+	}
+	mutex_unlock( &mutex_resolver );
+}
@@ -0,0 +1,55 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+/**
+ * Host names asked for by Mode I viewers, resolved once and kept for
+ * RESOLVER_TTL seconds, failures for RESOLVER_NEGATIVE_TTL, so a viewer
+ * reconnecting to the same host does not wait on DNS again. The cache
+ * holds RESOLVER_ENTRIES names; a new one replaces the entry closest to
+ * expiring. Dotted addresses are not cached, they need no lookup.
+ */
+#define RESOLVER_ENTRIES	256
+#define RESOLVER_TTL		60
+#define RESOLVER_NEGATIVE_TTL	10
+
+typedef struct _resolver_stats {
+	unsigned int entries;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long failures;
+} resolver_stats;
+
+int ResolverInit( void );
+void ResolverFree( void );
+
+/* IPv4 address of host into addr. Returns 0, or -1 if it does not resolve. */
+int ResolverLookup(const char * host, struct in_addr * addr);
+
+void ResolverGetStats(resolver_stats * stats);
+
+#endif
@@ -0,0 +1,541 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfb.h"
+#include "rfbstream.h"
+
+
+static CARD16
+read_card16(const char * buf)
+{
+	return (CARD16)( ( (unsigned char)buf[0] << 8 ) | (unsigned char)buf[1] );
+}
+
+static CARD32
+read_card32(const char * buf)
+{
+	return ( (CARD32)(unsigned char)buf[0] << 24 ) | ( (CARD32)(unsigned char)buf[1] << 16 ) |
+		( (CARD32)(unsigned char)buf[2] << 8 ) | (CARD32)(unsigned char)buf[3];
+}
+
+
+int
+RfbClientMessageLength(const char * buf, unsigned int len)
+{
+	if( len < 1 )
+		return RFB_NEED_MORE;
+
+	switch( (unsigned char)buf[0] ) {
+	case rfbSetPixelFormat:
+		return sz_rfbSetPixelFormatMsg;
+
+	case rfbSetEncodings:
+		if( len < sz_rfbSetEncodingsMsg )
+			return RFB_NEED_MORE;
+		return sz_rfbSetEncodingsMsg + read_card16( buf + 2 ) * 4;
+
+	case rfbFramebufferUpdateRequest:
+		return sz_rfbFramebufferUpdateRequestMsg;
+
+	case rfbKeyEvent:
+		return sz_rfbKeyEventMsg;
+
+	case rfbPointerEvent:
+		return sz_rfbPointerEventMsg;
+
+	case rfbClientCutText:
+		if( len < sz_rfbClientCutTextMsg )
+			return RFB_NEED_MORE;
+		if( read_card32( buf + 4 ) > 0x7fffffff - sz_rfbClientCutTextMsg )
+			return RFB_UNKNOWN;
+		return sz_rfbClientCutTextMsg + (int)read_card32( buf + 4 );
+	}
+
+	/* Protocol extensions are relayed without parsing */
+	return RFB_UNKNOWN;
+}
+
+
+int
+RfbIsStatelessEncoding(CARD32 encoding)
+{
+	switch( encoding ) {
+	case rfbEncodingRaw:
+	case rfbEncodingCopyRect:
+	case rfbEncodingRRE:
+	case rfbEncodingCoRRE:
+	case rfbEncodingHextile:
+	case rfbEncodingXCursor:
+	case rfbEncodingRichCursor:
+	case rfbEncodingPointerPos:
+	case rfbEncodingLastRect:
+	case rfbEncodingNewFBSize:
+		return 1;
+	}
+
+	/* Compression and quality hints never show up in the stream */
+	if( ( encoding >= rfbEncodingCompressLevel0 ) && ( encoding <= rfbEncodingCompressLevel9 ) )
+		return 1;
+	if( ( encoding >= rfbEncodingQualityLevel0 ) && ( encoding <= rfbEncodingQualityLevel9 ) )
+		return 1;
+
+	return 0;
+}
+
+
+/*****************************************************************************
+ *
+ * Server to client stream
+ *
+ *****************************************************************************/
+
+#define RFB_STATE_SERVER_INIT	0
+#define RFB_STATE_NAME		1
+#define RFB_STATE_MESSAGE	2
+#define RFB_STATE_UPDATE	3
+#define RFB_STATE_RECT		4
+#define RFB_STATE_COLOURMAP	5
+#define RFB_STATE_CUTTEXT	6
+#define RFB_STATE_COPYRECT	7
+#define RFB_STATE_RRE		8
+#define RFB_STATE_RRE_SUBRECT	9
+#define RFB_STATE_HEXTILE	10
+#define RFB_STATE_LENGTH	11
+
+#define RFB_AFTER_MESSAGE	0
+#define RFB_AFTER_RECT		1
+#define RFB_AFTER_TILE		2
+
+static void
+rfb_event(rfb_server_stream * st, int event, const char * data, unsigned int len)
+{
+	if( st->update != NULL )
+		st->update( st->update_ctx, st, event, data, len );
+}
+
+static void
+rfb_expect(rfb_server_stream * st, int state, unsigned int need)
+{
+	st->state = state;
+	st->unit_len = 0;
+	st->unit_need = need;
+}
+
+static int
+rfb_message_done(rfb_server_stream * st)
+{
+	rfb_expect( st, RFB_STATE_MESSAGE, 1 );
+	return 1;
+}
+
+static int
+rfb_next_rect(rfb_server_stream * st)
+{
+	st->rects_left--;
+	if( st->rects_left == 0 )
+		return rfb_message_done( st );
+
+	rfb_expect( st, RFB_STATE_RECT, sz_rfbFramebufferUpdateRectHeader );
+	return 0;
+}
+
+static int
+rfb_next_tile(rfb_server_stream * st)
+{
+	st->tile_x += 16;
+	if( st->tile_x >= st->rect.w ) {
+		st->tile_x = 0;
+		st->tile_y += 16;
+	}
+	if( st->tile_y >= st->rect.h )
+		return rfb_next_rect( st );
+
+	st->tile_phase = 0;
+	rfb_expect( st, RFB_STATE_HEXTILE, 1 );
+	return 0;
+}
+
+static int
+rfb_continue(rfb_server_stream * st, int after)
+{
+	switch( after ) {
+	case RFB_AFTER_RECT:
+		return rfb_next_rect( st );
+	case RFB_AFTER_TILE:
+		return rfb_next_tile( st );
+	}
+	return rfb_message_done( st );
+}
+
+/* Pass over n payload bytes, then carry on with the next unit */
+static int
+rfb_skip(rfb_server_stream * st, unsigned long long n, int after)
+{
+	if( n == 0 )
+		return rfb_continue( st, after );
+
+	st->skip = n;
+	st->after_skip = after;
+	st->skip_event = 0;
+	st->unit_len = 0;
+	st->unit_need = 0;
+	return 0;
+}
+
+static int
+rfb_rect_header(rfb_server_stream * st)
+{
+	unsigned long long w;
+	unsigned long long h;
+	unsigned long long mask;
+
+	st->rect.x = read_card16( st->unit );
+	st->rect.y = read_card16( st->unit + 2 );
+	st->rect.w = read_card16( st->unit + 4 );
+	st->rect.h = read_card16( st->unit + 6 );
+	st->encoding = read_card32( st->unit + 8 );
+
+	w = st->rect.w;
+	h = st->rect.h;
+	mask = ( ( w + 7 ) / 8 ) * h;
+
+	rfb_event( st, RFB_EVENT_RECT, NULL, 0 );
+
+	switch( st->encoding ) {
+	case rfbEncodingRaw:
+		if( w * h == 0 )
+			return rfb_next_rect( st );
+		/* The pixels go to the decoder as they arrive */
+		rfb_skip( st, w * h * st->bpp, RFB_AFTER_RECT );
+		st->skip_event = RFB_EVENT_RAW;
+		return 0;
+
+	case rfbEncodingCopyRect:
+		rfb_expect( st, RFB_STATE_COPYRECT, 4 );
+		return 0;
+
+	case rfbEncodingRRE:
+	case rfbEncodingCoRRE:
+		rfb_expect( st, RFB_STATE_RRE, 4 + st->bpp );
+		return 0;
+
+	case rfbEncodingHextile:
+		st->tile_x = 0;
+		st->tile_y = 0;
+		st->tile_phase = 0;
+		if( ( w == 0 ) || ( h == 0 ) )
+			return rfb_next_rect( st );
+		rfb_expect( st, RFB_STATE_HEXTILE, 1 );
+		return 0;
+
+	case rfbEncodingZlib:
+	case rfbEncodingZRLE:
+		/* Length prefixed, but the decoder keeps its zlib stream */
+		st->stateful = 1;
+		rfb_expect( st, RFB_STATE_LENGTH, 4 );
+		return 0;
+
+	case rfbEncodingXCursor:
+		if( w * h == 0 )
+			return rfb_next_rect( st );
+		return rfb_skip( st, 6 + 2 * mask, RFB_AFTER_RECT );
+
+	case rfbEncodingRichCursor:
+		return rfb_skip( st, w * h * st->bpp + mask, RFB_AFTER_RECT );
+
+	case rfbEncodingPointerPos:
+		return rfb_next_rect( st );
+
+	case rfbEncodingNewFBSize:
+		st->width = st->rect.w;
+		st->height = st->rect.h;
+		return rfb_next_rect( st );
+
+	case rfbEncodingLastRect:
+		return rfb_message_done( st );
+	}
+
+	return -1;
+}
+
+static int
+rfb_hextile(rfb_server_stream * st)
+{
+	unsigned int subencoding;
+	unsigned int tw;
+	unsigned int th;
+	unsigned int fixed;
+	unsigned int per_subrect;
+
+	subencoding = (unsigned char)st->unit[0];
+	tw = ( st->rect.w - st->tile_x < 16 ) ? st->rect.w - st->tile_x : 16;
+	th = ( st->rect.h - st->tile_y < 16 ) ? st->rect.h - st->tile_y : 16;
+
+	fixed = 0;
+	if( subencoding & rfbHextileBackgroundSpecified )
+		fixed += st->bpp;
+	if( subencoding & rfbHextileForegroundSpecified )
+		fixed += st->bpp;
+	if( subencoding & rfbHextileAnySubrects )
+		fixed++;
+
+	switch( st->tile_phase ) {
+	case 0:
+		if( subencoding & rfbHextileRaw ) {
+			st->tile_phase = 2;
+			st->unit_need = 1 + tw * th * st->bpp;
+			return 0;
+		}
+		if( fixed == 0 ) {
+			rfb_event( st, RFB_EVENT_HEXTILE, st->unit, st->unit_len );
+			return rfb_next_tile( st );
+		}
+		st->tile_phase = 1;
+		st->unit_need = 1 + fixed;
+		return 0;
+
+	case 1:
+		if( ( subencoding & rfbHextileAnySubrects ) && ( st->unit[fixed] != 0 ) ) {
+			per_subrect = ( subencoding & rfbHextileSubrectsColoured ) ? st->bpp + 2 : 2;
+			st->tile_phase = 2;
+			st->unit_need = 1 + fixed + (unsigned char)st->unit[fixed] * per_subrect;
+			return 0;
+		}
+		break;
+	}
+
+	rfb_event( st, RFB_EVENT_HEXTILE, st->unit, st->unit_len );
+	return rfb_next_tile( st );
+}
+
+/* A complete unit has been accumulated */
+static int
+rfb_unit_done(rfb_server_stream * st)
+{
+	unsigned int n;
+
+	switch( st->state ) {
+	case RFB_STATE_SERVER_INIT:
+		st->width = read_card16( st->unit );
+		st->height = read_card16( st->unit + 2 );
+		memcpy( &st->format, st->unit + 4, sz_rfbPixelFormat );
+		if( RfbServerStreamSetFormat( st, &st->format ) != 0 )
+			return -1;
+		st->name_len = read_card32( st->unit + 20 );
+		if( st->name_len == 0 ) {
+			st->initialized = 1;
+			return rfb_message_done( st );
+		}
+		/* Keep a sane amount of the desktop name, skip the rest */
+		rfb_expect( st, RFB_STATE_NAME, ( st->name_len < RFB_UNIT_MAX ) ? st->name_len : RFB_UNIT_MAX );
+		return 0;
+
+	case RFB_STATE_NAME:
+		st->name = (char *)malloc( st->unit_len );
+		if( st->name == NULL )
+			return -1;
+		memcpy( st->name, st->unit, st->unit_len );
+		n = st->name_len - st->unit_len;
+		st->name_len = st->unit_len;
+		st->initialized = 1;
+		return rfb_skip( st, n, RFB_AFTER_MESSAGE );
+
+	case RFB_STATE_MESSAGE:
+		st->msg_type = (CARD8)st->unit[0];
+		st->stateful = 0;
+		switch( st->msg_type ) {
+		case rfbFramebufferUpdate:
+			st->unit_need = sz_rfbFramebufferUpdateMsg;
+			st->state = RFB_STATE_UPDATE;
+			return 0;
+		case rfbSetColourMapEntries:
+			st->unit_need = sz_rfbSetColourMapEntriesMsg;
+			st->state = RFB_STATE_COLOURMAP;
+			return 0;
+		case rfbBell:
+			return rfb_message_done( st );
+		case rfbServerCutText:
+			st->unit_need = sz_rfbServerCutTextMsg;
+			st->state = RFB_STATE_CUTTEXT;
+			return 0;
+		}
+		return -1;
+
+	case RFB_STATE_UPDATE:
+		st->rects_left = read_card16( st->unit + 2 );
+		if( st->rects_left == 0 )
+			return rfb_message_done( st );
+		rfb_expect( st, RFB_STATE_RECT, sz_rfbFramebufferUpdateRectHeader );
+		return 0;
+
+	case RFB_STATE_COLOURMAP:
+		return rfb_skip( st, 6 * (unsigned long long)read_card16( st->unit + 4 ), RFB_AFTER_MESSAGE );
+
+	case RFB_STATE_CUTTEXT:
+		return rfb_skip( st, read_card32( st->unit + 4 ), RFB_AFTER_MESSAGE );
+
+	case RFB_STATE_RECT:
+		return rfb_rect_header( st );
+
+	case RFB_STATE_COPYRECT:
+		rfb_event( st, RFB_EVENT_COPYRECT, st->unit, st->unit_len );
+		return rfb_next_rect( st );
+
+	case RFB_STATE_RRE:
+		rfb_event( st, RFB_EVENT_RRE, st->unit, st->unit_len );
+		st->subrects_left = read_card32( st->unit );
+		if( st->subrects_left == 0 )
+			return rfb_next_rect( st );
+		n = ( st->encoding == rfbEncodingRRE ) ? 8 : 4;
+		rfb_expect( st, RFB_STATE_RRE_SUBRECT, st->bpp + n );
+		return 0;
+
+	case RFB_STATE_RRE_SUBRECT:
+		rfb_event( st, RFB_EVENT_RRE_SUBRECT, st->unit, st->unit_len );
+		st->subrects_left--;
+		if( st->subrects_left == 0 )
+			return rfb_next_rect( st );
+		st->unit_len = 0;
+		return 0;
+
+	case RFB_STATE_HEXTILE:
+		return rfb_hextile( st );
+
+	case RFB_STATE_LENGTH:
+		return rfb_skip( st, read_card32( st->unit ), RFB_AFTER_RECT );
+	}
+
+	return -1;
+}
+
+
+void
+RfbServerStreamInit(rfb_server_stream * st)
+{
+	memset( st, 0, sizeof(rfb_server_stream) );
+	rfb_expect( st, RFB_STATE_SERVER_INIT, sz_rfbServerInitMsg );
+}
+
+
+void
+RfbServerStreamFree(rfb_server_stream * st)
+{
+	if( st->name != NULL )
+		free( st->name );
+	st->name = NULL;
+}
+
+
+int
+RfbServerStreamFeed(rfb_server_stream * st, const char * buf, unsigned int len, int * message_end)
+{
+	unsigned int pos;
+	unsigned int take;
+	int result;
+
+	*message_end = 0;
+	pos = 0;
+	while( pos < len ) {
+		if( st->skip > 0 ) {
+			take = ( st->skip < (unsigned long long)( len - pos ) ) ? (unsigned int)st->skip : len - pos;
+			if( st->skip_event != 0 )
+				rfb_event( st, st->skip_event, buf + pos, take );
+			pos += take;
+			st->skip -= take;
+			if( st->skip > 0 )
+				break;
+			result = rfb_continue( st, st->after_skip );
+		} else {
+			take = st->unit_need - st->unit_len;
+			if( take > len - pos )
+				take = len - pos;
+			memcpy( st->unit + st->unit_len, buf + pos, take );
+			st->unit_len += take;
+			pos += take;
+			if( st->unit_len < st->unit_need )
+				break;
+			result = rfb_unit_done( st );
+		}
+
+		if( result < 0 )
+			return RFB_UNKNOWN;
+		if( result > 0 ) {
+			*message_end = 1;
+			break;
+		}
+	}
+
+	return (int)pos;
+}
+
+
+int
+RfbServerStreamIdle(rfb_server_stream * st)
+{
+	return ( st->state == RFB_STATE_MESSAGE ) && ( st->unit_len == 0 ) && ( st->skip == 0 );
+}
+
+
+int
+RfbServerStreamSetFormat(rfb_server_stream * st, const rfbPixelFormat * format)
+{
+	switch( format->bitsPerPixel ) {
+	case 8:
+	case 16:
+	case 32:
+		break;
+	default:
+		return -1;
+	}
+
+	memmove( &st->format, format, sizeof(rfbPixelFormat) );
+	st->bpp = format->bitsPerPixel / 8;
+	return 0;
+}
+
+
+unsigned int
+RfbServerStreamInitMessage(rfb_server_stream * st, char * buf, unsigned int size)
+{
+	unsigned char * p;
+
+	if( size < sz_rfbServerInitMsg + st->name_len )
+		return 0;
+
+	p = (unsigned char *)buf;
+	p[0] = (unsigned char)( st->width >> 8 );
+	p[1] = (unsigned char)st->width;
+	p[2] = (unsigned char)( st->height >> 8 );
+	p[3] = (unsigned char)st->height;
+	memcpy( p + 4, &st->format, sz_rfbPixelFormat );
+	p[20] = (unsigned char)( st->name_len >> 24 );
+	p[21] = (unsigned char)( st->name_len >> 16 );
+	p[22] = (unsigned char)( st->name_len >> 8 );
+	p[23] = (unsigned char)st->name_len;
+	if( st->name_len > 0 )
+		memcpy( p + sz_rfbServerInitMsg, st->name, st->name_len );
+
+	return sz_rfbServerInitMsg + st->name_len;
+}
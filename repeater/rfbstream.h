@@ -0,0 +1,134 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef _RFBSTREAM_H
+#define _RFBSTREAM_H
+
+/*
+ * Helpers to find message boundaries in an RFB 3.3 stream once the
+ * handshake is over. They never consume data; the relay keeps forwarding
+ * bytes unchanged and only uses the boundaries for scheduling decisions.
+ */
+
+#define RFB_NEED_MORE	0
+#define RFB_UNKNOWN		-1
+
+/**
+ * Length of the client to server message at the start of buf,
+ * RFB_NEED_MORE if the header is not complete yet or RFB_UNKNOWN if the
+ * message type can not be parsed (the stream must be relayed blindly from
+ * then on).
+ */
+int RfbClientMessageLength(const char * buf, unsigned int len);
+
+/**
+ * Encodings the server stream parser can follow without keeping any
+ * decoder state, so a viewer can start receiving at any message boundary.
+ */
+int RfbIsStatelessEncoding(CARD32 encoding);
+
+
+/*****************************************************************************
+ *
+ * Server to client stream
+ *
+ *****************************************************************************/
+
+/**
+ * Largest unit (header, hextile tile...) the parser needs to see at once.
+ */
+#define RFB_UNIT_MAX	2048
+
+/**
+ * Framebuffer content seen by the parser, for decoders following along.
+ */
+#define RFB_EVENT_RECT		1	/* New rectangle in st->rect, st->encoding */
+#define RFB_EVENT_RAW		2	/* Next bytes of a Raw rectangle */
+#define RFB_EVENT_COPYRECT	3	/* Source position */
+#define RFB_EVENT_RRE		4	/* Subrectangle count and background */
+#define RFB_EVENT_RRE_SUBRECT	5	/* One RRE or CoRRE subrectangle */
+#define RFB_EVENT_HEXTILE	6	/* One complete tile at st->tile_x, st->tile_y */
+
+struct _rfb_server_stream;
+typedef void (*rfb_update_callback)(void * ctx, struct _rfb_server_stream * st, int event, const char * data, unsigned int len);
+
+typedef struct _rfb_server_stream {
+	int state;
+	int after_skip;            /* What to do once the skipped data is over */
+	char unit[RFB_UNIT_MAX];   /* Accumulates the current header or tile */
+	unsigned int unit_len;
+	unsigned int unit_need;
+	unsigned long long skip;   /* Payload bytes to pass over */
+
+	/* Desktop, as announced by ServerInit and changed by the client */
+	int initialized;
+	CARD16 width;
+	CARD16 height;
+	rfbPixelFormat format;     /* Network byte order */
+	unsigned int bpp;          /* Bytes per pixel */
+	char * name;
+	CARD32 name_len;
+
+	/* Current message */
+	CARD8 msg_type;
+	unsigned int rects_left;
+	rfbRectangle rect;
+	CARD32 encoding;
+	CARD32 subrects_left;
+	unsigned int tile_x;
+	unsigned int tile_y;
+	int tile_phase;
+	int stateful;              /* Uses an encoding with decoder state */
+
+	/* Optional decoder */
+	rfb_update_callback update;
+	void * update_ctx;
+	int skip_event;            /* Event for the skipped payload, if any */
+} rfb_server_stream;
+
+void RfbServerStreamInit(rfb_server_stream * st);
+void RfbServerStreamFree(rfb_server_stream * st);
+
+/**
+ * Parse len bytes of the server stream. Returns the number of bytes
+ * consumed or RFB_UNKNOWN if the stream can not be followed. Parsing stops
+ * right after the end of a message, setting *message_end.
+ */
+int RfbServerStreamFeed(rfb_server_stream * st, const char * buf, unsigned int len, int * message_end);
+
+/**
+ * True when the parser sits on a message boundary.
+ */
+int RfbServerStreamIdle(rfb_server_stream * st);
+
+/**
+ * The client changed the pixel format used by the following updates.
+ */
+int RfbServerStreamSetFormat(rfb_server_stream * st, const rfbPixelFormat * format);
+
+/**
+ * Write a ServerInit message describing the current desktop into buf.
+ * Returns the message length, or 0 if buf is too small.
+ */
+unsigned int RfbServerStreamInitMessage(rfb_server_stream * st, char * buf, unsigned int size);
+
+#endif
@@ -0,0 +1,531 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfb.h"
+#include "rfbstream.h"
+#include "shadow.h"
+
+
+static unsigned int
+read_card16(const char * buf)
+{
+	return ( (unsigned char)buf[0] << 8 ) | (unsigned char)buf[1];
+}
+
+/* Start over with an unpainted framebuffer */
+static int
+shadow_resize(shadow_framebuffer * fb, unsigned int width, unsigned int height, unsigned int bpp)
+{
+	unsigned long long size;
+
+	ShadowFree( fb );
+
+	size = (unsigned long long)width * height * bpp;
+	if( ( size == 0 ) || ( size > SHADOW_MAX_BYTES ) )
+		return -1;
+
+	fb->pixels = (char *)malloc( (size_t)size );
+	fb->painted = (unsigned char *)calloc( ( (size_t)width * height + 7 ) / 8, 1 );
+	if( ( fb->pixels == NULL ) || ( fb->painted == NULL ) ) {
+		ShadowFree( fb );
+		return -1;
+	}
+
+	fb->width = width;
+	fb->height = height;
+	fb->bpp = bpp;
+	fb->stride = width * bpp;
+	fb->unpainted = (unsigned long)width * height;
+	return 0;
+}
+
+/* Clip a rectangle to the framebuffer. Returns 0 if nothing is left. */
+static int
+shadow_clip(shadow_framebuffer * fb, unsigned int * x, unsigned int * y, unsigned int * w, unsigned int * h)
+{
+	if( ( *x >= fb->width ) || ( *y >= fb->height ) )
+		return 0;
+	if( *w > fb->width - *x )
+		*w = fb->width - *x;
+	if( *h > fb->height - *y )
+		*h = fb->height - *y;
+	return ( *w > 0 ) && ( *h > 0 );
+}
+
+static void
+shadow_mark(shadow_framebuffer * fb, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	unsigned long bit;
+	unsigned int i, j;
+
+	if( ( fb->unpainted == 0 ) || !shadow_clip( fb, &x, &y, &w, &h ) )
+		return;
+
+	for( j = y; j < y + h; j++ ) {
+		bit = (unsigned long)j * fb->width + x;
+		for( i = 0; i < w; i++, bit++ ) {
+			if( !( fb->painted[bit >> 3] & ( 1 << ( bit & 7 ) ) ) ) {
+				fb->painted[bit >> 3] |= ( 1 << ( bit & 7 ) );
+				fb->unpainted--;
+			}
+		}
+	}
+}
+
+static void
+shadow_fill(shadow_framebuffer * fb, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const char * pixel)
+{
+	char * row;
+	unsigned int i, j;
+
+	if( !shadow_clip( fb, &x, &y, &w, &h ) )
+		return;
+
+	for( j = y; j < y + h; j++ ) {
+		row = fb->pixels + j * fb->stride + x * fb->bpp;
+		for( i = 0; i < w; i++, row += fb->bpp )
+			memcpy( row, pixel, fb->bpp );
+	}
+}
+
+/* Rows of w pixels starting at x, y */
+static void
+shadow_put(shadow_framebuffer * fb, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const char * pixels)
+{
+	unsigned int cw;
+	unsigned int ch;
+	unsigned int j;
+
+	cw = w;
+	ch = h;
+	if( !shadow_clip( fb, &x, &y, &cw, &ch ) )
+		return;
+
+	for( j = 0; j < ch; j++ )
+		memcpy( fb->pixels + ( y + j ) * fb->stride + x * fb->bpp, pixels + j * w * fb->bpp, cw * fb->bpp );
+}
+
+static void
+shadow_copy(shadow_framebuffer * fb, unsigned int sx, unsigned int sy, rfbRectangle * r)
+{
+	unsigned int w, h, j;
+	unsigned int x, y;
+
+	x = r->x;
+	y = r->y;
+	w = r->w;
+	h = r->h;
+	if( !shadow_clip( fb, &x, &y, &w, &h ) || !shadow_clip( fb, &sx, &sy, &w, &h ) )
+		return;
+
+	/* Walk the rows so an overlapping source is read before it is written */
+	if( sy < y ) {
+		for( j = h; j > 0; j-- )
+			memmove( fb->pixels + ( y + j - 1 ) * fb->stride + x * fb->bpp, fb->pixels + ( sy + j - 1 ) * fb->stride + sx * fb->bpp, w * fb->bpp );
+	} else {
+		for( j = 0; j < h; j++ )
+			memmove( fb->pixels + ( y + j ) * fb->stride + x * fb->bpp, fb->pixels + ( sy + j ) * fb->stride + sx * fb->bpp, w * fb->bpp );
+	}
+}
+
+/* Raw pixels come in pieces of any size, even split in the middle of a pixel */
+static void
+shadow_raw(shadow_framebuffer * fb, rfbRectangle * r, const char * data, unsigned int len)
+{
+	unsigned long long row_bytes;
+	unsigned int row;
+	unsigned int col;
+	unsigned int take;
+	unsigned int visible;
+	unsigned int n;
+
+	row_bytes = (unsigned long long)r->w * fb->bpp;
+	visible = ( r->x < fb->width ) ? ( fb->width - r->x ) * fb->bpp : 0;
+	while( len > 0 ) {
+		row = (unsigned int)( fb->raw_offset / row_bytes );
+		col = (unsigned int)( fb->raw_offset % row_bytes );
+		take = ( row_bytes - col < len ) ? (unsigned int)( row_bytes - col ) : len;
+
+		/* Only the part of the row inside the framebuffer */
+		if( ( r->y + row < fb->height ) && ( col < visible ) ) {
+			n = ( take < visible - col ) ? take : visible - col;
+			memcpy( fb->pixels + ( r->y + row ) * fb->stride + r->x * fb->bpp + col, data, n );
+		}
+
+		data += take;
+		len -= take;
+		fb->raw_offset += take;
+	}
+}
+
+static void
+shadow_hextile(shadow_framebuffer * fb, rfb_server_stream * st, const char * tile)
+{
+	unsigned int subencoding;
+	unsigned int x, y, tw, th;
+	unsigned int count;
+	unsigned int i;
+	const char * p;
+	const char * colour;
+
+	x = st->rect.x + st->tile_x;
+	y = st->rect.y + st->tile_y;
+	tw = ( st->rect.w - st->tile_x < 16 ) ? st->rect.w - st->tile_x : 16;
+	th = ( st->rect.h - st->tile_y < 16 ) ? st->rect.h - st->tile_y : 16;
+
+	subencoding = (unsigned char)tile[0];
+	p = tile + 1;
+
+	if( subencoding & rfbHextileRaw ) {
+		shadow_put( fb, x, y, tw, th, p );
+		return;
+	}
+
+	if( subencoding & rfbHextileBackgroundSpecified ) {
+		memcpy( fb->hextile_bg, p, fb->bpp );
+		p += fb->bpp;
+	}
+	if( subencoding & rfbHextileForegroundSpecified ) {
+		memcpy( fb->hextile_fg, p, fb->bpp );
+		p += fb->bpp;
+	}
+	shadow_fill( fb, x, y, tw, th, fb->hextile_bg );
+
+	if( !( subencoding & rfbHextileAnySubrects ) )
+		return;
+
+	count = (unsigned char)*p++;
+	for( i = 0; i < count; i++ ) {
+		colour = fb->hextile_fg;
+		if( subencoding & rfbHextileSubrectsColoured ) {
+			colour = p;
+			p += fb->bpp;
+		}
+		shadow_fill( fb, x + ( (unsigned char)p[0] >> 4 ), y + ( p[0] & 0x0f ), ( (unsigned char)p[1] >> 4 ) + 1, ( p[1] & 0x0f ) + 1, colour );
+		p += 2;
+	}
+}
+
+
+void
+ShadowFree(shadow_framebuffer * fb)
+{
+	if( fb->pixels != NULL )
+		free( fb->pixels );
+	if( fb->painted != NULL )
+		free( fb->painted );
+	memset( fb, 0, sizeof(shadow_framebuffer) );
+}
+
+
+int
+ShadowValid(shadow_framebuffer * fb, rfb_server_stream * st)
+{
+	return ( fb->pixels != NULL ) && ( fb->unpainted == 0 ) && ( fb->width == st->width ) &&
+		( fb->height == st->height ) && ( fb->bpp == st->bpp ) && st->format.trueColour;
+}
+
+
+void
+ShadowUpdate(void * ctx, rfb_server_stream * st, int event, const char * data, unsigned int len)
+{
+	shadow_framebuffer * fb;
+	rfbRectangle * r;
+
+	fb = (shadow_framebuffer *)ctx;
+	r = &st->rect;
+
+	if( event == RFB_EVENT_RECT ) {
+		if( st->encoding == rfbEncodingNewFBSize ) {
+			shadow_resize( fb, r->w, r->h, st->bpp );
+			return;
+		}
+
+		/* The client changed the pixel format, or this is the first update */
+		if( ( fb->width != st->width ) || ( fb->height != st->height ) || ( fb->bpp != st->bpp ) ) {
+			if( shadow_resize( fb, st->width, st->height, st->bpp ) != 0 )
+				return;
+		}
+
+		fb->raw_offset = 0;
+		switch( st->encoding ) {
+		case rfbEncodingRaw:
+		case rfbEncodingCopyRect:
+		case rfbEncodingRRE:
+		case rfbEncodingCoRRE:
+		case rfbEncodingHextile:
+			/* Joins happen at message boundaries, when the rectangle is complete */
+			shadow_mark( fb, r->x, r->y, r->w, r->h );
+			break;
+		}
+		return;
+	}
+
+	if( fb->pixels == NULL )
+		return;
+
+	switch( event ) {
+	case RFB_EVENT_RAW:
+		shadow_raw( fb, r, data, len );
+		break;
+
+	case RFB_EVENT_COPYRECT:
+		shadow_copy( fb, read_card16( data ), read_card16( data + 2 ), r );
+		break;
+
+	case RFB_EVENT_RRE:
+		shadow_fill( fb, r->x, r->y, r->w, r->h, data + 4 );
+		break;
+
+	case RFB_EVENT_RRE_SUBRECT:
+		if( st->encoding == rfbEncodingRRE ) {
+			shadow_fill( fb, r->x + read_card16( data + fb->bpp ), r->y + read_card16( data + fb->bpp + 2 ),
+				read_card16( data + fb->bpp + 4 ), read_card16( data + fb->bpp + 6 ), data );
+		} else {
+			shadow_fill( fb, r->x + (unsigned char)data[fb->bpp], r->y + (unsigned char)data[fb->bpp + 1],
+				(unsigned char)data[fb->bpp + 2], (unsigned char)data[fb->bpp + 3], data );
+		}
+		break;
+
+	case RFB_EVENT_HEXTILE:
+		shadow_hextile( fb, st, data );
+		break;
+	}
+}
+
+
+unsigned int
+ShadowUpdateSize(shadow_framebuffer * fb)
+{
+	return sz_rfbFramebufferUpdateMsg + sz_rfbFramebufferUpdateRectHeader + fb->height * fb->stride;
+}
+
+
+unsigned int
+ShadowUpdateMessage(shadow_framebuffer * fb, char * buf, unsigned int size)
+{
+	unsigned char * p;
+
+	if( ( fb->pixels == NULL ) || ( size < ShadowUpdateSize( fb ) ) )
+		return 0;
+
+	p = (unsigned char *)buf;
+	memset( p, 0, sz_rfbFramebufferUpdateMsg + sz_rfbFramebufferUpdateRectHeader );
+	p[0] = rfbFramebufferUpdate;
+	p[3] = 1;
+	p += sz_rfbFramebufferUpdateMsg;
+
+	/* One Raw rectangle at 0,0 */
+	p[4] = (unsigned char)( fb->width >> 8 );
+	p[5] = (unsigned char)fb->width;
+	p[6] = (unsigned char)( fb->height >> 8 );
+	p[7] = (unsigned char)fb->height;
+	p += sz_rfbFramebufferUpdateRectHeader;
+
+	memcpy( p, fb->pixels, fb->height * fb->stride );
+	return ShadowUpdateSize( fb );
+}
+
+
+/*****************************************************************************
+ *
+ * Regions
+ *
+ *****************************************************************************/
+
+int
+ShadowRegionInit(shadow_region * region, shadow_framebuffer * fb)
+{
+	region->columns = ( fb->width + SHADOW_TILE - 1 ) / SHADOW_TILE;
+	region->rows = ( fb->height + SHADOW_TILE - 1 ) / SHADOW_TILE;
+	region->count = 0;
+	region->tiles = (unsigned char *)calloc( region->columns * region->rows + 1, 1 );
+	return ( region->tiles != NULL ) ? 0 : -1;
+}
+
+void
+ShadowRegionAdd(shadow_region * region, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	unsigned int column, row;
+	unsigned int last_column, last_row;
+
+	if( ( w == 0 ) || ( h == 0 ) )
+		return;
+
+	last_column = ( x + w - 1 ) / SHADOW_TILE;
+	last_row = ( y + h - 1 ) / SHADOW_TILE;
+	if( last_column >= region->columns )
+		last_column = region->columns - 1;
+	if( last_row >= region->rows )
+		last_row = region->rows - 1;
+
+	for( row = y / SHADOW_TILE; row <= last_row; row++ ) {
+		for( column = x / SHADOW_TILE; column <= last_column; column++ ) {
+			if( !region->tiles[row * region->columns + column] ) {
+				region->tiles[row * region->columns + column] = 1;
+				region->count++;
+			}
+		}
+	}
+}
+
+void
+ShadowRegionFree(shadow_region * region)
+{
+	if( region->tiles != NULL )
+		free( region->tiles );
+	region->tiles = NULL;
+	region->count = 0;
+}
+
+/* Walk the region as runs of dirty tiles, one rectangle per run */
+static int
+shadow_next_run(shadow_framebuffer * fb, shadow_region * region, unsigned int * index, rfbRectangle * r)
+{
+	unsigned int column, row, start;
+
+	while( *index < region->columns * region->rows ) {
+		if( !region->tiles[*index] ) {
+			(*index)++;
+			continue;
+		}
+
+		row = *index / region->columns;
+		start = *index % region->columns;
+		column = start;
+		while( ( column < region->columns ) && region->tiles[row * region->columns + column] )
+			column++;
+		*index = row * region->columns + column;
+
+		r->x = start * SHADOW_TILE;
+		r->y = row * SHADOW_TILE;
+		r->w = ( column * SHADOW_TILE > fb->width ) ? fb->width - r->x : ( column - start ) * SHADOW_TILE;
+		r->h = ( (unsigned int)r->y + SHADOW_TILE > fb->height ) ? fb->height - r->y : SHADOW_TILE;
+		return 1;
+	}
+	return 0;
+}
+
+static int
+shadow_solid(shadow_framebuffer * fb, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	const char * first;
+	const char * p;
+	unsigned int i, j;
+
+	first = fb->pixels + y * fb->stride + x * fb->bpp;
+	for( j = 0; j < h; j++ ) {
+		p = fb->pixels + ( y + j ) * fb->stride + x * fb->bpp;
+		for( i = 0; i < w; i++, p += fb->bpp ) {
+			if( memcmp( p, first, fb->bpp ) != 0 )
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+shadow_write_rect(unsigned char * p, rfbRectangle * r, CARD32 encoding)
+{
+	p[0] = (unsigned char)( r->x >> 8 );
+	p[1] = (unsigned char)r->x;
+	p[2] = (unsigned char)( r->y >> 8 );
+	p[3] = (unsigned char)r->y;
+	p[4] = (unsigned char)( r->w >> 8 );
+	p[5] = (unsigned char)r->w;
+	p[6] = (unsigned char)( r->h >> 8 );
+	p[7] = (unsigned char)r->h;
+	p[8] = (unsigned char)( encoding >> 24 );
+	p[9] = (unsigned char)( encoding >> 16 );
+	p[10] = (unsigned char)( encoding >> 8 );
+	p[11] = (unsigned char)encoding;
+}
+
+unsigned int
+ShadowRegionUpdateSize(shadow_framebuffer * fb, shadow_region * region, int hextile)
+{
+	unsigned int size;
+	unsigned int index;
+	rfbRectangle r;
+
+	size = sz_rfbFramebufferUpdateMsg;
+	index = 0;
+	while( shadow_next_run( fb, region, &index, &r ) ) {
+		/* Worst case for Hextile: every tile raw */
+		size += sz_rfbFramebufferUpdateRectHeader + r.w * r.h * fb->bpp;
+		if( hextile )
+			size += ( r.w + SHADOW_TILE - 1 ) / SHADOW_TILE;
+	}
+	return size;
+}
+
+unsigned int
+ShadowRegionUpdate(shadow_framebuffer * fb, shadow_region * region, int hextile, char * buf, unsigned int size)
+{
+	unsigned char * p;
+	unsigned int index;
+	unsigned int count;
+	unsigned int tx, tw, j;
+	rfbRectangle r;
+
+	if( ( fb->pixels == NULL ) || ( size < ShadowRegionUpdateSize( fb, region, hextile ) ) )
+		return 0;
+
+	p = (unsigned char *)buf + sz_rfbFramebufferUpdateMsg;
+	index = 0;
+	count = 0;
+	while( shadow_next_run( fb, region, &index, &r ) && ( count < 0xffff ) ) {
+		shadow_write_rect( p, &r, hextile ? rfbEncodingHextile : rfbEncodingRaw );
+		p += sz_rfbFramebufferUpdateRectHeader;
+		count++;
+
+		if( !hextile ) {
+			for( j = 0; j < r.h; j++, p += r.w * fb->bpp )
+				memcpy( p, fb->pixels + ( r.y + j ) * fb->stride + r.x * fb->bpp, r.w * fb->bpp );
+			continue;
+		}
+
+		/* Runs are one tile high: solid tiles cost a pixel, the others go raw */
+		for( tx = 0; tx < r.w; tx += SHADOW_TILE ) {
+			tw = ( r.w - tx < SHADOW_TILE ) ? r.w - tx : SHADOW_TILE;
+			if( shadow_solid( fb, r.x + tx, r.y, tw, r.h ) ) {
+				*p++ = rfbHextileBackgroundSpecified;
+				memcpy( p, fb->pixels + r.y * fb->stride + ( r.x + tx ) * fb->bpp, fb->bpp );
+				p += fb->bpp;
+			} else {
+				*p++ = rfbHextileRaw;
+				for( j = 0; j < r.h; j++, p += tw * fb->bpp )
+					memcpy( p, fb->pixels + ( r.y + j ) * fb->stride + ( r.x + tx ) * fb->bpp, tw * fb->bpp );
+			}
+		}
+	}
+
+	buf[0] = rfbFramebufferUpdate;
+	buf[1] = 0;
+	buf[2] = (char)( count >> 8 );
+	buf[3] = (char)count;
+	return (unsigned int)( (char *)p - buf );
+}
@@ -0,0 +1,94 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+#ifndef _SHADOW_H
+#define _SHADOW_H
+
+/**
+ * Largest framebuffer kept by the repeater for a single session.
+ */
+#define SHADOW_MAX_BYTES	(32 * 1024 * 1024)
+
+/**
+ * Copy of the server framebuffer, rebuilt from the updates it sends, so a
+ * late viewer gets the whole screen without asking the server.
+ */
+typedef struct _shadow_framebuffer {
+	char * pixels;
+	unsigned int width;
+	unsigned int height;
+	unsigned int bpp;               /* Bytes per pixel, in the client format */
+	unsigned int stride;
+
+	/* One bit per pixel until everything has been painted once */
+	unsigned char * painted;
+	unsigned long unpainted;
+
+	/* Decoder state */
+	unsigned long long raw_offset;  /* Progress inside the current Raw rectangle */
+	char hextile_bg[4];
+	char hextile_fg[4];
+} shadow_framebuffer;
+
+void ShadowFree(shadow_framebuffer * fb);
+
+/**
+ * True if the shadow holds the whole screen as described by the stream.
+ */
+int ShadowValid(shadow_framebuffer * fb, rfb_server_stream * st);
+
+/**
+ * Parser callback, ctx is the shadow_framebuffer.
+ */
+void ShadowUpdate(void * ctx, rfb_server_stream * st, int event, const char * data, unsigned int len);
+
+/**
+ * Size of, and a FramebufferUpdate with the whole screen as one Raw rectangle.
+ */
+unsigned int ShadowUpdateSize(shadow_framebuffer * fb);
+unsigned int ShadowUpdateMessage(shadow_framebuffer * fb, char * buf, unsigned int size);
+
+/**
+ * Screen areas a viewer has missed, in tiles.
+ */
+#define SHADOW_TILE	16
+
+typedef struct _shadow_region {
+	unsigned char * tiles;
+	unsigned int columns;
+	unsigned int rows;
+	unsigned int count;             /* Dirty tiles */
+} shadow_region;
+
+int ShadowRegionInit(shadow_region * region, shadow_framebuffer * fb);
+void ShadowRegionAdd(shadow_region * region, unsigned int x, unsigned int y, unsigned int w, unsigned int h);
+void ShadowRegionFree(shadow_region * region);
+
+/**
+ * Size of, and a FramebufferUpdate repainting the region from the shadow,
+ * in Hextile (solid or raw tiles) if the viewer takes it, Raw otherwise.
+ */
+unsigned int ShadowRegionUpdateSize(shadow_framebuffer * fb, shadow_region * region, int hextile);
+unsigned int ShadowRegionUpdate(shadow_framebuffer * fb, shadow_region * region, int hextile, char * buf, unsigned int size);
+
+#endif
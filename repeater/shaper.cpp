@@ -0,0 +1,410 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "mutex.h"
+#include "repeater.h"
+#include "config.h"
+#include "shaper.h"
+
+/* Buckets shared between sessions, under mutex_shaper */
+static token_bucket global_bucket[2];
+static shaper_range * ranges = NULL;
+static volatile int shared = 0;
+static int shaper_running = 0;
+static mutex_t mutex_shaper;
+
+/* Bumped, under mutex_shaper, each time the configuration changes */
+static volatile unsigned int shaper_generation = 0;
+
+
+/*****************************************************************************
+ *
+ * Token buckets
+ *
+ *****************************************************************************/
+
+static void
+bucket_init(token_bucket * b, unsigned long rate)
+{
+	b->rate = rate;
+	b->burst = rate / 4;
+	if( b->burst < SHAPER_MIN_BURST )
+		b->burst = SHAPER_MIN_BURST;
+	b->tokens = b->burst;
+	b->last = ShaperNow();
+}
+
+static void
+bucket_refill(token_bucket * b, unsigned long long now)
+{
+	unsigned long long elapsed;
+
+	if( now <= b->last )
+		return;
+
+	elapsed = now - b->last;
+	/* Long idle periods only fill the bucket up */
+	if( elapsed > 1000000 )
+		elapsed = 1000000;
+	b->tokens += (long long)( elapsed * b->rate / 1000000 );
+	if( b->tokens > (long long)b->burst )
+		b->tokens = b->burst;
+	/* Keep the remainder of a partial token for the next refill */
+	b->last = ( elapsed * b->rate % 1000000 == 0 ) ? now : now - ( elapsed * b->rate % 1000000 ) / b->rate;
+}
+
+/* A new rate for a bucket in use: it keeps its tokens, up to the new burst */
+static void
+bucket_set_rate(token_bucket * b, unsigned long rate)
+{
+	if( b->rate == rate )
+		return;
+	if( b->rate == 0 ) {
+		bucket_init( b, rate );
+		return;
+	}
+
+	b->rate = rate;
+	b->burst = rate / 4;
+	if( b->burst < SHAPER_MIN_BURST )
+		b->burst = SHAPER_MIN_BURST;
+	if( b->tokens > (long long)b->burst )
+		b->tokens = b->burst;
+}
+
+/* Smallest amount worth waking up for */
+static unsigned long
+bucket_quantum(token_bucket * b, unsigned long want)
+{
+	unsigned long quantum;
+
+	quantum = ( b->burst < SHAPER_QUANTUM ) ? b->burst : SHAPER_QUANTUM;
+	return ( want < quantum ) ? want : quantum;
+}
+
+static unsigned long
+bucket_allow(token_bucket * b, unsigned long want, unsigned long long now)
+{
+	if( ( b->rate == 0 ) || ( want == 0 ) )
+		return want;
+
+	bucket_refill( b, now );
+	if( b->tokens < (long long)bucket_quantum( b, want ) )
+		return 0;
+	return ( b->tokens < (long long)want ) ? (unsigned long)b->tokens : want;
+}
+
+static void
+bucket_consume(token_bucket * b, unsigned long len, unsigned long long now)
+{
+	if( b->rate == 0 )
+		return;
+	bucket_refill( b, now );
+	b->tokens -= len;
+}
+
+static unsigned long
+bucket_delay(token_bucket * b, unsigned long long now)
+{
+	long long missing;
+
+	if( b->rate == 0 )
+		return 0;
+
+	bucket_refill( b, now );
+	missing = (long long)bucket_quantum( b, SHAPER_QUANTUM ) - b->tokens;
+	if( missing <= 0 )
+		return 0;
+	return (unsigned long)( ( (unsigned long long)missing * 1000000 + b->rate - 1 ) / b->rate );
+}
+
+
+/*****************************************************************************
+ *
+ * Shaper
+ *
+ *****************************************************************************/
+
+unsigned long long
+ShaperNow( void )
+{
+#ifdef WIN32
+	return (unsigned long long)GetTickCount() * 1000;
+#else
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void
+shaper_free_ranges(shaper_range * list)
+{
+	shaper_range * range;
+
+	while( list != NULL ) {
+		range = list;
+		list = range->next;
+		free( range );
+	}
+}
+
+/* The ranges of the configuration, in its order since the first matching one wins */
+static int
+shaper_build_ranges(const repeater_config * config, shaper_range ** list)
+{
+	shaper_range * range;
+	shaper_range ** last;
+	unsigned int i;
+
+	*list = NULL;
+	last = list;
+	for( i = 0; i < config->rate_limit_count; i++ ) {
+		range = (shaper_range *)malloc( sizeof(shaper_range) );
+		if( range == NULL ) {
+			error("Not enough memory for a rate limit.\n");
+			shaper_free_ranges( *list );
+			*list = NULL;
+			return -1;
+		}
+
+		memset( range, 0, sizeof(shaper_range) );
+		range->first = config->rate_limits[i].first;
+		range->last = config->rate_limits[i].last;
+		bucket_init( &range->bucket[SHAPER_DOWN], config->rate_limits[i].rate );
+		bucket_init( &range->bucket[SHAPER_UP], config->rate_limits[i].rate );
+		*last = range;
+		last = &range->next;
+	}
+	return 0;
+}
+
+/* Called under mutex_shaper */
+static shaper_range *
+shaper_find_range(unsigned long code)
+{
+	shaper_range * range;
+
+	for( range = ranges; range != NULL; range = range->next ) {
+		if( ( code >= range->first ) && ( code <= range->last ) )
+			break;
+	}
+	return range;
+}
+
+/* The range of the session, looked up again after a reload. Called under mutex_shaper. */
+static shaper_range *
+shaper_session_range(shaper_session * sh)
+{
+	if( sh->range_generation != shaper_generation ) {
+		sh->range = shaper_find_range( sh->code );
+		sh->range_generation = shaper_generation;
+	}
+	return sh->range;
+}
+
+/* Follow the configuration: the session rate, the range and whether to shape at all */
+static void
+shaper_session_refresh(shaper_session * sh)
+{
+	const repeater_config * config;
+	shaper_range * range;
+
+	config = ConfigGet();
+	bucket_set_rate( &sh->bucket[SHAPER_DOWN], config->session_rate );
+	bucket_set_rate( &sh->bucket[SHAPER_UP], config->session_rate );
+
+	range = NULL;
+	if( shaper_running ) {
+		mutex_lock( &mutex_shaper );
+		sh->range_generation = shaper_generation - 1;
+		range = shaper_session_range( sh );
+		sh->generation = sh->range_generation;
+		mutex_unlock( &mutex_shaper );
+	}
+
+	sh->active = ( config->session_rate != 0 ) || ( config->global_rate != 0 ) || ( range != NULL );
+}
+
+int
+ShaperInit( void )
+{
+	const repeater_config * config;
+
+	config = ConfigGet();
+	bucket_init( &global_bucket[SHAPER_DOWN], config->global_rate );
+	bucket_init( &global_bucket[SHAPER_UP], config->global_rate );
+	if( shaper_build_ranges( config, &ranges ) != 0 )
+		return -1;
+	shared = ( config->global_rate != 0 ) || ( ranges != NULL );
+
+	/* Taken even without shared buckets, a reload may bring some */
+	if( mutex_init( &mutex_shaper ) != 0 ) {
+		error("Failed to create the shaper mutex.\n");
+		return -1;
+	}
+	shaper_running = 1;
+	return 0;
+}
+
+int
+ShaperReload( void )
+{
+	const repeater_config * config;
+	shaper_range * fresh;
+	shaper_range * range;
+	shaper_range * old;
+
+	if( !shaper_running )
+		return 0;
+
+	config = ConfigGet();
+	if( shaper_build_ranges( config, &fresh ) != 0 )
+		return -1;
+
+	mutex_lock( &mutex_shaper );
+
+	/* A range kept from the last configuration keeps its tokens */
+	for( range = fresh; range != NULL; range = range->next ) {
+		for( old = ranges; old != NULL; old = old->next ) {
+			if( ( old->first == range->first ) && ( old->last == range->last ) ) {
+				bucket_set_rate( &old->bucket[SHAPER_DOWN], range->bucket[SHAPER_DOWN].rate );
+				bucket_set_rate( &old->bucket[SHAPER_UP], range->bucket[SHAPER_UP].rate );
+				range->bucket[SHAPER_DOWN] = old->bucket[SHAPER_DOWN];
+				range->bucket[SHAPER_UP] = old->bucket[SHAPER_UP];
+				break;
+			}
+		}
+	}
+	bucket_set_rate( &global_bucket[SHAPER_DOWN], config->global_rate );
+	bucket_set_rate( &global_bucket[SHAPER_UP], config->global_rate );
+
+	/* The sessions look their range up again before using it */
+	old = ranges;
+	ranges = fresh;
+	shared = ( config->global_rate != 0 ) || ( ranges != NULL );
+	shaper_generation++;
+
+	mutex_unlock( &mutex_shaper );
+
+	shaper_free_ranges( old );
+	return 0;
+}
+
+void
+ShaperFree( void )
+{
+	shaper_free_ranges( ranges );
+	ranges = NULL;
+
+	if( shaper_running )
+		mutex_destroy( &mutex_shaper );
+	shaper_running = 0;
+	shared = 0;
+}
+
+void
+ShaperSessionInit(shaper_session * sh, unsigned long code)
+{
+	memset( sh, 0, sizeof(shaper_session) );
+	sh->code = code;
+	shaper_session_refresh( sh );
+}
+
+unsigned long
+ShaperAllow(shaper_session * sh, int direction, unsigned long want, unsigned long long now)
+{
+	shaper_range * range;
+
+	if( sh->generation != shaper_generation )
+		shaper_session_refresh( sh );
+	if( !sh->active )
+		return want;
+
+	want = bucket_allow( &sh->bucket[direction], want, now );
+	if( shared && ( want > 0 ) ) {
+		mutex_lock( &mutex_shaper );
+		if( ( range = shaper_session_range( sh ) ) != NULL )
+			want = bucket_allow( &range->bucket[direction], want, now );
+		want = bucket_allow( &global_bucket[direction], want, now );
+		mutex_unlock( &mutex_shaper );
+	}
+	return want;
+}
+
+void
+ShaperConsume(shaper_session * sh, int direction, unsigned long len, unsigned long long now)
+{
+	shaper_range * range;
+
+	if( sh->generation != shaper_generation )
+		shaper_session_refresh( sh );
+	if( !sh->active )
+		return;
+
+	bucket_consume( &sh->bucket[direction], len, now );
+	if( shared ) {
+		mutex_lock( &mutex_shaper );
+		if( ( range = shaper_session_range( sh ) ) != NULL )
+			bucket_consume( &range->bucket[direction], len, now );
+		bucket_consume( &global_bucket[direction], len, now );
+		mutex_unlock( &mutex_shaper );
+	}
+}
+
+unsigned long
+ShaperDelay(shaper_session * sh, int direction, unsigned long long now)
+{
+	shaper_range * range;
+	unsigned long delay;
+	unsigned long wait;
+
+	if( sh->generation != shaper_generation )
+		shaper_session_refresh( sh );
+	if( !sh->active )
+		return 0;
+
+	delay = bucket_delay( &sh->bucket[direction], now );
+	if( shared ) {
+		mutex_lock( &mutex_shaper );
+		if( ( range = shaper_session_range( sh ) ) != NULL ) {
+			wait = bucket_delay( &range->bucket[direction], now );
+			if( wait > delay )
+				delay = wait;
+		}
+		wait = bucket_delay( &global_bucket[direction], now );
+		if( wait > delay )
+			delay = wait;
+		mutex_unlock( &mutex_shaper );
+	}
+	return delay;
+}
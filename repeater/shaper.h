@@ -0,0 +1,96 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+#ifndef _SHAPER_H
+#define _SHAPER_H
+
+/**
+ * Traffic directions, shaped independently.
+ */
+#define SHAPER_DOWN	0	/* server => viewers */
+#define SHAPER_UP	1	/* viewers => server */
+
+/**
+ * A bucket holds a quarter of a second of traffic, and lets data through
+ * in pieces of at least SHAPER_QUANTUM bytes so a throttled session is not
+ * woken up for a handful of bytes.
+ */
+#define SHAPER_MIN_BURST	4096
+#define SHAPER_QUANTUM		4096
+
+typedef struct _token_bucket {
+	unsigned long rate;             /* Bytes per second, 0 for no limit */
+	unsigned long burst;
+	long long tokens;               /* Goes below zero when shared buckets race */
+	unsigned long long last;        /* Last refill, in microseconds */
+} token_bucket;
+
+typedef struct _shaper_range {
+	unsigned long first;
+	unsigned long last;
+	token_bucket bucket[2];
+	struct _shaper_range * next;
+} shaper_range;
+
+/**
+ * Shaping state of one session: its own buckets, plus the ones shared
+ * with the sessions of its ID range and with every session.
+ */
+typedef struct _shaper_session {
+	int active;
+	unsigned long code;
+	token_bucket bucket[2];
+	shaper_range * range;           /* Under mutex_shaper */
+	unsigned int generation;        /* Of the configuration followed */
+	unsigned int range_generation;  /* Of the range list range points into */
+} shaper_session;
+
+/**
+ * The rates and the ID ranges come from the configuration published
+ * before ShaperInit().
+ */
+int ShaperInit( void );
+void ShaperFree( void );
+
+/**
+ * Pick a newly published configuration up. The buckets of the ranges kept
+ * keep their tokens, running sessions follow at their next call.
+ */
+int ShaperReload( void );
+
+void ShaperSessionInit(shaper_session * sh, unsigned long code);
+
+/**
+ * Bytes that may go through now, up to want. 0 when the direction is
+ * throttled: ShaperDelay() tells when to try again.
+ */
+unsigned long ShaperAllow(shaper_session * sh, int direction, unsigned long want, unsigned long long now);
+void ShaperConsume(shaper_session * sh, int direction, unsigned long len, unsigned long long now);
+unsigned long ShaperDelay(shaper_session * sh, int direction, unsigned long long now);
+
+/**
+ * Monotonic clock, in microseconds.
+ */
+unsigned long long ShaperNow( void );
+
+#endif
@@ -19,6 +19,7 @@
 //
 /////////////////////////////////////////////////////////////////////////////
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <ctype.h>
@@ -31,10 +32,15 @@
 #include "repeater.h"
 #include "slots.h"
 
+#ifdef WIN32
+#define snprintf _snprintf
+#endif
+
 
 repeaterslot * Slots;
 unsigned int slotCount;
-unsigned int max_slots;
+/* Changed by SetMaxSlots() without taking mutex_slots */
+volatile unsigned int max_slots;
 
 unsigned char challenge_key[CHALLENGESIZE];
 
@@ -114,6 +120,35 @@ ParseID(char * code)
 	return retVal;
 }
 
+/* Split "host:ID" and cypher the ID into the challenge used to pair slots */
+int
+ParseDisplay(char *display, char *phost, int hostlen, int *pport, unsigned char *challengedid)
+{
+	unsigned char challenge[CHALLENGESIZE];
+	char tmp_id[MAX_HOST_NAME_LEN + 1];
+	char *colonpos = strchr(display, ':');
+	int tmp_code;
+
+	if( hostlen < (int)strlen(display) ) return 0;
+
+	if( colonpos == NULL ) return 0;
+
+	strncpy(phost, display, colonpos - display);
+	phost[colonpos - display]  = '\0';
+
+	memset(&tmp_id, 0, sizeof(tmp_id));
+	if( sscanf(colonpos + 1, "%d", &tmp_code) != 1 ) return 0;
+	if( sscanf(colonpos + 1, "%s", (char *)&tmp_id) != 1 ) return 0;
+
+	// encrypt
+	memcpy(&challenge, challenge_key, CHALLENGESIZE);
+	vncEncryptBytes(challenge, tmp_id);
+
+	memcpy((unsigned char *)challengedid, challenge, CHALLENGESIZE);
+	*pport = tmp_code;
+	return 1;
+}
+
 repeaterslot *
 NewSlot( void )
 {
@@ -135,6 +170,13 @@ InitializeSlots( unsigned int max )
 	vncRandomBytes( challenge_key );
 }
 
+/* Slots already taken above a lowered limit stay until freed */
+void
+SetMaxSlots( unsigned int max )
+{
+	max_slots = max;
+}
+
 
 
 void 
@@ -208,10 +250,6 @@ AddSlot(repeaterslot *slot)
 		error("Memory allocation problem detected while trying to add a slot.\n");
 		UnlockSlots("AddSlot()");
 		return NULL;
-	} else if( ( max_slots > 0 ) && (max_slots == slotCount) ) {
-		error("All the slots are in use.\n");
-		UnlockSlots("AddSlot()");
-		return NULL;
 	}
 
 	if( Slots == NULL ) {
@@ -228,8 +266,14 @@ AddSlot(repeaterslot *slot)
 #endif
 		return Slots;
 	} else {
-		current = FindSlotByChallenge( slot->challenge );
-		if( current == NULL ) {
+		/* A Mode I slot comes paired already, it pairs with nothing */
+		current = slot->modei ? NULL : FindSlotByChallenge( slot->challenge );
+		if( ( current == NULL ) && ( max_slots > 0 ) && ( slotCount >= max_slots ) ) {
+			/* Only a new slot counts against the limit, a peer still pairs */
+			error("All the slots are in use.\n");
+			UnlockSlots("AddSlot()");
+			return NULL;
+		} else if( current == NULL ) {
 			/* This is a new slot, but slots already exist */
 			slot->next = Slots;
 			Slots = slot;
@@ -239,11 +283,15 @@ AddSlot(repeaterslot *slot)
 			debug("Allocated repeater slots: %d.\n", slotCount);
 #endif
 			return Slots;
-		} else if( current->server == INVALID_SOCKET ) {
+		} else if( ( current->server == INVALID_SOCKET ) && ( slot->server != INVALID_SOCKET ) ) {
 			current->server = slot->server;
 			current->code = slot->code;
-		} else if( current->viewer == INVALID_SOCKET ) {
+		} else if( ( current->viewer == INVALID_SOCKET ) && ( slot->viewer != INVALID_SOCKET ) ) {
 			current->viewer = slot->viewer;
+		} else if( ( current->relay != NULL ) && ( slot->server == INVALID_SOCKET ) ) {
+			/* One more viewer for a running session, the relay decides */
+			UnlockSlots("AddSlot()");
+			return current;
 		} else {
 			UnlockSlots("AddSlot()");
 #ifdef _DEBUG
@@ -273,8 +321,6 @@ CleanupSlots( void )
 	repeaterslot *current;
 	repeaterslot * previous;
 	repeaterslot *next;
-	fd_set read_fds;
-	struct timeval tm;
 	BYTE buf;
 	int num_bytes;
 
@@ -283,18 +329,14 @@ CleanupSlots( void )
 
 	current = Slots;
 	previous = NULL;
-	tm.tv_sec=0;
-	tm.tv_usec=50;
 
 	while( current != NULL )
 	{
-		if( ( current->viewer == INVALID_SOCKET ) || ( current->server == INVALID_SOCKET ) ) {
-			FD_ZERO( &read_fds );
-			
+		/* Running sessions are watched by their relay */
+		if( ( current->relay == NULL ) && ( ( current->viewer == INVALID_SOCKET ) || ( current->server == INVALID_SOCKET ) ) ) {
 			if( current->viewer == INVALID_SOCKET ) {
 				/* check the server connection */
-				FD_SET( current->server , &read_fds );
-				if( select( current->server + 1, &read_fds, NULL, NULL, &tm) == 0 ) {
+				if( socket_poll( current->server, 0, 0 ) == 0 ) {
 					/* Timed out */
 					previous = current;
 					current = current->next;
@@ -332,8 +374,7 @@ CleanupSlots( void )
 				}
 			} else if( current->server == INVALID_SOCKET ) {
 				/* Check the viewer connection */
-				FD_SET( current->viewer , &read_fds );
-				if( select( current->viewer + 1, &read_fds, NULL, NULL, &tm) == 0 ) {
+				if( socket_poll( current->viewer, 0, 0 ) == 0 ) {
 					/* Timed out */
 					previous = current;
 					current = current->next;
@@ -411,7 +452,7 @@ FindSlotByChallenge(unsigned char * challenge)
 	while( current != NULL)
 	{
 		// ERROR: Getting exception here!!!
-		if( memcmp(challenge, current->challenge, CHALLENGESIZE) == 0 ) {
+		if( !current->modei && ( memcmp(challenge, current->challenge, CHALLENGESIZE) == 0 ) ) {
 #ifdef _DEBUG
 			debug("Found a slot assigned to the given challenge ID.\n");
 #endif
@@ -457,7 +498,8 @@ FreeSlot(repeaterslot *slot)
 #endif
 	while( current != NULL )
 	{
-		if( memcmp(current->challenge, slot->challenge, CHALLENGESIZE) == 0 ) {
+		/* A Mode I slot has no challenge of its own */
+		if( ( current->modei || slot->modei ) ? ( current == slot ) : ( memcmp(current->challenge, slot->challenge, CHALLENGESIZE) == 0 ) ) {
 			/* The slot has been found */
 #ifdef _DEBUG
 			debug("Slots found. Trying to free resources.\n");
@@ -516,3 +558,231 @@ FreeSlot(repeaterslot *slot)
 #endif
 }
 
+
+
+
+/* Free the servers and viewers still waiting for their peer */
+unsigned int
+FreeWaitingSlots( void )
+{
+	repeaterslot *current;
+	repeaterslot *next;
+	unsigned int count;
+
+	if( LockSlots("FreeWaitingSlots()") != 0 )
+		return 0;
+
+	count = 0;
+	for( current = Slots; current != NULL; current = next ) {
+		next = current->next;
+		if( current->relay == NULL ) {
+			FreeSlot( current );
+			count++;
+		}
+	}
+
+	UnlockSlots("FreeWaitingSlots()");
+	return count;
+}
+
+
+static int
+compare_slot_age(const void * a, const void * b)
+{
+	unsigned long ta = (*(repeaterslot * const *)a)->timestamp;
+	unsigned long tb = (*(repeaterslot * const *)b)->timestamp;
+
+	return ( ta < tb ) ? -1 : ( ta > tb ) ? 1 : 0;
+}
+
+/* Free up to n waiting slots, the ones waiting the longest first. Returns how many went. */
+unsigned int
+ShedWaitingSlots(unsigned int n)
+{
+	repeaterslot *current;
+	repeaterslot **waiting;
+	unsigned int count;
+	unsigned int i;
+
+	if( n == 0 )
+		return 0;
+	if( LockSlots("ShedWaitingSlots()") != 0 )
+		return 0;
+
+	count = 0;
+	for( current = Slots; current != NULL; current = current->next ) {
+		if( current->relay == NULL )
+			count++;
+	}
+
+	waiting = NULL;
+	if( count > 0 )
+		waiting = (repeaterslot **)malloc( count * sizeof(repeaterslot *) );
+	if( waiting == NULL ) {
+		UnlockSlots("ShedWaitingSlots()");
+		return 0;
+	}
+
+	i = 0;
+	for( current = Slots; current != NULL; current = current->next ) {
+		if( current->relay == NULL )
+			waiting[i++] = current;
+	}
+	qsort( waiting, count, sizeof(repeaterslot *), compare_slot_age );
+
+	if( n > count )
+		n = count;
+	for( i = 0; i < n; i++ )
+		FreeSlot( waiting[i] );
+
+	UnlockSlots("ShedWaitingSlots()");
+	free( waiting );
+	return n;
+}
+
+/* Running sessions, waiting slots and what the relays hold in their buffers, in one pass */
+void
+CountSlots(unsigned int * sessions, unsigned int * waiting, unsigned long long * buffered)
+{
+	repeaterslot *current;
+
+	*sessions = 0;
+	*waiting = 0;
+	*buffered = 0;
+	if( LockSlots("CountSlots()") != 0 )
+		return;
+
+	for( current = Slots; current != NULL; current = current->next ) {
+		if( current->relay != NULL ) {
+			(*sessions)++;
+			*buffered += current->serverbuf_len + current->viewerbuf_len;
+		} else {
+			(*waiting)++;
+		}
+	}
+
+	UnlockSlots("CountSlots()");
+}
+
+/* Number of slots with a running relay */
+unsigned int
+CountSessions( void )
+{
+	repeaterslot *current;
+	unsigned int count;
+
+	if( LockSlots("CountSessions()") != 0 )
+		return 0;
+
+	count = 0;
+	for( current = Slots; current != NULL; current = current->next ) {
+		if( current->relay != NULL )
+			count++;
+	}
+
+	UnlockSlots("CountSessions()");
+	return count;
+}
+
+
+
+
+/*******************************************************************************
+ *
+ * Write the top N running sessions, sorted by bandwidth, as a text table into buf.
+ * Returns the number of bytes written (not counting the terminating zero).
+ *
+ ******************************************************************************/
+int
+ListTopSlots(char * buf, unsigned int size, unsigned int n)
+{
+	repeaterslot *current;
+	repeaterslot **paired;
+	repeaterslot *tmp;
+	unsigned int count;
+	unsigned int i, j, best;
+	unsigned long now;
+	int len, written;
+
+	if( size == 0 )
+		return 0;
+	buf[0] = '\0';
+
+	if( LockSlots("ListTopSlots()") != 0 )
+		return 0;
+
+	written = snprintf(buf, size, "%-9s %7s %6s %7s %14s %9s %14s %9s %12s %7s %7s %12s %8s %8s %8s %8s\n",
+		"ID", "AGE", "IDLE", "VIEWERS", "S->V BYTES", "S->V READS", "V->S BYTES", "V->S READS", "RATE(B/s)", "SRVBUF", "VWRBUF", "DROPPED",
+		"RTT(us)", "SNDBUF", "LOWAT", "RCVBUF");
+	if( ( written < 0 ) || ( (unsigned int)written >= size ) ) {
+		UnlockSlots("ListTopSlots()");
+		buf[size - 1] = '\0';
+		return size - 1;
+	}
+
+	paired = NULL;
+	if( slotCount > 0 ) {
+		paired = (repeaterslot **)malloc( slotCount * sizeof(repeaterslot *) );
+		if( paired == NULL ) {
+			error("Not enough memory to list the repeater slots.\n");
+			UnlockSlots("ListTopSlots()");
+			return written;
+		}
+	}
+
+	/* Collect the active sessions */
+	count = 0;
+	for( current = Slots; current != NULL; current = current->next ) {
+		if( current->relay != NULL )
+			paired[count++] = current;
+	}
+
+	/* Partial selection sort: only the first n entries need to be in order */
+	if( n > count )
+		n = count;
+	for( i = 0; i < n; i++ ) {
+		best = i;
+		for( j = i + 1; j < count; j++ ) {
+			if( paired[j]->bandwidth > paired[best]->bandwidth )
+				best = j;
+		}
+		tmp = paired[i];
+		paired[i] = paired[best];
+		paired[best] = tmp;
+	}
+
+	now = (unsigned long)time(NULL);
+	for( i = 0; i < n; i++ ) {
+		current = paired[i];
+		len = snprintf(buf + written, size - written, "%-9lu %7lu %6lu %7u %14llu %9lu %14llu %9lu %12lu %7u %7u %12llu %8u %8u %8u %8u\n",
+			current->code,
+			now - current->started,
+			now - current->last_activity,
+			current->viewers,
+			current->server_bytes,
+			current->server_reads,
+			current->viewer_bytes,
+			current->viewer_reads,
+			current->bandwidth,
+			current->serverbuf_len,
+			current->viewerbuf_len,
+			current->dropped_bytes,
+			current->rtt,
+			current->sndbuf,
+			current->lowat,
+			current->rcvbuf);
+		if( ( len < 0 ) || ( (unsigned int)len >= size - written ) ) {
+			/* Truncated */
+			written = size - 1;
+			break;
+		}
+		written += len;
+	}
+
+	UnlockSlots("ListTopSlots()");
+
+	if( paired != NULL )
+		free( paired );
+
+	return written;
+}
@@ -25,6 +25,8 @@
 
 #include "mutex.h"
 
+#define MAX_HOST_NAME_LEN	250
+
 
 typedef struct _repeaterslot
 {
@@ -33,6 +35,26 @@ typedef struct _repeaterslot
 	unsigned long timestamp;
 	unsigned long code;
 	unsigned char challenge[CHALLENGESIZE];
+	int modei;                      /* Paired by the repeater for a Mode I viewer, nobody else may join */
+
+	/* Traffic accounting (written by the repeater thread, read under mutex_slots) */
+	unsigned long started;          /* When the session was paired */
+	unsigned long last_activity;    /* Last time data was relayed */
+	unsigned long long server_bytes; /* server => viewer */
+	unsigned long long viewer_bytes; /* viewer => server */
+	unsigned long server_reads;     /* recv() calls that returned data, not RFB messages */
+	unsigned long viewer_reads;
+	unsigned int serverbuf_len;     /* Current buffer occupancy */
+	unsigned int viewerbuf_len;
+	unsigned long bandwidth;        /* Bytes per second over the last sample */
+	unsigned int viewers;           /* Viewers watching the session */
+	unsigned long long dropped_bytes; /* Superseded updates slow viewers never got */
+	unsigned int rtt;               /* Slowest viewer, microseconds */
+	unsigned int sndbuf;            /* Its send buffer and TCP_NOTSENT_LOWAT */
+	unsigned int lowat;
+	unsigned int rcvbuf;            /* Receive buffer of the server */
+
+	struct _relay_session * relay;  /* Running relay, it owns the sockets */
 
 	struct _repeaterslot * next;
 } repeaterslot;
@@ -45,14 +67,23 @@ extern unsigned char challenge_key[CHALLENGESIZE];
 extern mutex_t mutex_slots;
 
 /* Prototypes */
+int LockSlots(const char * function_name);
+int UnlockSlots(const char * function_name);
+int ParseDisplay(char *display, char *phost, int hostlen, int *pport, unsigned char *challengedid);
 void InitializeSlots( unsigned int max );
+void SetMaxSlots( unsigned int max );
 void FreeSlots( void );
 
 repeaterslot * AddSlot(repeaterslot *slot);
 void CleanupSlots( void );
 void  FreeSlot(repeaterslot *slot);
+unsigned int FreeWaitingSlots( void );
+unsigned int CountSessions( void );
+unsigned int ShedWaitingSlots(unsigned int n);
+void CountSlots(unsigned int * sessions, unsigned int * waiting, unsigned long long * buffered);
 repeaterslot * AddServer(SOCKET s, char * code);
 repeaterslot * AddViewer(SOCKET s, unsigned char * challenge);
 repeaterslot * FindSlotByChallenge(unsigned char * challenge);
+int ListTopSlots(char * buf, unsigned int size, unsigned int n);
 
 #endif
\ No newline at end of file
@@ -19,7 +19,10 @@
 //
 /////////////////////////////////////////////////////////////////////////////
 
+#include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#include <time.h>
 #ifndef WIN32
 #include <sys/socket.h>
 #include <netinet/tcp.h>
@@ -71,6 +74,45 @@ WinsockFinalize( void )
 	WSACleanup();
 }
 
+int
+socket_select_poll(struct pollfd * fds, unsigned int nfds, int timeout)
+{
+	fd_set read_fds;
+	fd_set write_fds;
+	struct timeval tm;
+	unsigned int i;
+	int n;
+
+	FD_ZERO( &read_fds );
+	FD_ZERO( &write_fds );
+	for( i = 0; i < nfds; i++ ) {
+		if( fds[i].events & POLLIN )
+			FD_SET( fds[i].fd, &read_fds );
+		if( fds[i].events & POLLOUT )
+			FD_SET( fds[i].fd, &write_fds );
+	}
+	tm.tv_sec = timeout / 1000;
+	tm.tv_usec = ( timeout % 1000 ) * 1000;
+
+	n = select( 0, &read_fds, &write_fds, NULL, ( timeout < 0 ) ? NULL : &tm );
+	if( n < 0 ) {
+		errno = WSAGetLastError();
+		return -1;
+	}
+
+	n = 0;
+	for( i = 0; i < nfds; i++ ) {
+		fds[i].revents = 0;
+		if( FD_ISSET( fds[i].fd, &read_fds ) )
+			fds[i].revents |= POLLIN;
+		if( FD_ISSET( fds[i].fd, &write_fds ) )
+			fds[i].revents |= POLLOUT;
+		if( fds[i].revents != 0 )
+			n++;
+	}
+	return n;
+}
+
 #endif /* END WIN32 */
 
 
@@ -82,8 +124,8 @@ WinsockFinalize( void )
  *
  *****************************************************************************/
 
-SOCKET 
-CreateListenerSocket(u_short port)
+static SOCKET 
+CreateListenerSocketOn(u_short port, u_long address)
 {
 	SOCKET              sock;
 	struct sockaddr_in  addr;
@@ -93,7 +135,7 @@ CreateListenerSocket(u_short port)
 	memset(&addr, 0, sizeof(struct sockaddr_in));
 	addr.sin_family = AF_INET;					
 	addr.sin_port = htons(port);
-	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_addr.s_addr = address;
 
 	/* Initialize the socket */
 	sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -121,7 +163,7 @@ CreateListenerSocket(u_short port)
 	}
 
 	/* Start listening */
-	if( listen(sock, 5) < 0 ) {
+	if( listen(sock, SOMAXCONN) < 0 ) {
 		error("Failed to start listening on port %d.\n", port);
 		socket_close(sock);
 		return INVALID_SOCKET;
@@ -131,6 +173,18 @@ CreateListenerSocket(u_short port)
 	return sock;
 }
 
+SOCKET 
+CreateListenerSocket(u_short port)
+{
+	return CreateListenerSocketOn(port, INADDR_ANY);
+}
+
+SOCKET 
+CreateLoopbackListenerSocket(u_short port)
+{
+	return CreateListenerSocketOn(port, htonl(INADDR_LOOPBACK));
+}
+
 
 
 //int 
@@ -174,32 +228,15 @@ socket_read_exact(SOCKET s, char * buff, socklen_t bufflen)
 {
 	int bytes;
 	socklen_t currlen = bufflen;
-	fd_set read_fds;
-	struct timeval tm;
 	int count;
 
 	while (currlen > 0) {
 		// Wait until some data can be read
-		do {
-			FD_ZERO( &read_fds );
-			FD_SET( s, &read_fds );
-			
-			tm.tv_sec = 0;
-			tm.tv_usec = 50;
-			count = select( s + 1, &read_fds, NULL, NULL, &tm);
-		} while (count == 0);
-
-		if( count < 0 ) {
-#ifdef WIN32
-			errno = WSAGetLastError();
-#endif
-			return -1;
-		} else if( count > 2 ) {
-			error("socket error in select()\n");
+		count = socket_poll( s, 0, -1 );
+		if( count < 0 )
 			return -1;
-		}
 		
-		if( FD_ISSET( s, &read_fds ) ) {
+		if( count > 0 ) {
 			// Try to read some data in
 			bytes = socket_read(s, buff, currlen);
 			if (bytes > 0) {
@@ -229,22 +266,13 @@ int
 socket_write_exact(SOCKET s, char * buff, socklen_t bufflen)
 {
 	socklen_t currlen = bufflen;
-	fd_set write_fds;
-	struct timeval tm;
 	int n;
 
 	while (currlen > 0) {
-		// Wait until some data can be read
-		do {
-			FD_ZERO( &write_fds );
-			FD_SET( s, &write_fds );
-			
-			tm.tv_sec = 0;
-			tm.tv_usec = 50;
-			n = select( s + 1, NULL, &write_fds, NULL, &tm);
-		} while (n == 0);
+		// Wait until some data can be written
+		socket_poll( s, 1, -1 );
 
-		n = send( s, buff, bufflen, 0);
+		n = send( s, buff, currlen, 0);
 
 		if (n > 0) {
 			buff += n;
@@ -257,6 +285,8 @@ socket_write_exact(SOCKET s, char * buff, socklen_t bufflen)
 #ifdef WIN32
 			errno = WSAGetLastError();
 #endif
+			if( errno == EWOULDBLOCK )
+				continue;
 			return -1;
 		}
 	}
@@ -320,6 +350,69 @@ socket_accept(SOCKET s, struct sockaddr * addr, socklen_t * addrlen)
 	return sock;
 }
 
+/*
+ * Connect to addr without blocking past msec, for the connections the
+ * repeater opens itself. The socket comes out like an accepted one:
+ * non-blocking, with Nagle disabled.
+ */
+SOCKET
+socket_connect(const struct sockaddr_in * addr, unsigned int msec)
+{
+	SOCKET sock;
+	socklen_t len;
+	const int one = 1;
+	int err;
+	int n;
+
+#ifdef WIN32
+	u_long ioctlsocket_arg = 1;
+#endif
+
+	sock = socket( AF_INET, SOCK_STREAM, 0 );
+	if( sock == INVALID_SOCKET ) {
+#ifdef WIN32
+		errno = WSAGetLastError();
+#endif
+		return INVALID_SOCKET;
+	}
+	setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one) );
+#ifdef WIN32
+	ioctlsocket( sock, FIONBIO, &ioctlsocket_arg );
+#else
+	fcntl( sock, F_SETFL, O_NDELAY );
+#endif
+
+	if( connect( sock, (struct sockaddr *)addr, sizeof(struct sockaddr_in) ) == 0 )
+		return sock;
+#ifdef WIN32
+	errno = WSAGetLastError();
+	if( errno != WSAEWOULDBLOCK ) {
+#else
+	if( errno != EINPROGRESS ) {
+#endif
+		err = errno;
+		socket_close( sock );
+		errno = err;
+		return INVALID_SOCKET;
+	}
+
+	/* Writable once connected, or once it failed */
+	do {
+		n = socket_poll( sock, 1, (int)msec );
+	} while( ( n < 0 ) && ( errno == EINTR ) );
+
+	err = ETIMEDOUT;
+	len = sizeof(err);
+	if( ( n < 0 ) || ( ( n > 0 ) && ( getsockopt( sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len ) != 0 ) ) )
+		err = errno;
+	if( ( n > 0 ) && ( err == 0 ) )
+		return sock;
+
+	socket_close( sock );
+	errno = err;
+	return INVALID_SOCKET;
+}
+
 int 
 socket_close(SOCKET s)
 {
@@ -338,6 +431,190 @@ socket_close(SOCKET s)
 	return 0;
 }
 
+/* Close with a reset, leaving no TIME_WAIT behind, for connections refused at once */
+int
+socket_reset(SOCKET s)
+{
+	struct linger linger;
+
+	linger.l_onoff = 1;
+	linger.l_linger = 0;
+	setsockopt( s, SOL_SOCKET, SO_LINGER, (char *)&linger, sizeof(linger) );
+	return socket_release( s );
+}
+
+/*
+ * Drop this process' handle on a socket without shutting the connection
+ * down, another process holds it as well.
+ */
+int
+socket_release(SOCKET s)
+{
+	errno = 0;
+
+#ifdef WIN32
+	if( closesocket( s ) != 0 ) {
+		errno = WSAGetLastError();
+#else
+	if( close( s ) != 0 ) {
+#endif
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait until s can be read. Returns 1 if it can, 0 if wake became readable
+ * first and -1 on error.
+ */
+int
+socket_wait(SOCKET s, SOCKET wake)
+{
+	struct pollfd fds[2];
+	int n;
+
+	for( ;; ) {
+		fds[0].fd = s;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = wake;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		n = poll( fds, 2, -1 );
+		if( n < 0 ) {
+			if( errno == EINTR )
+				continue;
+			return -1;
+		}
+
+		if( fds[1].revents != 0 )
+			return 0;
+		if( fds[0].revents != 0 )
+			return 1;
+	}
+}
+
+/* Wait up to msec for s to be readable: 1 if it is, 0 on timeout or signal, -1 on error */
+int
+socket_wait_timeout(SOCKET s, unsigned int msec)
+{
+	int n;
+
+	n = socket_poll( s, 0, (int)msec );
+	if( n < 0 )
+		return ( errno == EINTR ) ? 0 : -1;
+	return n;
+}
+
+/*
+ * Wait up to msec, -1 for no limit, for s to be readable, or writable with
+ * write set. poll() rather than select(): a descriptor past FD_SETSIZE does
+ * not fit in an fd_set. Returns 1 if it is ready, 0 on timeout, -1 on error.
+ */
+int
+socket_poll(SOCKET s, int write, int msec)
+{
+	struct pollfd fds;
+	int n;
+
+	fds.fd = s;
+	fds.events = write ? POLLOUT : POLLIN;
+	fds.revents = 0;
+
+	n = poll( &fds, 1, msec );
+	return ( n > 0 ) ? 1 : n;
+}
+
+/*
+ * Optional TCP behaviour of a listening socket. defer_accept: seconds
+ * accept() waits for the peer's first bytes, for ports where the peer
+ * speaks first. fast_open: length of the queue of connections whose SYN
+ * may carry data. 0 leaves either off. Neither exists everywhere, they
+ * are skipped where the system lacks them. Returns -1 if one failed.
+ */
+int
+socket_listener_options(SOCKET s, unsigned int defer_accept, unsigned int fast_open)
+{
+	int rc;
+	int value;
+
+	rc = 0;
+#ifdef TCP_DEFER_ACCEPT
+	value = (int)defer_accept;
+	if( setsockopt( s, IPPROTO_TCP, TCP_DEFER_ACCEPT, (char *)&value, sizeof(value) ) != 0 ) {
+		error("Failed to set TCP_DEFER_ACCEPT, errno=%d.\n", errno);
+		rc = -1;
+	}
+#else
+	if( defer_accept > 0 )
+		debug("TCP_DEFER_ACCEPT isn't available on this system.\n");
+#endif
+
+	if( fast_open > 0 ) {
+#ifdef TCP_FASTOPEN
+		value = (int)fast_open;
+		if( setsockopt( s, IPPROTO_TCP, TCP_FASTOPEN, (char *)&value, sizeof(value) ) != 0 ) {
+#ifdef WIN32
+			errno = WSAGetLastError();
+#endif
+			error("Failed to set TCP_FASTOPEN, errno=%d.\n", errno);
+			rc = -1;
+		}
+#else
+		debug("TCP_FASTOPEN isn't available on this system.\n");
+#endif
+	}
+
+	return rc;
+}
+
+/* Connected pair of non-blocking sockets, used to wake up poll() */
+int
+socket_pair(SOCKET sv[2])
+{
+#ifdef WIN32
+	SOCKET listener;
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	u_long ioctlsocket_arg = 1;
+
+	sv[0] = INVALID_SOCKET;
+	sv[1] = INVALID_SOCKET;
+
+	listener = CreateLoopbackListenerSocket( 0 );
+	if( listener == INVALID_SOCKET )
+		return -1;
+
+	addrlen = sizeof(addr);
+	if( getsockname( listener, (struct sockaddr *)&addr, &addrlen ) == 0 ) {
+		sv[1] = socket( AF_INET, SOCK_STREAM, 0 );
+		if( ( sv[1] != INVALID_SOCKET ) && ( connect( sv[1], (struct sockaddr *)&addr, addrlen ) == 0 ) )
+			sv[0] = accept( listener, NULL, NULL );
+	}
+	socket_close( listener );
+
+	if( sv[0] == INVALID_SOCKET ) {
+		if( sv[1] != INVALID_SOCKET )
+			socket_close( sv[1] );
+		sv[1] = INVALID_SOCKET;
+		return -1;
+	}
+
+	ioctlsocket( sv[0], FIONBIO, &ioctlsocket_arg );
+	ioctlsocket( sv[1], FIONBIO, &ioctlsocket_arg );
+#else
+	if( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0 )
+		return -1;
+
+	fcntl( sv[0], F_SETFL, O_NDELAY );
+	fcntl( sv[1], F_SETFL, O_NDELAY );
+#endif
+
+	return 0;
+}
+
 int 
 WriteExact(int sock, char *buf, int len)
 {
@@ -358,3 +635,365 @@ WriteExact(int sock, char *buf, int len)
 	}
 	return 1;
 }
+
+
+
+/*****************************************************************************
+ *
+ * Handshake I/O
+ *
+ *****************************************************************************/
+
+/* Milliseconds from now on a clock that never goes back */
+unsigned long long
+socket_deadline(unsigned int msec)
+{
+#ifdef WIN32
+	return (unsigned long long)GetTickCount() + msec;
+#else
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + msec;
+#endif
+}
+
+/* Milliseconds left until deadline, 0 once it has passed */
+unsigned int
+socket_time_left(unsigned long long deadline)
+{
+	unsigned long long now;
+
+	now = socket_deadline( 0 );
+	return ( now < deadline ) ? (unsigned int)( deadline - now ) : 0;
+}
+
+/* Wait up to msec for s to take more data. Returns 1 if it does, 0 on timeout. */
+static int
+socket_wait_writable(SOCKET s, unsigned int msec)
+{
+	int n;
+
+	n = socket_poll( s, 1, (int)msec );
+	if( n < 0 )
+		return ( errno == EINTR ) ? 0 : -1;
+	return n;
+}
+
+void
+socket_buffer_init(socket_buffer * b, SOCKET s)
+{
+	b->sock = s;
+	b->pos = 0;
+	b->len = 0;
+}
+
+/*
+ * Read len bytes, waiting at most msec for all of them. The next ahead bytes
+ * are known to follow at once, they are read along when the peer has sent
+ * them already. Returns 0, or -1 with errno set.
+ */
+int
+socket_buffer_read(socket_buffer * b, char * buff, unsigned int len, unsigned int ahead, unsigned int msec)
+{
+	unsigned long long deadline;
+	unsigned int want;
+	unsigned int left;
+	int bytes;
+
+	/* A peer trickling a byte at a time gets no more time than a silent one */
+	deadline = socket_deadline( msec );
+	while( b->len - b->pos < len ) {
+		if( b->pos > 0 ) {
+			memmove( b->data, b->data + b->pos, b->len - b->pos );
+			b->len -= b->pos;
+			b->pos = 0;
+		}
+
+		want = len + ahead - b->len;
+		if( want > SOCKET_BUFFER_SIZE - b->len )
+			want = SOCKET_BUFFER_SIZE - b->len;
+		if( b->len + want < len ) {
+			error("socket_buffer_read(): %u bytes don't fit.\n", len);
+			errno = EINVAL;
+			return -1;
+		}
+
+		/* The socket is non-blocking: only wait when nothing is there yet */
+		bytes = socket_read( b->sock, b->data + b->len, want );
+		if( bytes > 0 ) {
+			b->len += bytes;
+			continue;
+		}
+		if( ( bytes == 0 ) || ( errno != EWOULDBLOCK ) )
+			return -1;
+
+		left = socket_time_left( deadline );
+		if( left == 0 ) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if( socket_wait_timeout( b->sock, left ) < 0 )
+			return -1;
+	}
+
+	memcpy( buff, b->data + b->pos, len );
+	b->pos += len;
+	return 0;
+}
+
+/*
+ * Send the chunks as one write, so they leave in as few segments as the
+ * peer's window allows. Waits at most msec in all for the socket to take them.
+ * Returns 0, or -1 with errno set.
+ */
+int
+socket_write_chunks(SOCKET s, const socket_chunk * chunks, unsigned int count, unsigned int msec)
+{
+	unsigned long long deadline;
+	unsigned int first;
+	unsigned int done;
+	unsigned int left;
+	unsigned int i;
+	int n;
+#ifdef WIN32
+	/* winsock.h has no gather send, the chunks are joined instead */
+	char joined[SOCKET_BUFFER_SIZE];
+	unsigned int joined_len;
+#else
+	struct iovec bufs[SOCKET_MAX_CHUNKS];
+	struct msghdr msg;
+#endif
+
+	if( count > SOCKET_MAX_CHUNKS ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	deadline = socket_deadline( msec );
+	first = 0;
+	done = 0;
+	while( first < count ) {
+		/* What is left of the chunk partly sent, then the others */
+#ifdef WIN32
+		joined_len = 0;
+		for( i = first; i < count; i++ ) {
+			n = chunks[i].len - ( ( i == first ) ? done : 0 );
+			if( joined_len + n > sizeof(joined) )
+				n = sizeof(joined) - joined_len;
+			memcpy( joined + joined_len, chunks[i].data + ( ( i == first ) ? done : 0 ), n );
+			joined_len += n;
+		}
+		n = send( s, joined, joined_len, 0 );
+		if( n < 0 )
+			errno = WSAGetLastError();
+#else
+		for( i = first; i < count; i++ ) {
+			bufs[i - first].iov_base = (void *)( chunks[i].data + ( ( i == first ) ? done : 0 ) );
+			bufs[i - first].iov_len = chunks[i].len - ( ( i == first ) ? done : 0 );
+		}
+
+		memset( &msg, 0, sizeof(msg) );
+		msg.msg_iov = bufs;
+		msg.msg_iovlen = count - first;
+		n = sendmsg( s, &msg, MSG_NOSIGNAL );
+#endif
+		if( n < 0 ) {
+			if( errno != EWOULDBLOCK )
+				return -1;
+			left = socket_time_left( deadline );
+			if( left == 0 ) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			if( socket_wait_writable( s, left ) < 0 )
+				return -1;
+			continue;
+		}
+
+		/* Skip what went out */
+		done += n;
+		while( ( first < count ) && ( done >= chunks[first].len ) ) {
+			done -= chunks[first].len;
+			first++;
+		}
+	}
+
+	return 0;
+}
+
+
+
+/*****************************************************************************
+ *
+ * Buffer tuning
+ *
+ *****************************************************************************/
+
+#if defined(TCP_INFO) && defined(TCP_NOTSENT_LOWAT)
+
+/* The kernel's tcp_info goes on past what the C library declares */
+typedef struct _socket_tcp_info {
+	struct tcp_info base;
+	uint64_t pacing_rate;
+	uint64_t max_pacing_rate;
+	uint64_t bytes_acked;
+	uint64_t bytes_received;
+	uint32_t segs_out;
+	uint32_t segs_in;
+	uint32_t notsent_bytes;
+	uint32_t min_rtt;
+	uint32_t data_segs_in;
+	uint32_t data_segs_out;
+	uint64_t delivery_rate;
+} socket_tcp_info;
+
+/* net.core.wmem_max and rmem_max, what setsockopt() may ask for */
+static unsigned int tune_wmem_max = 0;
+static unsigned int tune_rmem_max = 0;
+
+/* The third field of tcp_wmem and tcp_rmem, where the kernel's autotuning stops */
+static unsigned int tune_wmem_auto = 0;
+static unsigned int tune_rmem_auto = 0;
+static int tune_limits_read = 0;
+
+/* Field n of a /proc/sys file, 0 if it can't be read */
+static unsigned int
+socket_tune_limit(const char * path, int n)
+{
+	FILE * f;
+	unsigned long value;
+
+	value = 0;
+	f = fopen( path, "r" );
+	if( f != NULL ) {
+		while( n-- >= 0 ) {
+			if( fscanf( f, "%lu", &value ) != 1 ) {
+				value = 0;
+				break;
+			}
+		}
+		fclose( f );
+	}
+	return ( value > SOCKET_TUNE_MAX_BUFFER ) ? SOCKET_TUNE_MAX_BUFFER : (unsigned int)value;
+}
+
+/*
+ * Raise a buffer to size, if the kernel has less and the system lets it.
+ * Setting SO_SNDBUF or SO_RCVBUF takes the socket out of the kernel's
+ * autotuning for good, so it is only done for a size autotuning would
+ * never reach (autotune) and the system limit allows past it. Returns the
+ * buffer size.
+ */
+static unsigned int
+socket_tune_buffer(SOCKET s, int option, unsigned int size, unsigned int limit, unsigned int autotune)
+{
+	socklen_t len;
+	int current;
+	int value;
+
+	len = sizeof(current);
+	if( getsockopt( s, SOL_SOCKET, option, (char *)&current, &len ) != 0 )
+		return 0;
+
+	if( ( size <= autotune ) || ( limit <= autotune ) )
+		return (unsigned int)current;
+
+	/* The kernel reports twice what it was given, room for its bookkeeping */
+	if( size > limit )
+		size = limit;
+	if( (unsigned long)size * 2 <= (unsigned long)current + current / 4 )
+		return (unsigned int)current;
+
+	value = (int)size;
+	if( setsockopt( s, SOL_SOCKET, option, (char *)&value, sizeof(value) ) != 0 )
+		return (unsigned int)current;
+	len = sizeof(current);
+	getsockopt( s, SOL_SOCKET, option, (char *)&current, &len );
+	return (unsigned int)current;
+}
+
+#endif
+
+void
+socket_tune_init(socket_tuning * t)
+{
+	memset( t, 0, sizeof(socket_tuning) );
+}
+
+/*
+ * Follow the path of a connection, once in a while. received_rate is what
+ * the relay reads from it per second, 0 when little comes in. Returns -1
+ * when the system has no TCP_INFO.
+ */
+int
+socket_tune(SOCKET s, socket_tuning * t, unsigned long received_rate)
+{
+#if defined(TCP_INFO) && defined(TCP_NOTSENT_LOWAT)
+	socket_tcp_info info;
+	socklen_t len;
+	unsigned long long bdp;
+	unsigned long long flight;
+	unsigned long lowat;
+	unsigned int rtt;
+	int value;
+
+	if( !tune_limits_read ) {
+		tune_wmem_max = socket_tune_limit( "/proc/sys/net/core/wmem_max", 0 );
+		tune_rmem_max = socket_tune_limit( "/proc/sys/net/core/rmem_max", 0 );
+		tune_wmem_auto = socket_tune_limit( "/proc/sys/net/ipv4/tcp_wmem", 2 );
+		tune_rmem_auto = socket_tune_limit( "/proc/sys/net/ipv4/tcp_rmem", 2 );
+		/* Without receive autotuning the buffer stays where it started */
+		if( socket_tune_limit( "/proc/sys/net/ipv4/tcp_moderate_rcvbuf", 0 ) == 0 )
+			tune_rmem_auto = 0;
+		tune_limits_read = 1;
+	}
+
+	memset( &info, 0, sizeof(info) );
+	len = sizeof(info);
+	if( getsockopt( s, IPPROTO_TCP, TCP_INFO, (char *)&info, &len ) != 0 )
+		return -1;
+	if( info.base.tcpi_rtt == 0 )
+		return 0;
+
+	/* Older kernels stop short of the delivery rate */
+	t->rtt = info.base.tcpi_rtt;
+	flight = (unsigned long long)info.base.tcpi_snd_cwnd * info.base.tcpi_snd_mss;
+	if( ( len >= offsetof(socket_tcp_info, delivery_rate) + sizeof(info.delivery_rate) ) && ( info.delivery_rate > 0 ) )
+		t->rate = (unsigned long)info.delivery_rate;
+	else
+		t->rate = (unsigned long)( flight * 1000000 / t->rtt );
+
+	bdp = (unsigned long long)t->rate * t->rtt / 1000000;
+	if( bdp < flight )
+		bdp = flight;
+
+	/* What the path takes in SOCKET_TUNE_QUEUE, changed when off by a quarter */
+	lowat = (unsigned long)( (unsigned long long)t->rate * SOCKET_TUNE_QUEUE / 1000 );
+	if( lowat < SOCKET_TUNE_MIN_LOWAT )
+		lowat = SOCKET_TUNE_MIN_LOWAT;
+	if( lowat > SOCKET_TUNE_MAX_LOWAT )
+		lowat = SOCKET_TUNE_MAX_LOWAT;
+	if( ( t->lowat == 0 ) || ( lowat > t->lowat + t->lowat / 4 ) || ( lowat < t->lowat - t->lowat / 4 ) ) {
+		value = (int)lowat;
+		if( setsockopt( s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char *)&value, sizeof(value) ) == 0 )
+			t->lowat = (unsigned int)lowat;
+	}
+
+	if( bdp * 2 + t->lowat > SOCKET_TUNE_MAX_BUFFER )
+		bdp = ( SOCKET_TUNE_MAX_BUFFER - t->lowat ) / 2;
+	t->sndbuf = socket_tune_buffer( s, SO_SNDBUF, (unsigned int)( bdp * 2 + t->lowat ), tune_wmem_max, tune_wmem_auto );
+
+	if( received_rate > 0 ) {
+		rtt = ( info.base.tcpi_rcv_rtt > 0 ) ? info.base.tcpi_rcv_rtt : t->rtt;
+		bdp = (unsigned long long)received_rate * rtt / 1000000;
+		if( bdp * 2 > SOCKET_TUNE_MAX_BUFFER )
+			bdp = SOCKET_TUNE_MAX_BUFFER / 2;
+		t->rcvbuf = socket_tune_buffer( s, SO_RCVBUF, (unsigned int)( bdp * 2 ), tune_rmem_max, tune_rmem_auto );
+	}
+
+	return 0;
+#else
+	return -1;
+#endif
+}
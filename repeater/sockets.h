@@ -30,6 +30,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h> 
 #include <sys/time.h>
+#include <poll.h>
 #include <errno.h>
 #endif
 
@@ -60,10 +61,22 @@
 #define ECONNRESET WSAECONNRESET 
 #endif
 
+#ifndef ETIMEDOUT
+#define ETIMEDOUT WSAETIMEDOUT
+#endif
+
 #ifndef ENOTSOCK
 #define ENOTSOCK WSAENOTSOCK
 #endif
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
 #ifndef FD_ALLOC
 #define FD_ALLOC(nfds) ((fd_set*)malloc((nfds+7)/8))
 #endif 
@@ -77,6 +90,77 @@ typedef int SOCKET;
 typedef uint8_t	BYTE;
 #endif
 
+#ifdef WIN32
+/*
+ * Winsock has no poll(), socket_select_poll() gives it one out of select().
+ * There an fd_set holds up to FD_SETSIZE sockets of any value.
+ */
+#ifndef POLLIN
+#define POLLIN	0x0001
+#define POLLOUT	0x0004
+#define POLLERR	0x0008
+#define POLLHUP	0x0010
+
+struct pollfd {
+	SOCKET fd;
+	short events;
+	short revents;
+};
+#endif
+
+#define poll(fds, nfds, timeout) socket_select_poll( (fds), (nfds), (timeout) )
+int socket_select_poll(struct pollfd * fds, unsigned int nfds, int timeout);
+#endif
+
+/**
+ * Handshake input. Each recv() takes whatever the peer has sent, up to the
+ * messages known to come next, so a handshake needs one recv() per round
+ * trip and no poll() unless the peer is slower than the repeater.
+ */
+#define SOCKET_BUFFER_SIZE	512
+
+typedef struct _socket_buffer {
+	SOCKET sock;
+	unsigned int pos;               /* Consumed so far */
+	unsigned int len;
+	char data[SOCKET_BUFFER_SIZE];
+} socket_buffer;
+
+/* Adjacent handshake messages, sent in a single call */
+typedef struct _socket_chunk {
+	const char * data;
+	unsigned int len;
+} socket_chunk;
+
+#define SOCKET_MAX_CHUNKS	4
+
+/**
+ * Per connection buffer sizes, picked from what TCP_INFO says of the path.
+ * TCP_NOTSENT_LOWAT keeps about SOCKET_TUNE_QUEUE of data unsent in the
+ * kernel, the rest waits in the relay where coalescing can still drop it.
+ * The send and receive buffers are left to the kernel's autotuning, unless
+ * twice the bandwidth-delay product is more than autotuning reaches and the
+ * system limits allow it: then they are raised to it, and never lowered.
+ */
+#define SOCKET_TUNE_QUEUE	20              /* Milliseconds */
+#define SOCKET_TUNE_MIN_LOWAT	(16 * 1024)
+#define SOCKET_TUNE_MAX_LOWAT	(1024 * 1024)
+#define SOCKET_TUNE_MAX_BUFFER	(16 * 1024 * 1024)
+
+typedef struct _socket_tuning {
+	unsigned int rtt;               /* Microseconds, 0 until known */
+	unsigned long rate;             /* Bytes per second the path delivers */
+	unsigned int sndbuf;            /* As the kernel has them */
+	unsigned int rcvbuf;
+	unsigned int lowat;             /* 0 until set */
+} socket_tuning;
+
+typedef struct _listener_thread_params {
+	u_short	port;
+	SOCKET	sock;
+	SOCKET	wake;	/* Readable when the listener must stop accepting */
+} listener_thread_params;
+
 
 /*****************************************************************************
  *
@@ -94,10 +178,28 @@ void WinsockFinalize( void );
  *
  *****************************************************************************/
 SOCKET CreateListenerSocket(u_short port);
+SOCKET CreateLoopbackListenerSocket(u_short port);
 //int ReadExact(int sock, char *buf, int len);
 int WriteExact(int sock, char *buf, int len);
 SOCKET socket_accept(SOCKET s, struct sockaddr * addr, socklen_t * addrlen);
+SOCKET socket_connect(const struct sockaddr_in * addr, unsigned int msec);
 int socket_close(SOCKET s);
+int socket_release(SOCKET s);
+int socket_reset(SOCKET s);
+int socket_wait(SOCKET s, SOCKET wake);
+int socket_wait_timeout(SOCKET s, unsigned int msec);
+int socket_poll(SOCKET s, int write, int msec);
 int socket_read(SOCKET s, char * buff, socklen_t bufflen);
 int socket_read_exact(SOCKET s, char * buff, socklen_t bufflen);
-int socket_write_exact(SOCKET s, char * buff, socklen_t bufflen);
\ No newline at end of file
+int socket_write_exact(SOCKET s, char * buff, socklen_t bufflen);
+int socket_pair(SOCKET sv[2]);
+int socket_listener_options(SOCKET s, unsigned int defer_accept, unsigned int fast_open);
+
+void socket_tune_init(socket_tuning * t);
+int socket_tune(SOCKET s, socket_tuning * t, unsigned long received_rate);
+
+void socket_buffer_init(socket_buffer * b, SOCKET s);
+int socket_buffer_read(socket_buffer * b, char * buff, unsigned int len, unsigned int ahead, unsigned int msec);
+int socket_write_chunks(SOCKET s, const socket_chunk * chunks, unsigned int count, unsigned int msec);
+unsigned long long socket_deadline(unsigned int msec);
+unsigned int socket_time_left(unsigned long long deadline);
\ No newline at end of file
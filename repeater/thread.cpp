@@ -64,6 +64,41 @@ thread_create(thread_t * thread, LPTHREAD_SECURITY_ATTRIBUTES attr, void *(*star
 	return 0;
 }
 
+int
+#ifdef WIN32
+thread_create_detached(LPTHREAD_START_ROUTINE start_routine, LPVOID arg, unsigned int stack_size)
+#else
+thread_create_detached(void *(*start_routine)(void *), LPVOID arg, unsigned int stack_size)
+#endif
+{
+#ifdef WIN32
+	HANDLE thread;
+	DWORD dwThreadId;
+
+	thread = CreateThread(NULL, stack_size, start_routine, arg, ( stack_size > 0 ) ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0, &dwThreadId);
+	if( thread == NULL )
+		return -1;
+	CloseHandle( thread );
+	return 0;
+#else
+	pthread_attr_t attr;
+	pthread_t thread;
+	int rc;
+
+	rc = pthread_attr_init( &attr );
+	if( rc != 0 )
+		return rc;
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+	if( ( stack_size > 0 ) && ( ( rc = pthread_attr_setstacksize( &attr, stack_size ) ) != 0 ) ) {
+		pthread_attr_destroy( &attr );
+		return rc;
+	}
+	rc = pthread_create( &thread, &attr, start_routine, arg );
+	pthread_attr_destroy( &attr );
+	return rc;
+#endif
+}
+
 int
 thread_join( thread_t thread, unsigned int seconds)
 {
@@ -134,4 +169,4 @@ thread_terminate(thread_t thread)
 #endif
 
 	return rc;
-}
\ No newline at end of file
+}
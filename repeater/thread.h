@@ -29,9 +29,11 @@
 #define thread_t HANDLE
 #define LPTHREAD_SECURITY_ATTRIBUTES LPSECURITY_ATTRIBUTES
 #define THREAD_CALL DWORD WINAPI 
+#define usleep(x) Sleep( (x) / 1000 )
 #else
 /* LINUX*/
 #include <pthread.h>
+#include <unistd.h>
 
 #define thread_t pthread_t
 #define LPVOID void * 
@@ -45,6 +47,12 @@ int thread_create(thread_t * thread, LPTHREAD_SECURITY_ATTRIBUTES attr, LPTHREAD
 #else
 int thread_create(thread_t * thread, LPTHREAD_SECURITY_ATTRIBUTES attr, void *(*start_routine)(void *), LPVOID arg);
 #endif
+/* A thread nobody joins, with an explicit stack size in bytes (0 for the default) */
+#ifdef WIN32
+int thread_create_detached(LPTHREAD_START_ROUTINE start_routine, LPVOID arg, unsigned int stack_size);
+#else
+int thread_create_detached(void *(*start_routine)(void *), LPVOID arg, unsigned int stack_size);
+#endif
 int thread_join( thread_t thread, unsigned int seconds);
 int thread_terminate(thread_t thread);
 
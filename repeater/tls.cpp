@@ -0,0 +1,306 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <errno.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "mutex.h"
+#include "sockets.h"
+#include "repeater.h"
+#include "config.h"
+#include "tls.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+/* The record layer has to go to the kernel, without kTLS there is no TLS */
+#if defined(HAVE_OPENSSL) && !defined(OPENSSL_NO_KTLS) && defined(SSL_OP_ENABLE_KTLS) && defined(TCP_ULP)
+#define TLS_OFFLOAD
+#endif
+
+#ifdef TLS_OFFLOAD
+/* The suites the kernel can take over with TLS 1.2 */
+#define TLS_CIPHERS	"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+			"ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:" \
+			"ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305"
+
+/* OpenSSL offloads the receive side of TLS 1.3 from 3.2 on */
+#define TLS_13_OFFLOAD	0x30200000L
+
+static SSL_CTX * tls_ctx = NULL;        /* Under mutex_tls, NULL while TLS is off */
+static int tls_running = 0;
+static mutex_t mutex_tls;
+
+
+/*****************************************************************************
+ *
+ * Helpers
+ *
+ *****************************************************************************/
+
+/* Log what OpenSSL queued up, and clear it */
+static void
+tls_log_errors(const char * what)
+{
+	unsigned long code;
+	char message[256];
+
+	while( ( code = ERR_get_error() ) != 0 ) {
+		ERR_error_string_n( code, message, sizeof(message) );
+		error("%s: %s\n", what, message);
+	}
+}
+
+/*
+ * The tls module answers ENOTCONN on a socket that is not connected yet,
+ * ENOENT means the kernel doesn't have it (and can't load it).
+ */
+static int
+tls_kernel_support( void )
+{
+	SOCKET s;
+	int supported;
+
+	s = socket( AF_INET, SOCK_STREAM, 0 );
+	if( s == INVALID_SOCKET )
+		return 0;
+	supported = ( setsockopt( s, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls") ) == 0 ) || ( errno != ENOENT );
+	socket_release( s );
+	return supported;
+}
+
+static SSL_CTX *
+tls_context_new(const repeater_config * config)
+{
+	SSL_CTX * ctx;
+
+	ctx = SSL_CTX_new( TLS_server_method() );
+	if( ctx == NULL ) {
+		tls_log_errors( "TLS" );
+		return NULL;
+	}
+
+	SSL_CTX_set_options( ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION );
+	SSL_CTX_set_min_proto_version( ctx, TLS1_2_VERSION );
+	if( OpenSSL_version_num() < TLS_13_OFFLOAD )
+		SSL_CTX_set_max_proto_version( ctx, TLS1_2_VERSION );
+
+	if( ( SSL_CTX_set_cipher_list( ctx, TLS_CIPHERS ) != 1 )
+		|| ( SSL_CTX_use_certificate_chain_file( ctx, config->tls_certificate ) != 1 )
+		|| ( SSL_CTX_use_PrivateKey_file( ctx, config->tls_key, SSL_FILETYPE_PEM ) != 1 )
+		|| ( SSL_CTX_check_private_key( ctx ) != 1 ) ) {
+		tls_log_errors( config->tls_certificate );
+		SSL_CTX_free( ctx );
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/* Wait up to msec for the socket to be ready the way OpenSSL wants it. Returns 1 if it is. */
+static int
+tls_wait(SOCKET s, int write, unsigned int msec)
+{
+	int n;
+
+	n = socket_poll( s, write, (int)msec );
+	if( n < 0 )
+		return ( errno == EINTR ) ? 1 : -1;
+	return n;
+}
+#endif
+
+
+/*****************************************************************************
+ *
+ * TLS
+ *
+ *****************************************************************************/
+
+int
+TlsInit( void )
+{
+	const repeater_config * config;
+
+	config = ConfigGet();
+	if( !config->server_tls && !config->viewer_tls )
+		return 0;
+
+#ifndef TLS_OFFLOAD
+	error("ServerTLS and ViewerTLS need a repeater built with OpenSSL and kTLS.\n");
+	return -1;
+#else
+	if( !tls_kernel_support() ) {
+		error("The kernel has no TLS support (the \"tls\" module), needed by ServerTLS and ViewerTLS.\n");
+		return -1;
+	}
+
+	if( mutex_init( &mutex_tls ) != 0 ) {
+		error("Failed to create the TLS mutex.\n");
+		return -1;
+	}
+
+	tls_ctx = tls_context_new( config );
+	if( tls_ctx == NULL ) {
+		mutex_destroy( &mutex_tls );
+		return -1;
+	}
+
+	tls_running = 1;
+	return 0;
+#endif
+}
+
+int
+TlsReload( void )
+{
+#ifdef TLS_OFFLOAD
+	const repeater_config * config;
+	SSL_CTX * ctx;
+	SSL_CTX * old;
+
+	if( !tls_running )
+		return TlsInit();
+
+	/* A renewed certificate is picked up, the handshakes running keep the old one */
+	config = ConfigGet();
+	ctx = NULL;
+	if( config->server_tls || config->viewer_tls ) {
+		ctx = tls_context_new( config );
+		if( ctx == NULL )
+			return -1;
+	}
+
+	mutex_lock( &mutex_tls );
+	old = tls_ctx;
+	tls_ctx = ctx;
+	mutex_unlock( &mutex_tls );
+	if( old != NULL )
+		SSL_CTX_free( old );
+	return 0;
+#else
+	return TlsInit();
+#endif
+}
+
+void
+TlsFree( void )
+{
+#ifdef TLS_OFFLOAD
+	if( tls_running ) {
+		tls_running = 0;
+		if( tls_ctx != NULL )
+			SSL_CTX_free( tls_ctx );
+		tls_ctx = NULL;
+		mutex_destroy( &mutex_tls );
+	}
+#endif
+}
+
+int
+TlsAccept(SOCKET s, unsigned int msec)
+{
+#ifdef TLS_OFFLOAD
+	unsigned long long deadline;
+	SSL_CTX * ctx;
+	SSL * ssl;
+	int result;
+	int ready;
+	int n;
+
+	ctx = NULL;
+	if( tls_running ) {
+		mutex_lock( &mutex_tls );
+		ctx = tls_ctx;
+		if( ctx != NULL )
+			SSL_CTX_up_ref( ctx );
+		mutex_unlock( &mutex_tls );
+	}
+	if( ctx == NULL ) {
+		debug("TLS connection refused, TLS is off.\n");
+		return -1;
+	}
+
+	/* The SSL holds its own reference to the context */
+	ssl = SSL_new( ctx );
+	SSL_CTX_free( ctx );
+	if( ( ssl == NULL ) || ( SSL_set_fd( ssl, s ) != 1 ) ) {
+		tls_log_errors( "TLS" );
+		if( ssl != NULL )
+			SSL_free( ssl );
+		return -1;
+	}
+
+	result = -1;
+	deadline = socket_deadline( msec );
+	for( ;; ) {
+		n = SSL_accept( ssl );
+		if( n == 1 ) {
+			result = 0;
+			break;
+		}
+
+		switch( SSL_get_error( ssl, n ) ) {
+		case SSL_ERROR_WANT_READ:
+			ready = tls_wait( s, 0, socket_time_left( deadline ) );
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			ready = tls_wait( s, 1, socket_time_left( deadline ) );
+			break;
+		default:
+			debug("TLS handshake failed, socket error %d.\n", errno);
+			ERR_clear_error();
+			ready = -1;
+			break;
+		}
+		if( ready <= 0 ) {
+			if( ready == 0 )
+				debug("TLS handshake timed out.\n");
+			break;
+		}
+	}
+
+	/* From here on the relay only sees plain data */
+	if( ( result == 0 ) && ( !BIO_get_ktls_send( SSL_get_wbio( ssl ) ) || !BIO_get_ktls_recv( SSL_get_rbio( ssl ) ) ) ) {
+		error("TLS connection refused, the kernel did not take %s over (%s).\n",
+			BIO_get_ktls_send( SSL_get_wbio( ssl ) ) ? "receiving" : "sending", SSL_get_cipher_name( ssl ));
+		result = -1;
+	}
+
+	/* Free it without a close_notify, leaving the session in the cache */
+	SSL_set_shutdown( ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN );
+	SSL_free( ssl );
+	return result;
+#else
+	debug("TLS connection refused, TLS is off.\n");
+	return -1;
+#endif
+}
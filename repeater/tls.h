@@ -0,0 +1,55 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+#ifndef _TLS_H
+#define _TLS_H
+
+/**
+ * TLS on the listening ports (ServerTLS, ViewerTLS). OpenSSL runs the
+ * handshake, then hands the record layer to the kernel (kTLS): from there
+ * on the connection is an ordinary socket to the rest of the repeater, the
+ * kernel encrypts what the relay sends and decrypts what it receives.
+ * Connections the kernel can not take over are refused, the relay has no
+ * userspace TLS path. Needs OpenSSL 3.0 built with kTLS and the Linux
+ * "tls" module.
+ */
+
+/**
+ * Load the certificate of the current configuration. Returns -1 when TLS
+ * is asked for and can't be offered.
+ */
+int TlsInit( void );
+
+/* Follow a reloaded configuration, keeping the current certificate on failure */
+int TlsReload( void );
+void TlsFree( void );
+
+/**
+ * Run the server side of the handshake on an accepted, non-blocking
+ * socket, waiting at most msec each time the peer stalls. Returns 0 once
+ * the kernel holds both directions, or -1 with the socket left open.
+ */
+int TlsAccept(SOCKET s, unsigned int msec);
+
+#endif
@@ -0,0 +1,929 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "thread.h"
+#include "sockets.h"
+#include "rfb.h"
+#include "vncauth.h"
+#include "repeater.h"
+#include "slots.h"
+#include "relay.h"
+#include "upgrade.h"
+
+#ifndef WIN32
+
+/**
+ * Messages: a header, then length bytes. The sockets travel with the
+ * header.
+ */
+#define UPGRADE_HELLO		1	/* new => old: CARD32 version */
+#define UPGRADE_KEY		2	/* The challenge key the slots are paired with */
+#define UPGRADE_LISTENER	3	/* CARD32 index, CARD32 port + the listening socket */
+#define UPGRADE_SLOT		4	/* upgrade_slot + the socket waiting for a peer */
+#define UPGRADE_SESSION		5	/* upgrade_session, ServerInit + server and viewer sockets */
+#define UPGRADE_DONE		6
+#define UPGRADE_ACK		7	/* new => old: everything taken */
+
+#define UPGRADE_MAX_SOCKETS	( 1 + RELAY_MAX_VIEWERS )
+#define UPGRADE_MAX_MESSAGE	( 64 * 1024 )
+
+typedef struct _upgrade_header {
+	CARD32 type;
+	CARD32 length;
+} upgrade_header;
+
+/* Host byte order, UPGRADE_VERSION goes up whenever the layout changes */
+#define UPGRADE_SLOT_SERVER	1	/* A server socket comes with the slot */
+#define UPGRADE_SLOT_VIEWER	2	/* A viewer socket comes with the slot, after the server */
+#define UPGRADE_SLOT_MODEI	4	/* A Mode I session */
+
+typedef struct _upgrade_slot {
+	CARD32 code;
+	CARD32 flags;
+	CARD32 timestamp;
+	CARD32 started;
+	unsigned long long server_bytes;
+	unsigned long long viewer_bytes;
+	unsigned long long dropped_bytes;
+	CARD32 server_reads;
+	CARD32 viewer_reads;
+	CARD8 challenge[CHALLENGESIZE];
+} upgrade_slot;
+
+#define UPGRADE_PARSE_SERVER		1
+#define UPGRADE_PARSE_VIEWERS		2
+#define UPGRADE_UPDATES_REQUESTED	4
+
+typedef struct _upgrade_session {
+	upgrade_slot slot;
+	unsigned long long received;
+	CARD32 flags;
+	CARD32 viewers;
+	CARD32 joining;
+	CARD32 init_len;
+	CARD8 viewer_flags[RELAY_MAX_VIEWERS];
+} upgrade_session;
+
+/* Slots taken over, started once the old repeater has let them go */
+typedef struct _upgrade_item {
+	repeaterslot * slot;
+	int session;
+	relay_state state;
+	struct _upgrade_item * next;
+} upgrade_item;
+
+static SOCKET upgrade_listener = INVALID_SOCKET;
+static SOCKET upgrade_peer = INVALID_SOCKET;
+static char upgrade_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+
+/*****************************************************************************
+ *
+ * Messages
+ *
+ *****************************************************************************/
+
+static int
+upgrade_write(SOCKET s, const char * buf, unsigned int len)
+{
+	int n;
+
+	while( len > 0 ) {
+		n = send( s, buf, len, MSG_NOSIGNAL );
+		if( n < 0 ) {
+			if( errno == EINTR )
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+upgrade_read(SOCKET s, char * buf, unsigned int len)
+{
+	int n;
+
+	while( len > 0 ) {
+		n = recv( s, buf, len, 0 );
+		if( n == 0 )
+			return -1;
+		if( n < 0 ) {
+			if( errno == EINTR )
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+upgrade_release(SOCKET * socks, unsigned int count)
+{
+	unsigned int i;
+
+	for( i = 0; i < count; i++ )
+		socket_release( socks[i] );
+}
+
+static int
+upgrade_send(SOCKET s, CARD32 type, const void * data, unsigned int len, const SOCKET * socks, unsigned int count)
+{
+	upgrade_header header;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr * cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE( sizeof(int) * UPGRADE_MAX_SOCKETS )];
+	} control;
+
+	header.type = type;
+	header.length = len;
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if( count > 0 ) {
+		memset( &control, 0, sizeof(control) );
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE( sizeof(int) * count );
+		cmsg = CMSG_FIRSTHDR( &msg );
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN( sizeof(int) * count );
+		memcpy( CMSG_DATA( cmsg ), socks, sizeof(int) * count );
+	}
+
+	if( sendmsg( s, &msg, MSG_NOSIGNAL ) != sizeof(header) )
+		return -1;
+	if( len > 0 )
+		return upgrade_write( s, (const char *)data, len );
+	return 0;
+}
+
+/* buf holds UPGRADE_MAX_MESSAGE bytes, socks UPGRADE_MAX_SOCKETS */
+static int
+upgrade_receive(SOCKET s, upgrade_header * header, char * buf, SOCKET * socks, unsigned int * count)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr * cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE( sizeof(int) * UPGRADE_MAX_SOCKETS )];
+	} control;
+	unsigned int n;
+	int received;
+
+	iov.iov_base = header;
+	iov.iov_len = sizeof(upgrade_header);
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	*count = 0;
+	do {
+		received = recvmsg( s, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC );
+	} while( ( received < 0 ) && ( errno == EINTR ) );
+
+	for( cmsg = CMSG_FIRSTHDR( &msg ); ( received > 0 ) && ( cmsg != NULL ); cmsg = CMSG_NXTHDR( &msg, cmsg ) ) {
+		if( ( cmsg->cmsg_level != SOL_SOCKET ) || ( cmsg->cmsg_type != SCM_RIGHTS ) )
+			continue;
+		n = ( cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof(int);
+		if( *count + n > UPGRADE_MAX_SOCKETS )
+			n = UPGRADE_MAX_SOCKETS - *count;
+		memcpy( socks + *count, CMSG_DATA( cmsg ), n * sizeof(int) );
+		*count += n;
+	}
+
+	if( ( received != sizeof(upgrade_header) ) || ( msg.msg_flags & MSG_CTRUNC ) ||
+		( header->length > UPGRADE_MAX_MESSAGE ) || ( upgrade_read( s, buf, header->length ) != 0 ) ) {
+		upgrade_release( socks, *count );
+		*count = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+upgrade_timeouts(SOCKET s, unsigned int seconds)
+{
+	struct timeval tv;
+
+	tv.tv_sec = seconds;
+	tv.tv_usec = 0;
+	setsockopt( s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv) );
+	setsockopt( s, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv) );
+}
+
+static void
+upgrade_slot_export(repeaterslot * slot, upgrade_slot * out)
+{
+	memset( out, 0, sizeof(upgrade_slot) );
+	out->code = (CARD32)slot->code;
+	out->timestamp = (CARD32)slot->timestamp;
+	if( slot->modei )
+		out->flags |= UPGRADE_SLOT_MODEI;
+	out->started = (CARD32)slot->started;
+	out->server_bytes = slot->server_bytes;
+	out->viewer_bytes = slot->viewer_bytes;
+	out->dropped_bytes = slot->dropped_bytes;
+	out->server_reads = (CARD32)slot->server_reads;
+	out->viewer_reads = (CARD32)slot->viewer_reads;
+	memcpy( out->challenge, slot->challenge, CHALLENGESIZE );
+}
+
+static repeaterslot *
+upgrade_slot_import(const upgrade_slot * in)
+{
+	repeaterslot * slot;
+
+	slot = (repeaterslot *)malloc( sizeof(repeaterslot) );
+	if( slot == NULL ) {
+		error("Not enough memory to take a slot over.\n");
+		return NULL;
+	}
+
+	memset( slot, 0, sizeof(repeaterslot) );
+	slot->server = INVALID_SOCKET;
+	slot->viewer = INVALID_SOCKET;
+	slot->code = in->code;
+	slot->timestamp = in->timestamp;
+	slot->modei = ( ( in->flags & UPGRADE_SLOT_MODEI ) != 0 );
+	slot->started = in->started;
+	slot->last_activity = (unsigned long)time(NULL);
+	slot->server_bytes = in->server_bytes;
+	slot->viewer_bytes = in->viewer_bytes;
+	slot->dropped_bytes = in->dropped_bytes;
+	slot->server_reads = in->server_reads;
+	slot->viewer_reads = in->viewer_reads;
+	memcpy( slot->challenge, in->challenge, CHALLENGESIZE );
+	return slot;
+}
+
+
+/*****************************************************************************
+ *
+ * Old repeater
+ *
+ *****************************************************************************/
+
+int
+UpgradeInit(const char * path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+
+	if( path[0] == '\0' )
+		return 0;
+
+	if( strlen( path ) >= sizeof(addr.sun_path) ) {
+		error("The upgrade socket path is too long: %s\n", path);
+		return -1;
+	}
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, path );
+
+	/* Left behind, or the one of the repeater taken over */
+	if( ( lstat( path, &st ) == 0 ) && S_ISSOCK( st.st_mode ) )
+		unlink( path );
+
+	upgrade_listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( upgrade_listener == INVALID_SOCKET ) {
+		error("Failed to create the upgrade socket, error %d.\n", errno);
+		return -1;
+	}
+
+	/* Only the owner of the repeater may take it over */
+	mask = umask( 077 );
+	if( ( bind( upgrade_listener, (struct sockaddr *)&addr, sizeof(addr) ) != 0 ) || ( listen( upgrade_listener, 1 ) != 0 ) ) {
+		umask( mask );
+		error("Failed to listen for upgrades on %s, error %d.\n", path, errno);
+		close( upgrade_listener );
+		upgrade_listener = INVALID_SOCKET;
+		return -1;
+	}
+	umask( mask );
+
+	strcpy( upgrade_path, path );
+	debug("Listening for upgrades on %s.\n", path);
+	return 0;
+}
+
+
+void
+UpgradeFree(int handed_over)
+{
+	if( upgrade_peer != INVALID_SOCKET )
+		close( upgrade_peer );
+	upgrade_peer = INVALID_SOCKET;
+
+	if( upgrade_listener == INVALID_SOCKET )
+		return;
+
+	close( upgrade_listener );
+	upgrade_listener = INVALID_SOCKET;
+	if( !handed_over )
+		unlink( upgrade_path );
+}
+
+
+int
+UpgradeRequested( void )
+{
+	struct ucred cred;
+	socklen_t len;
+	SOCKET peer;
+
+	if( upgrade_listener == INVALID_SOCKET )
+		return 0;
+
+	if( socket_poll( upgrade_listener, 0, 0 ) <= 0 )
+		return 0;
+
+	peer = accept( upgrade_listener, NULL, NULL );
+	if( peer == INVALID_SOCKET )
+		return 0;
+
+	len = sizeof(cred);
+	if( ( getsockopt( peer, SOL_SOCKET, SO_PEERCRED, &cred, &len ) != 0 ) || ( cred.uid != geteuid() ) ) {
+		error("Upgrade refused to a process of another user.\n");
+		close( peer );
+		return 0;
+	}
+
+	upgrade_timeouts( peer, UPGRADE_TIMEOUT );
+	upgrade_peer = peer;
+	return 1;
+}
+
+/* Wait for the sessions to park, or to give up */
+static void
+upgrade_wait_parked( void )
+{
+	repeaterslot * slot;
+	unsigned int waiting;
+	time_t deadline;
+
+	deadline = time(NULL) + RELAY_PARK_TIMEOUT + UPGRADE_TIMEOUT;
+	do {
+		waiting = 0;
+		if( LockSlots("upgrade_wait_parked()") != 0 )
+			return;
+		for( slot = Slots; slot != NULL; slot = slot->next ) {
+			if( ( slot->relay != NULL ) && ( RelayParked( slot->relay ) == 0 ) )
+				waiting++;
+		}
+		UnlockSlots("upgrade_wait_parked()");
+
+		if( waiting > 0 )
+			usleep( 10000 );
+	} while( ( waiting > 0 ) && ( time(NULL) <= deadline ) );
+}
+
+/* Everything but the sessions that stay. Called with the slots locked. */
+static int
+upgrade_send_all(SOCKET peer, SOCKET listeners[UPGRADE_LISTENERS], u_short ports[UPGRADE_LISTENERS], char * buf)
+{
+	repeaterslot * slot;
+	upgrade_session * session;
+	relay_state state;
+	SOCKET socks[UPGRADE_MAX_SOCKETS];
+	unsigned int count;
+	unsigned int slots;
+	unsigned int sessions;
+	unsigned int i;
+	CARD32 listener[2];
+	int result;
+
+	if( upgrade_send( peer, UPGRADE_KEY, challenge_key, CHALLENGESIZE, NULL, 0 ) != 0 )
+		return -1;
+
+	for( i = 0; i < UPGRADE_LISTENERS; i++ ) {
+		if( listeners[i] == INVALID_SOCKET )
+			continue;
+		listener[0] = i;
+		listener[1] = ports[i];
+		if( upgrade_send( peer, UPGRADE_LISTENER, listener, sizeof(listener), &listeners[i], 1 ) != 0 )
+			return -1;
+	}
+
+	slots = 0;
+	sessions = 0;
+	for( slot = Slots; slot != NULL; slot = slot->next ) {
+		if( slot->relay == NULL ) {
+			/* Waiting for its peer */
+			upgrade_slot_export( slot, (upgrade_slot *)buf );
+			count = 0;
+			if( slot->server != INVALID_SOCKET ) {
+				((upgrade_slot *)buf)->flags |= UPGRADE_SLOT_SERVER;
+				socks[count++] = slot->server;
+			}
+			if( slot->viewer != INVALID_SOCKET ) {
+				((upgrade_slot *)buf)->flags |= UPGRADE_SLOT_VIEWER;
+				socks[count++] = slot->viewer;
+			}
+			if( upgrade_send( peer, UPGRADE_SLOT, buf, sizeof(upgrade_slot), socks, count ) != 0 )
+				return -1;
+			slots++;
+			continue;
+		}
+
+		if( RelayParked( slot->relay ) != 1 )
+			continue;
+		if( RelayExport( slot->relay, &state ) != 0 )
+			return -1;
+		if( sizeof(upgrade_session) + state.init_len > UPGRADE_MAX_MESSAGE ) {
+			error("The desktop name of ID %lu is too long to hand it over.\n", slot->code);
+			free( state.init );
+			return -1;
+		}
+
+		session = (upgrade_session *)buf;
+		memset( session, 0, sizeof(upgrade_session) );
+		upgrade_slot_export( slot, &session->slot );
+		session->slot.flags = UPGRADE_SLOT_SERVER;
+		session->received = state.received;
+		if( state.parse_server )
+			session->flags |= UPGRADE_PARSE_SERVER;
+		if( state.parse_viewers )
+			session->flags |= UPGRADE_PARSE_VIEWERS;
+		if( state.updates_requested )
+			session->flags |= UPGRADE_UPDATES_REQUESTED;
+		session->viewers = state.viewer_count;
+		session->joining = state.joining_count;
+		session->init_len = state.init_len;
+		for( i = 0; i < state.viewer_count; i++ )
+			session->viewer_flags[i] = (CARD8)state.viewer_flags[i];
+		if( state.init_len > 0 )
+			memcpy( buf + sizeof(upgrade_session), state.init, state.init_len );
+		free( state.init );
+
+		socks[0] = slot->server;
+		memcpy( socks + 1, state.viewers, ( state.viewer_count + state.joining_count ) * sizeof(SOCKET) );
+		result = upgrade_send( peer, UPGRADE_SESSION, buf, sizeof(upgrade_session) + session->init_len,
+			socks, 1 + state.viewer_count + state.joining_count );
+		if( result != 0 )
+			return -1;
+		sessions++;
+	}
+
+	if( upgrade_send( peer, UPGRADE_DONE, NULL, 0, NULL, 0 ) != 0 )
+		return -1;
+
+	debug("Handed %u waiting slots and %u sessions over.\n", slots, sessions);
+	return 0;
+}
+
+
+int
+UpgradeSend(SOCKET listeners[UPGRADE_LISTENERS], u_short ports[UPGRADE_LISTENERS])
+{
+	upgrade_header header;
+	repeaterslot * slot;
+	repeaterslot * next;
+	SOCKET socks[UPGRADE_MAX_SOCKETS];
+	unsigned int count;
+	unsigned int i;
+	CARD32 version;
+	SOCKET peer;
+	char * buf;
+	int result;
+
+	peer = upgrade_peer;
+	upgrade_peer = INVALID_SOCKET;
+	if( peer == INVALID_SOCKET )
+		return -1;
+
+	buf = (char *)malloc( UPGRADE_MAX_MESSAGE );
+	if( buf == NULL ) {
+		error("Not enough memory to hand the repeater over.\n");
+		close( peer );
+		return -1;
+	}
+
+	if( ( upgrade_receive( peer, &header, buf, socks, &count ) != 0 ) || ( count > 0 ) ||
+		( header.type != UPGRADE_HELLO ) || ( header.length != sizeof(version) ) ) {
+		error("Upgrade refused: bad request.\n");
+		upgrade_release( socks, count );
+		free( buf );
+		close( peer );
+		return -1;
+	}
+	memcpy( &version, buf, sizeof(version) );
+	if( version != UPGRADE_VERSION ) {
+		error("Upgrade refused: version %u, this repeater speaks %u.\n", version, UPGRADE_VERSION);
+		free( buf );
+		close( peer );
+		return -1;
+	}
+
+	debug("Handing the repeater over...\n");
+	RelayPark( 1 );
+	upgrade_wait_parked();
+
+	if( LockSlots("UpgradeSend()") != 0 ) {
+		RelayPark( 0 );
+		free( buf );
+		close( peer );
+		return -1;
+	}
+
+	result = upgrade_send_all( peer, listeners, ports, buf );
+	if( result == 0 ) {
+		if( ( upgrade_receive( peer, &header, buf, socks, &count ) != 0 ) || ( header.type != UPGRADE_ACK ) ) {
+			upgrade_release( socks, count );
+			result = -1;
+		}
+	}
+
+	/* Sessions restarted from here go on relaying */
+	RelayPark( 0 );
+
+	if( result == 0 ) {
+		/* The new repeater owns everything handed over */
+		for( i = 0; i < UPGRADE_LISTENERS; i++ ) {
+			if( listeners[i] != INVALID_SOCKET )
+				socket_release( listeners[i] );
+			listeners[i] = INVALID_SOCKET;
+		}
+
+		for( slot = Slots; slot != NULL; slot = next ) {
+			next = slot->next;
+			if( slot->relay == NULL ) {
+				if( slot->server != INVALID_SOCKET )
+					socket_release( slot->server );
+				if( slot->viewer != INVALID_SOCKET )
+					socket_release( slot->viewer );
+				slot->server = INVALID_SOCKET;
+				slot->viewer = INVALID_SOCKET;
+				FreeSlot( slot );
+			} else if( RelayParked( slot->relay ) == 1 ) {
+				RelayRelease( slot );
+			}
+		}
+	} else {
+		error("Upgrade failed, going on.\n");
+		for( slot = Slots; slot != NULL; slot = next ) {
+			next = slot->next;
+			if( ( slot->relay != NULL ) && ( RelayParked( slot->relay ) == 1 ) )
+				RelayRestart( slot->relay );
+		}
+	}
+
+	UnlockSlots("UpgradeSend()");
+	free( buf );
+	close( peer );
+	return result;
+}
+
+
+/*****************************************************************************
+ *
+ * New repeater
+ *
+ *****************************************************************************/
+
+static void
+upgrade_free_items(upgrade_item * items)
+{
+	upgrade_item * item;
+	unsigned int i;
+
+	while( items != NULL ) {
+		item = items;
+		items = item->next;
+		if( item->slot->server != INVALID_SOCKET )
+			socket_release( item->slot->server );
+		if( item->slot->viewer != INVALID_SOCKET )
+			socket_release( item->slot->viewer );
+		for( i = 0; i < item->state.viewer_count + item->state.joining_count; i++ )
+			socket_release( item->state.viewers[i] );
+		if( item->state.init != NULL )
+			free( item->state.init );
+		free( item->slot );
+		free( item );
+	}
+}
+
+/* A waiting slot or a session, as sent by the old repeater */
+static upgrade_item *
+upgrade_take(upgrade_header * header, char * buf, SOCKET * socks, unsigned int count)
+{
+	upgrade_item * item;
+	upgrade_session * session;
+	upgrade_slot * in;
+	unsigned int used;
+	unsigned int i;
+
+	in = (upgrade_slot *)buf;
+	session = (upgrade_session *)buf;
+	if( header->type == UPGRADE_SLOT ) {
+		if( header->length != sizeof(upgrade_slot) )
+			return NULL;
+		used = ( ( in->flags & UPGRADE_SLOT_SERVER ) ? 1 : 0 ) + ( ( in->flags & UPGRADE_SLOT_VIEWER ) ? 1 : 0 );
+	} else {
+		if( ( header->length < sizeof(upgrade_session) ) || ( session->viewers + session->joining > RELAY_MAX_VIEWERS ) ||
+			( header->length != sizeof(upgrade_session) + session->init_len ) || !( in->flags & UPGRADE_SLOT_SERVER ) )
+			return NULL;
+		used = 1 + session->viewers + session->joining;
+	}
+	if( ( used == 0 ) || ( used != count ) )
+		return NULL;
+
+	item = (upgrade_item *)malloc( sizeof(upgrade_item) );
+	if( item == NULL )
+		return NULL;
+	memset( item, 0, sizeof(upgrade_item) );
+
+	if( ( header->type == UPGRADE_SESSION ) && ( session->init_len > 0 ) ) {
+		item->state.init = (char *)malloc( session->init_len );
+		if( item->state.init == NULL ) {
+			free( item );
+			return NULL;
+		}
+		memcpy( item->state.init, buf + sizeof(upgrade_session), session->init_len );
+		item->state.init_len = session->init_len;
+	}
+
+	item->slot = upgrade_slot_import( in );
+	if( item->slot == NULL ) {
+		if( item->state.init != NULL )
+			free( item->state.init );
+		free( item );
+		return NULL;
+	}
+
+	/* The sockets belong to the item from here */
+	used = 0;
+	if( in->flags & UPGRADE_SLOT_SERVER )
+		item->slot->server = socks[used++];
+	if( header->type == UPGRADE_SLOT ) {
+		if( in->flags & UPGRADE_SLOT_VIEWER )
+			item->slot->viewer = socks[used++];
+		return item;
+	}
+
+	item->session = 1;
+	item->state.received = session->received;
+	item->state.parse_server = ( session->flags & UPGRADE_PARSE_SERVER ) != 0;
+	item->state.parse_viewers = ( session->flags & UPGRADE_PARSE_VIEWERS ) != 0;
+	item->state.updates_requested = ( session->flags & UPGRADE_UPDATES_REQUESTED ) != 0;
+	item->state.viewer_count = session->viewers;
+	item->state.joining_count = session->joining;
+	for( i = 0; i < session->viewers + session->joining; i++ )
+		item->state.viewers[i] = socks[used++];
+	for( i = 0; i < session->viewers; i++ )
+		item->state.viewer_flags[i] = session->viewer_flags[i];
+	return item;
+}
+
+/* Start what was taken over, now that the old repeater has let it go */
+static void
+upgrade_start(upgrade_item * items)
+{
+	upgrade_item * item;
+	repeaterslot * current;
+	unsigned int slots;
+	unsigned int sessions;
+	unsigned int i;
+
+	slots = 0;
+	sessions = 0;
+	LockSlots("upgrade_start()");
+	while( items != NULL ) {
+		item = items;
+		items = item->next;
+
+		current = AddSlot( item->slot );
+		if( current == NULL ) {
+			error("No slot for ID %lu, closing it.\n", item->slot->code);
+			if( item->slot->server != INVALID_SOCKET )
+				socket_close( item->slot->server );
+			if( item->slot->viewer != INVALID_SOCKET )
+				socket_close( item->slot->viewer );
+			for( i = 0; i < item->state.viewer_count + item->state.joining_count; i++ )
+				socket_close( item->state.viewers[i] );
+			free( item->slot );
+		} else {
+			/* AddSlot() keeps its own copy unless the slot was inserted as is */
+			if( current != item->slot )
+				free( item->slot );
+
+			if( !item->session ) {
+				slots++;
+			} else {
+				current->viewer = ( item->state.viewer_count > 0 ) ? item->state.viewers[0] : INVALID_SOCKET;
+				if( RelayResume( current, &item->state ) == 0 ) {
+					sessions++;
+				} else {
+					/* The relay closed the viewers, the slot closes the server */
+					current->viewer = INVALID_SOCKET;
+					FreeSlot( current );
+				}
+			}
+		}
+
+		if( item->state.init != NULL )
+			free( item->state.init );
+		free( item );
+	}
+	UnlockSlots("upgrade_start()");
+
+	debug("Took %u waiting slots and %u sessions over.\n", slots, sessions);
+}
+
+
+int
+UpgradeReceive(const char * path, SOCKET listeners[UPGRADE_LISTENERS], u_short ports[UPGRADE_LISTENERS])
+{
+	struct sockaddr_un addr;
+	upgrade_header header;
+	upgrade_item * items;
+	upgrade_item * item;
+	SOCKET socks[UPGRADE_MAX_SOCKETS];
+	unsigned int count;
+	unsigned int i;
+	CARD32 listener[2];
+	CARD32 version;
+	SOCKET s;
+	char * buf;
+	int result;
+
+	for( i = 0; i < UPGRADE_LISTENERS; i++ )
+		listeners[i] = INVALID_SOCKET;
+
+	if( ( path[0] == '\0' ) || ( strlen( path ) >= sizeof(addr.sun_path) ) ) {
+		error("No upgrade socket to take over from.\n");
+		return -1;
+	}
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, path );
+
+	s = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( s == INVALID_SOCKET )
+		return -1;
+	if( connect( s, (struct sockaddr *)&addr, sizeof(addr) ) != 0 ) {
+		error("No repeater to take over at %s, error %d.\n", path, errno);
+		close( s );
+		return -1;
+	}
+	/* The old repeater parks its sessions before it answers */
+	upgrade_timeouts( s, RELAY_PARK_TIMEOUT + 2 * UPGRADE_TIMEOUT );
+
+	buf = (char *)malloc( UPGRADE_MAX_MESSAGE );
+	if( buf == NULL ) {
+		close( s );
+		return -1;
+	}
+
+	version = UPGRADE_VERSION;
+	result = upgrade_send( s, UPGRADE_HELLO, &version, sizeof(version), NULL, 0 );
+	items = NULL;
+	while( result == 0 ) {
+		result = upgrade_receive( s, &header, buf, socks, &count );
+		if( result != 0 )
+			break;
+
+		if( header.type == UPGRADE_DONE ) {
+			break;
+		} else if( ( header.type == UPGRADE_KEY ) && ( header.length == CHALLENGESIZE ) && ( count == 0 ) ) {
+			memcpy( challenge_key, buf, CHALLENGESIZE );
+		} else if( ( header.type == UPGRADE_LISTENER ) && ( header.length == sizeof(listener) ) && ( count == 1 ) ) {
+			memcpy( listener, buf, sizeof(listener) );
+			if( ( listener[0] >= UPGRADE_LISTENERS ) || ( listeners[listener[0]] != INVALID_SOCKET ) ) {
+				socket_release( socks[0] );
+				result = -1;
+			} else if( listener[1] != ports[listener[0]] ) {
+				debug("The listener on port %u is not in use anymore.\n", listener[1]);
+				listeners[listener[0]] = socks[0];
+				ports[listener[0]] = 0;
+			} else {
+				listeners[listener[0]] = socks[0];
+			}
+		} else if( ( header.type == UPGRADE_SLOT ) || ( header.type == UPGRADE_SESSION ) ) {
+			item = upgrade_take( &header, buf, socks, count );
+			if( item == NULL ) {
+				upgrade_release( socks, count );
+				result = -1;
+			} else {
+				item->next = items;
+				items = item;
+			}
+		} else {
+			upgrade_release( socks, count );
+			result = -1;
+		}
+	}
+
+	if( result == 0 )
+		result = upgrade_send( s, UPGRADE_ACK, NULL, 0, NULL, 0 );
+	close( s );
+	free( buf );
+
+	if( result != 0 ) {
+		error("Failed to take the repeater over.\n");
+		for( i = 0; i < UPGRADE_LISTENERS; i++ ) {
+			if( listeners[i] != INVALID_SOCKET )
+				socket_release( listeners[i] );
+			listeners[i] = INVALID_SOCKET;
+		}
+		upgrade_free_items( items );
+		return -1;
+	}
+
+	/* Ours now: the listeners on another port go away */
+	for( i = 0; i < UPGRADE_LISTENERS; i++ ) {
+		if( ( listeners[i] != INVALID_SOCKET ) && ( ports[i] == 0 ) ) {
+			socket_close( listeners[i] );
+			listeners[i] = INVALID_SOCKET;
+		}
+	}
+	upgrade_start( items );
+	return 0;
+}
+
+#else
+
+int
+UpgradeInit(const char * path)
+{
+	if( path[0] != '\0' )
+		error("Hot upgrades are not available on this platform.\n");
+	return 0;
+}
+
+void
+UpgradeFree(int handed_over)
+{
+}
+
+int
+UpgradeRequested( void )
+{
+	return 0;
+}
+
+int
+UpgradeSend(SOCKET listeners[UPGRADE_LISTENERS], u_short ports[UPGRADE_LISTENERS])
+{
+	return -1;
+}
+
+int
+UpgradeReceive(const char * path, SOCKET listeners[UPGRADE_LISTENERS], u_short ports[UPGRADE_LISTENERS])
+{
+	error("Hot upgrades are not available on this platform.\n");
+	return -1;
+}
+
+#endif
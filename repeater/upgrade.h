@@ -0,0 +1,75 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+
+#ifndef _UPGRADE_H
+#define _UPGRADE_H
+
+/**
+ * Hot upgrade. A new repeater started with -upgrade connects to the Unix
+ * socket of the running one, which stops accepting, parks its sessions
+ * once nothing is left in their buffers and hands the listeners, the
+ * slots waiting for a peer and the parked sessions over, passing the
+ * sockets with SCM_RIGHTS. Sessions that can not be parked in time stay
+ * with the old repeater, which exits once they are over.
+ */
+#define UPGRADE_VERSION		1
+#define UPGRADE_TIMEOUT		10	/* Seconds to wait for the other repeater */
+
+/* Listeners, as indexes of the arrays handed around */
+#define UPGRADE_SERVER_LISTENER	0
+#define UPGRADE_VIEWER_LISTENER	1
+#define UPGRADE_ADMIN_LISTENER	2
+#define UPGRADE_MODEI_LISTENER	3
+#define UPGRADE_LISTENERS	4
+
+/**
+ * Wait for a new repeater on the Unix socket at path, if not empty.
+ */
+int UpgradeInit(const char * path);
+
+/**
+ * The socket file is left alone once the new repeater owns it.
+ */
+void UpgradeFree(int handed_over);
+
+/**
+ * True once a new repeater has connected. Does not block.
+ */
+int UpgradeRequested( void );
+
+/**
+ * Hand everything over to the new repeater. The listener threads must be
+ * stopped. On success the listeners are released (INVALID_SOCKET) and the
+ * slots handed over are gone, on failure everything goes on as before.
+ */
+int UpgradeSend(SOCKET listeners[UPGRADE_LISTENERS], u_short ports[UPGRADE_LISTENERS]);
+
+/**
+ * Take over from the repeater listening at path. Listeners on a port other
+ * than the one in ports are closed, listeners[] is INVALID_SOCKET for them
+ * and for the ones that were not handed over.
+ */
+int UpgradeReceive(const char * path, SOCKET listeners[UPGRADE_LISTENERS], u_short ports[UPGRADE_LISTENERS]);
+
+#endif
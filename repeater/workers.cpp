@@ -0,0 +1,239 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include "thread.h"
+#include "mutex.h"
+#include "sockets.h"
+#include "repeater.h"
+#include "pool.h"
+#include "workers.h"
+
+/* Seconds WorkersFree() gives the workers to leave */
+#define WORKER_STOP_TIMEOUT	5
+
+
+typedef struct _worker_item {
+	worker_job job;
+	void * arg;
+} worker_item;
+
+/* Everything below is under mutex_workers */
+static worker_item worker_queue[WORKER_QUEUE_LIMIT];
+static unsigned int queue_head = 0;
+static worker_stats workers;
+static int workers_stopping = 0;
+static int workers_running = 0;
+static mutex_t mutex_workers;
+
+/* A byte per job wakes the idle workers up, threads counts them all */
+static idle_pool worker_pool;
+
+
+/*****************************************************************************
+ *
+ * Workers
+ *
+ *****************************************************************************/
+
+static THREAD_CALL
+worker_main(LPVOID lpParam)
+{
+	worker_item item;
+	int leave;
+
+	mutex_lock( &mutex_workers );
+	while( !workers_stopping ) {
+		if( workers.queued > 0 ) {
+			item = worker_queue[queue_head];
+			queue_head = ( queue_head + 1 ) % WORKER_QUEUE_LIMIT;
+			workers.queued--;
+			workers.idle--;
+			workers.busy++;
+			workers.jobs++;
+			if( workers.busy > workers.busy_peak )
+				workers.busy_peak = workers.busy;
+			mutex_unlock( &mutex_workers );
+
+			item.job( item.arg );
+
+			mutex_lock( &mutex_workers );
+			workers.busy--;
+			workers.idle++;
+			continue;
+		}
+
+		mutex_unlock( &mutex_workers );
+		leave = !pool_idle( &worker_pool, WORKER_IDLE_TIMEOUT * 1000 );
+		mutex_lock( &mutex_workers );
+
+		/* Nothing came for a while, or the limit went down */
+		if( ( workers.queued == 0 ) && ( ( leave && ( workers.idle > WORKER_SPARE ) )
+			|| ( ( workers.limit > 0 ) && ( worker_pool.threads > workers.limit ) ) ) )
+			break;
+	}
+	workers.idle--;
+	worker_pool.threads--;
+	mutex_unlock( &mutex_workers );
+
+	return 0;
+}
+
+/* Called under mutex_workers */
+static int
+worker_start( void )
+{
+	worker_pool.threads++;
+	workers.idle++;
+	if( thread_create_detached( worker_main, NULL, WORKER_STACK_SIZE ) != 0 ) {
+		worker_pool.threads--;
+		workers.idle--;
+		return -1;
+	}
+	workers.started++;
+	return 0;
+}
+
+
+/*****************************************************************************
+ *
+ * Pool
+ *
+ *****************************************************************************/
+
+int
+WorkersInit(unsigned int limit)
+{
+	unsigned int i;
+
+	if( pool_init( &worker_pool, &mutex_workers ) != 0 ) {
+		error("Failed to create the wake up sockets for the workers.\n");
+		return -1;
+	}
+	if( mutex_init( &mutex_workers ) != 0 ) {
+		error("Failed to create the workers mutex.\n");
+		pool_free( &worker_pool );
+		return -1;
+	}
+
+	memset( &workers, 0, sizeof(workers) );
+	workers.limit = limit;
+	workers_stopping = 0;
+	workers_running = 1;
+
+	mutex_lock( &mutex_workers );
+	for( i = 0; ( i < WORKER_SPARE ) && ( ( limit == 0 ) || ( i < limit ) ); i++ ) {
+		if( worker_start() != 0 ) {
+			error("Unable to start a worker thread.\n");
+			break;
+		}
+	}
+	mutex_unlock( &mutex_workers );
+
+	return 0;
+}
+
+void
+WorkersSetLimit(unsigned int limit)
+{
+	if( !workers_running )
+		return;
+
+	mutex_lock( &mutex_workers );
+	workers.limit = limit;
+	mutex_unlock( &mutex_workers );
+}
+
+void
+WorkersFree( void )
+{
+	if( !workers_running )
+		return;
+
+	mutex_lock( &mutex_workers );
+	workers_stopping = 1;
+	mutex_unlock( &mutex_workers );
+
+	workers_running = 0;
+	/* They are detached, count them out */
+	if( pool_stop( &worker_pool, WORKER_STOP_TIMEOUT, "worker" ) > 0 )
+		return;
+
+	mutex_destroy( &mutex_workers );
+	pool_free( &worker_pool );
+}
+
+int
+WorkerSubmit(worker_job job, void * arg)
+{
+	if( !workers_running )
+		return -1;
+
+	mutex_lock( &mutex_workers );
+	if( workers.queued == WORKER_QUEUE_LIMIT ) {
+		workers.rejected++;
+		mutex_unlock( &mutex_workers );
+		error("Every worker is busy and the queue is full.\n");
+		return -1;
+	}
+
+	/* A new worker unless an idle one is there for the job */
+	if( ( workers.idle <= workers.queued ) && ( ( workers.limit == 0 ) || ( worker_pool.threads < workers.limit ) ) ) {
+		if( ( worker_start() != 0 ) && ( worker_pool.threads == 0 ) ) {
+			mutex_unlock( &mutex_workers );
+			error("Unable to start a worker thread.\n");
+			return -1;
+		}
+	}
+
+	worker_queue[( queue_head + workers.queued ) % WORKER_QUEUE_LIMIT].job = job;
+	worker_queue[( queue_head + workers.queued ) % WORKER_QUEUE_LIMIT].arg = arg;
+	workers.queued++;
+	if( workers.queued > workers.queued_peak )
+		workers.queued_peak = workers.queued;
+	mutex_unlock( &mutex_workers );
+
+	pool_wake( &worker_pool, 1 );
+	return 0;
+}
+
+void
+WorkersGetStats(worker_stats * stats)
+{
+	if( !workers_running ) {
+		memset( stats, 0, sizeof(worker_stats) );
+		return;
+	}
+
+	mutex_lock( &mutex_workers );
+	*stats = workers;
+	mutex_unlock( &mutex_workers );
+}
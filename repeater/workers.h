@@ -0,0 +1,70 @@
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright (C) 2010 Juan Pedro Gonzalez. All Rights Reserved.
+//
+//
+//  The VNC system is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+//  USA.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+
+
+#ifndef _WORKERS_H
+#define _WORKERS_H
+
+/**
+ * The sessions run on a pool of threads, started with a small stack and
+ * reused from one session to the next. WORKER_SPARE of them are started
+ * up front and stay idle; the others leave once idle for
+ * WORKER_IDLE_TIMEOUT seconds.
+ */
+#define WORKER_STACK_SIZE	(256 * 1024)
+#define WORKER_SPARE		4
+#define WORKER_IDLE_TIMEOUT	30
+
+/**
+ * Jobs wait here while every worker is busy and the pool is at its limit.
+ * Past that, WorkerSubmit() fails.
+ */
+#define WORKER_QUEUE_LIMIT	64
+
+typedef void (*worker_job)(void * arg);
+
+typedef struct _worker_stats {
+	unsigned int busy;
+	unsigned int idle;
+	unsigned int limit;             /* 0 for no limit */
+	unsigned int queued;
+	unsigned int busy_peak;
+	unsigned int queued_peak;
+	unsigned long started;          /* Threads started so far */
+	unsigned long jobs;             /* Jobs taken so far */
+	unsigned long rejected;         /* Jobs refused with a full queue */
+} worker_stats;
+
+/**
+ * limit caps the number of threads, 0 for no cap. A lowered limit takes
+ * effect as the workers above it go idle.
+ */
+int WorkersInit(unsigned int limit);
+void WorkersSetLimit(unsigned int limit);
+void WorkersFree( void );
+
+/* Run job(arg) on a worker. Returns -1 when the queue is full. */
+int WorkerSubmit(worker_job job, void * arg);
+
+void WorkersGetStats(worker_stats * stats);
+
+#endif